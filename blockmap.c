@@ -0,0 +1,533 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This builds a map of the basic blocks of a program and the
+ * control flow between them.
+ *
+ * Code is found by following control flow from entry points
+ * (normally the reset and interrupt vectors), so data in
+ * program memory is not taken for code. A block starts at an
+ * entry point, at the target of a branch, or after an
+ * instruction that may not continue with the next one. It
+ * ends before the next block starts, or with an instruction
+ * that may not continue. Calls end a block too, so once a
+ * block is entered it runs to its last instruction.
+ *
+ * The successors of a block are the blocks it may go to in
+ * the same function, so a call goes on to the instruction
+ * after it. The target of the call is kept separately.
+ * Jumps and calls through a register pair go to addresses
+ * that cannot be known, so code only reached that way is
+ * not found, unless it is given as an entry point.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<inttypes.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"disassembler.h"
+#include	"blockmap.h"
+
+/* address flags */
+#define	ADDR_CODE	0x01	/* an instruction starts here */
+#define	ADDR_LEADER	0x02	/* a block starts here */
+
+/**************************************************************
+ * This will decode the instruction at address. It returns the
+ * size of the instruction, or 0 if it runs past the end of
+ * memory.
+ */
+
+static int decode(const uint8_t *mem, size_t size, uint32_t address,
+	enum inst_flow *flow, uint16_t *target)
+{
+	uint8_t pad[5];
+	const uint8_t *op;
+	size_t left;
+	int branch, op_size;
+
+	left = size - address;
+	op = mem + address;
+	if(left < sizeof(pad)) {
+		memset(pad, 0xff, sizeof(pad));
+		memcpy(pad, op, left);
+		op = pad;
+	}
+
+	op_size = inst_size(op, &branch);
+	if((size_t)op_size > left) {
+		return 0;
+	}
+	*flow = inst_flow(op, address, target);
+
+	/* a trap goes to the address in its vector */
+	if(*flow == flow_trap) {
+		if(*target + 1 < size) {
+			*target = (mem[*target] << 8) | mem[*target + 1];
+		} else {
+			*target = 0x0000;
+		}
+	}
+
+	return op_size;
+}
+
+/**************************************************************
+ * This will return the entry points in the reset and interrupt
+ * vectors of a program. Vectors that are erased, or point into
+ * the vector table or past the end of memory, are skipped.
+ */
+
+size_t blockmap_vectors(const uint8_t *mem, size_t size, uint16_t *entries,
+	size_t max)
+{
+	uint32_t address;
+	uint16_t vector;
+	size_t count;
+
+	assert(mem != NULL);
+	assert(entries != NULL || !max);
+
+	count = 0;
+	for(address = BLOCKMAP_VECTORS; address + 1 < size &&
+	    address < BLOCKMAP_VECTORS_END && count < max; address += 2) {
+		vector = (mem[address] << 8) | mem[address+1];
+		if(vector == 0xffff) {
+			/* erased, which is in range on a 64K part */
+			continue;
+		}
+		if(vector >= BLOCKMAP_VECTORS_END && vector < size) {
+			entries[count++] = vector;
+		}
+	}
+
+	return count;
+}
+
+/**************************************************************
+ * This will add a block start to the list of addresses to
+ * follow, unless it has been followed already.
+ */
+
+static void add_leader(uint8_t *flags, size_t size, uint32_t address,
+	uint16_t **stack, size_t *depth, size_t *alloc)
+{
+	if(address >= size) {
+		return;
+	}
+	flags[address] |= ADDR_LEADER;
+	if(flags[address] & ADDR_CODE) {
+		return;
+	}
+
+	if(*depth >= *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 256;
+		*stack = (uint16_t *)xrealloc(*stack,
+		    *alloc * sizeof(uint16_t));
+	}
+	(*stack)[(*depth)++] = address;
+
+	return;
+}
+
+/**************************************************************
+ * This will build the block map of the size bytes of program
+ * memory at mem, following control flow from the entry points.
+ */
+
+struct blockmap *blockmap_build(const uint8_t *mem, size_t size,
+	const uint16_t *entries, size_t count)
+{
+	struct blockmap *map;
+	struct block *b;
+	enum inst_flow flow;
+	uint8_t *flags;
+	uint16_t *stack, target;
+	size_t i, depth, alloc;
+	uint32_t address, next;
+	int op_size;
+
+	assert(mem != NULL);
+	assert(entries != NULL || !count);
+	assert(size <= 0x10000);
+
+	flags = (uint8_t *)xmalloc(size + 1);
+	memset(flags, 0, size + 1);
+	stack = NULL;
+	depth = 0;
+	alloc = 0;
+
+	for(i=0; i<count; i++) {
+		add_leader(flags, size, entries[i], &stack, &depth, &alloc);
+	}
+
+	/* find the code */
+	while(depth) {
+		address = stack[--depth];
+		while(address < size && !(flags[address] & ADDR_CODE)) {
+			op_size = decode(mem, size, address, &flow, &target);
+			if(!op_size) {
+				break;
+			}
+			flags[address] |= ADDR_CODE;
+			next = address + op_size;
+
+			if(flow == flow_jump || flow == flow_branch ||
+			    flow == flow_call ||
+			    (flow == flow_trap && target)) {
+				add_leader(flags, size, target,
+				    &stack, &depth, &alloc);
+			}
+			if(flow == flow_next) {
+				address = next;
+				continue;
+			}
+			if(flow == flow_branch || flow == flow_call ||
+			    flow == flow_trap || flow == flow_call_ind) {
+				add_leader(flags, size, next,
+				    &stack, &depth, &alloc);
+			}
+			break;
+		}
+	}
+	free(stack);
+
+	/* split it into blocks */
+	map = (struct blockmap *)xmalloc(sizeof(struct blockmap));
+	memset(map, 0, sizeof(struct blockmap));
+
+	address = 0;
+	while(address < size) {
+		if(!(flags[address] & ADDR_CODE)) {
+			address++;
+			continue;
+		}
+
+		if(map->count >= map->alloc) {
+			map->alloc = map->alloc ? map->alloc * 2 : 256;
+			map->blocks = (struct block *)xrealloc(map->blocks,
+			    map->alloc * sizeof(struct block));
+		}
+		b = &map->blocks[map->count++];
+		memset(b, 0, sizeof(struct block));
+		b->start = address;
+
+		for(;;) {
+			op_size = decode(mem, size, address, &flow, &target);
+			assert(op_size > 0);
+			next = address + op_size;
+			if(flow != flow_next || next >= size ||
+			    (flags[next] & (ADDR_CODE | ADDR_LEADER)) !=
+			    ADDR_CODE) {
+				break;
+			}
+			address = next;
+		}
+		b->last = address;
+		b->end = next;
+		b->flow = flow;
+
+		switch(flow) {
+		case flow_next:
+			if(flags[next] & ADDR_CODE) {
+				b->succ[b->nsucc++] = next;
+			}
+			break;
+		case flow_jump:
+			b->succ[b->nsucc++] = target;
+			break;
+		case flow_branch:
+			b->succ[b->nsucc++] = target;
+			if(target != next) {
+				b->succ[b->nsucc++] = next;
+			}
+			break;
+		case flow_call:
+		case flow_trap:
+			b->call = target;
+			/* fall through */
+		case flow_call_ind:
+			if(flags[next] & ADDR_CODE) {
+				b->succ[b->nsucc++] = next;
+			}
+			break;
+		default:
+			break;
+		}
+
+		address = next;
+	}
+	free(flags);
+
+	return map;
+}
+
+/**************************************************************
+ * This will free a block map.
+ */
+
+void blockmap_free(struct blockmap *map)
+{
+	if(map) {
+		free(map->blocks);
+		free(map);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will return the index of the block containing address,
+ * or -1 if it is not in one.
+ */
+
+long blockmap_find(const struct blockmap *map, uint16_t address)
+{
+	size_t lo, hi, mid;
+
+	assert(map != NULL);
+
+	lo = 0;
+	hi = map->count;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(map->blocks[mid].end <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo < map->count && map->blocks[lo].start <= address) {
+		return lo;
+	}
+
+	return -1;
+}
+
+/**************************************************************
+ * This will mark the blocks that can be reached from block
+ * index in reach, and list them in queue. It returns the 
+ * number of blocks listed.
+ */
+
+static size_t reachable(const struct blockmap *map, long index,
+	uint8_t *reach, size_t *queue)
+{
+	const struct block *b;
+	size_t head, tail;
+	long s;
+	int j;
+
+	memset(reach, 0, map->count);
+	head = 0;
+	tail = 0;
+	queue[tail++] = index;
+	reach[index] = 1;
+	while(head < tail) {
+		b = &map->blocks[queue[head++]];
+		for(j=0; j<b->nsucc; j++) {
+			s = blockmap_find(map, b->succ[j]);
+			if(s >= 0 && !reach[s]) {
+				reach[s] = 1;
+				queue[tail++] = s;
+			}
+		}
+	}
+
+	return tail;
+}
+
+/**************************************************************
+ * This will mark the body of the loop that the edge from block
+ * tail back to block head closes in in_loop. That is the 
+ * blocks that can be reached from head and get to tail 
+ * without going through head again.
+ */
+
+static void loop_body(const struct blockmap *map, long head, long tail,
+	uint8_t *reach, size_t *queue, uint8_t *in_loop)
+{
+	const struct block *b;
+	size_t i, count;
+	long s;
+	int j, changed;
+
+	count = reachable(map, head, reach, queue);
+	memset(in_loop, 0, map->count);
+	in_loop[head] = 1;
+	in_loop[tail] = 1;
+
+	do {
+		changed = 0;
+		for(i=0; i<count; i++) {
+			if(in_loop[queue[i]]) {
+				continue;
+			}
+			b = &map->blocks[queue[i]];
+			for(j=0; j<b->nsucc; j++) {
+				s = blockmap_find(map, b->succ[j]);
+				if(s >= 0 && s != head && in_loop[s]) {
+					in_loop[queue[i]] = 1;
+					changed = 1;
+					break;
+				}
+			}
+		}
+	} while(changed);
+
+	return;
+}
+
+/**************************************************************
+ * This will add an address to a list, if it is not already
+ * in it.
+ */
+
+static void add_exit(uint16_t *exits, size_t *count, size_t max,
+	uint16_t address)
+{
+	size_t i;
+
+	for(i=0; i<*count; i++) {
+		if(exits[i] == address) {
+			return;
+		}
+	}
+	if(*count < max) {
+		exits[(*count)++] = address;
+	}
+
+	return;
+}
+
+/**************************************************************/
+
+struct back_edge {
+	long head;
+	long tail;
+	uint16_t span;
+};
+
+static int cmp_span(const void *a, const void *b)
+{
+	return (int)((const struct back_edge *)a)->span -
+	    (int)((const struct back_edge *)b)->span;
+}
+
+/**************************************************************
+ * This will find where control leaves the code at address.
+ *
+ * If loop is zero, these are the return instructions of the
+ * function containing address (that can be reached from
+ * address). Otherwise they are the addresses that the 
+ * innermost loop containing address goes to when it ends, and
+ * any return instructions in the loop. 
+ *
+ * Loops are found from their back edges, the branches to the
+ * same or a lower address. Of the loops whose back edge spans
+ * address, the one with the shortest span that has address in
+ * its body is used. If address is not in a loop, or the loop
+ * never ends, no exits are returned.
+ *
+ * Up to max addresses are saved in exits, and the number 
+ * saved is returned.
+ */
+
+size_t blockmap_exits(const struct blockmap *map, uint16_t address, int loop,
+	uint16_t *exits, size_t max)
+{
+	const struct block *b;
+	struct back_edge *edges;
+	uint8_t *reach, *in_loop;
+	size_t *queue, count, num, i, e;
+	long index, s;
+	int j;
+
+	assert(map != NULL);
+	assert(exits != NULL || !max);
+
+	index = blockmap_find(map, address);
+	if(index < 0) {
+		return 0;
+	}
+
+	reach = (uint8_t *)xmalloc(map->count * 2);
+	in_loop = reach + map->count;
+	queue = (size_t *)xmalloc(map->count * sizeof(size_t));
+	count = 0;
+
+	if(!loop) {
+		num = reachable(map, index, reach, queue);
+		for(i=0; i<num; i++) {
+			b = &map->blocks[queue[i]];
+			if(b->flow == flow_ret) {
+				add_exit(exits, &count, max, b->last);
+			}
+		}
+		free(queue);
+		free(reach);
+		return count;
+	}
+
+	/* back edges around address, shortest first */
+	edges = (struct back_edge *)xmalloc(map->count * 2 *
+	    sizeof(struct back_edge));
+	num = 0;
+	for(i=0; i<map->count; i++) {
+		b = &map->blocks[i];
+		if(b->start < map->blocks[index].start) {
+			continue;
+		}
+		for(j=0; j<b->nsucc; j++) {
+			s = blockmap_find(map, b->succ[j]);
+			if(s >= 0 && s <= index) {
+				edges[num].head = s;
+				edges[num].tail = i;
+				edges[num].span = b->start - 
+				    map->blocks[s].start;
+				num++;
+			}
+		}
+	}
+	qsort(edges, num, sizeof(struct back_edge), cmp_span);
+
+	for(e=0; e<num; e++) {
+		loop_body(map, edges[e].head, edges[e].tail, reach, queue,
+		    in_loop);
+		if(in_loop[index]) {
+			break;
+		}
+	}
+
+	if(e < num) {
+		for(i=0; i<map->count; i++) {
+			if(!in_loop[i]) {
+				continue;
+			}
+			b = &map->blocks[i];
+			if(b->flow == flow_ret) {
+				add_exit(exits, &count, max, b->last);
+			}
+			for(j=0; j<b->nsucc; j++) {
+				s = blockmap_find(map, b->succ[j]);
+				if(s < 0 || !in_loop[s]) {
+					add_exit(exits, &count, max,
+					    b->succ[j]);
+				}
+			}
+		}
+	}
+
+	free(edges);
+	free(queue);
+	free(reach);
+
+	return count;
+}
+
+/**************************************************************/
+
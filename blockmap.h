@@ -0,0 +1,51 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Basic block and control flow map of a program.
+ */
+
+#ifndef	BLOCKMAP_HEADER
+#define	BLOCKMAP_HEADER
+
+#include	<stdlib.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* reset and interrupt vectors */
+#define	BLOCKMAP_VECTORS	0x0002
+#define	BLOCKMAP_VECTORS_END	0x003c
+
+struct block {
+	uint16_t start;		/* first instruction */
+	uint16_t last;		/* last instruction */
+	uint32_t end;		/* address after the block */
+	uint8_t flow;		/* enum inst_flow of the last instruction */
+	uint8_t nsucc;
+	uint16_t succ[2];	/* successors in the same function */
+	uint16_t call;		/* target of a call or trap, if known */
+};
+
+struct blockmap {
+	size_t count;
+	size_t alloc;
+	struct block *blocks;	/* sorted by address */
+};
+
+size_t blockmap_vectors(const uint8_t *, size_t, uint16_t *, size_t);
+struct blockmap *blockmap_build(const uint8_t *, size_t,
+	const uint16_t *, size_t);
+void blockmap_free(struct blockmap *);
+long blockmap_find(const struct blockmap *, uint16_t);
+size_t blockmap_exits(const struct blockmap *, uint16_t, int,
+	uint16_t *, size_t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BLOCKMAP_HEADER */
+
@@ -0,0 +1,658 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This rebuilds the call tree of a program from an emulator
+ * trace, and reports the cycles spent in each function.
+ *
+ * Each instruction in the trace is looked up with the
+ * disassembler. After a call or trap, the next instruction
+ * is the entry of a new function; after a ret or iret, the
+ * function returns. After an interrupt acknowledge, the next
+ * instruction is the entry of an interrupt handler, and the
+ * cycles from the acknowledge to it are its entry latency.
+ *
+ * Every frame counts as one cycle. When the trace has
+ * timestamp frames, the count is set from each timestamp, so
+ * cycles not traced are still accounted for. Functions are
+ * named by their entry address.
+ */
+
+#include	<string.h>
+#include	<stdio.h>
+#include	<ctype.h>
+#include	<assert.h>
+#include	<readline/readline.h>
+#include	<readline/history.h>
+#include	"xmalloc.h"
+
+#include	"ez8dbg.h"
+#include	"ez8.h"
+#include	"disassembler.h"
+#include	"trcedec.h"
+
+/**************************************************************/
+
+extern int esc_key;
+extern ez8dbg *ez8;
+
+/* longest call chain followed */
+#define	CALL_DEPTH	256
+
+/* instruction classes */
+enum { inst_unknown, inst_other, inst_call, inst_ret };
+
+struct call_node {
+	uint16_t func;
+	bool irq;
+	unsigned long calls;
+	uint64_t incl;
+	uint64_t excl;
+	struct call_node *parent;
+	struct call_node *child;
+	struct call_node *sibling;
+};
+
+struct call_frame {
+	struct call_node *node;
+	uint32_t entry;
+	uint64_t child;
+	bool call;		/* a call is pending */
+};
+
+struct func_stats {
+	unsigned long calls;
+	uint64_t incl;
+	uint64_t excl;
+	uint16_t active;
+};
+
+struct irq_stats {
+	uint16_t isr;
+	unsigned long count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+
+static struct call_node *roots = NULL;
+static struct call_frame stack[CALL_DEPTH];
+static int depth = 0;
+static int overflow = 0;
+static uint32_t cycle;
+static uint8_t *inst_class = NULL;
+static struct func_stats *funcs = NULL;
+static struct irq_stats *irqs = NULL;
+static size_t num_irqs = 0;
+
+/**************************************************************
+ * This will classify the instruction at pc.
+ */
+
+static int classify(uint16_t pc)
+{
+	const uint8_t *inst;
+	const char *mnemonic;
+
+	if(inst_class[pc] == inst_unknown) {
+		ez8->disasm(pc, &inst, NULL);
+		mnemonic = inst_mnemonic(inst);
+		if(!mnemonic) {
+			inst_class[pc] = inst_other;
+		} else if(!strcmp(mnemonic, "call") ||
+		    !strcmp(mnemonic, "trap")) {
+			inst_class[pc] = inst_call;
+		} else if(!strcmp(mnemonic, "ret") ||
+		    !strcmp(mnemonic, "iret")) {
+			inst_class[pc] = inst_ret;
+		} else {
+			inst_class[pc] = inst_other;
+		}
+	}
+
+	return inst_class[pc];
+}
+
+/**************************************************************
+ * This will free a call tree.
+ */
+
+static void free_nodes(struct call_node *node)
+{
+	struct call_node *next;
+
+	while(node) {
+		next = node->sibling;
+		free_nodes(node->child);
+		free(node);
+		node = next;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will enter a function.
+ */
+
+static void push(uint16_t func, bool irq)
+{
+	struct call_node **list, *node;
+	struct call_frame *f;
+
+	/* too deep, charge it to the caller */
+	if(depth == CALL_DEPTH) {
+		overflow++;
+		return;
+	}
+
+	list = depth ? &stack[depth-1].node->child : &roots;
+	for(node = *list; node; node = node->sibling) {
+		if(node->func == func && node->irq == irq) {
+			break;
+		}
+	}
+	if(!node) {
+		node = (struct call_node *)xmalloc(sizeof(struct call_node));
+		memset(node, 0, sizeof(struct call_node));
+		node->func = func;
+		node->irq = irq;
+		node->parent = depth ? stack[depth-1].node : NULL;
+		node->sibling = *list;
+		*list = node;
+	}
+	node->calls++;
+	funcs[func].calls++;
+	funcs[func].active++;
+
+	f = &stack[depth++];
+	f->node = node;
+	f->entry = cycle;
+	f->child = 0;
+	f->call = 0;
+
+	return;
+}
+
+/**************************************************************
+ * This will return from the innermost function.
+ */
+
+static void pop(void)
+{
+	struct call_frame *f;
+	struct func_stats *s;
+	uint64_t incl;
+
+	if(overflow) {
+		overflow--;
+		return;
+	}
+	assert(depth > 0);
+
+	f = &stack[--depth];
+	incl = (uint32_t)(cycle - f->entry);
+	if(incl < f->child) {
+		incl = f->child;
+	}
+	f->node->incl += incl;
+	f->node->excl += incl - f->child;
+
+	s = &funcs[f->node->func];
+	s->excl += incl - f->child;
+	if(!--s->active) {
+		s->incl += incl;
+	}
+
+	if(depth) {
+		stack[depth-1].child += incl;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will record the entry latency of an interrupt.
+ */
+
+static void add_latency(uint16_t isr, uint32_t cycles)
+{
+	struct irq_stats *s;
+	size_t i;
+
+	for(i=0; i<num_irqs; i++) {
+		if(irqs[i].isr == isr) {
+			break;
+		}
+	}
+	if(i == num_irqs) {
+		irqs = (struct irq_stats *)xrealloc(irqs,
+		    ++num_irqs * sizeof(struct irq_stats));
+		memset(&irqs[i], 0, sizeof(struct irq_stats));
+		irqs[i].isr = isr;
+		irqs[i].min = cycles;
+	}
+
+	s = &irqs[i];
+	s->count++;
+	s->total += cycles;
+	if(cycles < s->min) {
+		s->min = cycles;
+	}
+	if(cycles > s->max) {
+		s->max = cycles;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will build the call tree from decoded trace events.
+ */
+
+static void build_tree(const struct trcedec *dec)
+{
+	size_t i;
+	uint16_t pc;
+	uint32_t ack;
+	bool irq, ret;
+
+	irq = ret = 0;
+	ack = 0;
+	cycle = 0;
+
+	for(i=0; i<dec->count; i++) {
+		switch(dec->kind[i]) {
+		case trcedec_time:
+			cycle = dec->time[i];
+			continue;
+		case trcedec_gap:
+			/* calls and returns were lost */
+			while(depth) {
+				pop();
+			}
+			irq = ret = 0;
+			continue;
+		case trcedec_intack:
+			cycle++;
+			irq = 1;
+			ack = cycle;
+			continue;
+		case trcedec_inst:
+			cycle++;
+			break;
+		default:
+			cycle++;
+			continue;
+		}
+		pc = dec->pc[i];
+
+		if(ret) {
+			ret = 0;
+			if(depth) {
+				pop();
+			}
+		}
+		if(irq) {
+			irq = 0;
+			push(pc, 1);
+			add_latency(pc, cycle - ack);
+		} else if(depth && stack[depth-1].call) {
+			stack[depth-1].call = 0;
+			push(pc, 0);
+		}
+		if(!depth) {
+			/* started inside, or returned from, a function
+			 * whose entry was not traced */
+			push(pc, 0);
+		}
+
+		switch(classify(pc)) {
+		case inst_call:
+			stack[depth-1].call = 1;
+			break;
+		case inst_ret:
+			ret = 1;
+			break;
+		}
+	}
+
+	while(depth) {
+		pop();
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will display the call tree, busiest calls first.
+ */
+
+static int cmp_node(const void *a, const void *b)
+{
+	const struct call_node *x = *(const struct call_node * const *)a;
+	const struct call_node *y = *(const struct call_node * const *)b;
+
+	if(x->incl != y->incl) {
+		return x->incl < y->incl ? 1 : -1;
+	}
+
+	return x->func - y->func;
+}
+
+static void show_nodes(struct call_node *list, int level, uint64_t total)
+{
+	struct call_node **nodes, *node;
+	size_t i, num;
+
+	num = 0;
+	for(node = list; node; node = node->sibling) {
+		num++;
+	}
+	if(!num) {
+		return;
+	}
+	nodes = (struct call_node **)xmalloc(num * sizeof(*nodes));
+	for(i=0, node = list; node; node = node->sibling) {
+		nodes[i++] = node;
+	}
+	qsort(nodes, num, sizeof(*nodes), cmp_node);
+
+	for(i=0; i<num; i++) {
+		node = nodes[i];
+		printf("%8lu %12llu %12llu %5.1f%%  %*s%04X%s\n",
+		    node->calls, (unsigned long long)node->incl,
+		    (unsigned long long)node->excl,
+		    total ? 100.0 * node->incl / total : 0.0,
+		    level * 2, "", node->func, node->irq ? " (irq)" : "");
+		show_nodes(node->child, level + 1, total);
+	}
+	free(nodes);
+
+	return;
+}
+
+/**************************************************************
+ * This will display the time spent in each function, busiest
+ * first.
+ */
+
+static int cmp_func(const void *a, const void *b)
+{
+	uint16_t x = *(const uint16_t *)a;
+	uint16_t y = *(const uint16_t *)b;
+
+	if(funcs[x].excl != funcs[y].excl) {
+		return funcs[x].excl < funcs[y].excl ? 1 : -1;
+	}
+
+	return x - y;
+}
+
+static void show_funcs(uint64_t total)
+{
+	uint16_t *list;
+	size_t i, num;
+
+	list = (uint16_t *)xmalloc(EZ8MEM_SIZE * sizeof(uint16_t));
+	num = 0;
+	for(i=0; i<EZ8MEM_SIZE; i++) {
+		if(funcs[i].calls) {
+			list[num++] = i;
+		}
+	}
+	qsort(list, num, sizeof(uint16_t), cmp_func);
+
+	printf("   Calls    Inclusive    Exclusive      %%  Function\n");
+	for(i=0; i<num; i++) {
+		printf("%8lu %12llu %12llu %5.1f%%  %04X\n",
+		    funcs[list[i]].calls,
+		    (unsigned long long)funcs[list[i]].incl,
+		    (unsigned long long)funcs[list[i]].excl,
+		    total ? 100.0 * funcs[list[i]].excl / total : 0.0,
+		    list[i]);
+	}
+	free(list);
+
+	return;
+}
+
+/**************************************************************
+ * This will display the entry latency of each interrupt.
+ */
+
+static void show_irqs(void)
+{
+	size_t i;
+
+	if(!num_irqs) {
+		return;
+	}
+
+	printf("\nInterrupt entry latency (cycles)\n");
+	printf("   Count      Min      Avg      Max  Handler\n");
+	for(i=0; i<num_irqs; i++) {
+		printf("%8lu %8lu %8.1f %8lu  %04X\n", irqs[i].count,
+		    (unsigned long)irqs[i].min,
+		    (double)irqs[i].total / irqs[i].count,
+		    (unsigned long)irqs[i].max, irqs[i].isr);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will write the exclusive cycles of each call path in
+ * the collapsed stack format used by flamegraph tools.
+ */
+
+static void write_paths(FILE *file, struct call_node *list, char *path,
+	size_t len)
+{
+	struct call_node *node;
+	size_t n;
+
+	for(node = list; node; node = node->sibling) {
+		n = len;
+		if(n + 8 < CALL_DEPTH * 8) {
+			n += sprintf(path + n, "%s%04X", n ? ";" : "",
+			    node->func);
+		}
+		if(node->excl) {
+			fprintf(file, "%s %llu\n", path,
+			    (unsigned long long)node->excl);
+		}
+		write_paths(file, node->child, path, n);
+		path[len] = '\0';
+	}
+
+	return;
+}
+
+static int write_collapsed(const char *filename)
+{
+	FILE *file;
+	char *path;
+
+	file = fopen(filename, "w");
+	if(!file) {
+		perror(filename);
+		return -1;
+	}
+
+	path = (char *)xmalloc(CALL_DEPTH * 8 + 1);
+	*path = '\0';
+	write_paths(file, roots, path, 0);
+	free(path);
+
+	if(fclose(file)) {
+		perror(filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will read the frames to analyze, from a capture file
+ * or from the trace buffer. It returns NULL if aborted.
+ */
+
+static struct trcedec *read_trace(void)
+{
+	char *buff;
+	char *tail;
+	unsigned long start, size;
+	struct trce_frame *frames;
+	struct trcedec *dec;
+
+	buff = readline("Capture file (blank for trace buffer): ");
+	if(!buff) {
+		printf("\n");
+		return NULL;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(buff);
+		return NULL;
+	}
+
+	dec = trcedec_new();
+	if(*buff) {
+		if(trcedec_rd_file(dec, buff, NULL)) {
+			printf("Could not read %s\n", buff);
+			trcedec_free(dec);
+			dec = NULL;
+		}
+		free(buff);
+		return dec;
+	}
+	free(buff);
+
+	buff = readline("Start: ");
+	if(!buff || esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(buff);
+		trcedec_free(dec);
+		return NULL;
+	}
+	start = strtoul(buff, &tail, 16);
+	if(!tail || *tail || tail == buff || start > 0xffff) {
+		printf("Invalid Number\n");
+		free(buff);
+		trcedec_free(dec);
+		return NULL;
+	}
+	free(buff);
+
+	buff = readline("Size: ");
+	if(!buff || esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(buff);
+		trcedec_free(dec);
+		return NULL;
+	}
+	size = strtoul(buff, &tail, 16);
+	if(!tail || *tail || tail == buff || !size || size > 0xffff) {
+		printf("Invalid Number\n");
+		free(buff);
+		trcedec_free(dec);
+		return NULL;
+	}
+	free(buff);
+
+	frames = (struct trce_frame *)
+	    xmalloc(sizeof(struct trce_frame) * size);
+	try {
+		ez8->rd_trce_buff(start, frames, size);
+	} catch(char *err) {
+		free(frames);
+		trcedec_free(dec);
+		throw err;
+	}
+	trcedec_decode(dec, (uint8_t *)frames, size, NULL);
+	free(frames);
+
+	return dec;
+}
+
+/**************************************************************
+ * trce_call_tree()
+ *
+ * This trace command will build a call tree from a trace, and
+ * display the cycles spent in each function.
+ */
+
+void trce_call_tree(void)
+{
+	struct trcedec *dec;
+	struct call_node *node;
+	uint64_t total;
+	char *filename;
+
+	dec = read_trace();
+	if(!dec) {
+		return;
+	}
+
+	inst_class = (uint8_t *)xmalloc(EZ8MEM_SIZE);
+	memset(inst_class, inst_unknown, EZ8MEM_SIZE);
+	funcs = (struct func_stats *)
+	    xmalloc(EZ8MEM_SIZE * sizeof(struct func_stats));
+	memset(funcs, 0, EZ8MEM_SIZE * sizeof(struct func_stats));
+	roots = NULL;
+	irqs = NULL;
+	num_irqs = 0;
+	depth = 0;
+	overflow = 0;
+
+	try {
+		build_tree(dec);
+	} catch(char *err) {
+		free_nodes(roots);
+		free(inst_class);
+		free(funcs);
+		free(irqs);
+		trcedec_free(dec);
+		throw err;
+	}
+	printf("%lu events\n", (unsigned long)dec->count);
+	trcedec_free(dec);
+
+	total = 0;
+	for(node = roots; node; node = node->sibling) {
+		total += node->incl;
+	}
+
+	printf("\n   Calls    Inclusive    Exclusive      %%  Call tree\n");
+	show_nodes(roots, 0, total);
+	printf("\n");
+	show_funcs(total);
+	show_irqs();
+
+	filename = readline("\nCollapsed stack file (blank for none): ");
+	if(esc_key) {
+		esc_key = 0;
+		printf("\n");
+	} else if(filename && *filename) {
+		if(!write_collapsed(filename)) {
+			printf("Wrote %s\n", filename);
+		}
+	}
+	free(filename);
+
+	free_nodes(roots);
+	roots = NULL;
+	free(inst_class);
+	free(funcs);
+	free(irqs);
+	irqs = NULL;
+
+	return;
+}
+
+/**************************************************************/
+
@@ -0,0 +1,716 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This measures code coverage with one-shot breakpoints. A
+ * breakpoint is set at the start of every basic block (or
+ * every function), and is removed the first time it is
+ * reached, so code that has run once runs at full speed.
+ *
+ * Removing a breakpoint means programming its flash page, so
+ * breakpoints that have been reached are not removed right
+ * away. The cpu is resumed without syncing the breakpoints,
+ * and they are removed together, a page at a time, when one
+ * of them is reached again or when coverage ends.
+ *
+ * The result is written as a disassembly listing marking the
+ * code that ran, and as an lcov tracefile of that listing, so
+ * the usual lcov tools can report on it.
+ */
+
+#include	<string.h>
+#include	<stdio.h>
+#include	<ctype.h>
+#include	<assert.h>
+#include	<sys/time.h>
+#include	<readline/readline.h>
+#include	<readline/history.h>
+#include	"xmalloc.h"
+
+#include	"ez8dbg.h"
+#include	"ez8.h"
+#include	"disassembler.h"
+#include	"blockmap.h"
+#include	"timer.h"
+
+/**************************************************************/
+
+extern int esc_key;
+extern char *readline_hook(const char *, rl_hook_func_t *, int);
+extern ez8dbg *ez8;
+extern rl_command_func_t *tab_function;
+extern void display_registers(void);
+
+/* time to wait for a breakpoint between keyboard checks (ms) */
+#define	COV_WAIT	20
+
+/* time to wait for a key between breakpoint checks (usec) */
+#define	COV_CHECK	1000
+
+struct cov_point {
+	uint16_t address;
+	uint32_t end;		/* end of block, in block mode */
+	bool planted;		/* breakpoint set */
+	bool hit;
+};
+
+static struct cov_point *points = NULL;
+static size_t num_points = 0;
+static size_t max_points = 0;
+static bool cov_blocks = 1;
+
+/* breakpoints reached, but still in flash */
+static uint16_t *pending = NULL;
+static size_t num_pending = 0;
+
+static unsigned long cov_hits = 0;
+static unsigned long cov_rehits = 0;
+static unsigned long cov_syncs = 0;
+static unsigned long cov_pages = 0;
+static long cov_stopped = 0;
+static bool cov_brk = 0;
+static char *cov_err = NULL;
+
+/**************************************************************
+ * This will find the coverage point at an address. It returns
+ * -1 if there is none.
+ */
+
+static long find_point(uint16_t address)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = num_points;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(points[mid].address < address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo < num_points && points[lo].address == address) {
+		return lo;
+	}
+
+	return -1;
+}
+
+static void add_point(uint16_t address, uint32_t end)
+{
+	if(num_points == max_points) {
+		max_points = max_points ? max_points * 2 : 1024;
+		points = (struct cov_point *)xrealloc(points,
+		    max_points * sizeof(struct cov_point));
+	}
+	points[num_points].address = address;
+	points[num_points].end = end;
+	points[num_points].planted = 0;
+	points[num_points].hit = 0;
+	num_points++;
+
+	return;
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+	return (int)((const struct cov_point *)a)->address -
+	    (int)((const struct cov_point *)b)->address;
+}
+
+/**************************************************************
+ * This will count the flash pages the addresses are on. The
+ * addresses must be sorted.
+ */
+
+static unsigned long count_pages(const uint16_t *addrs, size_t num)
+{
+	unsigned long pages;
+	size_t i;
+
+	pages = 0;
+	for(i=0; i<num; i++) {
+		if(!i || addrs[i] / EZ8MEM_PAGESIZE !=
+		    addrs[i-1] / EZ8MEM_PAGESIZE) {
+			pages++;
+		}
+	}
+
+	return pages;
+}
+
+static int cmp_address(const void *a, const void *b)
+{
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/**************************************************************
+ * This will remove the breakpoints that have been reached from
+ * flash, and run again.
+ */
+
+static void sync_pending(void)
+{
+	qsort(pending, num_pending, sizeof(uint16_t), cmp_address);
+	cov_pages += count_pages(pending, num_pending);
+	cov_syncs++;
+	num_pending = 0;
+
+	ez8->run();
+
+	return;
+}
+
+/**************************************************************
+ * This is a readline hook. It is called periodically while
+ * measuring coverage, and handles the breakpoints reached.
+ */
+
+static int cov_poll(void)
+{
+	struct timer t;
+	uint16_t pc;
+	long i;
+
+	try {
+		if(!ez8->wait_for_stop(COV_WAIT)) {
+			return 0;
+		}
+
+		timerstart(&t);
+		pc = ez8->rd_pc();
+		i = find_point(pc);
+		if(i < 0 || !points[i].planted) {
+			/* stopped for some other reason */
+			cov_brk = 1;
+			rl_done = 1;
+			return 0;
+		}
+
+		if(!points[i].hit) {
+			points[i].hit = 1;
+			cov_hits++;
+			ez8->remove_breakpoint(pc);
+			pending[num_pending++] = pc;
+			ez8->resume();
+		} else {
+			/* reached again before it was removed */
+			cov_rehits++;
+			sync_pending();
+		}
+
+		timerstop(&t);
+		cov_stopped += timerusec(&t);
+	} catch(char *err) {
+		cov_err = err;
+		rl_done = 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will find the points to measure: the start of each
+ * block, or the start of each function (the targets of calls
+ * and the vectors).
+ */
+
+static void find_points(const struct blockmap *map)
+{
+	uint8_t vectors[BLOCKMAP_VECTORS_END];
+	uint16_t entries[BLOCKMAP_VECTORS_END / 2];
+	const struct block *b;
+	size_t i, j, count;
+	long index;
+
+	num_points = 0;
+
+	if(cov_blocks) {
+		for(i=0; i<map->count; i++) {
+			b = &map->blocks[i];
+			add_point(b->start, b->end);
+		}
+		return;
+	}
+
+	ez8->read_mem(0x0000, vectors, sizeof(vectors));
+	count = blockmap_vectors(vectors, EZ8MEM_SIZE, entries,
+	    sizeof(entries) / sizeof(*entries));
+	for(i=0; i<count; i++) {
+		add_point(entries[i], 0);
+	}
+	for(i=0; i<map->count; i++) {
+		b = &map->blocks[i];
+		if((b->flow == flow_call || b->flow == flow_trap) &&
+		    b->call) {
+			add_point(b->call, 0);
+		}
+	}
+
+	/* sort, drop duplicates and entries outside the code */
+	qsort(points, num_points, sizeof(struct cov_point), cmp_point);
+	for(i=0, j=0; i<num_points; i++) {
+		if(j && points[j-1].address == points[i].address) {
+			continue;
+		}
+		index = blockmap_find(map, points[i].address);
+		if(index < 0 || map->blocks[index].start !=
+		    points[i].address) {
+			continue;
+		}
+		points[j++] = points[i];
+	}
+	num_points = j;
+
+	return;
+}
+
+/**************************************************************
+ * This will remove the breakpoints still set, and write flash.
+ * It returns the number of pages written.
+ */
+
+static unsigned long remove_points(void)
+{
+	uint16_t *addrs;
+	unsigned long pages;
+	size_t i, num;
+
+	addrs = (uint16_t *)xmalloc((num_points + 1) * sizeof(uint16_t));
+	num = 0;
+	for(i=0; i<num_points; i++) {
+		if(points[i].planted && !points[i].hit) {
+			addrs[num++] = points[i].address;
+		}
+	}
+
+	try {
+		ez8->change_breakpoints(NULL, 0, addrs, num);
+		memcpy(addrs + num, pending, num_pending * sizeof(uint16_t));
+		num += num_pending;
+		num_pending = 0;
+		qsort(addrs, num, sizeof(uint16_t), cmp_address);
+		pages = count_pages(addrs, num);
+		ez8->sync_breakpoints();
+	} catch(char *err) {
+		free(addrs);
+		throw err;
+	}
+	free(addrs);
+
+	return pages;
+}
+
+/**************************************************************
+ * This will write the listing of the code in the block map,
+ * marking the code that ran with '+' and the code that did
+ * not with '-'. If lcov is not NULL, an lcov tracefile of the
+ * listing is written to it as well.
+ */
+
+static int write_listing(const char *filename, const char *lcovname,
+	const struct blockmap *map)
+{
+	const struct block *b;
+	const uint8_t *inst;
+	const char *text;
+	FILE *file, *lcov;
+	char bytes[16], mark;
+	unsigned long line, *da_line, lf, lh, fnf, fnh;
+	uint8_t *da_hit;
+	uint32_t address, last;
+	size_t i, k, num_da;
+	long index, hit;
+	int size, j;
+
+	file = fopen(filename, "w");
+	if(!file) {
+		perror(filename);
+		return -1;
+	}
+	lcov = NULL;
+	if(lcovname) {
+		lcov = fopen(lcovname, "w");
+		if(!lcov) {
+			perror(lcovname);
+			fclose(file);
+			return -1;
+		}
+		fprintf(lcov, "TN:ez8mon\n");
+		fprintf(lcov, "SF:%s\n", filename);
+	}
+
+	/* one line for each instruction */
+	da_line = (unsigned long *)xmalloc(EZ8MEM_SIZE * sizeof(long));
+	da_hit = (uint8_t *)xmalloc(EZ8MEM_SIZE);
+	num_da = 0;
+	fnf = 0;
+	fnh = 0;
+	line = 0;
+	last = 0;
+
+	for(i=0; i<map->count; i++) {
+		b = &map->blocks[i];
+
+		if(i && b->start != last) {
+			fprintf(file, "\n");
+			line++;
+		}
+		last = b->end;
+
+		/* function labels */
+		index = find_point(b->start);
+		hit = -1;
+		if(index >= 0 && points[index].planted) {
+			hit = points[index].hit;
+		}
+		if(!cov_blocks && index >= 0) {
+			mark = hit < 0 ? ' ' : hit ? '+' : '-';
+			fprintf(file, "%c func_%04X:\n", mark, b->start);
+			line++;
+			if(lcov) {
+				fprintf(lcov, "FN:%lu,func_%04X\n", line,
+				    b->start);
+				fprintf(lcov, "FNDA:%ld,func_%04X\n",
+				    hit > 0 ? 1L : 0L, b->start);
+				fnf++;
+				fnh += hit > 0;
+			}
+		}
+
+		mark = ' ';
+		if(cov_blocks && hit >= 0) {
+			mark = hit ? '+' : '-';
+		}
+
+		for(address = b->start; address < b->end; address += size) {
+			size = ez8->disasm(address, &inst, &text);
+			for(j=0, k=0; j<size && j<5; j++) {
+				k += snprintf(bytes + k, sizeof(bytes) - k,
+				    "%02X ", inst[j]);
+			}
+			fprintf(file, "%c   %04X: %-15s %s\n", mark,
+			    address, bytes, text);
+			line++;
+			if(mark != ' ') {
+				da_line[num_da] = line;
+				da_hit[num_da] = mark == '+';
+				num_da++;
+			}
+		}
+	}
+
+	if(lcov) {
+		fprintf(lcov, "FNF:%lu\n", fnf);
+		fprintf(lcov, "FNH:%lu\n", fnh);
+		lf = 0;
+		lh = 0;
+		for(k=0; k<num_da; k++) {
+			fprintf(lcov, "DA:%lu,%d\n", da_line[k], da_hit[k]);
+			lf++;
+			lh += da_hit[k];
+		}
+		fprintf(lcov, "LF:%lu\n", lf);
+		fprintf(lcov, "LH:%lu\n", lh);
+		fprintf(lcov, "end_of_record\n");
+		fclose(lcov);
+	}
+	free(da_line);
+	free(da_hit);
+
+	fclose(file);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will show the coverage summary.
+ */
+
+static void show_coverage(long elapsed, long plant_time,
+	unsigned long plant_pages, long clean_time, unsigned long clean_pages)
+{
+	unsigned long planted, hit, bytes, bytes_hit;
+	size_t i;
+
+	planted = 0;
+	hit = 0;
+	bytes = 0;
+	bytes_hit = 0;
+	for(i=0; i<num_points; i++) {
+		if(!points[i].planted) {
+			continue;
+		}
+		planted++;
+		bytes += points[i].end - points[i].address;
+		if(points[i].hit) {
+			hit++;
+			bytes_hit += points[i].end - points[i].address;
+		}
+	}
+
+	printf("Coverage: %lu of %lu %s (%.1f%%)", hit, planted,
+	    cov_blocks ? "blocks" : "functions",
+	    planted ? 100.0 * hit / planted : 0.0);
+	if(cov_blocks) {
+		printf(", %lu of %lu bytes (%.1f%%)", bytes_hit, bytes,
+		    bytes ? 100.0 * bytes_hit / bytes : 0.0);
+	}
+	printf("\n");
+	if(planted < num_points) {
+		printf("%lu not measured, a breakpoint is already set\n",
+		    (unsigned long)(num_points - planted));
+	}
+
+	printf("Set %lu breakpoints on %lu pages in %ldms, "
+	    "removed them from %lu pages in %ldms\n", planted,
+	    plant_pages, plant_time / 1000, clean_pages, clean_time / 1000);
+	printf("%lu hits, %lu reached again before removal, "
+	    "%lu syncs of %lu pages\n", cov_hits, cov_rehits,
+	    cov_syncs, cov_pages);
+	if(cov_hits + cov_rehits) {
+		printf("Overhead %ldus/hit, cpu stopped %.1f%% "
+		    "of the time\n",
+		    cov_stopped / (long)(cov_hits + cov_rehits),
+		    elapsed > 0 ? 100.0 * cov_stopped / elapsed : 0.0);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will read a line for a coverage prompt. It returns NULL
+ * if aborted.
+ */
+
+static char *cov_readline(const char *prompt)
+{
+	char *buff;
+
+	tab_function = rl_complete;
+	buff = readline(prompt);
+	tab_function = rl_insert;
+	if(!buff) {
+		printf("Abort\n");
+		return NULL;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		free(buff);
+		printf("\nAbort\n");
+		return NULL;
+	}
+
+	return buff;
+}
+
+/**************************************************************
+ * This will set the breakpoints and run until a key is pressed
+ * or the cpu stops somewhere else. The breakpoints are always
+ * removed before returning.
+ */
+
+static void run_coverage(const struct blockmap *map, long *elapsed,
+	long *plant_time, unsigned long *plant_pages, long *clean_time,
+	unsigned long *clean_pages)
+{
+	struct timer t, run;
+	uint16_t *addrs;
+	uint16_t pc;
+	char *buff;
+	size_t i, num;
+	long index;
+
+	/* the block at the pc is about to run */
+	pc = ez8->cached_pc();
+	index = blockmap_find(map, pc);
+
+	addrs = (uint16_t *)xmalloc((num_points + 1) * sizeof(uint16_t));
+	num = 0;
+	for(i=0; i<num_points; i++) {
+		if(points[i].address == 0x0000 ||
+		    ez8->breakpoint_set(points[i].address)) {
+			continue;
+		}
+		points[i].planted = 1;
+		if(index >= 0 && points[i].address == pc) {
+			points[i].hit = 1;
+			cov_hits++;
+			continue;
+		}
+		addrs[num++] = points[i].address;
+	}
+	*plant_pages = count_pages(addrs, num);
+	pending = (uint16_t *)xrealloc(pending,
+	    (num_points + 1) * sizeof(uint16_t));
+	num_pending = 0;
+
+	timerstart(&t);
+	try {
+		ez8->change_breakpoints(addrs, num, NULL, 0);
+	} catch(char *err) {
+		free(addrs);
+		throw err;
+	}
+	free(addrs);
+
+	try {
+		ez8->sync_breakpoints();
+		timerstop(&t);
+		*plant_time = timerusec(&t);
+
+		timerstart(&run);
+		ez8->run();
+		buff = readline_hook("Measuring coverage... ", cov_poll, 
+		    COV_CHECK);
+		timerstop(&run);
+		*elapsed = timerusec(&run);
+		if(buff) {
+			free(buff);
+			buff = NULL;
+		} else {
+			printf("\n");
+		}
+		if(esc_key) {
+			esc_key = 0;
+			printf("\n");
+		}
+		if(!ez8->state(ez8->state_stopped)) {
+			ez8->stop();
+		}
+	} catch(char *err) {
+		if(!cov_err) {
+			cov_err = err;
+		}
+	}
+
+	/* take the breakpoints out again, even after an error */
+	try {
+		timerstart(&t);
+		*clean_pages = remove_points();
+		timerstop(&t);
+		*clean_time = timerusec(&t);
+	} catch(char *err) {
+		if(!cov_err) {
+			cov_err = err;
+		}
+	}
+
+	if(cov_err) {
+		char *err;
+
+		err = cov_err;
+		cov_err = NULL;
+		throw err;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * coverage_program()
+ *
+ * This monitor command will run the program with a breakpoint
+ * at every block or function, until a key is pressed or a
+ * breakpoint is reached, then show what code ran.
+ */
+
+void coverage_program(void)
+{
+	const struct blockmap *map;
+	char *buff, *listfile, *lcovfile;
+	long elapsed, plant_time, clean_time;
+	unsigned long plant_pages, clean_pages;
+
+	listfile = NULL;
+	lcovfile = NULL;
+
+	rl_num_chars_to_read = 1;
+	buff = readline("[B]locks or [F]unctions? ");
+	rl_num_chars_to_read = 0;
+	if(!buff) {
+		printf("\n");
+		return;
+	}
+	switch(toupper(*buff)) {
+	case 'B':
+		cov_blocks = 1;
+		break;
+	case 'F':
+		cov_blocks = 0;
+		break;
+	default:
+		free(buff);
+		printf("Abort\n");
+		return;
+	}
+	free(buff);
+
+	buff = cov_readline("Listing file: ");
+	if(!buff) {
+		return;
+	}
+	if(*buff) {
+		add_history(buff);
+		listfile = xstrdup(strtok(buff, " \t\r\n"));
+	}
+	free(buff);
+
+	if(listfile) {
+		buff = cov_readline("lcov file: ");
+		if(!buff) {
+			free(listfile);
+			return;
+		}
+		if(*buff) {
+			add_history(buff);
+			lcovfile = xstrdup(strtok(buff, " \t\r\n"));
+		}
+		free(buff);
+	}
+
+	cov_hits = 0;
+	cov_rehits = 0;
+	cov_syncs = 0;
+	cov_pages = 0;
+	cov_stopped = 0;
+	cov_brk = 0;
+	elapsed = 0;
+	plant_time = 0;
+	plant_pages = 0;
+	clean_time = 0;
+	clean_pages = 0;
+
+	try {
+		map = ez8->block_map();
+		find_points(map);
+		if(!num_points) {
+			printf("No code found\n");
+		} else {
+			run_coverage(map, &elapsed, &plant_time, &plant_pages,
+			    &clean_time, &clean_pages);
+			if(cov_brk) {
+				printf("BREAK\n");
+			}
+			show_coverage(elapsed, plant_time, plant_pages,
+			    clean_time, clean_pages);
+			if(listfile) {
+				write_listing(listfile, lcovfile, map);
+			}
+		}
+	} catch(char *err) {
+		free(listfile);
+		free(lcovfile);
+		throw err;
+	}
+	free(listfile);
+	free(lcovfile);
+
+	display_registers();
+
+	return;
+}
+
+/**************************************************************/
+
@@ -108,5 +108,94 @@ uint16_t crc_ccitt(uint16_t crc, uint8_t *data, size_t size)
 	return ~crc;
 }
 
+/**************************************************************
+ * The crc of a run of identical bytes is computed in closed
+ * form. One byte step of the (inverted) crc register is an
+ * affine map over GF(2), 
+ *
+ *	crc' = A * crc + crctable[fill]
+ *
+ * so the map for count bytes is found by repeated squaring.
+ * Column i of A is the image of bit i.
+ */
+
+/* below this, just run the table */
+#define	CRC_FILL_SHORT	64
+
+struct crc_affine {
+	uint16_t col[16];
+	uint16_t c;
+};
+
+static uint16_t crc_apply(const struct crc_affine *m, uint16_t x, int affine)
+{
+	uint16_t y;
+	int i;
+
+	y = affine ? m->c : 0;
+	for(i=0; x; i++, x >>= 1) {
+		if(x & 0x01) {
+			y ^= m->col[i];
+		}
+	}
+
+	return y;
+}
+
+/* r = a(b(x)) */
+static void crc_compose(struct crc_affine *r, const struct crc_affine *a,
+	const struct crc_affine *b)
+{
+	struct crc_affine t;
+	int i;
+
+	for(i=0; i<16; i++) {
+		t.col[i] = crc_apply(a, b->col[i], 0);
+	}
+	t.c = crc_apply(a, b->c, 1);
+	*r = t;
+
+	return;
+}
+
+uint16_t crc_ccitt_fill(uint16_t crc, uint8_t fill, size_t count)
+{
+	struct crc_affine step, result;
+	int i;
+
+#ifndef	STATIC_CRCTABLE
+	if(!crctable) {
+		gen_crctable();
+	}
+#endif
+	crc = ~crc;
+
+	if(count < CRC_FILL_SHORT) {
+		while(count-- > 0) {
+			crc = (crc >> 8) ^ crctable[(fill ^ crc) & 0xff];
+		}
+		return ~crc;
+	}
+
+	for(i=0; i<16; i++) {
+		step.col[i] = i < 8 ? crctable[1 << i] : 1 << (i - 8);
+		result.col[i] = 1 << i;
+	}
+	step.c = crctable[fill];
+	result.c = 0;
+
+	while(count) {
+		if(count & 0x01) {
+			crc_compose(&result, &step, &result);
+		}
+		crc_compose(&step, &step, &step);
+		count >>= 1;
+	}
+
+	crc = crc_apply(&result, crc, 1);
+
+	return ~crc;
+}
+
 /**************************************************************/
 
@@ -15,6 +15,7 @@ extern "C" {
 #endif
 
 uint16_t crc_ccitt(uint16_t, uint8_t *, size_t);
+uint16_t crc_ccitt_fill(uint16_t, uint8_t, size_t);
 
 #ifdef	__cplusplus
 }
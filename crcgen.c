@@ -13,6 +13,7 @@
 #include	<unistd.h>
 #include	"xmalloc.h"
 
+#include	"image.h"
 #include	"hexfile.h"
 #include	"crc.h"
 
@@ -125,22 +126,23 @@ int main(int argc, char **argv)
 	int i;
 	uint16_t crc;
 	uint8_t *buff;
+	struct image *image;
 
 	err = setup(argc, argv);
 	if(err) {
 		return EXIT_FAILURE;
 	}
 
-	buff = (uint8_t *)xmalloc(memsize * sizeof(uint8_t));
-
 	for(i=optind; i<argc; i++) {
-		memset(buff, zero_fill ? 0x00 : 0xff, memsize);
-		err = rd_hexfile(buff, memsize, argv[i]);
-		if(err) {
+		image = rd_hexfile_image(argv[i], zero_fill ? 0x00 : 0xff,
+		    memsize);
+		if(!image) {
 			continue;
 		}
 		if(debug) {
 			int i;
+			buff = (uint8_t *)xmalloc(memsize * sizeof(uint8_t));
+			image_read(image, 0, buff, memsize);
 			crc = 0;
 			printf("%d:%04x\n", 0, ~crc & 0xffff);
 			for(i=0; i<memsize; i++) {
@@ -149,10 +151,11 @@ int main(int argc, char **argv)
 				    i+1, buff[i], ~crc & 0xffff);
 			}
 			printf("inverted -> %04x\n", crc);
-				
+			free(buff);
 		}
-		crc = crc_ccitt(0x0000, buff, memsize);
+		crc = image_crc(image, 0x0000, memsize);
 		printf("%s: %04x\n", argv[i], crc);
+		image_free(image);
 	}
 
 	return EXIT_SUCCESS;
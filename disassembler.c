@@ -12,6 +12,7 @@
 #include	<assert.h>
 
 #include	"opcodes.h"
+#include	"disassembler.h"
 
 #define		OP_BUF_SIZ 10
 
@@ -82,28 +83,130 @@ int opcode_size(const struct opcode_t *op_ptr)
 }
 
 /****************************************************************
- * This finds and returns the index of our opcode within 
- * the z9_opcodes array.
- *
- * This function will return NULL if the instruction is not 
- * found ('ill' instruction).
+ * Opcodes are decoded with two 256 entry tables, one for the
+ * primary opcodes and one for the opcodes following the 0x1f
+ * prefix. They are built from z9_opcodes and z9_alt_opcodes
+ * the first time they are needed, so each instruction takes
+ * one lookup instead of a search of the opcode list.
  */
 
-const struct opcode_t *find_opcode(uint8_t opcode)
+struct op_entry {
+	const struct opcode_t *op;	/* NULL if illegal */
+	uint8_t size;			/* including prefix */
+	uint8_t branch;
+	uint8_t flow;			/* enum inst_flow */
+};
+
+static struct op_entry op_table[256];
+static struct op_entry alt_table[256];
+static int tables_built = 0;
+
+/****************************************************************
+ * This searches an opcode list for an opcode.
+ */
+
+static const struct opcode_t *scan_opcodes(const struct opcode_t *list,
+	uint8_t opcode)
+{
+	int i;
+
+	for(i=0; list[i].mnemonic; i++) {
+		if(opcode == list[i].opcode) {
+			return &list[i];
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************
+ * This will fill in a table entry. Instructions that may not
+ * continue with the one that follows them (jumps, calls, 
+ * returns, and instructions that stop the cpu or let 
+ * interrupts in) are marked as branches. Illegal instructions
+ * are treated as branches too, who knows what they do.
+ */
+
+static void set_entry(struct op_entry *e, const struct opcode_t *op_ptr,
+	int prefix)
 {
+	static const struct {
+		const char *mnemonic;
+		enum inst_flow flow;
+	} branches[] = {
+		{ "brk",  flow_stop },
+		{ "jp",   flow_branch },
+		{ "jr",   flow_branch },
+		{ "djnz", flow_branch },
+		{ "call", flow_call },
+		{ "ret",  flow_ret },
+		{ "iret", flow_ret },
+		{ "trap", flow_trap },
+		{ "btj",  flow_branch },
+		{ "halt", flow_next },
+		{ "stop", flow_stop },
+		{ "ei",   flow_next },
+		{ NULL,   flow_next }
+	};
 	int i;
 
-	if((opcode & 0x0f) >= 0x0a && (opcode & 0x0f) <= 0x0e) {
-		opcode &= 0x0f;
+	e->op = op_ptr;
+	if(op_ptr == NULL) {
+		e->size = 1;
+		e->branch = 1;
+		e->flow = flow_stop;
+		return;
 	}
 
-	for(i=0; z9_opcodes[i].mnemonic; i++) {
-		if(opcode == z9_opcodes[i].opcode) {
-			return &z9_opcodes[i];
+	e->size = prefix + opcode_size(op_ptr);
+	e->branch = 0;
+	e->flow = flow_next;
+	for(i=0; branches[i].mnemonic; i++) {
+		if(!strcmp(op_ptr->mnemonic, branches[i].mnemonic)) {
+			e->branch = 1;
+			e->flow = branches[i].flow;
+			break;
 		}
 	}
 
-	return NULL;
+	/* through a register pair, the target is not known */
+	if(op_ptr->am == am_IRR1) {
+		e->flow = e->flow == flow_call ? flow_call_ind : flow_jump_ind;
+	}
+
+	return;
+}
+
+static void build_tables(void)
+{
+	int i;
+	uint8_t opcode;
+
+	for(i=0; i<256; i++) {
+		/* the working register forms of column a-e share 
+		 * one entry */
+		opcode = i;
+		if((opcode & 0x0f) >= 0x0a && (opcode & 0x0f) <= 0x0e) {
+			opcode &= 0x0f;
+		}
+		set_entry(&op_table[i], scan_opcodes(z9_opcodes, opcode), 0);
+		set_entry(&alt_table[i], scan_opcodes(z9_alt_opcodes, i), 1);
+	}
+	tables_built = 1;
+
+	return;
+}
+
+static const struct op_entry *op_lookup(const uint8_t *op)
+{
+	if(!tables_built) {
+		build_tables();
+	}
+	if(op[0] == ALT_OPCODE) {
+		return &alt_table[op[1]];
+	}
+
+	return &op_table[op[0]];
 }
 
 /****************************************************************
@@ -114,17 +217,126 @@ const struct opcode_t *find_opcode(uint8_t opcode)
  * found ('ill' instruction).
  */
 
+const struct opcode_t *find_opcode(uint8_t opcode)
+{
+	if(!tables_built) {
+		build_tables();
+	}
+
+	return op_table[opcode].op;
+}
+
+/****************************************************************
+ * This finds and returns the index of our opcode within 
+ * the z9_alt_opcodes array.
+ *
+ * This function will return NULL if the instruction is not 
+ * found ('ill' instruction).
+ */
+
 const struct opcode_t *find_alt_opcode(uint8_t opcode)
 {
-	int i;
+	if(!tables_built) {
+		build_tables();
+	}
+
+	return alt_table[opcode].op;
+}
+
+/****************************************************************
+ * This will return the size of the instruction at op. If the
+ * instruction may not continue with the one that follows it
+ * (jumps, calls, returns, and instructions that stop the cpu
+ * or let interrupts in), *branch is set.
+ */
+
+int inst_size(const uint8_t *op, int *branch)
+{
+	const struct op_entry *e;
+
+	assert(op != NULL);
+	assert(branch != NULL);
+
+	e = op_lookup(op);
+	*branch = e->branch;
+
+	return e->size;
+}
+
+/****************************************************************
+ * This will return the mnemonic of the instruction at op, or
+ * NULL if it is illegal.
+ */
+
+const char *inst_mnemonic(const uint8_t *op)
+{
+	const struct op_entry *e;
+
+	assert(op != NULL);
+
+	e = op_lookup(op);
+
+	return e->op ? e->op->mnemonic : NULL;
+}
+
+/****************************************************************
+ * This will return how the instruction at op, at address pc,
+ * passes control on. If the instruction goes to a known 
+ * address, it is saved in *target. For a trap, that is the
+ * address of the vector, not of the handler.
+ */
 
-	for(i=0; z9_alt_opcodes[i].mnemonic; i++) {
-		if(opcode == z9_alt_opcodes[i].opcode) {
-			return &z9_alt_opcodes[i];
+enum inst_flow inst_flow(const uint8_t *op, uint16_t pc, uint16_t *target)
+{
+	const struct op_entry *e;
+	int cc;
+
+	assert(op != NULL);
+	assert(target != NULL);
+
+	e = op_lookup(op);
+	*target = 0x0000;
+	if(e->flow == flow_next || e->flow == flow_stop || 
+	    e->flow == flow_ret || e->flow == flow_jump_ind ||
+	    e->flow == flow_call_ind) {
+		return (enum inst_flow)e->flow;
+	}
+
+	pc += e->size;
+	switch(e->op->am) {
+	case am_DA:
+		*target = (op[1] << 8) | op[2];
+		break;
+	case am_vec:
+		*target = op[1] << 1;
+		break;
+	case am_r1_RA:
+		*target = pc + (int8_t)op[1];
+		break;
+	case am_p_bit_r1_RA:
+	case am_p_bit_Ir1_RA:
+		*target = pc + (int8_t)op[2];
+		break;
+	case am_cc_DA:
+	case am_cc_RA:
+		if(e->op->am == am_cc_DA) {
+			*target = (op[1] << 8) | op[2];
+		} else {
+			*target = pc + (int8_t)op[1];
 		}
+		/* always, or never */
+		cc = (op[0] & 0xf0) >> 4;
+		if(cc == 0x08) {
+			return flow_jump;
+		} else if(cc == 0x00) {
+			return flow_next;
+		}
+		break;
+	default:
+		break;
 	}
 
-	return NULL;
+	return (enum inst_flow)e->flow;
 }
 
 /****************************************************************
@@ -465,25 +677,18 @@ static int append_operands(char *buff, size_t size, uint8_t *op,
 int disassemble(char *buff, size_t size, uint8_t *op, uint16_t pc)
 {
 	int op_size;
+	const struct op_entry *e;
 	const struct opcode_t *op_ptr;
 
+	e = op_lookup(op);
+	op_ptr = e->op;
+	op_size = e->size;
 	if(op[0] == ALT_OPCODE) {
-		op_ptr = find_alt_opcode(op[1]);
 		op = &op[1];
-		op_size = 1;
-	} else {
-		op_ptr = find_opcode(op[0]);
-		op_size = 0;
-	}
-
-	if(op_ptr != NULL) {
-		op_size += opcode_size(op_ptr);
-	} else {
-		op_size = 1;
 	}
 
 	if(buff == NULL) {
-		return size;
+		return op_size;
 	}
 
 	pc += op_size;
@@ -499,6 +704,53 @@ int disassemble(char *buff, size_t size, uint8_t *op, uint16_t pc)
 	return op_size;
 }
 
+/****************************************************************
+ * This will disassemble a block of memory starting at address
+ * into insts, one instruction after another, until the block
+ * or insts is used up. An instruction that runs past the end
+ * of the block is shown as 'ill', like one that runs past the
+ * end of memory.
+ *
+ * This returns the number of instructions disassembled.
+ */
+
+size_t disassemble_block(const uint8_t *mem, size_t size, uint16_t address,
+	struct dis_inst *insts, size_t max)
+{
+	uint8_t pad[5];
+	size_t pos, left, n;
+	int op_size;
+
+	assert(mem != NULL || !size);
+	assert(insts != NULL || !max);
+
+	for(pos=0, n=0; pos < size && n < max; n++) {
+		left = size - pos;
+		insts[n].address = address + pos;
+
+		if(left >= sizeof(pad)) {
+			op_size = disassemble(insts[n].text, 
+			    sizeof(insts[n].text), (uint8_t *)mem + pos, 
+			    address + pos);
+		} else {
+			memset(pad, 0xff, sizeof(pad));
+			memcpy(pad, mem + pos, left);
+			op_size = disassemble(insts[n].text, 
+			    sizeof(insts[n].text), pad, address + pos);
+			if((size_t)op_size > left) {
+				strncpy(insts[n].text, "ill", 
+				    sizeof(insts[n].text)-1);
+				op_size = left;
+			}
+		}
+
+		insts[n].size = op_size;
+		pos += op_size;
+	}
+
+	return n;
+}
+
 /****************************************************************/
 
 
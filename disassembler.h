@@ -11,7 +11,32 @@ extern "C" {
 #endif
 
 
+/* a disassembled instruction */
+struct dis_inst {
+	uint16_t address;
+	uint8_t size;
+	char text[32];
+};
+
+/* how an instruction passes control on */
+enum inst_flow {
+	flow_next,		/* to the next instruction */
+	flow_jump,		/* to the target */
+	flow_branch,		/* to the target, or the next instruction */
+	flow_call,		/* to the target, returning to the next */
+	flow_trap,		/* to the vector at the target, returning */
+	flow_jump_ind,		/* to an unknown address */
+	flow_call_ind,		/* to an unknown address, returning */
+	flow_ret,		/* back to the caller */
+	flow_stop,		/* nowhere (brk, stop or illegal) */
+};
+
 int disassemble(char *, size_t, uint8_t *, uint16_t);
+int inst_size(const uint8_t *, int *);
+const char *inst_mnemonic(const uint8_t *);
+enum inst_flow inst_flow(const uint8_t *, uint16_t, uint16_t *);
+size_t disassemble_block(const uint8_t *, size_t, uint16_t,
+	struct dis_inst *, size_t);
 
 
 #ifdef	__cplusplus
@@ -0,0 +1,176 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This program measures the speed of the disassembler. It
+ * compares finding each opcode by searching the opcode lists,
+ * as the disassembler used to, with the opcode tables, and
+ * disassembling one instruction per call with disassembling
+ * a whole image with disassemble_block().
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<inttypes.h>
+#include	<sys/time.h>
+#include	"xmalloc.h"
+
+#include	"image.h"
+#include	"hexfile.h"
+#include	"opcodes.h"
+#include	"disassembler.h"
+#include	"timer.h"
+
+/**************************************************************/
+
+#define	MEMSIZE		0x10000
+#define	PASSES		20
+
+extern const char *build;
+extern int opcode_size(const struct opcode_t *);
+
+/**************************************************************
+ * This is how instruction sizes were found before the opcode
+ * tables, by searching the opcode lists.
+ */
+
+static const struct opcode_t *scan(const struct opcode_t *list,
+	uint8_t opcode)
+{
+	int i;
+
+	for(i=0; list[i].mnemonic; i++) {
+		if(opcode == list[i].opcode) {
+			return &list[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int scan_size(const uint8_t *op)
+{
+	const struct opcode_t *op_ptr;
+	uint8_t opcode;
+
+	if(op[0] == ALT_OPCODE) {
+		op_ptr = scan(z9_alt_opcodes, op[1]);
+		if(op_ptr) {
+			return 1 + opcode_size(op_ptr);
+		}
+		return 1;
+	}
+
+	opcode = op[0];
+	if((opcode & 0x0f) >= 0x0a && (opcode & 0x0f) <= 0x0e) {
+		opcode &= 0x0f;
+	}
+	op_ptr = scan(z9_opcodes, opcode);
+
+	return op_ptr ? opcode_size(op_ptr) : 1;
+}
+
+/**************************************************************/
+
+static void report(const char *what, struct timer *t, unsigned long count)
+{
+	long usec;
+
+	usec = timerusec(t);
+	printf("%-28s %8ld us %10.1f ns/inst\n", what, usec,
+	    count ? usec * 1000.0 / count : 0.0);
+
+	return;
+}
+
+/**************************************************************/
+
+int main(int argc, char **argv)
+{
+	struct image *image;
+	struct dis_inst *insts;
+	struct timer t;
+	uint8_t *mem;
+	char buff[32];
+	unsigned long count, n;
+	size_t pos;
+	int pass, size, branch;
+
+	printf("disbench - build %s\n", build);
+
+	/* the image, or random bytes, padded to decode the end */
+	mem = (uint8_t *)xmalloc(MEMSIZE + 4);
+	memset(mem, 0xff, MEMSIZE + 4);
+	if(argc > 1) {
+		image = rd_hexfile_image(argv[1], 0xff, MEMSIZE);
+		if(!image) {
+			return EXIT_FAILURE;
+		}
+		image_read(image, 0, mem, MEMSIZE);
+		image_free(image);
+	} else {
+		srand(1);
+		for(pos=0; pos<MEMSIZE; pos++) {
+			mem[pos] = rand();
+		}
+	}
+
+	/* check the tables agree with the opcode lists */
+	for(pos=0; pos<MEMSIZE; pos++) {
+		if(inst_size(mem + pos, &branch) != scan_size(mem + pos)) {
+			fprintf(stderr, "Size mismatch at %04lX\n",
+			    (unsigned long)pos);
+			return EXIT_FAILURE;
+		}
+	}
+
+	count = 0;
+	timerstart(&t);
+	for(pass=0; pass<PASSES; pass++) {
+		for(pos=0; pos<MEMSIZE; pos+=scan_size(mem + pos)) {
+			count++;
+		}
+	}
+	timerstop(&t);
+	report("size, list search", &t, count);
+
+	count = 0;
+	timerstart(&t);
+	for(pass=0; pass<PASSES; pass++) {
+		for(pos=0; pos<MEMSIZE; pos+=inst_size(mem + pos, &branch)) {
+			count++;
+		}
+	}
+	timerstop(&t);
+	report("size, table", &t, count);
+
+	count = 0;
+	timerstart(&t);
+	for(pass=0; pass<PASSES; pass++) {
+		for(pos=0; pos<MEMSIZE; pos+=size) {
+			size = disassemble(buff, sizeof(buff), mem + pos, pos);
+			count++;
+		}
+	}
+	timerstop(&t);
+	report("disassemble, per call", &t, count);
+
+	insts = (struct dis_inst *)xmalloc(MEMSIZE * sizeof(struct dis_inst));
+	count = 0;
+	timerstart(&t);
+	for(pass=0; pass<PASSES; pass++) {
+		n = disassemble_block(mem, MEMSIZE, 0x0000, insts, MEMSIZE);
+		count += n;
+	}
+	timerstop(&t);
+	report("disassemble_block", &t, count);
+
+	free(insts);
+	free(mem);
+
+	return EXIT_SUCCESS;
+}
+
+/**************************************************************/
+
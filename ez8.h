@@ -73,6 +73,31 @@
 #define DBGSTAT_RD_PROTECT      0x20
 #define DBGSTAT_PARAM_UL        0x10
 
+/*
+ * The trace event bits below are not from a Zilog document.
+ * They are assumed, and so far only checked against the
+ * simulator, which was written to the same assumptions. The
+ * watchpoints that use them are unverified on hardware.
+ */
+
+/* TRCEEVENT control */
+#define TRCEEVENT_ENABLE        0x01
+#define TRCEEVENT_BREAK         0x02
+
+/* TRCESTAT register, one bit per event */
+#define TRCESTAT_EVENT          0x01
+
+/* TRCEEVENT register address word, as in trace frames */
+#define TRCE_CYCLE_MASK         0xc000
+#define TRCE_CYCLE_INST         0x4000
+#define TRCE_ACCESS_MASK        0x3000
+#define TRCE_ACCESS_WR          0x1000
+#define TRCE_ACCESS_RD          0x2000
+#define TRCE_ADDR_MASK          0x0fff
+
+/* trace event comparators */
+#define TRCE_EVENTS             4
+
 /* eZ8 limits */
 #define	EZ8MEM_SIZE	0x10000
 #define	EZ8REG_SIZE	0x1000
@@ -15,6 +15,7 @@
 #include	<inttypes.h>
 #include	<ctype.h>
 #include	<sys/stat.h>
+#include	<sys/time.h>
 #include	<assert.h>
 #include	<time.h>
 #include	"xmalloc.h"
@@ -27,6 +28,9 @@
 #include	"ez8.h"
 #include	"crc.h"
 #include	"err_msg.h"
+#include	"disassembler.h"
+#include	"blockmap.h"
+#include	"timer.h"
 
 /**************************************************************
  * Constructor for the debugger.
@@ -34,8 +38,18 @@
 
 ez8dbg::ez8dbg(void)
 {
+	int i;
+
 	cache = 0;
 	memcache_enabled = 1;
+	journal = NULL;
+	flash_callback = NULL;
+	log_flash = NULL;
+	memset(&last_erase, 0, sizeof(last_erase));
+
+	/* typical erase times, including polling interval */
+	page_erase_time = 20000;
+	mass_erase_time = 400000;
 
 	revid = 0x0000;
 	dbgstat = 0x00;
@@ -67,6 +81,24 @@ ez8dbg::ez8dbg(void)
 	num_breakpoints = 0;
 	breakpoints = NULL;
 	tbreak = 0;
+	hwbreak = 0;
+	cntr_used = 0;
+	resume_armed = 0;
+
+	for(i=0; i<TRCE_EVENTS; i++) {
+		wp_owner[i] = -1;
+	}
+	wp_hit = -1;
+
+	dis_mem = NULL;
+	dis_size = NULL;
+	dis_text = NULL;
+	dis_valid = 0;
+	blocks = NULL;
+
+	tbreaks = NULL;
+	num_tbreaks = 0;
+	tbreak_sp = -1;
 
 	return;
 }
@@ -77,11 +109,29 @@ ez8dbg::ez8dbg(void)
 
 ez8dbg::~ez8dbg(void)
 {
-	int addr;
+	uint16_t *addrs;
+	int i;
 
-	while(num_breakpoints > 0) {
-		addr = breakpoints[num_breakpoints-1].address;
-		remove_breakpoint(addr);
+	int num;
+
+	num = get_num_breakpoints();
+	if(num > 0) {
+		addrs = (uint16_t *)xmalloc(num * sizeof(uint16_t));
+		for(i=0; i<num; i++) {
+			addrs[i] = get_breakpoint(i);
+		}
+		change_breakpoints(NULL, 0, addrs, num);
+		free(addrs);
+	}
+	hwbreak = 0;
+	sync_breakpoints();
+
+	if(dbg && link_open() && link_up()) {
+		for(i=0; i<TRCE_EVENTS; i++) {
+			if(wp_owner[i] == i) {
+				clear_watchpoint(i);
+			}
+		}
 	}
 
 	if(main_mem) {
@@ -96,6 +146,11 @@ ez8dbg::~ez8dbg(void)
 	if(buffer) {
 		free(buffer);
 	}
+	free(dis_mem);
+	free(dis_size);
+	free(dis_text);
+	blockmap_free(blocks);
+	free(tbreaks);
 
 	if(dbg && link_open() && link_up()) {
 		ez8ocd::wr_dbgctl(0x00);
@@ -606,12 +661,15 @@ void ez8dbg::stop(void)
 		}
 	}
 
+	resume_armed = 0;
+
 	/* if temporary breakpoint set (on older parts without
 	 * a hardware breakpoint), clear it */
 	if(tbreak) {
 		remove_breakpoint(tbreak);
 		tbreak = 0x0000;
 	}
+	clear_tbreaks();
 
 	return;
 }
@@ -627,6 +685,31 @@ void ez8dbg::run(void)
 		return;
 	}
 
+	/* write breakpoints to flash, except one that can use
+	 * the hardware breakpoint */
+	assign_hwbreak(1);
+	sync_breakpoints();
+
+	resume();
+
+	return;
+}
+
+/**************************************************************
+ * This will put the ez8 back in run mode without writing the
+ * breakpoints to flash. Breakpoints removed since they were 
+ * last synced are still there, and the cpu stops at them as
+ * before. This lets breakpoints that are only wanted once be
+ * removed many pages at a time, instead of a page at each.
+ */
+
+void ez8dbg::resume(void)
+{
+	/* check if already running */
+	if(!state(state_stopped)) {
+		return;
+	}
+
 	/* check if we can put into run mode */
 	switch(cached_revid()) {
 	case 0x0100:
@@ -641,17 +724,32 @@ void ez8dbg::run(void)
 		}
 	}
 
+	/* the hardware breakpoint may have been removed */
+	if(hwbreak && !breakpoint_set(hwbreak)) {
+		hwbreak = 0x0000;
+	}
+
 	/* check if breakpoint set where we are at */
-	if(breakpoint_set(cached_pc())) {
+	if(breakpoint_installed(cached_pc()) || 
+	    (hwbreak && hwbreak == cached_pc())) {
 		step();
 	}
 
 	/* run */
+	dbgctl = DBGCTL_BRK_EN | DBGCTL_BRK_ACK;
+	if(hwbreak) {
+		wr_cntr(hwbreak);
+		dbgctl |= DBGCTL_BRK_PC;
+	}
+	cntr_used = hwbreak != 0;
 	cache &= ~(PC_CACHED | CRC_CACHED);
 	cache |= DBGCTL_CACHED;
-	dbgctl = DBGCTL_BRK_EN | DBGCTL_BRK_ACK;
 	wr_dbgctl(dbgctl);
 
+	/* check breakpoint conditions when it stops */
+	resume_armed = num_breakpoints > 0;
+	wp_hit = -1;
+
 	return;
 }
 
@@ -674,8 +772,14 @@ void ez8dbg::run_to(uint16_t addr)
 		throw err_msg;
 	}
 
+	/* write breakpoints to flash, the counter is needed */
+	resume_armed = 0;
+	wp_hit = -1;
+	assign_hwbreak(0);
+	sync_breakpoints();
+
 	/* if stopped at breakpoint, step over it */
-	if(breakpoint_set(cached_pc())) {
+	if(breakpoint_installed(cached_pc())) {
 		step();
 	}
 
@@ -690,11 +794,14 @@ void ez8dbg::run_to(uint16_t addr)
 		assert(!tbreak);
 
 		set_breakpoint(addr);
+		sync_breakpoints();
 		tbreak = addr;
+		cntr_used = 0;
 		break;
 	default:
 		wr_cntr(addr);
 		dbgctl |= DBGCTL_BRK_PC;
+		cntr_used = 1;
 	}
 
 	cache &= ~(PC_CACHED | CRC_CACHED);
@@ -734,6 +841,12 @@ void ez8dbg::run_clks(uint16_t clks)
 		break;
 	}
 
+	/* write breakpoints to flash, the counter is needed */
+	resume_armed = 0;
+	wp_hit = -1;
+	assign_hwbreak(0);
+	sync_breakpoints();
+
 	wr_cntr(clks);
 	cntr = rd_cntr();
 	if(cntr != clks) {
@@ -743,6 +856,7 @@ void ez8dbg::run_clks(uint16_t clks)
 	}
 	
 	dbgctl = DBGCTL_BRK_EN | DBGCTL_BRK_ACK | DBGCTL_BRK_CNTR;
+	cntr_used = 1;
 	cache &= ~(PC_CACHED | CRC_CACHED);
 	cache |= DBGCTL_CACHED;
 
@@ -789,10 +903,23 @@ int ez8dbg::isrunning(void)
 	}
 
 	if(dbgctl & DBGCTL_DBG_MODE) {
+		/* keep going if stopped at a breakpoint
+		 * whose condition is false, unless a 
+		 * watchpoint stopped it */
+		check_watchpoints();
+		if(wp_hit < 0 && resume_armed && resume_breakpoint()) {
+			return 1;
+		}
+		resume_armed = 0;
+		if(wp_hit < 0 && num_tbreaks && resume_tbreak()) {
+			return 1;
+		}
+
 		if(tbreak) {
 			remove_breakpoint(tbreak);
 			tbreak = 0x0000;
 		} 
+		clear_tbreaks();
 
 		return 0;
 	} else {
@@ -800,6 +927,62 @@ int ez8dbg::isrunning(void)
 	}
 }
 
+/**************************************************************
+ * This will wait up to timeout milliseconds (forever if 
+ * negative) for the cpu to stop. It returns 1 if the cpu is
+ * stopped, 0 if it is still running.
+ *
+ * The on-chip debugger sends an acknowledge when it reaches a
+ * breakpoint, so on links that can wait for data this sleeps
+ * until the acknowledge arrives (checking every WAIT_CHECK
+ * milliseconds anyway, in case the link was lost). Other links
+ * are polled, backing off to WAIT_POLL milliseconds between
+ * polls.
+ */
+
+#define	WAIT_POLL	50
+#define	WAIT_CHECK	1000
+
+int ez8dbg::wait_for_stop(int timeout)
+{
+	struct timer t;
+	long elapsed;
+	int msec, delay;
+
+	timerstart(&t);
+	delay = 1;
+
+	while(isrunning()) {
+		msec = -1;
+		if(timeout >= 0) {
+			timerstop(&t);
+			elapsed = timerusec(&t) / 1000;
+			if(elapsed >= timeout) {
+				return 0;
+			}
+			msec = timeout - elapsed;
+		}
+
+		if(poll_fd() >= 0) {
+			if(msec < 0 || msec > WAIT_CHECK) {
+				msec = WAIT_CHECK;
+			}
+			wait_data(msec);
+		} else {
+			if(msec < 0 || msec > delay) {
+				msec = delay;
+			}
+			usleep(msec * 1000);
+			delay += delay / 2 + 1;
+			if(delay > WAIT_POLL) {
+				delay = WAIT_POLL;
+			}
+		}
+	}
+
+	return 1;
+}
+
 /**************************************************************
  * This will step into the next instruction.
  */
@@ -821,15 +1004,11 @@ void ez8dbg::step(void)
 	switch(cached_revid()) {
 	case 0x0100:
 		/* Workaround for z8f640ba pending interrupt bug */
-		if(breakpoint_set(cached_pc())) {
+		if(breakpoint_installed(cached_pc())) {
 			int i;
 			uint8_t irqctl;
 
-			for(i=0; i<num_breakpoints; i++) {
-				if(breakpoints[i].address == pc) {
-					break;
-				}
-			}
+			i = find_breakpoint(pc);
 			assert(i < num_breakpoints);
 			ez8ocd::rd_regs(EZ8_IRQCTL, &irqctl, 1);
 			if(irqctl & 0x80) {
@@ -865,14 +1044,10 @@ void ez8dbg::step(void)
 		break;
 
 	default:
-		if(breakpoint_set(cached_pc())) {
+		if(breakpoint_installed(cached_pc())) {
 			int i;
 
-			for(i=0; i<num_breakpoints; i++) {
-				if(breakpoints[i].address == pc) {
-					break;
-				}
-			}
+			i = find_breakpoint(pc);
 			assert(i < num_breakpoints);
 
 			cache &= ~(PC_CACHED | CRC_CACHED);
@@ -887,6 +1062,151 @@ void ez8dbg::step(void)
 	return;
 }
 
+/**************************************************************
+ * This will single step up to count instructions, and return
+ * the number of them logged. The address of each instruction
+ * stepped is stored in pc_log, if it is not NULL. It stops 
+ * early (after the first instruction) at a breakpoint.
+ *
+ * Instructions are stepped in bursts with one write, up to the
+ * next branch. The addresses in between are predicted from the
+ * instruction sizes, and the pc is read once after the burst.
+ * They are only logged if that pc is where the burst should
+ * have ended. Returns, indirect jumps and traps end somewhere
+ * that cannot be predicted, so they are stepped on their own.
+ *
+ * While interrupts are enabled, or on parts with the pending
+ * interrupt bug, the pc cannot be predicted, so instructions
+ * are stepped one at a time. If the pc after a burst is not
+ * the predicted one, the addresses of that burst are unknown.
+ * They are not logged, and the rest are stepped one at a time
+ * from the pc read back.
+ */
+
+#define	STEP_BURST	64
+#define	STEP_WINDOW	64
+#define	STEP_INST	5	/* longest instruction */
+
+int ez8dbg::step_n(int count, uint16_t *pc_log)
+{
+	int ops[STEP_BURST];
+	uint16_t burst[STEP_BURST];
+	uint8_t code[STEP_WINDOW + STEP_INST];
+	uint8_t irqctl;
+	uint32_t base, next;
+	uint16_t addr, target;
+	enum inst_flow flow, last;
+	int n, done, num, size, branch;
+	bool single, ok;
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not single step instructions\n"
+		    "device is running\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(state(state_protected)) {
+		strncpy(err_msg, "Could not single step instructions\n"
+		    "memory read protect is enabled\n", err_len-1);
+		throw err_msg;
+	}
+
+	single = cached_revid() == 0x0100;
+	base = EZ8MEM_SIZE;
+	memset(code + STEP_WINDOW, 0xff, STEP_INST);
+	addr = cached_pc();
+	target = 0x0000;
+
+	for(n=done=0; done<count; done+=num) {
+		if(done && breakpoint_set(addr)) {
+			break;
+		}
+
+		if(!single) {
+			ez8ocd::rd_regs(EZ8_IRQCTL, &irqctl, 1);
+		}
+		if(single || irqctl & 0x80) {
+			if(pc_log) {
+				pc_log[n] = addr;
+			}
+			n++;
+			step();
+			addr = cached_pc();
+			num = 1;
+			continue;
+		}
+
+		/* predict instructions up to next branch */
+		next = addr;
+		last = flow_next;
+		for(num=0; done+num<count && num<STEP_BURST; num++) {
+			if(num && breakpoint_set(next)) {
+				break;
+			}
+			/* keep a whole instruction in the window */
+			if(next < base || 
+			    next + STEP_INST > base + STEP_WINDOW) {
+				base = next;
+				if(base + STEP_WINDOW > EZ8MEM_SIZE) {
+					base = EZ8MEM_SIZE - STEP_WINDOW;
+				}
+				read_mem(base, code, STEP_WINDOW);
+			}
+			flow = inst_flow(code + (next - base), next, &target);
+			if(num && flow != flow_next && flow != flow_jump &&
+			    flow != flow_branch && flow != flow_call) {
+				break;
+			}
+			burst[num] = next;
+			if(breakpoint_installed(next)) {
+				ops[num] = code[next - base];
+			} else {
+				ops[num] = -1;
+			}
+			size = inst_size(code + (next - base), &branch);
+			next = (next + size) & 0xffff;
+			last = flow;
+			if(flow != flow_next) {
+				num++;
+				break;
+			}
+		}
+
+		cache &= ~(PC_CACHED | CRC_CACHED);
+		ez8ocd::step_insts(ops, num);
+		addr = cached_pc();
+
+		/* check the burst ended where predicted */
+		switch(last) {
+		case flow_next:
+			ok = addr == next;
+			break;
+		case flow_jump:
+		case flow_call:
+			ok = addr == target;
+			break;
+		case flow_branch:
+			ok = addr == next || addr == target;
+			break;
+		default:
+			/* stepped on its own, from a known pc */
+			ok = 1;
+			break;
+		}
+
+		if(!ok) {
+			single = 1;
+			continue;
+		}
+		if(pc_log) {
+			memcpy(pc_log + n, burst, num * sizeof(uint16_t));
+		}
+		n += num;
+	}
+
+	return n;
+}
+
 /**************************************************************
  * This will step over the next instruction.
  * 
@@ -900,8 +1220,10 @@ void ez8dbg::step(void)
 
 void ez8dbg::next(void)
 {
-	uint8_t buff[1];
-	uint16_t addr;
+	uint8_t buff[5];
+	uint16_t target;
+	size_t size;
+	int branch;
 
 	if(!state(state_stopped)) {
 		strncpy(err_msg, "Could not step over instruction\n"
@@ -916,27 +1238,141 @@ void ez8dbg::next(void)
 	}
 
 	/* get instruction at program counter */
-	rd_mem(cached_pc(), buff, 1);
-
-	/* determine if we need to set a breakpoint */
-	switch(*buff) {
-	case 0xd6:			
-		/* call da */
-		addr = pc + 3;
-		break;
-	case 0xd4:			
-		/* call irr */
-		addr = pc + 2;
+	memset(buff, 0xff, sizeof(buff));
+	size = EZ8MEM_SIZE - cached_pc();
+	if(size > sizeof(buff)) {
+		size = sizeof(buff);
+	}
+	read_mem(pc, buff, size);
+
+	/* run over calls and traps, step anything else */
+	switch(inst_flow(buff, pc, &target)) {
+	case flow_call:
+	case flow_call_ind:
+	case flow_trap:
+		run_to(pc + inst_size(buff, &branch));
 		break;
 	default:
-		addr = 0x0000;
+		step();
 		break;
 	}
 
-	if(addr) {
-		run_to(addr);
-	} else {
-		step();
+	return;
+}
+
+/**************************************************************
+ * This will run until the current function returns, and step
+ * the return. It stops at each return instruction that the
+ * block map shows can be reached from here.
+ */
+
+#define	MAX_EXITS	64
+
+void ez8dbg::step_out(void)
+{
+	uint16_t exits[MAX_EXITS];
+	int num;
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not step out of function\n"
+		    "device is running\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(state(state_protected)) {
+		strncpy(err_msg, "Could not step out of function\n"
+		    "memory read protect is enabled\n", err_len-1);
+		throw err_msg;
+	}
+
+	num = blockmap_exits(block_map(), cached_pc(), 0, exits, MAX_EXITS);
+	if(!num) {
+		strncpy(err_msg, "Could not step out of function\n"
+		    "no return found\n", err_len-1);
+		throw err_msg;
+	}
+
+	run_to_exits(exits, num);
+
+	return;
+}
+
+/**************************************************************
+ * This will run until the innermost loop around the current
+ * instruction ends. If it is not in a loop, this steps over 
+ * the instruction like next().
+ */
+
+void ez8dbg::step_loop(void)
+{
+	uint16_t exits[MAX_EXITS];
+	int num;
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not run to end of loop\n"
+		    "device is running\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(state(state_protected)) {
+		strncpy(err_msg, "Could not run to end of loop\n"
+		    "memory read protect is enabled\n", err_len-1);
+		throw err_msg;
+	}
+
+	num = blockmap_exits(block_map(), cached_pc(), 1, exits, MAX_EXITS);
+	if(!num) {
+		next();
+		return;
+	}
+
+	run_to_exits(exits, num);
+
+	return;
+}
+
+/**************************************************************
+ * This will run to any of the exits given, with temporary
+ * breakpoints. If the cpu stops at a return instruction that
+ * is one of them, the return is stepped.
+ */
+
+void ez8dbg::run_to_exits(const uint16_t *exits, int num)
+{
+	const uint8_t *inst;
+	uint16_t target;
+	uint8_t sp[2];
+	int i;
+
+	assert(num > 0);
+	assert(!num_tbreaks);
+
+	/* already at a return */
+	disasm(cached_pc(), &inst, NULL);
+	if(inst_flow(inst, pc, &target) == flow_ret) {
+		for(i=0; i<num; i++) {
+			if(exits[i] == pc) {
+				step();
+				return;
+			}
+		}
+	}
+
+	rd_regs(EZ8_SPH, sp, 2);
+
+	tbreaks = (uint16_t *)xrealloc(tbreaks, num * sizeof(uint16_t));
+	for(i=0; i<num; i++) {
+		if(exits[i] != 0x0000 && !breakpoint_set(exits[i])) {
+			tbreaks[num_tbreaks++] = exits[i];
+		}
+	}
+	try {
+		change_breakpoints(tbreaks, num_tbreaks, NULL, 0);
+		tbreak_sp = (sp[0] << 8) | sp[1];
+		run();
+	} catch(char *err) {
+		clear_tbreaks();
+		throw err;
 	}
 
 	return;
@@ -962,6 +1398,22 @@ uint16_t ez8dbg::rd_cntr(void)
 	return counter;
 }
 
+/**************************************************************
+ * This will read the number of clocks the cpu last ran for.
+ * If the counter was used as a breakpoint, the count is not
+ * known, and 0xffff is returned (the same as if it had 
+ * overflowed).
+ */
+
+uint16_t ez8dbg::rd_runcount(void)
+{
+	if(cntr_used) {
+		return 0xffff;
+	}
+
+	return rd_cntr();
+}
+
 /**************************************************************
  * This will read the remote memory crc.
  */
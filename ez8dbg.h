@@ -13,6 +13,10 @@
 
 #include	"ez8ocd.h"
 
+struct journal;
+struct image;
+struct blockmap;
+
 /**************************************************************/
 
 /* cache status */
@@ -33,6 +37,44 @@
 /* 5 second reset timeout (typical reset is 10ms) */
 #define	RESET_TIMEOUT	5
 
+/* breakpoint conditions */
+enum bp_space { bp_reg, bp_wreg, bp_data };
+enum bp_op { bp_always, bp_eq, bp_ne, bp_lt, bp_le, bp_gt, bp_ge };
+
+/* stop when (byte & mask) op value, on every nth time it is true */
+struct bp_cond {
+	enum bp_op op;
+	enum bp_space space;
+	uint16_t address;
+	uint8_t mask;
+	uint8_t value;
+	unsigned long every;
+};
+
+struct bp_stats {
+	unsigned long hits;		/* times breakpoint was reached */
+	unsigned long matches;		/* times condition was true */
+	unsigned long resumes;		/* times cpu was resumed */
+	long resume_time;		/* microseconds spent resuming */
+};
+
+/* watchpoints, using the emulator trace event comparators;
+ * ranges must be a power of two in size and aligned to it */
+enum wp_access { wp_none, wp_write, wp_read, wp_any };
+
+struct watchpoint {
+	enum wp_access access;		/* register access to stop on */
+	uint16_t reg_lo;
+	uint16_t reg_hi;
+	uint8_t data;			/* register data, under mask */
+	uint8_t data_mask;
+	bool pc;			/* only within pc range */
+	uint16_t pc_lo;
+	uint16_t pc_hi;
+	uint8_t flags;			/* cpu flags, under mask */
+	uint8_t flags_mask;
+};
+
 /**************************************************************/
 
 class ez8dbg : public ez8ocd
@@ -66,12 +108,48 @@ private:
 	/* breakpoints */
 	struct breakpoint_t {
 		uint16_t address;
-		uint8_t data;
+		uint8_t data;		/* opcode, if installed */
+		uint8_t flags;
+		struct bp_cond cond;
+		struct bp_stats stats;
 	};
+	enum { bp_wanted = 0x01, bp_installed = 0x02 };
 	struct breakpoint_t *breakpoints;
 	int num_breakpoints;
 	uint16_t tbreak;
+	uint16_t hwbreak;
+	bool cntr_used;
+	void assign_hwbreak(bool);
 	void delete_breakpoint(int);
+	int find_breakpoint(uint16_t);
+	bool breakpoint_installed(uint16_t);
+	bool resume_armed;
+	bool resume_breakpoint(void);
+
+	/* temporary breakpoints at the exits of a function or 
+	 * loop; reaching one deeper in the stack than tbreak_sp
+	 * is a nested call, and resumes */
+	uint16_t *tbreaks;
+	int num_tbreaks;
+	long tbreak_sp;
+	void run_to_exits(const uint16_t *, int);
+	void clear_tbreaks(void);
+	bool resume_tbreak(void);
+
+	/* watchpoints, one slot per trace event, 
+	 * by the first event used */
+	struct watchpoint watchpoints[4];
+	int wp_owner[4];
+	int wp_hit;
+	void check_watchpoints(void);
+
+	/* disassembly cache */
+	uint8_t *dis_mem;	/* program memory, without breakpoints */
+	uint8_t *dis_size;	/* instruction size, 0 if not decoded */
+	char (*dis_text)[32];
+	bool dis_valid;
+	struct blockmap *blocks;
+	void fill_disasm(void);
 
 	/* internal functions */
 	uint8_t  cached_dbgctl(void);
@@ -81,6 +159,17 @@ private:
 	void cache_freq(void);
 	void set_timeout(void);
 
+	/* journaled programming */
+	void wr_mem_journaled(uint16_t, const uint8_t *, size_t);
+	void journal_verify(uint16_t, uint32_t, bool);
+
+	/* measured flash timings (in microseconds) */
+	long page_erase_time;
+	long mass_erase_time;
+	long byte_time(void);
+	void erase_all(bool);
+	void erase_block(uint32_t, uint32_t, bool, bool);
+
 public:
 	int sysclk;
 
@@ -94,6 +183,26 @@ public:
 	~ez8dbg();
 
 	bool memcache_enabled;
+	struct journal *journal;
+
+	/* called after each flash block is written, with its
+	 * address, size and the time taken in microseconds */
+	void (*flash_callback)(uint16_t, size_t, long);
+
+	/* erase planning */
+	enum erase_method {
+		erase_none,
+		erase_pages,
+		erase_mass,
+	};
+	struct erase_plan {
+		enum erase_method method;
+		int pages;
+		long estimate;
+		long actual;
+	};
+	struct erase_plan last_erase;
+	FILE *log_flash;
 
 	enum dbg_state {
 		state_stopped = 1,
@@ -110,17 +219,23 @@ public:
 
 	void stop(void);
 	void run(void);
+	void resume(void);
 	void run_to(uint16_t);
 	void run_clks(uint16_t);
 	int isrunning(void);
+	int wait_for_stop(int);
 
 	void step(void);
+	int step_n(int, uint16_t *);
 	void next(void);
+	void step_out(void);
+	void step_loop(void);
 
 	uint16_t rd_revid(void);
 	uint16_t rd_crc(void);
 	uint16_t rd_pc(void);
 	uint16_t rd_cntr(void);
+	uint16_t rd_runcount(void);
 	uint16_t rd_reload(void);
 	void wr_pc(uint16_t);
 	void rd_regs(uint16_t, uint8_t *, size_t);
@@ -129,6 +244,7 @@ public:
 	void wr_data(uint16_t, const uint8_t *, size_t);
 	void rd_mem(uint16_t, uint8_t *, size_t);
 	void wr_mem(uint16_t, const uint8_t *, size_t);
+	void wr_image(const struct image *);
 
 	void rd_info(uint16_t, uint8_t *, size_t);
 	void wr_info(uint16_t, const uint8_t *, size_t);
@@ -136,6 +252,7 @@ public:
 	void set_sysclk(int);
 	void mass_erase(bool);
 	void flash_mass_erase(void);
+	void erase_mem(uint16_t, size_t);
 	void write_flash(uint16_t, const uint8_t *, size_t);
 
 	bool breakpoint_set(uint16_t);
@@ -143,7 +260,16 @@ public:
 	uint16_t get_breakpoint(int);
 	void set_breakpoint(uint16_t);
 	void remove_breakpoint(uint16_t);
+	void change_breakpoints(const uint16_t *, int, 
+	    const uint16_t *, int);
+	void sync_breakpoints(void);
+	void set_bp_condition(uint16_t, const struct bp_cond *);
+	void get_bp_condition(uint16_t, struct bp_cond *);
+	void get_bp_stats(uint16_t, struct bp_stats *);
 	void read_mem(uint16_t, uint8_t *, size_t);
+	int disasm(uint16_t, const uint8_t **, const char **);
+	void flush_disasm(void);
+	const struct blockmap *block_map(void);
 
 	int memory_size(void);
 	int cached_baudrate(void);
@@ -160,6 +286,10 @@ public:
 	void rd_trce_event(uint8_t, struct trce_event *);
 	uint16_t rd_trce_wr_ptr(void);
 	void rd_trce_buff(uint16_t, struct trce_frame *, size_t);
+	int set_watchpoint(const struct watchpoint *);
+	void clear_watchpoint(int);
+	bool get_watchpoint(int, struct watchpoint *);
+	int watchpoint_hit(void);
 
 };
 
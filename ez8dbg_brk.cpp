@@ -3,6 +3,22 @@
  * $Id: ez8dbg_brk.cpp,v 1.2 2004/12/01 01:26:49 jnekl Exp $
  *
  * This implements breakpoints for the debugger. 
+ *
+ * The breakpoint table is kept sorted by address. Each entry
+ * records whether the breakpoint is wanted, and whether it is
+ * installed in flash. Setting and removing breakpoints only
+ * changes what is wanted; the flash is brought up to date by
+ * sync_breakpoints() when the cpu is about to run. So setting
+ * and clearing the same breakpoint while stopped costs nothing.
+ *
+ * Breakpoints are synced a page at a time, so installing or 
+ * removing many of them costs one program cycle per page.
+ * On parts with a hardware PC breakpoint, one breakpoint may
+ * use it instead of being written to flash at all.
+ *
+ * A breakpoint may have a condition on a register or data 
+ * memory byte. The condition is checked when the cpu stops
+ * there, and if it is false the cpu is resumed.
  */
 
 #define		_REENTRANT
@@ -14,6 +30,7 @@
 #include	<inttypes.h>
 #include	<ctype.h>
 #include	<sys/stat.h>
+#include	<sys/time.h>
 #include	<assert.h>
 #include	"xmalloc.h"
 
@@ -24,6 +41,32 @@
 #include	"ez8dbg.h"
 #include	"ez8.h"
 #include	"err_msg.h"
+#include	"timer.h"
+#include	"disassembler.h"
+#include	"blockmap.h"
+
+/**************************************************************
+ * This will find the index of the first breakpoint at or
+ * after the specified address.
+ */
+
+int ez8dbg::find_breakpoint(uint16_t address)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = num_breakpoints;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(breakpoints[mid].address < address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
 
 /**************************************************************
  * This will determine if a breakpoint is currently set
@@ -35,13 +78,25 @@ bool ez8dbg::breakpoint_set(uint16_t address)
 {
 	int i;
 
-	for(i=0; i<num_breakpoints; i++) {
-		if(breakpoints[i].address == address) {
-			return 1;
-		}
-	}
+	i = find_breakpoint(address);
 
-	return 0;
+	return i < num_breakpoints && breakpoints[i].address == address &&
+	    breakpoints[i].flags & bp_wanted;
+}
+
+/**************************************************************
+ * This will determine if a breakpoint is currently written
+ * to flash at the specified address.
+ */
+
+bool ez8dbg::breakpoint_installed(uint16_t address)
+{
+	int i;
+
+	i = find_breakpoint(address);
+
+	return i < num_breakpoints && breakpoints[i].address == address &&
+	    breakpoints[i].flags & bp_installed;
 }
 
 /**************************************************************
@@ -50,7 +105,16 @@ bool ez8dbg::breakpoint_set(uint16_t address)
 
 int ez8dbg::get_num_breakpoints(void)
 {
-	return num_breakpoints;
+	int i, num;
+
+	num = 0;
+	for(i=0; i<num_breakpoints; i++) {
+		if(breakpoints[i].flags & bp_wanted) {
+			num++;
+		}
+	}
+
+	return num;
 }
 
 /**************************************************************
@@ -59,14 +123,18 @@ int ez8dbg::get_num_breakpoints(void)
 
 uint16_t ez8dbg::get_breakpoint(int index)
 {
-	if(index >= num_breakpoints) {
-		strncpy(err_msg, "Could not get breakpoint address\n"
-		    "index out of range\n", err_len-1);
-		abort();
-		throw err_msg;
+	int i;
+
+	for(i=0; i<num_breakpoints; i++) {
+		if(breakpoints[i].flags & bp_wanted && index-- == 0) {
+			return breakpoints[i].address;
+		}
 	}
 
-	return breakpoints[index].address;
+	strncpy(err_msg, "Could not get breakpoint address\n"
+	    "index out of range\n", err_len-1);
+	abort();
+	throw err_msg;
 }
 
 /**************************************************************
@@ -75,10 +143,6 @@ uint16_t ez8dbg::get_breakpoint(int index)
 
 void ez8dbg::set_breakpoint(uint16_t address) 
 {
-	uint8_t data[1];
-	const uint8_t brk[1] = { 0x00 };
-	struct breakpoint_t *bp;
-
 	if(!state(state_stopped)) {
 		strncpy(err_msg, "Could not set breakpoint\n"
 		    "device is running\n", err_len-1);
@@ -103,30 +167,7 @@ void ez8dbg::set_breakpoint(uint16_t address)
 		throw err_msg;
 	}
 
-	rd_mem(address, data, 1);
-
-	bp = (struct breakpoint_t *)xrealloc(breakpoints, 
-	    sizeof(struct breakpoint_t) * (num_breakpoints + 1));
-
-	breakpoints = bp;
-	breakpoints[num_breakpoints].address = address;
-	breakpoints[num_breakpoints].data = data[0];
-	num_breakpoints++;
-
-	flash_setup(0x00);
-
-	cache &= ~(MEMCRC_CACHED | CRC_CACHED);
-	main_mem[address] = *brk;
-	ez8ocd::wr_mem(address, brk, 1);
-
-	flash_lock();
-
-	rd_mem(address, data, 1);
-	if(*data != *brk) {
-		strncpy(err_msg, "Set breakpoint failed\n"
-		    "readback verify failed\n", err_len-1);
-		throw err_msg;
-	}
+	change_breakpoints(&address, 1, NULL, 0);
 
 	return;
 }
@@ -155,22 +196,17 @@ void ez8dbg::delete_breakpoint(int index)
 	}
 
 	num_breakpoints--;
-	breakpoints = (struct breakpoint_t *)xrealloc(breakpoints, 
-	    sizeof(struct breakpoint_t) * num_breakpoints);
 
 	return;
 }
 
 /**************************************************************
- * This will remove a breakpoint and write the origional
- * opcode back to memory.
+ * This will remove a breakpoint. The origional opcode is 
+ * written back to memory when breakpoints are next synced.
  */
 
 void ez8dbg::remove_breakpoint(uint16_t address)
 {
-	int index;
-	uint8_t buff[1];
-
 	if(!state(state_stopped)) {
 		strncpy(err_msg, "Could not remove breakpoint\n"
 		    "device is running\n", err_len-1);
@@ -182,27 +218,325 @@ void ez8dbg::remove_breakpoint(uint16_t address)
 		throw err_msg;
 	}
 
-	assert(num_breakpoints == 0 || breakpoints != NULL);
+	if(!breakpoint_set(address)) {
+		strncpy(err_msg, "Remove breakpoint failed\n"
+		    "breakpoint not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	change_breakpoints(NULL, 0, &address, 1);
+
+	return;
+}
+
+/**************************************************************
+ * This will set and remove a batch of breakpoints. All 
+ * arguments are checked before anything is changed. Nothing
+ * is written to flash until the breakpoints are synced.
+ */
+
+static int cmp_address(const void *a, const void *b)
+{
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+void ez8dbg::change_breakpoints(const uint16_t *add, int num_add,
+	const uint16_t *del, int num_del)
+{
+	uint16_t *addrs;
+	struct breakpoint_t *bp;
+	int i, index, num;
+
+	assert(num_add == 0 || add != NULL);
+	assert(num_del == 0 || del != NULL);
+
+	num = num_add + num_del;
+	if(!num) {
+		return;
+	}
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not change breakpoints\n"
+		    "device is running\n", err_len-1);
+		throw err_msg;
+	}
+	if(state(state_protected)) {
+		strncpy(err_msg, "Could not change breakpoints\n"
+		    "memory read protect is enabled\n", err_len-1);
+		throw err_msg;
+	}
 
-	for(index = 0; index < num_breakpoints; index++) {
-		if(breakpoints[index].address == address) {
+	/* check for duplicates */
+	addrs = (uint16_t *)xmalloc(num * sizeof(uint16_t));
+	if(num_add) {
+		memcpy(addrs, add, num_add * sizeof(uint16_t));
+	}
+	if(num_del) {
+		memcpy(addrs + num_add, del, num_del * sizeof(uint16_t));
+	}
+	qsort(addrs, num, sizeof(uint16_t), cmp_address);
+	for(i=1; i<num; i++) {
+		if(addrs[i] == addrs[i-1]) {
 			break;
 		}
 	}
+	free(addrs);
+	if(i < num) {
+		strncpy(err_msg, "Could not change breakpoints\n"
+		    "address given more than once\n", err_len-1);
+		throw err_msg;
+	}
 
-	if(index >= num_breakpoints) {
-		strncpy(err_msg, "Remove breakpoint failed\n"
-		    "breakpoint not set\n", err_len-1);
+	for(i=0; i<num_add; i++) {
+		if(add[i] == 0x0000 || breakpoint_set(add[i])) {
+			strncpy(err_msg, "Could not set breakpoint\n"
+			    "NULL address or breakpoint already set\n", 
+			    err_len-1);
+			throw err_msg;
+		}
+	}
+	for(i=0; i<num_del; i++) {
+		if(!breakpoint_set(del[i])) {
+			strncpy(err_msg, "Remove breakpoint failed\n"
+			    "breakpoint not set\n", err_len-1);
+			throw err_msg;
+		}
+	}
+
+	/* update wanted state */
+	for(i=0; i<num_add; i++) {
+		index = find_breakpoint(add[i]);
+		if(index < num_breakpoints && 
+		    breakpoints[index].address == add[i]) {
+			/* still installed */
+			bp = &breakpoints[index];
+			bp->flags |= bp_wanted;
+		} else {
+			bp = (struct breakpoint_t *)xrealloc(breakpoints, 
+			    sizeof(struct breakpoint_t) * 
+			    (num_breakpoints + 1));
+			breakpoints = bp;
+			memmove(breakpoints + index + 1, breakpoints + index, 
+			    (num_breakpoints - index) * 
+			    sizeof(struct breakpoint_t));
+			num_breakpoints++;
+			bp = &breakpoints[index];
+			bp->address = add[i];
+			bp->data = 0xff;
+			bp->flags = bp_wanted;
+		}
+		memset(&bp->cond, 0, sizeof(struct bp_cond));
+		memset(&bp->stats, 0, sizeof(struct bp_stats));
+	}
+	for(i=0; i<num_del; i++) {
+		index = find_breakpoint(del[i]);
+		breakpoints[index].flags &= ~bp_wanted;
+		if(!(breakpoints[index].flags & bp_installed)) {
+			delete_breakpoint(index);
+		}
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This decides which breakpoint, if any, uses the hardware PC
+ * breakpoint instead of flash. Only parts after revision 0110
+ * have one, and only if the counter is not needed for 
+ * something else.
+ *
+ * The slot goes to a breakpoint that is not installed yet and
+ * is the only change on its flash page, so that page does not
+ * need to be programmed at all.
+ */
+
+void ez8dbg::assign_hwbreak(bool cntr_free)
+{
+	int i, j, page, pending, candidate;
+	bool wanted, installed;
+
+	hwbreak = 0x0000;
+
+	if(!cntr_free) {
+		return;
+	}
+
+	switch(cached_revid()) {
+	case 0x0100:
+	case 0x0110:
+		return;
+	default:
+		break;
+	}
+
+	for(i=0; i<num_breakpoints; i=j) {
+		page = breakpoints[i].address / EZ8MEM_PAGESIZE;
+		pending = 0;
+		candidate = -1;
+		for(j=i; j<num_breakpoints && 
+		    breakpoints[j].address / EZ8MEM_PAGESIZE == page; j++) {
+			wanted = breakpoints[j].flags & bp_wanted;
+			installed = breakpoints[j].flags & bp_installed;
+			if(wanted != installed) {
+				pending++;
+				if(wanted) {
+					candidate = j;
+				}
+			}
+		}
+		if(pending == 1 && candidate >= 0) {
+			hwbreak = breakpoints[candidate].address;
+			return;
+		}
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will write the wanted breakpoints to flash, and restore
+ * the opcodes of the ones no longer wanted.
+ *
+ * The changes are grouped by flash page. Each page is read
+ * once, and then programmed with the flash unlocked once. A
+ * page is only erased if a breakpoint is removed from it, since
+ * installing a breakpoint only clears bits. Each page is 
+ * verified with one readback.
+ *
+ * The breakpoint assigned to the hardware PC breakpoint is
+ * left out of flash.
+ */
+
+void ez8dbg::sync_breakpoints(void)
+{
+	uint8_t *page_mem, *current;
+	uint8_t flash_state[4];
+	struct breakpoint_t *bp;
+	uint16_t start;
+	int i, j, k, page;
+	bool dirty, erase, wanted, installed;
+
+	/* find first breakpoint out of sync */
+	for(i=0; i<num_breakpoints; i++) {
+		bp = &breakpoints[i];
+		wanted = bp->flags & bp_wanted && bp->address != hwbreak;
+		installed = bp->flags & bp_installed;
+		if(wanted != installed) {
+			break;
+		}
+	}
+	if(i == num_breakpoints) {
+		return;
+	}
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not write breakpoints\n"
+		    "device is running\n", err_len-1);
 		throw err_msg;
 	}
+	if(state(state_protected)) {
+		strncpy(err_msg, "Could not write breakpoints\n"
+		    "memory read protect is enabled\n", err_len-1);
+		throw err_msg;
+	}
+
+	current = buffer;
+	page_mem = buffer + EZ8MEM_PAGESIZE;
+
+	save_flash_state(flash_state);
+
+	for(i=0; i<num_breakpoints; i=j) {
+		page = breakpoints[i].address / EZ8MEM_PAGESIZE;
+		start = page * EZ8MEM_PAGESIZE;
+		dirty = 0;
+		for(j=i; j<num_breakpoints && 
+		    breakpoints[j].address / EZ8MEM_PAGESIZE == page; j++) {
+			bp = &breakpoints[j];
+			wanted = bp->flags & bp_wanted && 
+			    bp->address != hwbreak;
+			installed = bp->flags & bp_installed;
+			if(wanted != installed) {
+				dirty = 1;
+			}
+		}
 
-	buff[0] = breakpoints[index].data;
+		/* skip pages that are in sync */
+		if(!dirty) {
+			continue;
+		}
 
-	/* program data back into flash */
-	wr_mem(address, buff, 1);
+		/* build new page contents */
+		rd_mem(start, current, EZ8MEM_PAGESIZE);
+		memcpy(page_mem, current, EZ8MEM_PAGESIZE);
+		erase = 0;
+		for(k=i; k<j; k++) {
+			bp = &breakpoints[k];
+			wanted = bp->flags & bp_wanted && 
+			    bp->address != hwbreak;
+			installed = bp->flags & bp_installed;
+			if(wanted && !installed) {
+				bp->data = current[bp->address - start];
+				page_mem[bp->address - start] = 0x00;
+			} else if(!wanted && installed) {
+				page_mem[bp->address - start] = bp->data;
+				if(bp->data & ~current[bp->address - start]) {
+					erase = 1;
+				}
+			}
+		}
 
-	/* remove breakpoint from array */
-	delete_breakpoint(index);
+		/* program page, unless nothing changed */
+		if(memcmp(page_mem, current, EZ8MEM_PAGESIZE)) {
+			cache &= ~(MEMCRC_CACHED | CRC_CACHED);
+			if(erase) {
+				flash_page_erase(page);
+				memset(current, 0xff, EZ8MEM_PAGESIZE);
+			}
+			memcpy(main_mem + start, page_mem, EZ8MEM_PAGESIZE);
+			flash_setup(0x00);
+			if(erase) {
+				write_flash(start, page_mem, EZ8MEM_PAGESIZE);
+			} else {
+				for(k=i; k<j; k++) {
+					bp = &breakpoints[k];
+					if(page_mem[bp->address - start] != 
+					    current[bp->address - start]) {
+						ez8ocd::wr_mem(bp->address, 
+						    page_mem + 
+						    (bp->address - start), 1);
+					}
+				}
+			}
+			flash_lock();
+
+			/* verify page */
+			ez8ocd::rd_mem(start, current, EZ8MEM_PAGESIZE);
+			if(memcmp(current, page_mem, EZ8MEM_PAGESIZE)) {
+				strncpy(err_msg, "Write breakpoints failed\n"
+				    "readback verify failed\n", err_len-1);
+				throw err_msg;
+			}
+		}
+
+		/* page now matches wanted state */
+		for(k=i; k<j; k++) {
+			bp = &breakpoints[k];
+			if(bp->flags & bp_wanted && bp->address != hwbreak) {
+				bp->flags |= bp_installed;
+			} else {
+				bp->flags &= ~bp_installed;
+			}
+		}
+	}
+
+	/* forget breakpoints that are gone */
+	for(i=num_breakpoints-1; i>=0; i--) {
+		if(!breakpoints[i].flags) {
+			delete_breakpoint(i);
+		}
+	}
+
+	restore_flash_state(flash_state);
 
 	return;
 }
@@ -218,14 +552,366 @@ void ez8dbg::read_mem(uint16_t address, uint8_t *data, size_t size)
 
 	rd_mem(address, data, size);
 
-	for(i=0; i<num_breakpoints; i++) {
-		int offset;
+	for(i = find_breakpoint(address); i < num_breakpoints; i++) {
+		if(breakpoints[i].address >= address + size) {
+			break;
+		}
+		if(breakpoints[i].flags & bp_installed) {
+			data[breakpoints[i].address - address] = 
+			    breakpoints[i].data;
+		}
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will return the size of the instruction at address,
+ * and optionally its bytes and disassembly.
+ *
+ * Program memory is read once, and each instruction is 
+ * disassembled the first time it is asked for, so listings 
+ * and traces do not read the device again. Since read_mem()
+ * puts back the opcodes replaced by breakpoints, setting or
+ * clearing breakpoints does not change the result; only 
+ * writing or erasing flash flushes the cache.
+ */
+
+int ez8dbg::disasm(uint16_t address, const uint8_t **inst, const char **text)
+{
+	int size;
+
+	fill_disasm();
+
+	if(!dis_size[address]) {
+		size = disassemble(dis_text[address], sizeof(*dis_text),
+		    dis_mem + address, address);
+		assert(size > 0 && size <= 5);
+		if(EZ8MEM_SIZE - address < size) {
+			strncpy(dis_text[address], "ill", 
+			    sizeof(*dis_text)-1);
+			size = EZ8MEM_SIZE - address;
+		}
+		dis_size[address] = size;
+	}
+
+	if(inst) {
+		*inst = dis_mem + address;
+	}
+	if(text) {
+		*text = dis_text[address];
+	}
+
+	return dis_size[address];
+}
+
+/**************************************************************
+ * This will flush the disassembly cache.
+ */
+
+void ez8dbg::flush_disasm(void)
+{
+	dis_valid = 0;
+	blockmap_free(blocks);
+	blocks = NULL;
+
+	return;
+}
+
+/**************************************************************
+ * This will read program memory into the disassembly cache, 
+ * if it is not there already.
+ */
+
+void ez8dbg::fill_disasm(void)
+{
+	int size;
+
+	if(!dis_mem) {
+		/* padded so the last instruction can be decoded */
+		dis_mem = (uint8_t *)xmalloc(EZ8MEM_SIZE + 4);
+		dis_size = (uint8_t *)xmalloc(EZ8MEM_SIZE);
+		dis_text = (char (*)[32])xmalloc(EZ8MEM_SIZE * 
+		    sizeof(*dis_text));
+		dis_valid = 0;
+	}
+
+	if(!dis_valid) {
+		size = memory_size();
+		if(!size) {
+			size = EZ8MEM_SIZE;
+		}
+		memset(dis_mem, 0xff, EZ8MEM_SIZE + 4);
+		read_mem(0x0000, dis_mem, size);
+		memset(dis_size, 0, EZ8MEM_SIZE);
+		dis_valid = 1;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will return the block map of program memory. It is 
+ * built from the disassembly cache, following the reset and
+ * interrupt vectors, and is flushed with it. If the cpu is
+ * stopped somewhere the vectors do not lead to, the map is 
+ * built again with the pc as another entry point.
+ */
+
+const struct blockmap *ez8dbg::block_map(void)
+{
+	uint16_t entries[BLOCKMAP_VECTORS_END / 2 + 1];
+	size_t size, count;
+
+	fill_disasm();
+
+	if(blocks && (!state(state_stopped) ||
+	    blockmap_find(blocks, cached_pc()) >= 0)) {
+		return blocks;
+	}
+
+	size = memory_size();
+	if(!size) {
+		size = EZ8MEM_SIZE;
+	}
+	count = blockmap_vectors(dis_mem, size, entries, 
+	    BLOCKMAP_VECTORS_END / 2);
+	if(state(state_stopped) && cached_pc() < size) {
+		entries[count++] = pc;
+	}
+
+	blockmap_free(blocks);
+	blocks = blockmap_build(dis_mem, size, entries, count);
+
+	return blocks;
+}
+
+/**************************************************************
+ * This will set the condition of a breakpoint. A NULL 
+ * condition makes it stop every time. The hit statistics of
+ * the breakpoint are cleared.
+ */
+
+void ez8dbg::set_bp_condition(uint16_t address, const struct bp_cond *cond)
+{
+	struct breakpoint_t *bp;
+
+	if(!breakpoint_set(address)) {
+		strncpy(err_msg, "Could not set breakpoint condition\n"
+		    "breakpoint not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(cond) {
+		if(cond->op < bp_always || cond->op > bp_ge ||
+		    (cond->space == bp_reg && cond->address >= EZ8REG_SIZE) ||
+		    (cond->space == bp_wreg && cond->address >= 16)) {
+			strncpy(err_msg, "Could not set breakpoint condition\n"
+			    "invalid condition\n", err_len-1);
+			throw err_msg;
+		}
+	}
+
+	bp = &breakpoints[find_breakpoint(address)];
+	if(cond) {
+		bp->cond = *cond;
+	} else {
+		memset(&bp->cond, 0, sizeof(struct bp_cond));
+	}
+	memset(&bp->stats, 0, sizeof(struct bp_stats));
+
+	return;
+}
+
+/**************************************************************
+ * This will get the condition of a breakpoint.
+ */
+
+void ez8dbg::get_bp_condition(uint16_t address, struct bp_cond *cond)
+{
+	assert(cond != NULL);
+
+	if(!breakpoint_set(address)) {
+		strncpy(err_msg, "Could not get breakpoint condition\n"
+		    "breakpoint not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	*cond = breakpoints[find_breakpoint(address)].cond;
+
+	return;
+}
+
+/**************************************************************
+ * This will get the hit statistics of a breakpoint.
+ */
+
+void ez8dbg::get_bp_stats(uint16_t address, struct bp_stats *stats)
+{
+	assert(stats != NULL);
+
+	if(!breakpoint_set(address)) {
+		strncpy(err_msg, "Could not get breakpoint statistics\n"
+		    "breakpoint not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	*stats = breakpoints[find_breakpoint(address)].stats;
+
+	return;
+}
+
+/**************************************************************
+ * This is called when the cpu has stopped after run(). It 
+ * counts the hit if the cpu stopped at a breakpoint, and 
+ * checks its condition. If the cpu should not have stopped,
+ * it is stepped over the breakpoint and run again, and 1 is
+ * returned.
+ *
+ * Only the byte the condition tests is read (and the register
+ * pointer for a working register), so a resume costs little
+ * more than the round trips to step and run again.
+ */
+
+bool ez8dbg::resume_breakpoint(void)
+{
+	struct breakpoint_t *bp;
+	struct timer t;
+	uint8_t rp, data;
+	uint16_t at, address;
+	bool match;
+	int i;
+
+	timerstart(&t);
+
+	at = cached_pc();
+	i = find_breakpoint(at);
+	if(i >= num_breakpoints || breakpoints[i].address != at ||
+	    !(breakpoints[i].flags & bp_wanted)) {
+		return 0;
+	}
+	bp = &breakpoints[i];
+	bp->stats.hits++;
+
+	/* evaluate condition */
+	if(bp->cond.op == bp_always) {
+		match = 1;
+	} else {
+		address = bp->cond.address;
+		switch(bp->cond.space) {
+		case bp_wreg:
+			rd_regs(EZ8_RP, &rp, 1);
+			address |= ((rp << 8) | rp) & 0x0ff0;
+			rd_regs(address, &data, 1);
+			break;
+		case bp_data:
+			rd_data(address, &data, 1);
+			break;
+		default:
+			rd_regs(address, &data, 1);
+			break;
+		}
+		data &= bp->cond.mask;
+
+		switch(bp->cond.op) {
+		case bp_eq:
+			match = data == bp->cond.value;
+			break;
+		case bp_ne:
+			match = data != bp->cond.value;
+			break;
+		case bp_lt:
+			match = data < bp->cond.value;
+			break;
+		case bp_le:
+			match = data <= bp->cond.value;
+			break;
+		case bp_gt:
+			match = data > bp->cond.value;
+			break;
+		case bp_ge:
+			match = data >= bp->cond.value;
+			break;
+		default:
+			match = 1;
+			break;
+		}
+	}
+
+	if(match) {
+		bp->stats.matches++;
+		if(bp->cond.every <= 1 || 
+		    bp->stats.matches % bp->cond.every == 0) {
+			return 0;
+		}
+	}
+
+	/* resume, stepping over the breakpoint */
+	run();
+
+	/* syncing may have moved the table */
+	timerstop(&t);
+	bp = &breakpoints[find_breakpoint(at)];
+	bp->stats.resumes++;
+	bp->stats.resume_time += timerusec(&t);
+
+	return 1;
+}
+
+/**************************************************************
+ * This is called when the cpu has stopped while there are
+ * temporary breakpoints. If it stopped at one of them deeper
+ * in the stack than where it started, it is in a nested call
+ * of the same code, so it is resumed and 1 is returned. If it
+ * stopped at a return instruction, the return is stepped.
+ */
+
+bool ez8dbg::resume_tbreak(void)
+{
+	const uint8_t *inst;
+	uint16_t at, target;
+	uint8_t sp[2];
+	int i;
+
+	at = cached_pc();
+	for(i=0; i<num_tbreaks; i++) {
+		if(tbreaks[i] == at) {
+			break;
+		}
+	}
+	if(i >= num_tbreaks) {
+		return 0;
+	}
+
+	rd_regs(EZ8_SPH, sp, 2);
+	if(((sp[0] << 8) | sp[1]) < tbreak_sp) {
+		run();
+		return 1;
+	}
+
+	disasm(at, &inst, NULL);
+	if(inst_flow(inst, at, &target) == flow_ret) {
+		step();
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will remove the temporary breakpoints.
+ */
+
+void ez8dbg::clear_tbreaks(void)
+{
+	int i;
 
-		offset = breakpoints[i].address - address;
-		if(offset >= 0 && offset < (int)size) {
-			data[offset] = breakpoints[i].data;
+	for(i=0; i<num_tbreaks; i++) {
+		if(breakpoint_set(tbreaks[i])) {
+			remove_breakpoint(tbreaks[i]);
 		}
 	}
+	num_tbreaks = 0;
+	tbreak_sp = -1;
 
 	return;
 }
@@ -14,6 +14,7 @@
 #include	<inttypes.h>
 #include	<ctype.h>
 #include	<sys/stat.h>
+#include	<sys/time.h>
 #include	<assert.h>
 #include	<time.h>
 #include	"xmalloc.h"
@@ -25,6 +26,9 @@
 #include	"ez8dbg.h"
 #include	"ez8.h"
 #include	"crc.h"
+#include	"journal.h"
+#include	"image.h"
+#include	"timer.h"
 #include	"err_msg.h"
 
 /**************************************************************
@@ -139,6 +143,7 @@ void ez8dbg::write_flash(uint16_t address, const uint8_t *buff, size_t size)
 		uint16_t block_addr;
 		size_t block_len;
 		const uint8_t *start, *end;
+		struct timer t;
 
 		/* find start and end of block to write */
 		start = next;
@@ -162,7 +167,13 @@ void ez8dbg::write_flash(uint16_t address, const uint8_t *buff, size_t size)
 		}
 
 		/* write block to flash */
+		timerstart(&t);
 		ez8ocd::wr_mem(block_addr, start, block_len);
+		timerstop(&t);
+
+		if(flash_callback) {
+			flash_callback(block_addr, block_len, timerusec(&t));
+		}
 	}
 
 	return;
@@ -177,10 +188,10 @@ void ez8dbg::write_flash(uint16_t address, const uint8_t *buff, size_t size)
 
 void ez8dbg::wr_mem(uint16_t address, const uint8_t *data, size_t size)
 {
-	uint16_t addr, block_start, offset;
+	uint16_t block_start, offset;
 	size_t block_length;
-	uint8_t pages;
 	uint8_t flash_state[4];
+	bool known;
 
 	/* check arguments and state */
 	if(address + size > EZ8MEM_SIZE) {
@@ -201,6 +212,13 @@ void ez8dbg::wr_mem(uint16_t address, const uint8_t *data, size_t size)
 		throw err_msg;
 	}
 
+	flush_disasm();
+
+	if(journal) {
+		wr_mem_journaled(address, data, size);
+		return;
+	}
+
 	save_flash_state(flash_state);
 
 	/* calculate block address (must start on page boundary) */
@@ -220,25 +238,23 @@ void ez8dbg::wr_mem(uint16_t address, const uint8_t *data, size_t size)
 	 */
 
 	/* validate memory cache */
+	known = 0;
 	if(memcache_enabled && memory_size()) {
-		cached_crc();
-		cached_memcrc();
+		known = cached_crc() == cached_memcrc();
 	}
 
 	/* if memory cache not enabled or cache is stale,
 	 * read memory out of device */
-	if(!memcache_enabled || !memory_size() || crc != memcrc) {
+	if(!known) {
 		rd_mem(block_start, main_mem + block_start, block_length);
 	}
 
-	/* if pages not blank, erase them */
-	cache &= ~CRC_CACHED;
-	memset(buffer, 0xff, EZ8MEM_SIZE);
-	for(addr = block_start, pages = block_length >> 9; 
-	    pages > 0; addr+=EZ8MEM_PAGESIZE, pages--) {
-		if(memcmp((void *)(main_mem+addr), buffer, EZ8MEM_PAGESIZE)) {
-			flash_page_erase(addr>>9);
-		}
+	/* erase pages that are not blank */
+	erase_block(block_start, block_start + block_length, 1, known);
+
+	/* a mass erase restored (and so read) all other memory */
+	if(last_erase.method == erase_mass) {
+		known = 1;
 	}
 
 	/* copy data into block */
@@ -251,7 +267,7 @@ void ez8dbg::wr_mem(uint16_t address, const uint8_t *data, size_t size)
 	flash_lock();
 
 	/* verify data */
-	if(memcache_enabled && memory_size() && crc == memcrc) {
+	if(known) {
 		if(cached_crc() != cached_memcrc()) {
 			strncpy(err_msg, "Write memory failed\n"
 			    "verify with crc failed\n", err_len-1);
@@ -271,6 +287,249 @@ void ez8dbg::wr_mem(uint16_t address, const uint8_t *data, size_t size)
 	return;
 }
 
+/**************************************************************
+ * This will program the populated extents of a sparse image.
+ *
+ * Extents that share a page are grouped into one run, and
+ * each run is written with wr_mem(). Pages that no extent
+ * touches are left alone, and bytes within a touched page 
+ * that are not in the image keep their current contents.
+ */
+
+void ez8dbg::wr_image(const struct image *image)
+{
+	const struct image_extent *e;
+	uint32_t start, end, addr, lo, hi;
+	uint8_t *data;
+	size_t i, j, k;
+
+	assert(image != NULL);
+
+	if(image_end(image) > EZ8MEM_SIZE) {
+		strncpy(err_msg, "Could not write memory\n"
+		    "invalid address range\n", err_len-1);
+		throw err_msg;
+	}
+
+	data = (uint8_t *)xmalloc(EZ8MEM_SIZE);
+
+	try {
+		for(i=0; i<image->count; i=j) {
+			/* find run of pages */
+			e = &image->extent[i];
+			start = e->address - e->address % EZ8MEM_PAGESIZE;
+			end = e->address + e->size;
+			for(j=i+1; j<image->count; j++) {
+				e = &image->extent[j];
+				if(e->address - e->address % EZ8MEM_PAGESIZE 
+				    > end) {
+					break;
+				}
+				end = e->address + e->size;
+			}
+			if(end % EZ8MEM_PAGESIZE) {
+				end += EZ8MEM_PAGESIZE - end % EZ8MEM_PAGESIZE;
+			}
+
+			/* read pages that are not fully populated */
+			k = i;
+			for(addr = start; addr < end; 
+			    addr += EZ8MEM_PAGESIZE) {
+				while(k < j && image->extent[k].address + 
+				    image->extent[k].size <= addr) {
+					k++;
+				}
+				e = &image->extent[k];
+				if(k == j || e->address > addr || 
+				    e->address + e->size < 
+				    addr + EZ8MEM_PAGESIZE) {
+					rd_mem(addr, data + (addr - start), 
+					    EZ8MEM_PAGESIZE);
+				}
+			}
+
+			/* overlay extents */
+			for(k=i; k<j; k++) {
+				e = &image->extent[k];
+				lo = e->address;
+				hi = e->address + e->size;
+				memcpy(data + (lo - start), e->data, hi - lo);
+			}
+
+			wr_mem(start, data, end - start);
+		}
+	} catch(char *err) {
+		free(data);
+		throw err;
+	}
+
+	free(data);
+
+	return;
+}
+
+/**************************************************************
+ * This will program data into flash memory, recording the
+ * state of each page in the journal as it goes.
+ *
+ * Pages the journal vouches for are neither read back nor
+ * reprogrammed, and pages it records as erased are not read
+ * back. So if a previous attempt was interrupted, programming
+ * resumes at the first page that was not verified.
+ */
+
+#define	JOURNAL_CHECKPOINT	8
+
+void ez8dbg::wr_mem_journaled(uint16_t address, const uint8_t *data, 
+	size_t size)
+{
+	uint32_t addr, start, end, lo, hi;
+	int page, count;
+	bool cached, mirror;
+	uint8_t flash_state[4];
+
+	assert(journal != NULL);
+
+	/* calculate page aligned block */
+	start = address - address % EZ8MEM_PAGESIZE;
+	end = address + size;
+	if(end % EZ8MEM_PAGESIZE) {
+		end += EZ8MEM_PAGESIZE - end % EZ8MEM_PAGESIZE;
+	}
+
+	/* The memory cache mirrors the device if it is valid now,
+	 * or once the whole memory has been accounted for below. 
+	 * If it does, progress can be verified with the crc. */
+	cached = mirror = 0;
+	if(memcache_enabled && memory_size()) {
+		if(cached_crc() == cached_memcrc()) {
+			cached = mirror = 1;
+		} else if(start == 0 && end >= (uint32_t)memory_size()) {
+			mirror = 1;
+		}
+	}
+
+	save_flash_state(flash_state);
+
+	/* find current contents of each page */
+	cache &= ~MEMCRC_CACHED;
+	for(addr = start; addr < end; addr += EZ8MEM_PAGESIZE) {
+		page = addr / EZ8MEM_PAGESIZE;
+		lo = addr < address ? address : addr;
+		hi = addr + EZ8MEM_PAGESIZE;
+		if(hi > address + size) {
+			hi = address + size;
+		}
+
+		if(journal->page[page] & JOURNAL_VERIFIED && 
+		    lo == addr && hi == addr + EZ8MEM_PAGESIZE) {
+			memcpy(main_mem + addr, data + (addr - address),
+			    EZ8MEM_PAGESIZE);
+		} else if(journal->page[page] == JOURNAL_ERASED ||
+		    (memory_size() && addr >= (uint32_t)memory_size())) {
+			memset(main_mem + addr, 0xff, EZ8MEM_PAGESIZE);
+		} else if(!cached) {
+			ez8ocd::rd_mem(addr, main_mem + addr, EZ8MEM_PAGESIZE);
+		}
+	}
+
+	/* program pages that differ */
+	memset(buffer, 0xff, EZ8MEM_PAGESIZE);
+	count = 0;
+	for(addr = start; addr < end; addr += EZ8MEM_PAGESIZE) {
+		page = addr / EZ8MEM_PAGESIZE;
+		lo = addr < address ? address : addr;
+		hi = addr + EZ8MEM_PAGESIZE;
+		if(hi > address + size) {
+			hi = address + size;
+		}
+
+		if(!memcmp(main_mem + lo, data + (lo - address), hi - lo)) {
+			journal_mark(journal, page, 
+			    journal->page[page] | JOURNAL_VERIFIED);
+			continue;
+		}
+
+		cache &= ~(CRC_CACHED | MEMCRC_CACHED);
+		if(memcmp(main_mem + addr, buffer, EZ8MEM_PAGESIZE)) {
+			flash_page_erase(page);
+			memset(main_mem + addr, 0xff, EZ8MEM_PAGESIZE);
+		}
+		journal_mark(journal, page, JOURNAL_ERASED);
+
+		memcpy(main_mem + lo, data + (lo - address), hi - lo);
+
+		flash_setup(0x00);
+		write_flash(addr, main_mem + addr, EZ8MEM_PAGESIZE);
+		flash_lock();
+		journal_mark(journal, page, JOURNAL_ERASED|JOURNAL_PROGRAMMED);
+
+		if(++count == JOURNAL_CHECKPOINT) {
+			journal_verify(start, addr + EZ8MEM_PAGESIZE, mirror);
+			count = 0;
+		}
+	}
+
+	journal_verify(start, end, mirror);
+
+	restore_flash_state(flash_state);
+
+	return;
+}
+
+/**************************************************************
+ * This will verify the programmed pages within the given 
+ * range, and mark them as verified in the journal.
+ */
+
+void ez8dbg::journal_verify(uint16_t start, uint32_t end, bool mirror)
+{
+	uint32_t addr;
+	int page;
+	bool ok;
+
+	if(mirror) {
+		ok = cached_crc() == cached_memcrc();
+	} else {
+		for(page = start / EZ8MEM_PAGESIZE; 
+		    page < (int)(end / EZ8MEM_PAGESIZE); page++) {
+			if(journal->page[page] & JOURNAL_PROGRAMMED &&
+			    !(journal->page[page] & JOURNAL_VERIFIED)) {
+				break;
+			}
+		}
+		addr = page * EZ8MEM_PAGESIZE;
+		if(addr < end) {
+			ez8ocd::rd_mem(addr, buffer, end - addr);
+			ok = !memcmp(buffer, main_mem + addr, end - addr);
+		} else {
+			ok = 1;
+		}
+	}
+
+	for(page = start / EZ8MEM_PAGESIZE; 
+	    page < (int)(end / EZ8MEM_PAGESIZE); page++) {
+		if(!(journal->page[page] & JOURNAL_PROGRAMMED) ||
+		    journal->page[page] & JOURNAL_VERIFIED) {
+			continue;
+		}
+		if(ok) {
+			journal_mark(journal, page, 
+			    journal->page[page] | JOURNAL_VERIFIED);
+		} else {
+			journal_mark(journal, page, 0);
+		}
+	}
+
+	if(!ok) {
+		strncpy(err_msg, "Write memory failed\n"
+		    "verify failed\n", err_len-1);
+		throw err_msg;
+	}
+
+	return;
+}
+
 /**************************************************************
  * This will read from info memory.
  */
@@ -551,6 +810,7 @@ void ez8dbg::flash_page_erase(uint8_t page)
 	const uint8_t erase[1] = { EZ8_FIF_PAGE_ERASE };
 	uint8_t status[1];
 	time_t start;
+	struct timer t;
 
 	if(!state(state_stopped)) {
 		strncpy(err_msg, "Could not erase flash\n"
@@ -564,6 +824,7 @@ void ez8dbg::flash_page_erase(uint8_t page)
 	}
 
 	/* execute page erase */
+	timerstart(&t);
 	flash_setup(page);
 	wr_regs(EZ8_FIF_BASE, erase, 1);
 
@@ -581,6 +842,9 @@ void ez8dbg::flash_page_erase(uint8_t page)
 		throw err_msg;
 	}
 
+	timerstop(&t);
+	page_erase_time = (page_erase_time + timerusec(&t)) / 2;
+
 	return;	
 }
 
@@ -592,10 +856,6 @@ void ez8dbg::flash_page_erase(uint8_t page)
 
 void ez8dbg::mass_erase(bool info)
 {
-	const uint8_t erase[1] = { EZ8_FIF_MASS_ERASE };
-	uint8_t status[1];
-	time_t start;
-
 	if(!state(state_stopped)) {
 		strncpy(err_msg, "Could not erase flash\n"
 		    "device is running\n", err_len-1);
@@ -608,6 +868,7 @@ void ez8dbg::mass_erase(bool info)
 		breakpoints = NULL;
 		num_breakpoints = 0;
 	}
+	hwbreak = 0;
 
 	/* clear cache memory */
 	memset(main_mem, 0xff, EZ8MEM_SIZE);
@@ -617,8 +878,27 @@ void ez8dbg::mass_erase(bool info)
 
 	/* invalidate cache */
 	cache &= ~(CRC_CACHED | MEMCRC_CACHED);
+	flush_disasm();
+
+	erase_all(info);
+
+	return;	
+}
+
+/**************************************************************
+ * This will execute a mass erase. It does not touch the
+ * breakpoints or memory cache.
+ */
+
+void ez8dbg::erase_all(bool info)
+{
+	const uint8_t erase[1] = { EZ8_FIF_MASS_ERASE };
+	uint8_t status[1];
+	time_t start;
+	struct timer t;
 
 	/* execute mass erase */
+	timerstart(&t);
 	flash_setup(info?0x80:0x00);
 	wr_regs(EZ8_FIF_BASE, erase, 1);
 
@@ -640,7 +920,10 @@ void ez8dbg::mass_erase(bool info)
 		throw err_msg;
 	}
 
-	return;	
+	timerstop(&t);
+	mass_erase_time = (mass_erase_time + timerusec(&t)) / 2;
+
+	return;
 }
 
 /**************************************************************/
@@ -650,6 +933,223 @@ void ez8dbg::flash_mass_erase(void)
 	mass_erase(0);
 }
 
+/**************************************************************
+ * This will return the time taken to send one byte over the
+ * link, in microseconds.
+ */
+
+long ez8dbg::byte_time(void)
+{
+	int baud;
+
+	baud = cached_baudrate();
+	if(baud <= 0) {
+		return 100;
+	}
+
+	return 10000000L / baud;
+}
+
+/**************************************************************
+ * This will erase the pages from start to end of main memory,
+ * leaving all memory outside the block intact.
+ *
+ * It picks the faster of erasing each page that is not blank,
+ * or a mass erase followed by reprogramming everything outside
+ * the block. The estimate is based on the measured erase times
+ * and the link speed. Info memory is never erased.
+ *
+ * If block is set, the memory cache holds the contents of the
+ * block. If all is set, it holds the contents of all memory.
+ * The memory cache itself is not changed.
+ */
+
+void ez8dbg::erase_block(uint32_t start, uint32_t end, bool block, bool all)
+{
+	struct erase_plan plan;
+	struct timer t;
+	uint32_t addr, size;
+	long cost_pages, cost_mass, outside;
+	static const char *method_names[] = { "blank", "page erase",
+	    "mass erase" };
+
+	size = memory_size();
+	memset(buffer, 0xff, EZ8MEM_PAGESIZE);
+
+	/* cost of erasing pages that are not blank */
+	plan.pages = 0;
+	if(block) {
+		for(addr = start; addr < end; addr += EZ8MEM_PAGESIZE) {
+			if(memcmp(main_mem + addr, buffer, EZ8MEM_PAGESIZE)) {
+				plan.pages++;
+			}
+		}
+		cost_pages = plan.pages * page_erase_time;
+	} else {
+		plan.pages = (end - start) / EZ8MEM_PAGESIZE;
+		cost_pages = plan.pages * page_erase_time + 
+		    (end - start) * byte_time();
+	}
+
+	/* cost of mass erase, then restoring memory outside block */
+	if(!size || end > size) {
+		cost_mass = -1;
+	} else if(all) {
+		outside = 0;
+		for(addr = 0; addr < start; addr++) {
+			outside += main_mem[addr] != 0xff;
+		}
+		for(addr = end; addr < size; addr++) {
+			outside += main_mem[addr] != 0xff;
+		}
+		cost_mass = mass_erase_time + outside * byte_time();
+	} else {
+		outside = size - (end - start);
+		cost_mass = mass_erase_time + 2 * outside * byte_time();
+	}
+
+	if(block && !plan.pages) {
+		plan.method = erase_none;
+		plan.estimate = 0;
+	} else if(cost_mass >= 0 && cost_mass < cost_pages) {
+		plan.method = erase_mass;
+		plan.estimate = cost_mass;
+	} else {
+		plan.method = erase_pages;
+		plan.estimate = cost_pages;
+	}
+
+	timerstart(&t);
+
+	switch(plan.method) {
+	case erase_none:
+		break;
+	case erase_pages:
+		if(!block) {
+			ez8ocd::rd_mem(start, main_mem + start, end - start);
+		}
+		cache &= ~CRC_CACHED;
+		plan.pages = 0;
+		for(addr = start; addr < end; addr += EZ8MEM_PAGESIZE) {
+			if(memcmp(main_mem + addr, buffer, EZ8MEM_PAGESIZE)) {
+				flash_page_erase(addr / EZ8MEM_PAGESIZE);
+				plan.pages++;
+			}
+		}
+		break;
+	case erase_mass:
+		if(!all) {
+			ez8ocd::rd_mem(0, main_mem, start);
+			ez8ocd::rd_mem(end, main_mem + end, size - end);
+		}
+		cache &= ~(CRC_CACHED | MEMCRC_CACHED);
+		erase_all(0);
+		flash_setup(0x00);
+		write_flash(0, main_mem, start);
+		write_flash(end, main_mem + end, size - end);
+		flash_lock();
+		break;
+	}
+
+	timerstop(&t);
+	plan.actual = timerusec(&t);
+	last_erase = plan;
+
+	if(log_flash) {
+		fprintf(log_flash, "Erase %04X-%04X: %s", (unsigned int)start,
+		    (unsigned int)end - 1, method_names[plan.method]);
+		if(plan.method == erase_pages) {
+			fprintf(log_flash, " (%d pages)", plan.pages);
+		}
+		fprintf(log_flash, ", estimated %ldms, actual %ldms\n",
+		    plan.estimate / 1000, plan.actual / 1000);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will erase the specified range of main memory. The
+ * range must be page aligned.
+ *
+ * Memory outside the range is left intact, and so is info
+ * memory. If memory read protect is enabled, the range must
+ * cover all of memory, and it is mass erased.
+ */
+
+void ez8dbg::erase_mem(uint16_t address, size_t size)
+{
+	uint32_t start, end;
+	struct timer t;
+	int i;
+	bool known;
+
+	start = address;
+	end = address + size;
+
+	if(end > EZ8MEM_SIZE || start % EZ8MEM_PAGESIZE || 
+	    end % EZ8MEM_PAGESIZE) {
+		strncpy(err_msg, "Could not erase memory\n"
+		    "invalid address range\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(!state(state_stopped)) {
+		strncpy(err_msg, "Could not erase memory\n"
+		    "device is running\n", err_len-1);
+		throw err_msg;
+	}
+
+	flush_disasm();
+
+	if(state(state_protected)) {
+		if(start > 0 || !memory_size() || 
+		    end < (uint32_t)memory_size()) {
+			strncpy(err_msg, "Could not erase memory\n"
+			    "memory read protect is enabled\n", err_len-1);
+			throw err_msg;
+		}
+		last_erase.method = erase_mass;
+		last_erase.pages = 0;
+		last_erase.estimate = mass_erase_time;
+		timerstart(&t);
+		mass_erase(0);
+		timerstop(&t);
+		last_erase.actual = timerusec(&t);
+		return;
+	}
+
+	/* if memory cache is stale, check if device is blank */
+	known = 0;
+	if(memcache_enabled && memory_size()) {
+		known = cached_crc() == cached_memcrc();
+		if(!known) {
+			memset(buffer, 0xff, memory_size());
+			if(crc == crc_ccitt(0x0000, buffer, memory_size())) {
+				memset(main_mem, 0xff, memory_size());
+				cache &= ~MEMCRC_CACHED;
+				known = cached_crc() == cached_memcrc();
+			}
+		}
+	}
+
+	erase_block(start, end, known, known);
+
+	/* update memory cache */
+	cache &= ~(CRC_CACHED | MEMCRC_CACHED);
+	memset(main_mem + start, 0xff, end - start);
+
+	/* forget breakpoints that were erased */
+	for(i=num_breakpoints-1; i>=0; i--) {
+		if(breakpoints[i].address >= start && 
+		    breakpoints[i].address < end) {
+			delete_breakpoint(i);
+		}
+	}
+
+	return;
+}
+
 /**************************************************************/
 
 
@@ -155,6 +155,233 @@ void ez8dbg::rd_trce_buff(uint16_t address, struct trce_frame *frames,
 	return;
 }
 
+/**************************************************************
+ * This will compute the comparator mask of an address range.
+ * It returns 0 if the range is not a power of two in size,
+ * aligned to its size.
+ */
+
+static bool range_mask(uint16_t lo, uint16_t hi, uint16_t *mask)
+{
+	uint32_t size;
+
+	if(lo > hi) {
+		return 0;
+	}
+	size = (uint32_t)hi - lo + 1;
+	if((size & (size - 1)) || (lo & (size - 1))) {
+		return 0;
+	}
+	*mask = ~(size - 1);
+
+	return 1;
+}
+
+/**************************************************************
+ * This will encode a watchpoint as a trace event, matching
+ * register accesses of one kind.
+ *
+ * The register address word of an event compares against the
+ * same bits as a trace frame: the cycle type, the access
+ * type, and the register address. A watchpoint on the pc
+ * alone only matches instruction cycles, so the pc is valid.
+ *
+ * The masks of the register and pc ranges are passed in, as
+ * found by range_mask() when the watchpoint was checked.
+ *
+ * The event bits are assumed, see ez8.h, so watchpoints are
+ * unverified on hardware.
+ */
+
+static void encode_watchpoint(const struct watchpoint *wp, 
+	enum wp_access access, uint16_t reg_mask, uint16_t pc_mask,
+	struct trce_event *event)
+{
+	memset(event, 0, sizeof(struct trce_event));
+	event->ctl = TRCEEVENT_ENABLE | TRCEEVENT_BREAK;
+
+	if(access != wp_none) {
+		event->mask.reg_addr = TRCE_ACCESS_MASK | 
+		    (reg_mask & TRCE_ADDR_MASK);
+		event->data.reg_addr = wp->reg_lo & TRCE_ADDR_MASK;
+		if(access == wp_write) {
+			event->data.reg_addr |= TRCE_ACCESS_WR;
+		} else {
+			event->data.reg_addr |= TRCE_ACCESS_RD;
+		}
+		event->mask.reg_data = wp->data_mask;
+		event->data.reg_data = wp->data & wp->data_mask;
+	}
+
+	if(wp->pc) {
+		event->mask.pc = pc_mask;
+		event->data.pc = wp->pc_lo & pc_mask;
+		if(access == wp_none) {
+			event->mask.reg_addr |= TRCE_CYCLE_MASK;
+			event->data.reg_addr |= TRCE_CYCLE_INST;
+		}
+	}
+
+	event->mask.cpu_flags = wp->flags_mask;
+	event->data.cpu_flags = wp->flags & wp->flags_mask;
+
+	return;
+}
+
+/**************************************************************
+ * This will set a watchpoint, stopping the cpu when it
+ * matches. A watchpoint on any register access uses two 
+ * trace events, others use one. It returns the number of the
+ * watchpoint.
+ */
+
+int ez8dbg::set_watchpoint(const struct watchpoint *wp)
+{
+	struct trce_event event, old;
+	uint16_t reg_mask, pc_mask;
+	int i, first, need, found;
+
+	assert(wp != NULL);
+
+	if(!state(state_trace)) {
+		strncpy(err_msg, "Could not set watchpoint\n"
+		    "trace not available\n", err_len-1);
+		throw err_msg;
+	}
+
+	reg_mask = pc_mask = 0xffff;
+	if((wp->access != wp_none && (wp->reg_hi >= EZ8REG_SIZE ||
+	    !range_mask(wp->reg_lo, wp->reg_hi, &reg_mask))) ||
+	    (wp->pc && !range_mask(wp->pc_lo, wp->pc_hi, &pc_mask))) {
+		strncpy(err_msg, "Could not set watchpoint\n"
+		    "range is not an aligned power of two\n", err_len-1);
+		throw err_msg;
+	}
+	if(wp->access == wp_none && !wp->pc && !wp->flags_mask) {
+		strncpy(err_msg, "Could not set watchpoint\n"
+		    "nothing to match\n", err_len-1);
+		throw err_msg;
+	}
+
+	/* find free, consecutive events */
+	need = wp->access == wp_any ? 2 : 1;
+	first = -1;
+	for(i=0; i + need <= TRCE_EVENTS; i++) {
+		if(wp_owner[i] < 0 && (need == 1 || wp_owner[i+1] < 0)) {
+			first = i;
+			break;
+		}
+	}
+	if(first < 0) {
+		strncpy(err_msg, "Could not set watchpoint\n"
+		    "no free trace events\n", err_len-1);
+		throw err_msg;
+	}
+
+	for(found=0; found<need; found++) {
+		if(wp->access == wp_any) {
+			encode_watchpoint(wp, found ? wp_read : wp_write, 
+			    reg_mask, pc_mask, &event);
+		} else {
+			encode_watchpoint(wp, wp->access, reg_mask, pc_mask,
+			    &event);
+		}
+		/* leave control bits we do not know about alone */
+		ez8ocd::rd_trce_event(first + found, &old);
+		event.ctl |= old.ctl & ~(TRCEEVENT_ENABLE | TRCEEVENT_BREAK);
+		ez8ocd::wr_trce_event(first + found, &event);
+		wp_owner[first + found] = first;
+	}
+	watchpoints[first] = *wp;
+
+	return first;
+}
+
+/**************************************************************
+ * This will clear a watchpoint.
+ */
+
+void ez8dbg::clear_watchpoint(int num)
+{
+	struct trce_event event, old;
+	int i;
+
+	if(num < 0 || num >= TRCE_EVENTS || wp_owner[num] != num) {
+		strncpy(err_msg, "Could not clear watchpoint\n"
+		    "watchpoint not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	memset(&event, 0, sizeof(event));
+	for(i=num; i<TRCE_EVENTS && wp_owner[i] == num; i++) {
+		ez8ocd::rd_trce_event(i, &old);
+		event.ctl = old.ctl & ~(TRCEEVENT_ENABLE | TRCEEVENT_BREAK);
+		ez8ocd::wr_trce_event(i, &event);
+		wp_owner[i] = -1;
+	}
+	if(wp_hit == num) {
+		wp_hit = -1;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will get a watchpoint. It returns 0 if it is not set.
+ */
+
+bool ez8dbg::get_watchpoint(int num, struct watchpoint *wp)
+{
+	if(num < 0 || num >= TRCE_EVENTS || wp_owner[num] != num) {
+		return 0;
+	}
+	if(wp) {
+		*wp = watchpoints[num];
+	}
+
+	return 1;
+}
+
+/**************************************************************
+ * This will return the watchpoint that stopped the cpu, or -1
+ * if it was not stopped by a watchpoint.
+ */
+
+int ez8dbg::watchpoint_hit(void)
+{
+	return wp_hit;
+}
+
+/**************************************************************
+ * This is called when the cpu stops, to find out if one of
+ * the trace events stopped it.
+ */
+
+void ez8dbg::check_watchpoints(void)
+{
+	uint8_t status;
+	int i;
+
+	for(i=0; i<TRCE_EVENTS; i++) {
+		if(wp_owner[i] >= 0) {
+			break;
+		}
+	}
+	if(i == TRCE_EVENTS) {
+		return;
+	}
+
+	status = ez8ocd::rd_trce_status();
+	for(i=0; i<TRCE_EVENTS; i++) {
+		if(wp_owner[i] >= 0 && (status & (TRCESTAT_EVENT << i))) {
+			wp_hit = wp_owner[i];
+			break;
+		}
+	}
+
+	return;
+}
+
 /**************************************************************/
 
 
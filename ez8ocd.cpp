@@ -19,6 +19,7 @@
 #include	"ocd_serial.h"
 #include	"ocd_parport.h"
 #include	"ocd_tcpip.h"
+#include	"ocd_sim.h"
 #include	"ez8ocd.h"
 #include	"ez8.h"
 
@@ -33,6 +34,8 @@ ez8ocd::ez8ocd()
 	cache = 0;
 	mtu = 0;
 	callback = NULL;
+	bytes_read = 0;
+	bytes_written = 0;
 
 	return;
 }
@@ -136,6 +139,36 @@ void ez8ocd::connect_tcpip(const char *device)
 	return;
 }
 
+/**************************************************************
+ * This will connect the debugger to the instruction set
+ * simulator, running at sysclk, with program memory loaded
+ * from image if it is not NULL.
+ */
+
+void ez8ocd::connect_sim(const char *image, int sysclk)
+{
+	ocd_sim *ocdptr;
+
+	if(dbg) {
+		strncpy(err_msg, "Cannot connect to simulator\n"
+		    "already connected\n", err_len-1);
+		throw err_msg;
+	}
+
+	ocdptr = new ocd_sim();
+
+	try {
+		ocdptr->connect(image, sysclk);
+	} catch(char *err) {
+		delete ocdptr;
+		throw err;
+	}
+
+	dbg = ocdptr;
+
+	return;
+}
+
 /**************************************************************
  * If we are currently connected to an interface, disconnect
  * from it.
@@ -181,6 +214,7 @@ void ez8ocd::read(uint8_t *buff, size_t size)
 		}
 		throw err;
 	}
+	bytes_read += size;
 
 	/* if protocol logging enabled, log what we read */
 	if(log_proto) {
@@ -252,6 +286,7 @@ void ez8ocd::write(const uint8_t *buff, size_t size)
 			}
 			throw err;
 		}
+		bytes_written += len;
 
 		buff += len;
 		size -= len;
@@ -419,6 +454,39 @@ bool ez8ocd::rd_ack(void)
 	return 1;
 }
 
+/**************************************************************
+ * This will wait up to msec milliseconds (forever if negative)
+ * for data from the on-chip debugger, such as an acknowledge.
+ * It returns non-zero if data is available.
+ */
+
+bool ez8ocd::wait_data(int msec)
+{
+	if(!dbg) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "not connected\n", err_len-1);
+		throw err_msg;
+	}
+
+	return dbg->wait(msec);
+}
+
+/**************************************************************
+ * This returns a file descriptor that becomes readable when 
+ * the on-chip debugger sends data, so callers can wait for a
+ * breakpoint with select() or poll(). It returns -1 if the
+ * link does not have one, and must be polled.
+ */
+
+int ez8ocd::poll_fd(void)
+{
+	if(!dbg) {
+		return -1;
+	}
+
+	return dbg->poll_fd();
+}
+
 /**************************************************************
  * This will write to the debug control register.
  */
@@ -794,6 +862,45 @@ void ez8ocd::stuf_inst(uint8_t opcode)
 	return;
 }
 
+/**************************************************************
+ * This will single step several instructions with one write.
+ * For each instruction, opcodes gives the first byte to stuff,
+ * or -1 to step the opcode in memory.
+ */
+
+void ez8ocd::step_insts(const int *opcodes, size_t count)
+{
+	uint8_t *command;
+	size_t i, len;
+
+	assert(opcodes != NULL);
+
+	if(!count) {
+		return;
+	}
+
+	command = (uint8_t *)xmalloc(count * 2);
+	len = 0;
+	for(i=0; i<count; i++) {
+		if(opcodes[i] < 0) {
+			command[len++] = DBG_CMD_STEP_INST;
+		} else {
+			command[len++] = DBG_CMD_STUFF_INST;
+			command[len++] = opcodes[i];
+		}
+	}
+
+	try {
+		write(command, len);
+	} catch(char *err) {
+		free(command);
+		throw err;
+	}
+	free(command);
+
+	return;
+}
+
 /**************************************************************
  * This will stuff the given opcode and execute it.
  */
@@ -1007,11 +1114,7 @@ void ez8ocd::rd_trce_buff(uint16_t addr, struct trce_frame *buff,
 	read(data, size * 8);
 
 	for(i=0; i<size; i++) {
-		int j;
-
-		for(j=0; j<8; j++) {
-			buff[i].data[j] = *data++;
-		}
+		memcpy(buff[i].data, data + i * 8, 8);
 	}
 
 	free(data);
@@ -55,6 +55,7 @@ public:
 
 	void new_command(void);
 	bool rd_ack(void);
+	bool wait_data(int);
 
 	void wr_dbgctl(uint8_t);
 	uint8_t rd_dbgctl(void);
@@ -78,6 +79,7 @@ public:
 
 	void step_inst(void);
 	void stuf_inst(uint8_t);
+	void step_insts(const int *, size_t);
 	void exec_inst(const uint8_t *, size_t);
 
 	uint8_t rd_memsize(void);
@@ -95,6 +97,10 @@ public:
 	size_t mtu;
 	FILE *log_proto;
 
+	/* link statistics */
+	unsigned long bytes_read;
+	unsigned long bytes_written;
+
 	ez8ocd();
 	~ez8ocd();
 
@@ -103,6 +109,7 @@ public:
 	void connect_serial(const char *, int);
 	void connect_parport(const char *);
 	void connect_tcpip(const char *);
+	void connect_sim(const char *, int);
 	void disconnect(void);
 	ocd *iflink(void);
 
@@ -115,6 +122,7 @@ public:
 
 	void read(uint8_t *, size_t);
 	void write(const uint8_t *, size_t);
+	int poll_fd(void);
 
 	uint16_t rd_revid(void);
 	uint16_t rd_reload(void);
@@ -0,0 +1,1558 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This simulates an eZ8 cpu, its flash controller, and the
+ * parts of the on-chip debugger that are inside the chip: the
+ * breakpoint instruction, the pc and counter breakpoints, and
+ * the trace buffer and events of the emulator parts.
+ *
+ * Instructions are decoded with two 256 entry tables, built
+ * from the opcode lists the first time they are needed, the
+ * same as the disassembler. Each entry has the function that
+ * executes the instruction, its addressing mode and its size,
+ * so an instruction takes one lookup and one call.
+ *
+ * There are no peripherals, so no interrupts. Halt and stop
+ * both wait until the debugger stops the cpu. Cycle counts are
+ * rough, one more than the size of the instruction.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<inttypes.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"ez8.h"
+#include	"crc.h"
+#include	"opcodes.h"
+#include	"ez8sim.h"
+
+/**************************************************************/
+
+/* flags register */
+#define	F_C		0x80
+#define	F_Z		0x40
+#define	F_S		0x20
+#define	F_V		0x10
+#define	F_D		0x08
+#define	F_H		0x04
+
+/* read protect option bit, at address 0000, active low */
+#define	OPTION_RP	0x04
+
+/* flash controller status */
+#define	FSTAT_LOCKED	0x00
+#define	FSTAT_UNLOCK_0	0x01
+#define	FSTAT_PROT_REG	0x04
+
+/* longest instruction, with prefix */
+#define	SIM_FETCH	5
+
+#define	FLAGS(sim)	((sim)->regs[EZ8_FLAGS])
+#define	RP(sim)		((sim)->regs[EZ8_RP])
+
+/* working register */
+#define	W(sim, n)	(((RP(sim) & 0x0f) << 8) | (RP(sim) & 0xf0) | (n))
+
+/* 8 bit register address, E0-EF are working registers */
+#define	R8(sim, r)	(((r) & 0xf0) == 0xe0 ? W(sim, (r) & 0x0f) : \
+			    ((RP(sim) & 0x0f) << 8) | (r))
+
+/* register pair */
+#define	RR(sim, r)	R8(sim, (r) & 0xfe)
+
+/* 12 bit register address, Exx are 8 bit addresses */
+#define	ER(sim, a)	(((a) & 0xf00) == 0xe00 ? R8(sim, (a) & 0xff) : (a))
+
+/**************************************************************/
+
+struct sim_op;
+
+typedef void (*sim_exec)(struct ez8sim *, const uint8_t *,
+	const struct sim_op *);
+
+struct sim_op {
+	sim_exec exec;
+	uint8_t am;		/* enum address_mode_t */
+	uint8_t size;		/* including prefix */
+	uint8_t cycles;
+	uint8_t arg;		/* which alu operation, etc */
+};
+
+static struct sim_op op_table[256];
+static struct sim_op alt_table[256];
+static int tables_built = 0;
+
+enum sim_alu {
+	alu_add, alu_adc, alu_sub, alu_sbc, alu_or, alu_and,
+	alu_tcm, alu_tm, alu_cp, alu_cpc, alu_xor
+};
+
+enum sim_unary {
+	un_rlc, un_inc, un_dec, un_da, un_com, un_rl, un_clr,
+	un_rrc, un_sra, un_srl, un_rr, un_swap, un_bswap
+};
+
+/**************************************************************
+ * These read and write the register file, as the cpu does.
+ * Accesses are noted for the trace buffer. The flash
+ * controller registers are not memory.
+ */
+
+static uint8_t fif_read(struct ez8sim *sim, uint16_t addr)
+{
+	switch(addr - EZ8_FIF_BASE) {
+	case 0:
+		return sim->fstat;
+	case 1:
+		return sim->fstat == FSTAT_PROT_REG ? sim->fprot : sim->fps;
+	default:
+		return sim->regs[addr];
+	}
+}
+
+static void flash_erase(struct ez8sim *sim, int mass)
+{
+	if(mass) {
+		memset(sim->mem, 0xff, EZ8MEM_SIZE);
+		if(sim->fps & 0x80) {
+			memset(sim->info, 0xff, EZ8MEM_PAGESIZE);
+		}
+		sim->protect = 0;
+	} else if(sim->fps & 0x80) {
+		memset(sim->info, 0xff, EZ8MEM_PAGESIZE);
+	} else {
+		memset(sim->mem + (sim->fps & 0x7f) * EZ8MEM_PAGESIZE,
+		    0xff, EZ8MEM_PAGESIZE);
+	}
+
+	return;
+}
+
+static void fif_write(struct ez8sim *sim, uint16_t addr, uint8_t data)
+{
+	switch(addr - EZ8_FIF_BASE) {
+	case 0:
+		if(data == EZ8_FIF_UNLOCK_0 && sim->fstat == FSTAT_LOCKED) {
+			sim->fstat = FSTAT_UNLOCK_0;
+		} else if(data == EZ8_FIF_UNLOCK_1 &&
+		    sim->fstat == FSTAT_UNLOCK_0) {
+			sim->fstat = EZ8_FIF_UNLOCKED;
+		} else if(data == EZ8_FIF_PROT_REG &&
+		    sim->fstat == FSTAT_LOCKED) {
+			sim->fstat = FSTAT_PROT_REG;
+		} else if(data == EZ8_FIF_PAGE_ERASE &&
+		    sim->fstat == EZ8_FIF_UNLOCKED) {
+			flash_erase(sim, 0);
+			sim->fstat = FSTAT_LOCKED;
+		} else if(data == EZ8_FIF_MASS_ERASE &&
+		    sim->fstat == EZ8_FIF_UNLOCKED) {
+			flash_erase(sim, 1);
+			sim->fstat = FSTAT_LOCKED;
+		} else {
+			sim->fstat = FSTAT_LOCKED;
+		}
+		break;
+	case 1:
+		if(sim->fstat == FSTAT_PROT_REG) {
+			sim->fprot = data;
+		} else {
+			sim->fps = data;
+		}
+		break;
+	default:
+		sim->regs[addr] = data;
+		break;
+	}
+
+	return;
+}
+
+static void note(struct ez8sim *sim, uint16_t access, uint8_t data)
+{
+	if(sim->naccess < EZ8SIM_ACCESSES) {
+		sim->access[sim->naccess] = access;
+		sim->access_data[sim->naccess] = data;
+		sim->naccess++;
+	}
+
+	return;
+}
+
+static uint8_t rd(struct ez8sim *sim, uint16_t addr)
+{
+	uint8_t data;
+
+	if(addr >= EZ8_FIF_BASE && addr < EZ8_FIF_BASE + 4) {
+		data = fif_read(sim, addr);
+	} else {
+		data = sim->regs[addr];
+	}
+	note(sim, TRCE_ACCESS_RD | addr, data);
+
+	return data;
+}
+
+static void wr(struct ez8sim *sim, uint16_t addr, uint8_t data)
+{
+	if(addr >= EZ8_FIF_BASE && addr < EZ8_FIF_BASE + 4) {
+		fif_write(sim, addr, data);
+	} else {
+		sim->regs[addr] = data;
+	}
+	note(sim, TRCE_ACCESS_WR | addr, data);
+
+	return;
+}
+
+static uint16_t rd16(struct ez8sim *sim, uint16_t addr)
+{
+	return (rd(sim, addr) << 8) | rd(sim, (addr + 1) & 0xfff);
+}
+
+static void wr16(struct ez8sim *sim, uint16_t addr, uint16_t data)
+{
+	wr(sim, addr, data >> 8);
+	wr(sim, (addr + 1) & 0xfff, data);
+
+	return;
+}
+
+/**************************************************************
+ * The stack is in the register file.
+ */
+
+static void push(struct ez8sim *sim, uint8_t data)
+{
+	uint16_t sp;
+
+	sp = ((sim->regs[EZ8_SPH] << 8) | sim->regs[EZ8_SPL]) - 1;
+	sim->regs[EZ8_SPH] = sp >> 8;
+	sim->regs[EZ8_SPL] = sp;
+	wr(sim, sp & 0xfff, data);
+
+	return;
+}
+
+static uint8_t pop(struct ez8sim *sim)
+{
+	uint16_t sp;
+	uint8_t data;
+
+	sp = (sim->regs[EZ8_SPH] << 8) | sim->regs[EZ8_SPL];
+	data = rd(sim, sp & 0xfff);
+	sp++;
+	sim->regs[EZ8_SPH] = sp >> 8;
+	sim->regs[EZ8_SPL] = sp;
+
+	return data;
+}
+
+/**************************************************************
+ * This will test a condition code.
+ */
+
+static int cond(struct ez8sim *sim, int cc)
+{
+	uint8_t f;
+	int lt;
+
+	f = FLAGS(sim);
+	lt = !(f & F_S) != !(f & F_V);
+
+	switch(cc) {
+	case 0x0:	return 0;
+	case 0x1:	return lt;
+	case 0x2:	return lt || (f & F_Z);
+	case 0x3:	return (f & F_C) || (f & F_Z);
+	case 0x4:	return (f & F_V) != 0;
+	case 0x5:	return (f & F_S) != 0;
+	case 0x6:	return (f & F_Z) != 0;
+	case 0x7:	return (f & F_C) != 0;
+	case 0x8:	return 1;
+	case 0x9:	return !lt;
+	case 0xa:	return !(lt || (f & F_Z));
+	case 0xb:	return !((f & F_C) || (f & F_Z));
+	case 0xc:	return !(f & F_V);
+	case 0xd:	return !(f & F_S);
+	case 0xe:	return !(f & F_Z);
+	default:	return !(f & F_C);
+	}
+}
+
+/**************************************************************
+ * This does the arithmetic and logic instructions, setting
+ * the flags. It returns non-zero if the result is written.
+ */
+
+static int alu(struct ez8sim *sim, int op, uint8_t d, uint8_t s,
+	uint8_t *result)
+{
+	unsigned int t, c;
+	uint8_t f, r;
+	int write;
+
+	f = FLAGS(sim);
+	write = 1;
+
+	switch(op) {
+	case alu_add:
+	case alu_adc:
+		c = op == alu_adc && (f & F_C) ? 1 : 0;
+		t = d + s + c;
+		r = t;
+		f &= ~(F_C | F_Z | F_S | F_V | F_D | F_H);
+		if(t & 0x100) {
+			f |= F_C;
+		}
+		if((d ^ r) & (s ^ r) & 0x80) {
+			f |= F_V;
+		}
+		if((d ^ s ^ r) & 0x10) {
+			f |= F_H;
+		}
+		break;
+	case alu_sub:
+	case alu_sbc:
+	case alu_cp:
+	case alu_cpc:
+		c = (op == alu_sbc || op == alu_cpc) && (f & F_C) ? 1 : 0;
+		t = d - s - c;
+		r = t;
+		f &= ~(F_C | F_S | F_V);
+		if(d < s + c) {
+			f |= F_C;
+		}
+		if((d ^ s) & (d ^ r) & 0x80) {
+			f |= F_V;
+		}
+		if(op == alu_sub || op == alu_sbc) {
+			f &= ~F_H;
+			f |= F_D;
+			if((d ^ s ^ r) & 0x10) {
+				f |= F_H;
+			}
+		} else {
+			write = 0;
+		}
+		break;
+	case alu_or:
+		r = d | s;
+		f &= ~(F_Z | F_S | F_V);
+		break;
+	case alu_and:
+		r = d & s;
+		f &= ~(F_Z | F_S | F_V);
+		break;
+	case alu_xor:
+		r = d ^ s;
+		f &= ~(F_Z | F_S | F_V);
+		break;
+	case alu_tcm:
+		r = ~d & s;
+		f &= ~(F_Z | F_S | F_V);
+		write = 0;
+		break;
+	case alu_tm:
+	default:
+		r = d & s;
+		f &= ~(F_Z | F_S | F_V);
+		write = 0;
+		break;
+	}
+
+	f &= ~(F_Z | F_S);
+	if(!r) {
+		f |= F_Z;
+	}
+	if(r & 0x80) {
+		f |= F_S;
+	}
+
+	/* cpc is zero only if the bytes before it were too */
+	if(op == alu_cpc && !(FLAGS(sim) & F_Z)) {
+		f &= ~F_Z;
+	}
+	FLAGS(sim) = f;
+	*result = r;
+
+	return write;
+}
+
+/**************************************************************
+ * This does the single operand instructions, setting the
+ * flags. It returns non-zero if the result is written.
+ */
+
+static int unary(struct ez8sim *sim, int op, uint8_t d, uint8_t *result)
+{
+	uint8_t f, r, c;
+	int i;
+
+	f = FLAGS(sim);
+	c = 0;
+
+	switch(op) {
+	case un_rlc:
+		r = (d << 1) | (f & F_C ? 1 : 0);
+		c = d & 0x80;
+		break;
+	case un_rl:
+		r = (d << 1) | (d >> 7);
+		c = d & 0x80;
+		break;
+	case un_rrc:
+		r = (d >> 1) | (f & F_C ? 0x80 : 0);
+		c = d & 0x01;
+		break;
+	case un_rr:
+		r = (d >> 1) | (d << 7);
+		c = d & 0x01;
+		break;
+	case un_sra:
+		r = (d >> 1) | (d & 0x80);
+		c = d & 0x01;
+		break;
+	case un_srl:
+		r = d >> 1;
+		c = d & 0x01;
+		break;
+	case un_inc:
+		r = d + 1;
+		f &= ~(F_Z | F_S | F_V);
+		if(r == 0x80) {
+			f |= F_V;
+		}
+		goto zs;
+	case un_dec:
+		r = d - 1;
+		f &= ~(F_Z | F_S | F_V);
+		if(r == 0x7f) {
+			f |= F_V;
+		}
+		goto zs;
+	case un_da:
+		r = d;
+		if(!(f & F_D)) {
+			if((f & F_H) || (d & 0x0f) > 0x09) {
+				r += 0x06;
+			}
+			if((f & F_C) || d > 0x99) {
+				r += 0x60;
+				c = 1;
+			}
+		} else {
+			if(f & F_H) {
+				r -= 0x06;
+			}
+			if(f & F_C) {
+				r -= 0x60;
+				c = 1;
+			}
+		}
+		f &= ~(F_C | F_Z | F_S);
+		if(c) {
+			f |= F_C;
+		}
+		goto zs;
+	case un_com:
+		r = ~d;
+		f &= ~(F_Z | F_S | F_V);
+		goto zs;
+	case un_swap:
+		r = (d << 4) | (d >> 4);
+		f &= ~(F_Z | F_S);
+		goto zs;
+	case un_bswap:
+		r = 0;
+		for(i=0; i<8; i++) {
+			if(d & (1 << i)) {
+				r |= 0x80 >> i;
+			}
+		}
+		*result = r;
+		return 1;
+	case un_clr:
+	default:
+		*result = 0;
+		return 1;
+	}
+
+	/* rotates and shifts */
+	f &= ~(F_C | F_Z | F_S | F_V);
+	if(c) {
+		f |= F_C;
+	}
+	if((d ^ r) & 0x80) {
+		f |= F_V;
+	}
+
+zs:
+	if(!r) {
+		f |= F_Z;
+	}
+	if(r & 0x80) {
+		f |= F_S;
+	}
+	FLAGS(sim) = f;
+	*result = r;
+
+	return 1;
+}
+
+/**************************************************************
+ * This will find the destination register and source data of
+ * a two operand instruction. It returns 0 if the addressing
+ * mode does not have them.
+ */
+
+static int operands(struct ez8sim *sim, const uint8_t *op, int am,
+	uint16_t *dst, uint8_t *src)
+{
+	uint8_t hi, lo;
+
+	hi = op[1] >> 4;
+	lo = op[1] & 0x0f;
+
+	switch(am) {
+	case am_r1_r2:
+		*src = rd(sim, W(sim, lo));
+		*dst = W(sim, hi);
+		break;
+	case am_r1_Ir2:
+		*src = rd(sim, R8(sim, rd(sim, W(sim, lo))));
+		*dst = W(sim, hi);
+		break;
+	case am_Ir1_r2:
+		*src = rd(sim, W(sim, lo));
+		*dst = R8(sim, rd(sim, W(sim, hi)));
+		break;
+	case am_R2_R1:
+		*src = rd(sim, R8(sim, op[1]));
+		*dst = R8(sim, op[2]);
+		break;
+	case am_IR2_R1:
+		*src = rd(sim, R8(sim, rd(sim, R8(sim, op[1]))));
+		*dst = R8(sim, op[2]);
+		break;
+	case am_R2_IR1:
+		*src = rd(sim, R8(sim, op[1]));
+		*dst = R8(sim, rd(sim, R8(sim, op[2])));
+		break;
+	case am_R1_IM:
+		*src = op[2];
+		*dst = R8(sim, op[1]);
+		break;
+	case am_IR1_IM:
+		*src = op[2];
+		*dst = R8(sim, rd(sim, R8(sim, op[1])));
+		break;
+	case am_r1_IM:
+		*src = op[1];
+		*dst = W(sim, op[0] >> 4);
+		break;
+	case am_ER2_ER1:
+		*src = rd(sim, ER(sim, (op[1] << 4) | (op[2] >> 4)));
+		*dst = ER(sim, ((op[2] & 0x0f) << 8) | op[3]);
+		break;
+	case am_IM_ER1:
+		*src = op[1];
+		*dst = ER(sim, ((op[2] & 0x0f) << 8) | op[3]);
+		break;
+	case am_r1_ER2:
+		*src = rd(sim, ER(sim, (lo << 8) | op[2]));
+		*dst = W(sim, hi);
+		break;
+	case am_r2_ER1:
+		*src = rd(sim, W(sim, hi));
+		*dst = ER(sim, (lo << 8) | op[2]);
+		break;
+	case am_Ir1_ER2:
+		*src = rd(sim, ER(sim, (lo << 8) | op[2]));
+		*dst = R8(sim, rd(sim, W(sim, hi)));
+		break;
+	case am_Ir2_ER1:
+		*src = rd(sim, R8(sim, rd(sim, W(sim, hi))));
+		*dst = ER(sim, (lo << 8) | op[2]);
+		break;
+	case am_IRR2_R1:
+		*src = rd(sim, rd16(sim, RR(sim, op[1])) & 0xfff);
+		*dst = R8(sim, op[2]);
+		break;
+	case am_R2_IRR1:
+		*src = rd(sim, R8(sim, op[1]));
+		*dst = rd16(sim, RR(sim, op[2])) & 0xfff;
+		break;
+	case am_IRR2_IR1:
+		*src = rd(sim, rd16(sim, RR(sim, op[1])) & 0xfff);
+		*dst = R8(sim, rd(sim, R8(sim, op[2])));
+		break;
+	case am_IR2_IRR1:
+		*src = rd(sim, R8(sim, rd(sim, R8(sim, op[1]))));
+		*dst = rd16(sim, RR(sim, op[2])) & 0xfff;
+		break;
+	case am_r1_r2_X:
+		*src = rd(sim, R8(sim, (uint8_t)(rd(sim, W(sim, lo)) + op[2])));
+		*dst = W(sim, hi);
+		break;
+	case am_r2_r1_X:
+		*src = rd(sim, W(sim, hi));
+		*dst = R8(sim, (uint8_t)(rd(sim, W(sim, lo)) + op[2]));
+		break;
+	case am_r1_rr2_X:
+		*src = rd(sim, (rd16(sim, W(sim, lo & 0x0e)) +
+		    (int8_t)op[2]) & 0xfff);
+		*dst = W(sim, hi);
+		break;
+	case am_rr1_r2_X:
+		*src = rd(sim, W(sim, lo));
+		*dst = (rd16(sim, W(sim, hi & 0x0e)) + (int8_t)op[2]) & 0xfff;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/**************************************************************
+ * This will find the register of a single operand instruction.
+ */
+
+static uint16_t operand(struct ez8sim *sim, const uint8_t *op, int am)
+{
+	switch(am) {
+	case am_r1:
+		return W(sim, op[0] >> 4);
+	case am_IR1:
+		return R8(sim, rd(sim, R8(sim, op[1])));
+	case am_RR1:
+		return RR(sim, op[1]);
+	case am_IRR1:
+		return RR(sim, rd(sim, R8(sim, op[1])));
+	case am_ER1:
+		return ER(sim, (op[1] << 4) | (op[2] >> 4));
+	case am_R1:
+	default:
+		return R8(sim, op[1]);
+	}
+}
+
+/**************************************************************
+ * Instructions.
+ */
+
+static void exec_nop(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	return;
+}
+
+static void exec_alu(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t dst;
+	uint8_t src, r;
+
+	if(operands(sim, op, e->am, &dst, &src) &&
+	    alu(sim, e->arg, rd(sim, dst), src, &r)) {
+		wr(sim, dst, r);
+	}
+
+	return;
+}
+
+static void exec_unary(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr;
+	uint8_t r;
+
+	addr = operand(sim, op, e->am);
+	if(unary(sim, e->arg, e->arg == un_clr ? 0 : rd(sim, addr), &r)) {
+		wr(sim, addr, r);
+	}
+
+	return;
+}
+
+static void exec_ld(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t dst;
+	uint8_t src;
+
+	if(operands(sim, op, e->am, &dst, &src)) {
+		wr(sim, dst, src);
+	}
+
+	return;
+}
+
+static void exec_lea(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint8_t hi, lo;
+
+	hi = op[1] >> 4;
+	lo = op[1] & 0x0f;
+
+	if(e->am == am_rr1_rr2_X) {
+		wr16(sim, W(sim, hi & 0x0e),
+		    rd16(sim, W(sim, lo & 0x0e)) + (int8_t)op[2]);
+	} else {
+		wr(sim, W(sim, hi), rd(sim, W(sim, lo)) + op[2]);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will load between registers and data memory (lde) or
+ * program memory (ldc). The arg is 1 for the auto increment
+ * forms, plus 2 for program memory.
+ */
+
+static void exec_ldmem(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t reg, pair, addr;
+	uint8_t hi, lo;
+	int to_mem;
+
+	hi = op[1] >> 4;
+	lo = op[1] & 0x0f;
+
+	switch(e->am) {
+	case am_r1_Irr2:
+		reg = W(sim, hi);
+		pair = W(sim, lo & 0x0e);
+		to_mem = 0;
+		break;
+	case am_r2_Irr1:
+		reg = W(sim, hi);
+		pair = W(sim, lo & 0x0e);
+		to_mem = 1;
+		break;
+	case am_Ir1_Irr2:
+		reg = R8(sim, rd(sim, W(sim, hi)));
+		pair = W(sim, lo & 0x0e);
+		to_mem = 0;
+		break;
+	case am_Ir2_Irr1:
+	default:
+		reg = R8(sim, rd(sim, W(sim, hi)));
+		pair = W(sim, lo & 0x0e);
+		to_mem = 1;
+		break;
+	}
+
+	addr = rd16(sim, pair);
+	if(e->arg & 2) {
+		if(to_mem) {
+			ez8sim_wr_mem(sim, addr, rd(sim, reg));
+		} else {
+			wr(sim, reg, ez8sim_rd_mem(sim, addr));
+		}
+	} else {
+		if(to_mem) {
+			sim->data[addr] = rd(sim, reg);
+		} else {
+			wr(sim, reg, sim->data[addr]);
+		}
+	}
+
+	if(e->arg & 1) {
+		wr(sim, W(sim, hi), rd(sim, W(sim, hi)) + 1);
+		wr16(sim, pair, addr + 1);
+	}
+
+	return;
+}
+
+static void exec_push(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	push(sim, rd(sim, operand(sim, op, e->am)));
+
+	return;
+}
+
+static void exec_pop(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint8_t data;
+
+	data = pop(sim);
+	wr(sim, operand(sim, op, e->am), data);
+
+	return;
+}
+
+/* incw and decw, arg is 1 for incw */
+static void exec_word(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr, r;
+	uint8_t f;
+
+	addr = operand(sim, op, e->am);
+	r = rd16(sim, addr) + (e->arg ? 1 : -1);
+	wr16(sim, addr, r);
+
+	f = FLAGS(sim) & ~(F_Z | F_S | F_V);
+	if(!r) {
+		f |= F_Z;
+	}
+	if(r & 0x8000) {
+		f |= F_S;
+	}
+	if(r == (e->arg ? 0x8000 : 0x7fff)) {
+		f |= F_V;
+	}
+	FLAGS(sim) = f;
+
+	return;
+}
+
+static void exec_mult(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr;
+
+	addr = operand(sim, op, e->am);
+	wr16(sim, addr, rd(sim, addr) * rd(sim, (addr + 1) & 0xfff));
+
+	return;
+}
+
+static void exec_srp(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	RP(sim) = op[1];
+
+	return;
+}
+
+static void exec_bit(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr;
+	uint8_t bit;
+
+	addr = W(sim, op[1] & 0x0f);
+	bit = 1 << ((op[1] >> 4) & 0x07);
+	if(op[1] & 0x80) {
+		wr(sim, addr, rd(sim, addr) | bit);
+	} else {
+		wr(sim, addr, rd(sim, addr) & ~bit);
+	}
+
+	return;
+}
+
+static void exec_btj(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr;
+	int bit;
+
+	addr = W(sim, op[1] & 0x0f);
+	if(e->am == am_p_bit_Ir1_RA) {
+		addr = R8(sim, rd(sim, addr));
+	}
+	bit = (rd(sim, addr) >> ((op[1] >> 4) & 0x07)) & 1;
+	if(bit == op[1] >> 7) {
+		sim->pc += (int8_t)op[2];
+	}
+
+	return;
+}
+
+static void exec_djnz(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t addr;
+	uint8_t r;
+
+	addr = W(sim, op[0] >> 4);
+	r = rd(sim, addr) - 1;
+	wr(sim, addr, r);
+	if(r) {
+		sim->pc += (int8_t)op[1];
+	}
+
+	return;
+}
+
+static void exec_jp(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	switch(e->am) {
+	case am_cc_RA:
+		if(cond(sim, op[0] >> 4)) {
+			sim->pc += (int8_t)op[1];
+		}
+		break;
+	case am_cc_DA:
+		if(cond(sim, op[0] >> 4)) {
+			sim->pc = (op[1] << 8) | op[2];
+		}
+		break;
+	case am_IRR1:
+	default:
+		sim->pc = rd16(sim, RR(sim, op[1]));
+		break;
+	}
+
+	return;
+}
+
+static void exec_call(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t target;
+
+	if(e->am == am_DA) {
+		target = (op[1] << 8) | op[2];
+	} else {
+		target = rd16(sim, RR(sim, op[1]));
+	}
+	push(sim, sim->pc & 0xff);
+	push(sim, sim->pc >> 8);
+	sim->pc = target;
+
+	return;
+}
+
+static void exec_trap(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t vector;
+
+	vector = op[1] << 1;
+	push(sim, sim->pc & 0xff);
+	push(sim, sim->pc >> 8);
+	push(sim, FLAGS(sim));
+	sim->pc = (sim->mem[vector] << 8) | sim->mem[(vector + 1) & 0xffff];
+
+	return;
+}
+
+static void exec_ret(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	uint16_t pc;
+
+	/* iret also pops the flags, and enables interrupts */
+	if(e->arg) {
+		FLAGS(sim) = pop(sim);
+		sim->regs[EZ8_IRQCTL] |= 0x80;
+	}
+	pc = pop(sim) << 8;
+	pc |= pop(sim);
+	sim->pc = pc;
+
+	return;
+}
+
+static void exec_halt(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	sim->halted = 1;
+
+	return;
+}
+
+/* di and ei, arg is 1 for ei */
+static void exec_irq(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	if(e->arg) {
+		sim->regs[EZ8_IRQCTL] |= 0x80;
+	} else {
+		sim->regs[EZ8_IRQCTL] &= ~0x80;
+	}
+
+	return;
+}
+
+/* rcf, scf and ccf */
+static void exec_carry(struct ez8sim *sim, const uint8_t *op,
+	const struct sim_op *e)
+{
+	switch(e->arg) {
+	case 0:
+		FLAGS(sim) &= ~F_C;
+		break;
+	case 1:
+		FLAGS(sim) |= F_C;
+		break;
+	default:
+		FLAGS(sim) ^= F_C;
+		break;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will build the decode tables from the opcode lists.
+ * Illegal opcodes execute as one byte nops, the same size the
+ * disassembler gives them.
+ */
+
+static const struct {
+	const char *mnemonic;
+	sim_exec exec;
+	uint8_t arg;
+} handlers[] = {
+	{ "add",   exec_alu,   alu_add },
+	{ "addx",  exec_alu,   alu_add },
+	{ "adc",   exec_alu,   alu_adc },
+	{ "adcx",  exec_alu,   alu_adc },
+	{ "sub",   exec_alu,   alu_sub },
+	{ "subx",  exec_alu,   alu_sub },
+	{ "sbc",   exec_alu,   alu_sbc },
+	{ "sbcx",  exec_alu,   alu_sbc },
+	{ "or",    exec_alu,   alu_or },
+	{ "orx",   exec_alu,   alu_or },
+	{ "and",   exec_alu,   alu_and },
+	{ "andx",  exec_alu,   alu_and },
+	{ "tcm",   exec_alu,   alu_tcm },
+	{ "tcmx",  exec_alu,   alu_tcm },
+	{ "tm",    exec_alu,   alu_tm },
+	{ "tmx",   exec_alu,   alu_tm },
+	{ "cp",    exec_alu,   alu_cp },
+	{ "cpx",   exec_alu,   alu_cp },
+	{ "cpc",   exec_alu,   alu_cpc },
+	{ "cpcx",  exec_alu,   alu_cpc },
+	{ "xor",   exec_alu,   alu_xor },
+	{ "xorx",  exec_alu,   alu_xor },
+	{ "rlc",   exec_unary, un_rlc },
+	{ "inc",   exec_unary, un_inc },
+	{ "dec",   exec_unary, un_dec },
+	{ "da",    exec_unary, un_da },
+	{ "com",   exec_unary, un_com },
+	{ "rl",    exec_unary, un_rl },
+	{ "clr",   exec_unary, un_clr },
+	{ "rrc",   exec_unary, un_rrc },
+	{ "sra",   exec_unary, un_sra },
+	{ "srl",   exec_unary, un_srl },
+	{ "rr",    exec_unary, un_rr },
+	{ "swap",  exec_unary, un_swap },
+	{ "bswap", exec_unary, un_bswap },
+	{ "ld",    exec_ld,    0 },
+	{ "ldx",   exec_ld,    0 },
+	{ "lea",   exec_lea,   0 },
+	{ "leax",  exec_lea,   0 },
+	{ "lde",   exec_ldmem, 0 },
+	{ "ldei",  exec_ldmem, 1 },
+	{ "ldc",   exec_ldmem, 2 },
+	{ "ldci",  exec_ldmem, 3 },
+	{ "push",  exec_push,  0 },
+	{ "pushx", exec_push,  0 },
+	{ "pop",   exec_pop,   0 },
+	{ "popx",  exec_pop,   0 },
+	{ "decw",  exec_word,  0 },
+	{ "incw",  exec_word,  1 },
+	{ "mult",  exec_mult,  0 },
+	{ "srp",   exec_srp,   0 },
+	{ "bit",   exec_bit,   0 },
+	{ "btj",   exec_btj,   0 },
+	{ "djnz",  exec_djnz,  0 },
+	{ "jr",    exec_jp,    0 },
+	{ "jp",    exec_jp,    0 },
+	{ "call",  exec_call,  0 },
+	{ "trap",  exec_trap,  0 },
+	{ "ret",   exec_ret,   0 },
+	{ "iret",  exec_ret,   1 },
+	{ "halt",  exec_halt,  0 },
+	{ "stop",  exec_halt,  0 },
+	{ "di",    exec_irq,   0 },
+	{ "ei",    exec_irq,   1 },
+	{ "rcf",   exec_carry, 0 },
+	{ "scf",   exec_carry, 1 },
+	{ "ccf",   exec_carry, 2 },
+	{ NULL,    exec_nop,   0 }
+};
+
+extern int opcode_size(const struct opcode_t *);
+
+static void set_op(struct sim_op *e, const struct opcode_t *list,
+	uint8_t opcode, int prefix)
+{
+	int i;
+
+	e->exec = exec_nop;
+	e->am = am_none;
+	e->size = 1;
+	e->arg = 0;
+
+	for(; list->mnemonic; list++) {
+		if(list->opcode == opcode) {
+			break;
+		}
+	}
+
+	if(list->mnemonic) {
+		for(i=0; handlers[i].mnemonic; i++) {
+			if(!strcmp(list->mnemonic, handlers[i].mnemonic)) {
+				e->exec = handlers[i].exec;
+				e->arg = handlers[i].arg;
+				break;
+			}
+		}
+		e->am = list->am;
+		e->size = prefix + opcode_size(list);
+	}
+	e->cycles = e->size + 1;
+
+	return;
+}
+
+static void build_tables(void)
+{
+	int i;
+	uint8_t opcode;
+
+	for(i=0; i<256; i++) {
+		opcode = i;
+		if((opcode & 0x0f) >= 0x0a && (opcode & 0x0f) <= 0x0e) {
+			opcode &= 0x0f;
+		}
+		set_op(&op_table[i], z9_opcodes, opcode, 0);
+		set_op(&alt_table[i], z9_alt_opcodes, i, 1);
+	}
+	tables_built = 1;
+
+	return;
+}
+
+/**************************************************************
+ * This will execute the instruction at op, which is at the pc.
+ * It returns the number of cycles taken.
+ */
+
+static int execute(struct ez8sim *sim, const uint8_t *op)
+{
+	const struct sim_op *e;
+
+	if(op[0] == ALT_OPCODE) {
+		e = &alt_table[op[1]];
+		op++;
+	} else {
+		e = &op_table[op[0]];
+	}
+
+	sim->naccess = 0;
+	sim->pc += e->size;
+	e->exec(sim, op, e);
+	sim->insts++;
+
+	return e->cycles;
+}
+
+/**************************************************************
+ * This will return the instruction at the pc. Near the end of
+ * memory, it is copied to buff so it can wrap around.
+ */
+
+static const uint8_t *fetch(struct ez8sim *sim, uint8_t *buff)
+{
+	int i;
+
+	if(sim->pc <= EZ8MEM_SIZE - SIM_FETCH) {
+		return sim->mem + sim->pc;
+	}
+
+	for(i=0; i<SIM_FETCH; i++) {
+		buff[i] = sim->mem[(sim->pc + i) & 0xffff];
+	}
+
+	return buff;
+}
+
+/**************************************************************
+ * This will write the trace frames of an instruction, one for
+ * the instruction with its first register access, and one for
+ * each access after that. It returns non-zero if an event that
+ * breaks matched one of them.
+ */
+
+static int trace(struct ez8sim *sim, uint16_t pc)
+{
+	struct ez8sim_event *ev;
+	uint8_t *f;
+	uint16_t sp, word;
+	int i, j, k, count, brk;
+
+	sp = (sim->regs[EZ8_SPH] << 8) | sim->regs[EZ8_SPL];
+	count = sim->naccess ? sim->naccess : 1;
+	brk = 0;
+
+	for(i=0; i<count; i++) {
+		f = sim->trce_buff + sim->trce_wr * EZ8SIM_TRCE_FRAME;
+		word = i ? 0 : TRCE_CYCLE_INST;
+		if(i < sim->naccess) {
+			word |= sim->access[i];
+			f[4] = sim->access_data[i];
+		} else {
+			f[4] = 0;
+		}
+		f[0] = sp >> 8;
+		f[1] = sp;
+		f[2] = word >> 8;
+		f[3] = word;
+		f[5] = FLAGS(sim);
+		f[6] = i ? 0 : pc >> 8;
+		f[7] = i ? 0 : pc;
+		sim->trce_wr++;
+
+		if(!sim->trce_armed) {
+			continue;
+		}
+		for(j=0; j<TRCE_EVENTS; j++) {
+			ev = &sim->events[j];
+			if(!(ev->ctl & TRCEEVENT_ENABLE)) {
+				continue;
+			}
+			for(k=0; k<6; k++) {
+				if((f[k+2] ^ ev->data[k]) & ev->mask[k]) {
+					break;
+				}
+			}
+			if(k == 6) {
+				sim->trce_status |= TRCESTAT_EVENT << j;
+				if(ev->ctl & TRCEEVENT_BREAK) {
+					brk = 1;
+				}
+			}
+		}
+	}
+
+	return brk;
+}
+
+/**************************************************************
+ * This will create a part with blank memory, stopped in debug
+ * mode.
+ */
+
+struct ez8sim *ez8sim_new(void)
+{
+	struct ez8sim *sim;
+
+	if(!tables_built) {
+		build_tables();
+	}
+
+	sim = (struct ez8sim *)xmalloc(sizeof(struct ez8sim));
+	memset(sim, 0, sizeof(struct ez8sim));
+	memset(sim->mem, 0xff, EZ8MEM_SIZE);
+	memset(sim->info, 0xff, EZ8MEM_PAGESIZE);
+	memset(sim->data, 0xff, EZ8MEM_SIZE);
+
+	sim->trce_buff = (uint8_t *)xmalloc(EZ8SIM_TRCE_DEPTH *
+	    EZ8SIM_TRCE_FRAME);
+	memset(sim->trce_buff, 0, EZ8SIM_TRCE_DEPTH * EZ8SIM_TRCE_FRAME);
+
+	sim->dbgctl = DBGCTL_DBG_MODE;
+	ez8sim_reset(sim);
+
+	return sim;
+}
+
+void ez8sim_free(struct ez8sim *sim)
+{
+	if(!sim) {
+		return;
+	}
+
+	free(sim->trce_buff);
+	free(sim);
+
+	return;
+}
+
+/**************************************************************
+ * This will reset the part. It starts at the reset vector,
+ * and latches the read protect option bit.
+ */
+
+void ez8sim_reset(struct ez8sim *sim)
+{
+	assert(sim != NULL);
+
+	sim->pc = (sim->mem[0x0002] << 8) | sim->mem[0x0003];
+	sim->halted = 0;
+
+	sim->regs[EZ8_FLAGS] = 0x00;
+	sim->regs[EZ8_RP] = 0x00;
+	sim->regs[EZ8_SPH] = 0x00;
+	sim->regs[EZ8_SPL] = 0x00;
+	sim->regs[EZ8_IRQCTL] = 0x00;
+
+	sim->fstat = FSTAT_LOCKED;
+	sim->fps = 0x00;
+	sim->fprot = 0x00;
+
+	sim->protect = !(sim->mem[0x0000] & OPTION_RP);
+
+	return;
+}
+
+/**************************************************************
+ * This will write the debug control register. Clearing debug
+ * mode runs the cpu, clearing the counter unless it is used
+ * for a breakpoint.
+ */
+
+void ez8sim_wr_dbgctl(struct ez8sim *sim, uint8_t data)
+{
+	int stopped;
+
+	stopped = sim->dbgctl & DBGCTL_DBG_MODE;
+
+	if(data & DBGCTL_RST) {
+		ez8sim_reset(sim);
+		data &= ~DBGCTL_RST;
+	}
+	sim->dbgctl = data;
+
+	if(stopped && !(data & DBGCTL_DBG_MODE)) {
+		if(!(data & (DBGCTL_BRK_PC | DBGCTL_BRK_CNTR))) {
+			sim->cntr = 0;
+		}
+		sim->trce_status = 0;
+	}
+
+	return;
+}
+
+uint8_t ez8sim_rd_dbgstat(const struct ez8sim *sim)
+{
+	uint8_t stat;
+
+	stat = 0;
+	if(sim->dbgctl & DBGCTL_DBG_MODE) {
+		stat |= DBGSTAT_STOPPED;
+	}
+	if(sim->halted) {
+		stat |= DBGSTAT_HALT_MODE;
+	}
+	if(sim->protect) {
+		stat |= DBGSTAT_RD_PROTECT;
+	}
+
+	return stat;
+}
+
+/**************************************************************
+ * These read and write registers for the debugger. They are
+ * not traced.
+ */
+
+uint8_t ez8sim_rd_reg(struct ez8sim *sim, uint16_t addr)
+{
+	addr &= EZ8REG_SIZE - 1;
+	if(addr >= EZ8_FIF_BASE && addr < EZ8_FIF_BASE + 4) {
+		return fif_read(sim, addr);
+	}
+
+	return sim->regs[addr];
+}
+
+void ez8sim_wr_reg(struct ez8sim *sim, uint16_t addr, uint8_t data)
+{
+	addr &= EZ8REG_SIZE - 1;
+	if(addr >= EZ8_FIF_BASE && addr < EZ8_FIF_BASE + 4) {
+		fif_write(sim, addr, data);
+	} else {
+		sim->regs[addr] = data;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * These read and program flash. The information area is at
+ * the last page while it is selected. Programming only clears
+ * bits, and only while the flash controller is unlocked.
+ */
+
+uint8_t ez8sim_rd_mem(const struct ez8sim *sim, uint16_t addr)
+{
+	if((sim->fps & 0x80) && addr >= EZ8MEM_SIZE - EZ8MEM_PAGESIZE) {
+		return sim->info[addr & (EZ8MEM_PAGESIZE - 1)];
+	}
+
+	return sim->mem[addr];
+}
+
+void ez8sim_wr_mem(struct ez8sim *sim, uint16_t addr, uint8_t data)
+{
+	if(sim->fstat != EZ8_FIF_UNLOCKED) {
+		return;
+	}
+
+	if((sim->fps & 0x80) && addr >= EZ8MEM_SIZE - EZ8MEM_PAGESIZE) {
+		sim->info[addr & (EZ8MEM_PAGESIZE - 1)] &= data;
+	} else {
+		sim->mem[addr] &= data;
+	}
+
+	return;
+}
+
+uint16_t ez8sim_crc(struct ez8sim *sim)
+{
+	return crc_ccitt(0x0000, sim->mem, EZ8MEM_SIZE);
+}
+
+/**************************************************************/
+
+void ez8sim_wr_event(struct ez8sim *sim, int num,
+	const struct ez8sim_event *event)
+{
+	int i;
+
+	assert(num >= 0 && num < TRCE_EVENTS);
+
+	sim->events[num] = *event;
+
+	sim->trce_armed = 0;
+	for(i=0; i<TRCE_EVENTS; i++) {
+		if(sim->events[i].ctl & TRCEEVENT_ENABLE) {
+			sim->trce_armed = 1;
+		}
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will step one instruction, while in debug mode. If
+ * opcode is not negative, it is used instead of the first
+ * byte in memory. A breakpoint instruction is not stepped.
+ * It returns the number of cycles taken.
+ */
+
+int ez8sim_step(struct ez8sim *sim, int opcode)
+{
+	uint8_t buff[SIM_FETCH];
+	const uint8_t *op;
+	uint16_t pc;
+	int cycles;
+
+	op = fetch(sim, buff);
+	if(opcode >= 0) {
+		if(op != buff) {
+			memcpy(buff, op, SIM_FETCH);
+		}
+		buff[0] = opcode;
+		op = buff;
+	}
+	if(op[0] == 0x00 && (sim->dbgctl & DBGCTL_BRK_EN)) {
+		return 0;
+	}
+
+	sim->halted = 0;
+	pc = sim->pc;
+	cycles = execute(sim, op);
+	trace(sim, pc);
+	sim->cycles += cycles;
+
+	return cycles;
+}
+
+/**************************************************************
+ * This will execute an instruction that is not in memory. The
+ * pc is left where it was. The instruction must be padded to
+ * the longest instruction.
+ */
+
+int ez8sim_exec(struct ez8sim *sim, const uint8_t *inst)
+{
+	uint16_t pc;
+	int cycles;
+
+	pc = sim->pc;
+	cycles = execute(sim, inst);
+	sim->pc = pc;
+	sim->cycles += cycles;
+
+	return cycles;
+}
+
+/**************************************************************
+ * This will run the cpu for about the number of cycles given,
+ * or until a breakpoint stops it, and return why it stopped.
+ * When not used for a breakpoint, the counter counts the
+ * cycles run, up to ffff.
+ */
+
+enum ez8sim_stop ez8sim_run(struct ez8sim *sim, unsigned long cycles)
+{
+	uint8_t buff[SIM_FETCH];
+	const uint8_t *op;
+	enum ez8sim_stop stop;
+	unsigned long used;
+	uint16_t pc;
+	int n, brk;
+
+	assert(!(sim->dbgctl & DBGCTL_DBG_MODE));
+
+	stop = sim_running;
+	for(used=0; used<cycles && stop == sim_running; used+=n) {
+		if(sim->halted) {
+			n = cycles - used;
+			brk = 0;
+		} else {
+			pc = sim->pc;
+			if((sim->dbgctl & DBGCTL_BRK_PC) && pc == sim->cntr) {
+				stop = sim_brk_pc;
+				break;
+			}
+			op = fetch(sim, buff);
+			if(op[0] == 0x00 && (sim->dbgctl & DBGCTL_BRK_EN)) {
+				stop = sim_brk;
+				break;
+			}
+			n = execute(sim, op);
+			brk = trace(sim, pc);
+		}
+
+		if(sim->dbgctl & DBGCTL_BRK_CNTR) {
+			if(sim->cntr <= n) {
+				sim->cntr = 0;
+				stop = sim_brk_cntr;
+			} else {
+				sim->cntr -= n;
+			}
+		} else if(!(sim->dbgctl & DBGCTL_BRK_PC)) {
+			if(sim->cntr + n >= 0xffff) {
+				sim->cntr = 0xffff;
+			} else {
+				sim->cntr += n;
+			}
+		}
+
+		if(brk) {
+			stop = sim_brk_trce;
+		}
+	}
+	sim->cycles += used;
+
+	if(stop != sim_running) {
+		sim->dbgctl |= DBGCTL_DBG_MODE;
+	}
+
+	return stop;
+}
+
+/**************************************************************/
+
@@ -0,0 +1,104 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Simulator of an eZ8 cpu and its on-chip debugger.
+ */
+
+#ifndef	EZ8SIM_HEADER
+#define	EZ8SIM_HEADER
+
+#include	<stdlib.h>
+#include	<inttypes.h>
+
+#include	"ez8.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* the simulated part, a 64k emulator part with trace */
+#define	EZ8SIM_REVID		0x8130
+#define	EZ8SIM_MEMSIZE		0x06
+
+/* trace buffer frames, and bytes per frame */
+#define	EZ8SIM_TRCE_DEPTH	0x10000
+#define	EZ8SIM_TRCE_FRAME	8
+
+/* register accesses traced per instruction */
+#define	EZ8SIM_ACCESSES		4
+
+/* why the cpu stopped */
+enum ez8sim_stop {
+	sim_running,
+	sim_brk,		/* breakpoint instruction */
+	sim_brk_pc,		/* pc matched the counter */
+	sim_brk_cntr,		/* counter reached zero */
+	sim_brk_trce		/* trace event */
+};
+
+/* trace event comparator, mask and data as in bytes 2-7 of a
+ * trace frame */
+struct ez8sim_event {
+	uint8_t ctl;
+	uint8_t mask[6];
+	uint8_t data[6];
+};
+
+struct ez8sim {
+	uint8_t mem[EZ8MEM_SIZE];	/* program memory */
+	uint8_t info[EZ8MEM_PAGESIZE];	/* information area */
+	uint8_t data[EZ8MEM_SIZE];	/* data memory */
+	uint8_t regs[EZ8REG_SIZE];	/* register file */
+	uint16_t pc;
+	int halted;
+
+	/* flash controller */
+	uint8_t fstat;
+	uint8_t fps;
+	uint8_t fprot;
+
+	/* on-chip debugger */
+	uint8_t dbgctl;
+	uint16_t cntr;
+	int protect;
+	uint64_t cycles;
+	unsigned long insts;
+
+	/* trace buffer and events */
+	uint8_t trce_ctl;
+	uint8_t trce_status;
+	uint16_t trce_wr;
+	int trce_armed;
+	struct ez8sim_event events[TRCE_EVENTS];
+	uint8_t *trce_buff;
+
+	/* register accesses of the current instruction */
+	int naccess;
+	uint16_t access[EZ8SIM_ACCESSES];
+	uint8_t access_data[EZ8SIM_ACCESSES];
+};
+
+struct ez8sim *ez8sim_new(void);
+void ez8sim_free(struct ez8sim *);
+void ez8sim_reset(struct ez8sim *);
+
+void ez8sim_wr_dbgctl(struct ez8sim *, uint8_t);
+uint8_t ez8sim_rd_dbgstat(const struct ez8sim *);
+uint8_t ez8sim_rd_reg(struct ez8sim *, uint16_t);
+void ez8sim_wr_reg(struct ez8sim *, uint16_t, uint8_t);
+uint8_t ez8sim_rd_mem(const struct ez8sim *, uint16_t);
+void ez8sim_wr_mem(struct ez8sim *, uint16_t, uint8_t);
+uint16_t ez8sim_crc(struct ez8sim *);
+void ez8sim_wr_event(struct ez8sim *, int, const struct ez8sim_event *);
+
+int ez8sim_step(struct ez8sim *, int);
+int ez8sim_exec(struct ez8sim *, const uint8_t *);
+enum ez8sim_stop ez8sim_run(struct ez8sim *, unsigned long);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EZ8SIM_HEADER */
+
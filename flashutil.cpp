@@ -11,12 +11,17 @@
 #include	<ctype.h>
 #include	<string.h>
 #include	<assert.h>
+#include	<sys/time.h>
 #include	<readline/readline.h>
 #include	"xmalloc.h"
 
 #include	"ez8dbg.h"
 #include	"crc.h"
+#include	"image.h"
 #include	"hexfile.h"
+#include	"hexcache.h"
+#include	"journal.h"
+#include	"timer.h"
 #include	"version.h"
 
 /**************************************************************/
@@ -43,6 +48,9 @@
 
 #define	MEMSIZE	0x10000
 
+/* times to resume a journaled job after a link error */
+#define	JOURNAL_RETRIES	3
+
 /**************************************************************/
 
 static const char *banner = "Z8 Encore! Flash Utility";
@@ -59,9 +67,15 @@ static int zero_fill = 0;
 static int crc_size = -1;
 static int verbose = 0;
 static char *savefilename = NULL;
+static int save_blank = 1;
 static char *programfilename = NULL;
+static char *journalfilename = NULL;
+static struct journal *journal = NULL;
+static char *reportfilename = NULL;
+static FILE *report = NULL;
 
-static uint8_t *buff, *blank;
+static uint8_t *buff;
+static struct image *image;
 static uint16_t buff_crc, blank_crc;
 static int mem_size = 0;
 static int max_mem = 0;
@@ -70,6 +84,49 @@ static uint16_t serial_address;
 static uint32_t serial_number;
 static int serial_size;
 
+static const char *connected_port = NULL;
+
+/* memory areas to keep when programming */
+struct keep_area {
+	uint16_t address;
+	int size;
+};
+static struct keep_area *keep = NULL;
+static int num_keep = 0;
+
+static const char *erase_methods[] = { "blank", "page", "mass" };
+
+/* timing profile of current device */
+enum phase {
+	phase_connect,
+	phase_reset_chip,
+	phase_memory_size,
+	phase_erase,
+	phase_program,
+	phase_verify,
+	NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = {
+	"connect", "reset_chip", "memory_size", "erase", "program", "verify"
+};
+
+struct block_time {
+	uint16_t address;
+	size_t size;
+	long usec;
+};
+
+static struct {
+	int device;
+	long usec[NUM_PHASES];
+	struct block_time *blocks;
+	int num_blocks;
+	int retries;
+} profile;
+
+static struct timer phase_timer;
+
 /**************************************************************/
 
 char *serialport_selection[] = 
@@ -102,6 +159,7 @@ printf("  -n ADDR=NUMBER   serialize part at ADDR, starting with NUMBER\n");
 printf("  -e               erase device\n");
 printf("  -p SERIALPORT    specify serialport to use (default: %s)\n",
     DEFAULT_SERIALPORT);
+printf("                   (\"sim\" uses a blank simulated device)\n");
 printf("  -b BAUDRATE      use baudrate (default: %d)\n", 
     DEFAULT_BAUDRATE);
 printf("  -t MTU           maximum transmission unit (default %d)\n", 
@@ -109,7 +167,12 @@ printf("  -t MTU           maximum transmission unit (default %d)\n",
 printf("  -c FREQUENCY     clock frequency in hertz (default: %d)\n", 
     DEFAULT_XTAL);
 printf("  -s FILENAME      save memory to file\n");
+printf("    -x             leave blank memory out of saved file\n");
 printf("  -z               fill memory with 00 instead of FF\n");
+printf("  -j FILENAME      journal programming to FILENAME, resume if\n");
+printf("                   a previous job was interrupted\n");
+printf("  -J FILENAME      append JSON timing report to FILENAME\n");
+printf("  -k ADDR:SIZE     keep SIZE bytes of device memory at ADDR\n");
 printf("\n");
 
 return;
@@ -121,11 +184,12 @@ int setup(int argc, char **argv)
 {
 	int c;
 	char *last, *ptr, *s;
+	long address, size;
 	double clock;
 
 	progname = argv[0];
 	
-	while((c = getopt(argc, argv, "hiemn:p:b:c:s:t:zr:v")) != EOF) {
+	while((c = getopt(argc, argv, "hiemn:p:b:c:s:t:zr:vj:J:k:x")) != EOF) {
 		switch(c) {
 		case '?':
 			printf("Try '%s -h' for more information.\n", argv[0]);
@@ -218,6 +282,9 @@ int setup(int argc, char **argv)
 		case 'z':
 			zero_fill = 1;
 			break;
+		case 'x':
+			save_blank = 0;
+			break;
 		case 'r':
 			crc_size = strtol(optarg, &last, 0);
 			if(!last || last == optarg) {
@@ -236,6 +303,34 @@ int setup(int argc, char **argv)
 		case 'v':
 			verbose++;
 			break;
+		case 'j':
+			journalfilename = optarg;
+			break;
+		case 'J':
+			reportfilename = optarg;
+			break;
+		case 'k':
+			address = strtol(optarg, &last, 16);
+			if(!last || last == optarg || *last != ':') {
+				fprintf(stderr, "Invalid keep area '%s'\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			ptr = last+1;
+			size = strtol(ptr, &last, 0);
+			if(!last || last == ptr || *last != '\0' ||
+			    address < 0 || address >= MEMSIZE ||
+			    size <= 0 || size > MEMSIZE - address) {
+				fprintf(stderr, "Invalid keep area '%s'\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			keep = (struct keep_area *)xrealloc(keep, 
+			    (num_keep + 1) * sizeof(struct keep_area));
+			keep[num_keep].address = address;
+			keep[num_keep].size = size;
+			num_keep++;
+			break;
 		default:
 			abort();
 		}
@@ -265,18 +360,167 @@ int setup(int argc, char **argv)
 		return -1;
 	}
 
+	if(reportfilename) {
+		if(strcmp(reportfilename, "-") == 0) {
+			report = stdout;
+		} else {
+			report = fopen(reportfilename, "a");
+			if(!report) {
+				perror(reportfilename);
+				return -1;
+			}
+		}
+	}
+
 	dbg->mtu = mtu;
 
 	dbg->set_sysclk(xtal);
 
 	buff = (uint8_t *)xmalloc(MEMSIZE);
-	blank = (uint8_t *)xmalloc(MEMSIZE);
-
-	memset(blank, 0xff, MEMSIZE);
 
 	return 0;
 }
 
+/**************************************************************
+ * This will record the time of each flash block written.
+ */
+
+void profile_block(uint16_t address, size_t size, long usec)
+{
+	struct block_time *b;
+
+	profile.blocks = (struct block_time *)xrealloc(profile.blocks,
+	    (profile.num_blocks + 1) * sizeof(struct block_time));
+	b = &profile.blocks[profile.num_blocks++];
+	b->address = address;
+	b->size = size;
+	b->usec = usec;
+
+	return;
+}
+
+/**************************************************************
+ * This will start a new device profile.
+ */
+
+void profile_begin(void)
+{
+	int i;
+
+	profile.device++;
+	for(i=0; i<NUM_PHASES; i++) {
+		profile.usec[i] = -1;
+	}
+	profile.num_blocks = 0;
+	profile.retries = 0;
+
+	dbg->bytes_read = 0;
+	dbg->bytes_written = 0;
+	dbg->flash_callback = report ? profile_block : NULL;
+
+	return;
+}
+
+/**************************************************************
+ * These will time a phase of the current device.
+ */
+
+void phase_start(void)
+{
+	timerstart(&phase_timer);
+	return;
+}
+
+void phase_stop(enum phase phase)
+{
+	timerstop(&phase_timer);
+	profile.usec[phase] = timerusec(&phase_timer);
+	return;
+}
+
+/**************************************************************
+ * This will write a string in json format.
+ */
+
+static void json_string(FILE *file, const char *s)
+{
+	fputc('"', file);
+	for(; s && *s; s++) {
+		if(*s == '"' || *s == '\\') {
+			fprintf(file, "\\%c", *s);
+		} else if((unsigned char)*s < ' ') {
+			fprintf(file, "\\u%04x", *s);
+		} else {
+			fputc(*s, file);
+		}
+	}
+	fputc('"', file);
+
+	return;
+}
+
+/**************************************************************
+ * This will append the profile of the current device to the
+ * report, as a single line of json.
+ */
+
+void profile_report(int err)
+{
+	const char *sep;
+	int i;
+
+	if(!report) {
+		return;
+	}
+
+	fprintf(report, "{\"device\":%d,\"port\":", profile.device);
+	json_string(report, connected_port ? connected_port : serialport);
+	fprintf(report, ",\"baudrate\":%d,\"result\":\"%s\"", 
+	    baudrate, err ? "fail" : "ok");
+
+	if(mem_size) {
+		fprintf(report, ",\"memory_size\":%d", mem_size);
+	}
+	if(programfilename && mem_size) {
+		fprintf(report, ",\"crc\":\"%04x\"", buff_crc);
+	}
+
+	fprintf(report, ",\"times_us\":{");
+	sep = "";
+	for(i=0; i<NUM_PHASES; i++) {
+		if(profile.usec[i] >= 0) {
+			fprintf(report, "%s\"%s\":%ld", sep, phase_names[i], 
+			    profile.usec[i]);
+			sep = ",";
+		}
+	}
+
+	fprintf(report, "}");
+
+	if(profile.usec[phase_erase] >= 0) {
+		fprintf(report, ",\"erase\":{\"method\":\"%s\",\"pages\":%d,"
+		    "\"estimate_us\":%ld,\"actual_us\":%ld}",
+		    erase_methods[dbg->last_erase.method],
+		    dbg->last_erase.pages, dbg->last_erase.estimate,
+		    dbg->last_erase.actual);
+	}
+
+	fprintf(report, ",\"blocks\":[");
+	for(i=0; i<profile.num_blocks; i++) {
+		fprintf(report, "%s[%u,%u,%ld]", i ? "," : "",
+		    profile.blocks[i].address, 
+		    (unsigned int)profile.blocks[i].size,
+		    profile.blocks[i].usec);
+	}
+
+	fprintf(report, "],\"link\":{\"tx\":%lu,\"rx\":%lu}", 
+	    dbg->bytes_written, dbg->bytes_read);
+	fprintf(report, ",\"retries\":%d}\n", profile.retries);
+	fflush(report);
+
+	return;
+}
+
 /**************************************************************/
 
 int connect(void)
@@ -284,7 +528,18 @@ int connect(void)
 	int i;
 	char *port;
 
-	if(strcasecmp(serialport, "auto") == 0) {
+	if(strcasecmp(serialport, "sim") == 0) {
+		try {
+			dbg->connect_sim(NULL, xtal);
+			dbg->reset_link();
+		} catch(char *err) {
+			printf("Could not connect to simulator\n");
+			fprintf(stderr, "%s", err);
+			return -1;
+		}
+		connected_port = serialport;
+
+	} else if(strcasecmp(serialport, "auto") == 0) {
 
 		printf("Autoconnecting to device ... ");
 		fflush(stdout);
@@ -305,6 +560,7 @@ int connect(void)
 			}
 
 			printf("found on %s\n", port);
+			connected_port = port;
 			return 0;
 		}
 
@@ -329,6 +585,7 @@ int connect(void)
 			dbg->disconnect();
 			return -1;
 		}
+		connected_port = serialport;
 	}
 
 	return 0;
@@ -389,8 +646,9 @@ void serialize(void)
 		address--;
 		number >>= 8;
 	}
+	image_write(image, serial_address, buff + serial_address, serial_size);
 
-	buff_crc = crc_ccitt(0x0000, buff, mem_size);
+	buff_crc = image_crc(image, 0x0000, mem_size);
 	printf("Serial number: %0*x, crc: %04x\n", serial_size * 2, 
 	    serial_number, buff_crc);
 
@@ -399,10 +657,38 @@ void serialize(void)
 	return;
 }
 
+/**************************************************************
+ * Files named like S-record files are saved as S-records, 
+ * everything else as an intel hexfile.
+ */
+
+static const char *srec_suffixes[] = { 
+	".s19", ".s28", ".s37", ".srec", ".mot", NULL 
+};
+
+int save_flags(const char *filename)
+{
+	const char *suffix;
+	int i;
+
+	suffix = strrchr(filename, '.');
+	if(!suffix) {
+		return 0;
+	}
+	for(i=0; srec_suffixes[i]; i++) {
+		if(strcasecmp(suffix, srec_suffixes[i]) == 0) {
+			return HEXFILE_SREC;
+		}
+	}
+
+	return 0;
+}
+
 /**************************************************************/
 
 int save_file(const char *filename)
 {
+	struct image *img;
 	int err;
 	uint16_t crc;
 
@@ -452,7 +738,14 @@ int save_file(const char *filename)
 	printf("Saving file ... ");
 	fflush(stdout);
 
-	err = wr_hexfile(buff, mem_size, 0x0000, filename);
+	if(save_blank) {
+		err = wr_hexfile_fmt(buff, mem_size, 0x0000, filename, 
+		    save_flags(filename));
+	} else {
+		img = image_from_buffer(buff, mem_size, 0xff);
+		err = wr_hexfile_image(img, filename, save_flags(filename));
+		image_free(img);
+	}
 	if(err) {
 		printf("fail\n");
 		return -1;
@@ -466,29 +759,27 @@ int save_file(const char *filename)
 
 int load_file(const char *filename)
 {
-	int err;
-	uint8_t c;
-
 	assert(filename != NULL);
 
 	printf("Reading file: %s ... ", filename);
 	fflush(stdout);
 
-	memset(buff, zero_fill ? 0x00 : 0xff, MEMSIZE);
-
-	err = rd_hexfile(buff, MEMSIZE, filename);
-	if(err) {
+	image_free(image);
+	image = rd_hexfile_cached(filename, zero_fill ? 0x00 : 0xff, MEMSIZE);
+	if(!image) {
 		printf("fail\n");
 		return -1;
 	}
 	printf("ok\n");
 
-	/* find max used memory */
-	c = zero_fill ? 0x00 : 0xff;
-	for(max_mem=MEMSIZE-1; max_mem>0; max_mem--) {
-		if(buff[max_mem] != c) {
-			break;
-		}
+	/* find max used memory, explicit fill bytes are not used */
+	max_mem = image_end(image);
+	image_read(image, 0x0000, buff, max_mem);
+	while(max_mem > 0 && buff[max_mem - 1] == image->fill) {
+		max_mem--;
+	}
+	if(max_mem) {
+		max_mem--;
 	}
 
 	return 0;
@@ -511,10 +802,10 @@ int erase_device(void)
 			dbg->mass_erase(1);
 			dbg->reset_chip();
 			mem_size = dbg->memory_size();
-			blank_crc = crc_ccitt(0x0000, blank, mem_size);
+			blank_crc = crc_ccitt_fill(0x0000, 0xff, mem_size);
 		} else
 #endif
-			dbg->flash_mass_erase();
+			dbg->erase_mem(0x0000, mem_size);
 	} catch(char *err) {
 		printf("fail\n");
 		fprintf(stderr, "%s", err);
@@ -533,7 +824,18 @@ int erase_device(void)
 		}
 	}
 
-	printf("ok\n");
+	if(verbose) {
+		struct ez8dbg::erase_plan *plan = &dbg->last_erase;
+
+		printf("ok, %s erase", erase_methods[plan->method]);
+		if(plan->method == dbg->erase_pages) {
+			printf(" of %d pages", plan->pages);
+		}
+		printf(", estimated %ldms, actual %ldms\n", 
+		    plan->estimate / 1000, plan->actual / 1000);
+	} else {
+		printf("ok\n");
+	}
 
 	printf("Blank check ... ");
 	fflush(stdout);
@@ -553,31 +855,311 @@ int erase_device(void)
 		printf("ok, crc: %04x\n", crc);
 	}
 
+	if(journal) {
+		int page;
+
+		for(page=0; page<mem_size/JOURNAL_PAGESIZE; page++) {
+			journal_mark(journal, page, JOURNAL_ERASED);
+		}
+	}
+
 	return 0;
 }
 
+/**************************************************************
+ * This will read the areas to keep out of the device, and 
+ * merge them into the image. If the journal already records
+ * them, they are taken from the journal, since an interrupted
+ * job may have erased them already.
+ */
+
+int read_keep_areas(void)
+{
+	int i;
+
+	if(!num_keep) {
+		return 0;
+	}
+
+	printf("Reading areas to keep ... ");
+	fflush(stdout);
+
+	for(i=0; i<num_keep; i++) {
+		if(keep[i].address + keep[i].size > mem_size) {
+			printf("fail\n");
+			fprintf(stderr, 
+			    "ERROR: keep area out-of-range for device\n");
+			return -1;
+		}
+		if(journal && !journal_rd_keep(journal, keep[i].address,
+		    buff + keep[i].address, keep[i].size)) {
+			/* kept before the interrupted job */
+		} else {
+			try {
+				dbg->rd_mem(keep[i].address, 
+				    buff + keep[i].address, keep[i].size);
+			} catch(char *err) {
+				printf("fail\n");
+				fprintf(stderr, "%s", err);
+				return -1;
+			}
+			if(journal) {
+				journal_wr_keep(journal, keep[i].address,
+				    buff + keep[i].address, keep[i].size);
+			}
+		}
+		if(image) {
+			image_write(image, keep[i].address, 
+			    buff + keep[i].address, keep[i].size);
+		}
+	}
+
+	if(image) {
+		buff_crc = image_crc(image, 0x0000, mem_size);
+	}
+	printf("ok\n");
+
+	return 0;
+}
+
+/**************************************************************
+ * This will write the areas to keep back to the device, after
+ * erasing it.
+ */
+
+int write_keep_areas(void)
+{
+	int i;
+
+	if(!num_keep) {
+		return 0;
+	}
+
+	printf("Restoring areas to keep ... ");
+	fflush(stdout);
+
+	for(i=0; i<num_keep; i++) {
+		try {
+			dbg->wr_mem(keep[i].address, buff + keep[i].address,
+			    keep[i].size);
+		} catch(char *err) {
+			printf("fail\n");
+			fprintf(stderr, "%s", err);
+			return -1;
+		}
+	}
+
+	printf("ok\n");
+
+	return 0;
+}
+
+/**************************************************************
+ * The journal is keyed on the image without the areas to keep,
+ * as those are only known once they have been read out of the
+ * device (or the journal).
+ */
+
+uint16_t journal_key(void)
+{
+	uint8_t *data;
+	uint16_t crc;
+	int i;
+
+	data = (uint8_t *)xmalloc(mem_size);
+	image_read(image, 0x0000, data, mem_size);
+	for(i=0; i<num_keep; i++) {
+		if(keep[i].address + keep[i].size <= mem_size) {
+			memset(data + keep[i].address, image->fill, 
+			    keep[i].size);
+		}
+	}
+	crc = crc_ccitt(0x0000, data, mem_size);
+	free(data);
+
+	return crc;
+}
+
+/**************************************************************
+ * This will remove the journal, and start a new one.
+ */
+
+int restart_journal(void)
+{
+	journal_close(journal, 1);
+	journal = journal_open(journalfilename, journal_key(), mem_size);
+	if(!journal) {
+		return -1;
+	}
+
+	return read_keep_areas();
+}
+
+/**************************************************************
+ * This will read back the pages a resumed journal vouches for,
+ * and check them against the image (or a blank page, if only
+ * erased). If any page differs, the journal was recorded on 
+ * another device or the device was changed since, so the job
+ * starts over with a new journal, and the areas to keep are
+ * read from the device again.
+ */
+
+int check_journal(void)
+{
+	uint8_t data[JOURNAL_PAGESIZE];
+	uint16_t addr, crc;
+	int page, state;
+
+	printf("Checking journal ... ");
+	fflush(stdout);
+
+	if(dbg->state(dbg->state_protected)) {
+		printf("fail, memory read protect is enabled\n");
+		return restart_journal();
+	}
+
+	for(page=0; page<mem_size/JOURNAL_PAGESIZE; page++) {
+		state = journal->page[page];
+		if(!(state & JOURNAL_VERIFIED) && state != JOURNAL_ERASED) {
+			continue;
+		}
+
+		addr = page * JOURNAL_PAGESIZE;
+		try {
+			dbg->rd_mem(addr, data, JOURNAL_PAGESIZE);
+		} catch(char *err) {
+			printf("fail\n");
+			fprintf(stderr, "%s", err);
+			return -1;
+		}
+
+		if(state & JOURNAL_VERIFIED) {
+			crc = image_crc(image, addr, JOURNAL_PAGESIZE);
+		} else {
+			crc = crc_ccitt_fill(0x0000, 0xff, JOURNAL_PAGESIZE);
+		}
+		if(crc_ccitt(0x0000, data, JOURNAL_PAGESIZE) != crc) {
+			printf("fail, page %02x differs, starting over\n",
+			    page);
+			return restart_journal();
+		}
+	}
+
+	printf("ok\n");
+
+	return 0;
+}
+
+/**************************************************************
+ * This will open the programming journal for the current 
+ * image. A journal recorded for another image is not touched,
+ * and nothing is erased.
+ */
+
+int open_journal(void)
+{
+	if(!journalfilename) {
+		return 0;
+	}
+
+	journal = journal_open(journalfilename, journal_key(), mem_size);
+	if(!journal) {
+		return -1;
+	}
+
+	if(journal->mismatch) {
+		fprintf(stderr, "ERROR: journal %s was recorded for "
+		    "another image or device\n", journalfilename);
+		journal_close(journal, 0);
+		journal = NULL;
+		return -1;
+	}
+
+	if(journal->resumed) {
+		printf("Resuming from journal: %s\n", journalfilename);
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will close the programming journal.
+ */
+
+void close_journal(int done)
+{
+	journal_close(journal, done);
+	journal = NULL;
+	dbg->journal = NULL;
+
+	return;
+}
+
+/**************************************************************
+ * This will check a resumed journal against the device. If 
+ * it still holds what the journal records, the device does 
+ * not need to be erased first.
+ */
+
+int resume_journal(void)
+{
+	if(!journal || !journal->resumed) {
+		return 0;
+	}
+
+	return check_journal();
+}
+
 /**************************************************************/
 
 int program_device()
 {
 	uint16_t crc;
+	int retries;
 
 	printf("Programming device ... ");
 	fflush(stdout);
-	try {
-		dbg->wr_mem(0x0000, buff, 0x10000);
-	} catch(char *err) {
-		printf("fail\n");
-		fprintf(stderr, "%s", err);
-		return -1;
+
+	phase_start();
+	dbg->journal = journal;
+	retries = 0;
+	for(;;) {
+		try {
+			if(retries) {
+				dbg->reset_link();
+				dbg->stop();
+			}
+			if(image->fill == 0xff) {
+				dbg->wr_image(image);
+			} else {
+				image_read(image, 0x0000, buff, MEMSIZE);
+				dbg->wr_mem(0x0000, buff, MEMSIZE);
+			}
+			break;
+		} catch(char *err) {
+			if(!journal || retries >= JOURNAL_RETRIES) {
+				printf("fail\n");
+				fprintf(stderr, "%s", err);
+				return -1;
+			}
+			printf("fail\n");
+			fprintf(stderr, "%s", err);
+			printf("Resuming ... ");
+			fflush(stdout);
+			retries++;
+			profile.retries++;
+		}
 	}
+	phase_stop(phase_program);
  
 	printf("ok\n");
 
 	printf("Verifying ... ");
 	fflush(stdout);
 	try {
+		phase_start();
 		crc = dbg->rd_crc();
+		phase_stop(phase_verify);
 	} catch(char *err) {
 		printf("fail\n");
 		fprintf(stderr, "%s", err);
@@ -586,6 +1168,9 @@ int program_device()
 
 	if(crc != buff_crc) {
 		printf("fail, crc: %04x\n", crc);
+		if(journal) {
+			journal_reset(journal);
+		}
 		return -1;
 	} else {
 		printf("ok, crc: %04x\n", crc);
@@ -596,11 +1181,13 @@ int program_device()
 
 /**************************************************************/
 
-int singlepassmode(void)
+int single_device(void)
 {
 	int err;
 
+	phase_start();
 	err = connect();
+	phase_stop(phase_connect);
 	if(err) {
 		return -1;
 	}
@@ -613,13 +1200,17 @@ int singlepassmode(void)
 	}
 
 	try {
+		phase_start();
 		dbg->reset_chip();
+		phase_stop(phase_reset_chip);
 	} catch(char *err) {
 		fprintf(stderr, "%s", err);
 		return -1;
 	}
 
+	phase_start();
 	mem_size = dbg->memory_size();
+	phase_stop(phase_memory_size);
 	printf("Memory size: %dk\n", mem_size / 1024);
 
 	if(info) {
@@ -654,19 +1245,54 @@ int singlepassmode(void)
 	}
 
 
+	if(programfilename) {
+		serialize();
+		buff_crc = image_crc(image, 0x0000, mem_size);
+	}
+
+	if(programfilename) {
+		err = open_journal();
+		if(err) {
+			return -1;
+		}
+	}
+
 	if(erase || programfilename) {
-		blank_crc = crc_ccitt(0x0000, blank, mem_size);
+		err = read_keep_areas();
+		if(err) {
+			close_journal(0);
+			return -1;
+		}
+	}
+
+	err = resume_journal();
+	if(err) {
+		close_journal(0);
+		return -1;
+	}
+
+	if((erase || programfilename) && !(journal && journal->resumed)) {
+		blank_crc = crc_ccitt_fill(0x0000, 0xff, mem_size);
 
+		phase_start();
 		err = erase_device();
+		phase_stop(phase_erase);
+		if(err) {
+			close_journal(0);
+			return -1;
+		}
+	}
+
+	if(erase && !programfilename) {
+		err = write_keep_areas();
 		if(err) {
 			return -1;
 		}
 	}
 
 	if(programfilename) {
-		serialize();
-		buff_crc = crc_ccitt(0x0000, buff, mem_size);
 		err = program_device();
+		close_journal(!err);
 		if(err) {
 			return -1;
 		}
@@ -677,12 +1303,117 @@ int singlepassmode(void)
 
 /**************************************************************/
 
+int singlepassmode(void)
+{
+	int err;
+
+	profile_begin();
+	err = single_device();
+	profile_report(err);
+
+	return err;
+}
+
+/**************************************************************/
+
+int multi_device(int *connected)
+{
+	int err;
+	int size;
+
+	try {
+		phase_start();
+		if(!*connected) {
+			if(connect()) {
+				return -1;
+			}
+			*connected = 1;
+		} else {
+			dbg->reset_link();
+		}
+		phase_stop(phase_connect);
+
+		dbg->stop();
+
+		phase_start();
+		dbg->reset_chip();
+		phase_stop(phase_reset_chip);
+
+		phase_start();
+		size = dbg->memory_size();
+		phase_stop(phase_memory_size);
+		printf("Memory size: %dk\n", size / 1024);
+
+		if(size <= max_mem) {
+			fprintf(stderr, 
+			    "ERROR: data out-of-range\n");
+			return -1;
+		}
+		if(size < serial_address + serial_size) {
+			fprintf(stderr, 
+			    "ERROR: serial address out-of-range\n");
+			return -1;
+		}
+
+		if(size != mem_size) {
+			blank_crc = crc_ccitt_fill(0x0000, 0xff, size);
+			buff_crc = image_crc(image, 0x0000, size);
+			mem_size = size;
+		}
+
+		serialize();
+
+		err = open_journal();
+		if(err) {
+			return -1;
+		}
+
+		err = read_keep_areas();
+		if(err) {
+			close_journal(1);
+			return -1;
+		}
+
+		err = resume_journal();
+		if(err) {
+			close_journal(1);
+			return -1;
+		}
+
+		/* The next device is another part, so the journal of
+		 * a failed device is removed rather than resumed. */
+		if(!(journal && journal->resumed)) {
+			phase_start();
+			err = erase_device();
+			phase_stop(phase_erase);
+			if(err) {
+				close_journal(1);
+				return -1;
+			}
+		}
+
+		err = program_device();
+		close_journal(1);
+		if(err) {
+			return -1;
+		}
+
+	} catch(char *err) {
+		fprintf(stderr, "%s", err);
+		close_journal(1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************/
+
 int multipassmode(void)
 {
 	int err;
 	int connected;
 	char *input;
-	int size;
 
 	printf("Multipass mode\n");
 	connected = 0;
@@ -704,57 +1435,9 @@ int multipassmode(void)
 		}
 		free(input);
 
-		try {
-			if(!connected) {
-				if(connect()) {
-					connected = 0;
-					continue;
-				} else {
-					connected = 1;
-				}
-			} else {
-				dbg->reset_link();
-			}
-
-			dbg->stop();
-			dbg->reset_chip();
-
-			size = dbg->memory_size();
-			printf("Memory size: %dk\n", size / 1024);
-
-			if(size <= max_mem) {
-				fprintf(stderr, 
-				    "ERROR: data out-of-range\n");
-				continue;
-			}
-			if(size < serial_address + serial_size) {
-				fprintf(stderr, 
-				    "ERROR: serial address out-of-range\n");
-				continue;
-			}
-
-			if(size != mem_size) {
-				blank_crc = crc_ccitt(0x0000, blank, size);
-				buff_crc = crc_ccitt(0x0000, buff, size);
-				mem_size = size;
-			}
-
-			err = erase_device();
-			if(err) {
-				continue;
-			}
-
-			serialize();
-
-			err = program_device();
-			if(err) {
-				continue;
-			}
-
-		} catch(char *err) {
-			fprintf(stderr, "%s", err);
-			continue;		
-		}
+		profile_begin();
+		err = multi_device(&connected);
+		profile_report(err);
 	} 
 
 	return 0;
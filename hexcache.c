@@ -0,0 +1,437 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This caches the images parsed from hexfiles, so loading the
+ * same file again does not parse it again.
+ *
+ * Images are kept in memory for the life of the process. If
+ * the EZ8_HEXCACHE environment variable names a directory,
+ * they are also saved there as binary blobs, so they survive
+ * from one run to the next.
+ *
+ * An entry is keyed by the path and size of the file, and by
+ * the md5 hash of its contents. The time stamps of a file are
+ * not trusted, since copying or unpacking a file can give it
+ * the time of the file it replaces. Hashing the file costs
+ * much less than parsing it.
+ *
+ * The crc of an image is not cached. Callers write serial
+ * numbers and kept memory into the image before taking it,
+ * and the size it covers depends on the part.
+ */
+
+#define		_GNU_SOURCE
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<errno.h>
+#include	<string.h>
+#include	<assert.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/types.h>
+#include	<sys/stat.h>
+#include	"xmalloc.h"
+
+#ifndef	_WIN32
+#define	HAVE_MMAP
+#include	<sys/mman.h>
+#endif
+
+#ifndef	O_BINARY
+#define	O_BINARY	0
+#endif
+
+#include	"md5.h"
+#include	"image.h"
+#include	"hexfile.h"
+#include	"hexcache.h"
+
+#define	HEXCACHE_MAGIC	"EZ8HEXC3"
+#define	HEXCACHE_SUFFIX	".ehc"
+
+/* the path is padded so the extents are aligned */
+#define	PATH_PAD(len)	(((len) + 3) & ~(size_t)3)
+
+struct hexcache_key {
+	uint64_t size;
+	uint32_t maxsize;
+	uint8_t fill;
+};
+
+struct hexcache_entry {
+	struct hexcache_entry *next;
+	char *path;
+	struct hexcache_key key;
+	uint8_t md5[16];
+	struct image *image;
+};
+
+/* blob file layout: header, padded path, extents, then data */
+struct hexcache_header {
+	char magic[8];
+	struct hexcache_key key;
+	uint8_t md5[16];
+	uint32_t pathlen;
+	uint32_t count;
+};
+
+struct hexcache_extent {
+	uint32_t address;
+	uint32_t size;
+};
+
+static struct hexcache_entry *entries = NULL;
+
+/**************************************************************
+ * This will get the cache key of a file.
+ */
+
+static int file_key(const char *filename, uint8_t fill, size_t maxsize,
+	struct hexcache_key *key)
+{
+	struct stat st;
+
+	if(stat(filename, &st)) {
+		return -1;
+	}
+
+	memset(key, 0, sizeof(struct hexcache_key));
+	key->size = st.st_size;
+	key->maxsize = maxsize;
+	key->fill = fill;
+
+	return 0;
+}
+
+/**************************************************************
+ * This will compute the md5 hash of a file.
+ */
+
+static int file_md5(const char *filename, uint8_t *digest)
+{
+	MD5_CTX ctx;
+	unsigned char buff[BUFSIZ];
+	ssize_t len;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if(fd == -1) {
+		return -1;
+	}
+
+	MD5Init(&ctx);
+	while((len = read(fd, buff, sizeof(buff))) > 0) {
+		MD5Update(&ctx, buff, len);
+	}
+	close(fd);
+	if(len < 0) {
+		return -1;
+	}
+	MD5Final(digest, &ctx);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will return the absolute path of a file, so the same
+ * file is found from any working directory.
+ */
+
+static char *abs_path(const char *filename)
+{
+#ifndef	_WIN32
+	char cwd[BUFSIZ];
+	char *path;
+
+	if(*filename != '/' && getcwd(cwd, sizeof(cwd))) {
+		path = (char *)xmalloc(strlen(cwd) + strlen(filename) + 2);
+		sprintf(path, "%s/%s", cwd, filename);
+		return path;
+	}
+#endif
+	return xstrdup(filename);
+}
+
+/**************************************************************
+ * This will return the name of the blob for a path, or NULL
+ * if there is no cache directory. The name is the md5 hash
+ * of the path.
+ */
+
+static char *blob_name(const char *path)
+{
+	MD5_CTX ctx;
+	uint8_t digest[16];
+	const char *dir;
+	char *name, *p;
+	int i;
+
+	dir = getenv(HEXCACHE_ENV);
+	if(!dir || !*dir) {
+		return NULL;
+	}
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, (unsigned char *)path, strlen(path));
+	MD5Final(digest, &ctx);
+
+	name = (char *)xmalloc(strlen(dir) + 1 + 32 +
+	    strlen(HEXCACHE_SUFFIX) + 1);
+	p = name + sprintf(name, "%s/", dir);
+	for(i=0; i<16; i++) {
+		p += sprintf(p, "%02x", digest[i]);
+	}
+	strcpy(p, HEXCACHE_SUFFIX);
+
+	return name;
+}
+
+/**************************************************************
+ * This will load an image from a blob, if the blob is for the
+ * same file and contents. It returns NULL otherwise.
+ */
+
+static struct image *rd_blob(const char *name, const char *path,
+	const struct hexcache_key *key, const uint8_t *md5)
+{
+	struct hexcache_header *head;
+	struct hexcache_extent *ext;
+	struct image *image;
+	struct stat st;
+	uint8_t *blob, *data;
+	size_t size, need;
+	uint32_t i;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if(fd == -1) {
+		return NULL;
+	}
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof(*head)) {
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+
+#ifdef	HAVE_MMAP
+	blob = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(blob == MAP_FAILED) {
+		return NULL;
+	}
+#else
+	blob = (uint8_t *)xmalloc(size);
+	if(read(fd, blob, size) != (ssize_t)size) {
+		close(fd);
+		free(blob);
+		return NULL;
+	}
+	close(fd);
+#endif
+
+	image = NULL;
+	head = (struct hexcache_header *)blob;
+
+	/* check blob is for this file */
+	if(memcmp(head->magic, HEXCACHE_MAGIC, sizeof(head->magic)) ||
+	    memcmp(&head->key, key, sizeof(*key)) ||
+	    memcmp(head->md5, md5, sizeof(head->md5)) ||
+	    head->pathlen != strlen(path) ||
+	    PATH_PAD(head->pathlen) > size - sizeof(*head) ||
+	    memcmp(blob + sizeof(*head), path, head->pathlen)) {
+		goto done;
+	}
+
+	/* check blob is complete, and its extents fit the image */
+	need = sizeof(*head) + PATH_PAD(head->pathlen);
+	ext = (struct hexcache_extent *)(blob + need);
+	if(head->count > (size - need) / sizeof(*ext)) {
+		goto done;
+	}
+	need += head->count * sizeof(*ext);
+	for(i=0; i<head->count; i++) {
+		if(ext[i].size > size - need ||
+		    ext[i].size > key->maxsize ||
+		    ext[i].address > key->maxsize - ext[i].size) {
+			goto done;
+		}
+		need += ext[i].size;
+	}
+	if(need != size) {
+		goto done;
+	}
+
+	image = image_new(key->fill);
+	data = (uint8_t *)(ext + head->count);
+	for(i=0; i<head->count; i++) {
+		image_write(image, ext[i].address, data, ext[i].size);
+		data += ext[i].size;
+	}
+
+done:
+#ifdef	HAVE_MMAP
+	munmap(blob, size);
+#else
+	free(blob);
+#endif
+
+	return image;
+}
+
+/**************************************************************
+ * This will save an image to a blob. It is written to a
+ * temporary file first, so readers never see part of a blob.
+ * Errors are ignored, the cache is only an optimization.
+ */
+
+static void wr_blob(const char *name, const char *path,
+	const struct hexcache_key *key, const uint8_t *md5,
+	const struct image *image)
+{
+	struct hexcache_header head;
+	struct hexcache_extent ext;
+	static const char pad[4] = { 0, 0, 0, 0 };
+	char *tmpname;
+	FILE *file;
+	size_t i, padlen;
+	int err;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, HEXCACHE_MAGIC, sizeof(head.magic));
+	head.key = *key;
+	memcpy(head.md5, md5, sizeof(head.md5));
+	head.pathlen = strlen(path);
+	head.count = image->count;
+
+	tmpname = (char *)xmalloc(strlen(name) + 16);
+	sprintf(tmpname, "%s.%d", name, (int)getpid());
+
+	file = fopen(tmpname, "wb");
+	if(!file) {
+		free(tmpname);
+		return;
+	}
+
+	err = fwrite(&head, sizeof(head), 1, file) != 1;
+	err |= fwrite(path, 1, head.pathlen, file) != head.pathlen;
+	padlen = PATH_PAD(head.pathlen) - head.pathlen;
+	err |= fwrite(pad, 1, padlen, file) != padlen;
+	for(i=0; i<image->count; i++) {
+		ext.address = image->extent[i].address;
+		ext.size = image->extent[i].size;
+		err |= fwrite(&ext, sizeof(ext), 1, file) != 1;
+	}
+	for(i=0; i<image->count; i++) {
+		err |= fwrite(image->extent[i].data, 1,
+		    image->extent[i].size, file) != image->extent[i].size;
+	}
+	err |= fclose(file) != 0;
+
+	if(err || rename(tmpname, name)) {
+		remove(tmpname);
+	}
+	free(tmpname);
+
+	return;
+}
+
+/**************************************************************
+ * This will remember an image in the memory cache, replacing
+ * any older entry for the same path.
+ */
+
+static void remember(char *path, const struct hexcache_key *key,
+	const uint8_t *md5, struct image *image)
+{
+	struct hexcache_entry *e;
+
+	for(e = entries; e; e = e->next) {
+		if(!strcmp(e->path, path)) {
+			break;
+		}
+	}
+	if(e) {
+		free(path);
+		image_free(e->image);
+	} else {
+		e = (struct hexcache_entry *)
+		    xmalloc(sizeof(struct hexcache_entry));
+		e->path = path;
+		e->next = entries;
+		entries = e;
+	}
+
+	e->key = *key;
+	memcpy(e->md5, md5, sizeof(e->md5));
+	e->image = image;
+
+	return;
+}
+
+/**************************************************************
+ * This will read a hexfile into a new image, like
+ * rd_hexfile_image(), using the cache when it can. The caller
+ * owns the returned image.
+ */
+
+struct image *rd_hexfile_cached(const char *filename, uint8_t fill,
+	size_t maxsize)
+{
+	struct hexcache_entry *e;
+	struct hexcache_key key;
+	struct image *image;
+	uint8_t md5[16];
+	char *path, *name;
+
+	assert(filename != NULL);
+
+	/* hash it before parsing, so a change while parsing 
+	 * makes the entry stale, not wrong */
+	if(file_key(filename, fill, maxsize, &key) || 
+	    file_md5(filename, md5)) {
+		/* let the parser report the error */
+		return rd_hexfile_image(filename, fill, maxsize);
+	}
+	path = abs_path(filename);
+
+	/* loaded before by this process */
+	for(e = entries; e; e = e->next) {
+		if(!strcmp(e->path, path) &&
+		    !memcmp(&e->key, &key, sizeof(key)) &&
+		    !memcmp(e->md5, md5, sizeof(md5))) {
+			free(path);
+			return image_dup(e->image);
+		}
+	}
+
+	/* loaded before by another process */
+	image = NULL;
+	name = blob_name(path);
+	if(name) {
+		image = rd_blob(name, path, &key, md5);
+	}
+
+	/* parse it */
+	if(!image) {
+		image = rd_hexfile_image(filename, fill, maxsize);
+		if(!image) {
+			free(name);
+			free(path);
+			return NULL;
+		}
+		if(name) {
+			wr_blob(name, path, &key, md5, image);
+		}
+	}
+	free(name);
+
+	remember(path, &key, md5, image);
+
+	return image_dup(image);
+}
+
+/**************************************************************/
+
@@ -0,0 +1,29 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Parsed hexfile cache.
+ */
+
+#ifndef	HEXCACHE_HEADER
+#define	HEXCACHE_HEADER
+
+#include	<stdlib.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* directory for cached images */
+#define	HEXCACHE_ENV	"EZ8_HEXCACHE"
+
+struct image;
+struct image *rd_hexfile_cached(const char *, uint8_t, size_t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HEXCACHE_HEADER */
+
@@ -2,7 +2,14 @@
  *
  * $Id: hexfile.c,v 1.3 2008/10/02 17:52:53 jnekl Exp $
  *
- * These functions are used to read and write Intel hexfiles.
+ * These functions are used to read and write Intel hexfiles
+ * and Motorola S-records.
+ *
+ * Files are read by mapping them into memory and decoding each
+ * record with lookup tables. Files are written by encoding 
+ * records into a large output buffer, also with a table. The
+ * populated address ranges are tracked as a sorted list of 
+ * extents, which is also used to detect overlapping data.
  */
 
 #define		_GNU_SOURCE
@@ -14,134 +21,338 @@
 #include	<ctype.h>
 #include	<string.h>
 #include	<assert.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/types.h>
+#include	<sys/stat.h>
 #include	"xmalloc.h"
 
+#ifndef	_WIN32
+#define	HAVE_MMAP
+#include	<sys/mman.h>
+#endif
+
+#ifndef	O_BINARY
+#define	O_BINARY	0
+#endif
+
+#include	"image.h"
 #include	"hexfile.h"
 
 /**************************************************************
- * This function will read an intel hexfile into the memory 
- * pointed to by *buff.
+ * Ascii hex decode tables. Invalid characters set bit 8, so
+ * a whole record can be decoded before checking for errors.
+ * The encode table holds the two digits of each byte.
  */
 
-int rd_ihex(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
+static uint16_t hex_hi[256];
+static uint16_t hex_lo[256];
+static uint8_t hex_enc[256][2];
+
+static void hex_init(void)
 {
-	int c, line;
-	char *readbuff;
-	uint8_t size, dri, type, *data, checksum;
-	uint16_t drlo, sba, lba;
-	uint32_t address;
-	uint8_t *ptr1, *ptr2, *end, fill;
+	static int init = 0;
+	int c;
 
-	sba = lba = 0;
-	fill = buff[0];
+	if(init) {
+		return;
+	}
+
+	for(c=0; c<256; c++) {
+		hex_hi[c] = hex_lo[c] = 0x100;
+	}
+	for(c='0'; c<='9'; c++) {
+		hex_hi[c] = (c - '0') << 4;
+		hex_lo[c] = c - '0';
+	}
+	for(c='A'; c<='F'; c++) {
+		hex_hi[c] = hex_hi[c - 'A' + 'a'] = (c - 'A' + 10) << 4;
+		hex_lo[c] = hex_lo[c - 'A' + 'a'] = c - 'A' + 10;
+	}
+	for(c=0; c<256; c++) {
+		hex_enc[c][0] = "0123456789ABCDEF"[c >> 4];
+		hex_enc[c][1] = "0123456789ABCDEF"[c & 0x0f];
+	}
 
-	line = 0;
-	readbuff = (char *)xmalloc(BUFSIZ);
+	init = 1;
 
-	while(fgets(readbuff, BUFSIZ, file)) {
-		line++;
-		data = (uint8_t *)strtok(readbuff, " \t\r\n");
-		if(data == NULL) {
-			continue;
+	return;
+}
+
+/**************************************************************
+ * This will decode size bytes of ascii hex. It returns the 
+ * sum of the bytes, or -1 if an invalid character was found.
+ */
+
+static int hex_decode(const uint8_t *s, uint8_t *data, size_t size)
+{
+	unsigned int value, sum, bad;
+
+	sum = bad = 0;
+	while(size--) {
+		value = hex_hi[s[0]] | hex_lo[s[1]];
+		bad |= value;
+		sum += value;
+		*data++ = value;
+		s += 2;
+	}
+
+	if(bad & 0x100) {
+		return -1;
+	}
+
+	return sum & 0xff;
+}
+
+/**************************************************************
+ * This will add a populated range to a sorted extent list, 
+ * merging it with adjacent extents. It returns -1 if the range
+ * overlaps an existing extent.
+ */
+
+struct hex_extent {
+	uint32_t address;
+	uint32_t size;
+};
+
+struct extent_list {
+	struct hex_extent *extent;
+	size_t count;
+	size_t alloc;
+};
+
+static int add_extent(struct extent_list *list, uint32_t address, 
+	uint32_t size)
+{
+	struct hex_extent *e;
+	size_t lo, hi, mid;
+	int prev, next;
+
+	/* find first extent that ends after address */
+	lo = 0;
+	hi = list->count;
+	if(hi && list->extent[hi-1].address + list->extent[hi-1].size 
+	    <= address) {
+		/* common case, appending */
+		lo = hi;
+	}
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		e = &list->extent[mid];
+		if(e->address + e->size <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		if(*data == '\0') {
-			continue;
+	}
+
+	if(lo < list->count && list->extent[lo].address < address + size) {
+		return -1;
+	}
+
+	prev = lo > 0 && 
+	    list->extent[lo-1].address + list->extent[lo-1].size == address;
+	next = lo < list->count && 
+	    list->extent[lo].address == address + size;
+
+	if(prev && next) {
+		list->extent[lo-1].size += size + list->extent[lo].size;
+		memmove(list->extent + lo, list->extent + lo + 1,
+		    (list->count - lo - 1) * sizeof(struct hex_extent));
+		list->count--;
+	} else if(prev) {
+		list->extent[lo-1].size += size;
+	} else if(next) {
+		list->extent[lo].address = address;
+		list->extent[lo].size += size;
+	} else {
+		if(list->count == list->alloc) {
+			list->alloc = list->alloc ? list->alloc * 2 : 16;
+			list->extent = (struct hex_extent *)xrealloc(
+			    list->extent, 
+			    list->alloc * sizeof(struct hex_extent));
 		}
-		if(*data++ != ':') {
-			fprintf(stderr, "%s:%d:hexfile corrupt\n", 
-			    filename, line);
-			free(readbuff);
-			return -1;
+		memmove(list->extent + lo + 1, list->extent + lo,
+		    (list->count - lo) * sizeof(struct hex_extent));
+		list->extent[lo].address = address;
+		list->extent[lo].size = size;
+		list->count++;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * Data records are passed to a sink, which stores them.
+ * The sink returns one of these codes.
+ */
+
+#define	SINK_OK		0
+#define	SINK_RANGE	1
+#define	SINK_OVERLAP	2
+
+struct hex_sink {
+	int (*store)(struct hex_sink *, uint32_t, const uint8_t *, size_t);
+	struct extent_list extents;
+	uint8_t *buff;
+	size_t buffsize;
+	struct image *image;
+};
+
+static int store_buff(struct hex_sink *sink, uint32_t address, 
+	const uint8_t *data, size_t size)
+{
+	if(address >= sink->buffsize || size > sink->buffsize - address) {
+		return SINK_RANGE;
+	}
+	if(add_extent(&sink->extents, address, size)) {
+		return SINK_OVERLAP;
+	}
+	memcpy(sink->buff + address, data, size);
+
+	return SINK_OK;
+}
+
+static int store_image(struct hex_sink *sink, uint32_t address, 
+	const uint8_t *data, size_t size)
+{
+	if(address >= sink->buffsize || size > sink->buffsize - address) {
+		return SINK_RANGE;
+	}
+	if(add_extent(&sink->extents, address, size)) {
+		return SINK_OVERLAP;
+	}
+	image_write(sink->image, address, data, size);
+
+	return SINK_OK;
+}
+
+static int sink_error(int err, const char *filename, int line, 
+	uint32_t address)
+{
+	switch(err) {
+	case SINK_RANGE:
+		fprintf(stderr, "%s:%d:memory out of range\n", 
+		    filename, line);
+		break;
+	case SINK_OVERLAP:
+		fprintf(stderr, "%s:%d:overlapping data, addr %04x\n", 
+		    filename, line, address);
+		break;
+	}
+
+	return -1;
+}
+
+/**************************************************************
+ * These skip whitespace and the rest of a line, counting lines.
+ */
+
+static const uint8_t *skip_space(const uint8_t *p, const uint8_t *end, 
+	int *line)
+{
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || 
+	    *p == '\n')) {
+		if(*p++ == '\n') {
+			(*line)++;
 		}
-		/* remove ascii bias */
-		end = data;
-		while(*end != '\0') {
-			c = *end;
-			if(c >= '0' && c <= '9') {
-				*end++ = c - '0';
-			} else if(c >= 'A' && c <= 'F') {
-				*end++ = c - 'A' + 10;
-			} else if(c >= 'a' && c <= 'f') {
-				*end++ = c - 'a' + 10;
-			} else {
-				fprintf(stderr, "%s:%d:hexfile corrupt\n", 
-				    filename, line);
-				free(readbuff);
-				return -1;
-			}
+	}
+
+	return p;
+}
+
+static const uint8_t *skip_line(const uint8_t *p, const uint8_t *end)
+{
+	p = (const uint8_t *)memchr(p, '\n', end - p);
+
+	return p ? p : end;
+}
+
+/**************************************************************
+ * This function will parse an intel hexfile held in memory.
+ */
+
+static int parse_ihex(const uint8_t *p, const uint8_t *end, 
+	const char *filename, struct hex_sink *sink)
+{
+	int line, sum, err;
+	uint8_t record[5+255];
+	uint8_t size, type, *data;
+	uint16_t drlo, sba, lba;
+	uint32_t address;
+	size_t first;
+
+	sba = lba = 0;
+	line = 1;
+
+	for(;;) {
+		p = skip_space(p, end, &line);
+		if(p == end) {
+			break;
 		}
-		/* should be even number of nibbles */
-		if((end - data) % 2) {
+
+		/* record must be ':' followed by at least SSAAAATTCC */
+		if(*p++ != ':' || end - p < 10 ||
+		    hex_decode(p, record, 1) < 0) {
 			fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 			    filename, line);
-			free(readbuff);
-			return -1;
-		}
-		if((end-data) < sizeof("SSAAAATTCC") - 1) {
-			fprintf(stderr, "%s:%d:hexfile corrput\n", 
-			    filename, line);
-			free(readbuff);
 			return -1;
 		}
-			
-		/* pack nibbles into bytes */
-		ptr1 = ptr2 = data;
-		while(ptr2 != end) {
-			*ptr1 = *ptr2++ << 4;
-			*ptr1++ |= *ptr2++;
-		}
-		/* verify checksum */
-		checksum = 0;
-		ptr2 = data;
-		while(ptr2 < ptr1) {
-			checksum += *ptr2++;
-		}
-		if(checksum != 0x00) {
+		size = record[0];
+		if(end - p < 2 * (5 + size) || 
+		    (end - p > 2 * (5 + size) && 
+		    !isspace(p[2 * (5 + size)]))) {
 			fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
 
-		size = *data++;
-		drlo = *data++ << 8;
-		drlo |= *data++;
-		type = *data++;
-
-		if(size != ptr1 - data - 1) {
-			fprintf(stderr, "%s:%d:hexfile corrupt", 
+		/* decode and verify checksum */
+		sum = hex_decode(p, record, 5 + size);
+		if(sum != 0x00) {
+			fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
+		p = skip_line(p + 2 * (5 + size), end);
+
+		drlo = record[1] << 8 | record[2];
+		type = record[3];
+		data = record + 4;
 
 		switch(type) {
 		case 0x00:	/* data record */
-			for(dri=0; dri<size; dri++) {
-				address = sba ?
-					(sba<<4)+((drlo+dri)%0x10000) :
-				        (((lba<<16)|drlo)+dri)&0xffffffff;
-				if(address >= buffsize) {
-					fprintf(stderr, "%s:%d:memory out "
-					    "of range\n", filename, line);
-					free(readbuff);
-					return -1;
-				}
-				if(buff[address] != fill) {
-					fprintf(stderr, "%s:%d:overlapping "
-					    "data, addr %04x\n", filename, 
-					    line, address);
-					free(readbuff);
-					return -1;
+			if(!size) {
+				break;
+			}
+			if(sba) {
+				/* address wraps within segment */
+				address = (sba << 4) + drlo;
+				first = 0x10000 - drlo;
+				if(first < size) {
+					err = sink->store(sink, address, 
+					    data, first);
+					if(err) {
+						return sink_error(err, 
+						    filename, line, address);
+					}
+					address = sba << 4;
+					data += first;
+					size -= first;
 				}
-				buff[address] = data[dri];
+			} else {
+				address = lba << 16 | drlo;
+			}
+			err = sink->store(sink, address, data, size);
+			if(err) {
+				return sink_error(err, filename, line, 
+				    address);
 			}
 			break;
 		case 0x01:	/* end-of-file record */
 			if(drlo != 0x0000 || size != 0x00) {
 				fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			return 0;
@@ -149,7 +360,6 @@ int rd_ihex(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			if(drlo != 0x0000 || size != 0x02) {
 				fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			sba = data[0] << 8 | data[1];
@@ -159,7 +369,6 @@ int rd_ihex(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			if(drlo != 0x0000 || size != 0x04) {
 				fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			break;
@@ -167,7 +376,6 @@ int rd_ihex(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			if(drlo != 0x0000 || size != 0x02) {
 				fprintf(stderr, "%s:%d:hexfile corrupt\n",
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			lba = data[0] << 8 | data[1];
@@ -177,146 +385,91 @@ int rd_ihex(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			if(drlo != 0x0000 || size != 0x04) {
 				fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			break;
 		default:
 			fprintf(stderr, "%s:%d:hexfile corrupt\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
 	}
 
-	free(readbuff);
-
 	return 0;
 }
 
 /**************************************************************
- * This function will read S-record into the memory 
- * pointed to by *buff.
+ * This function will parse an S-record file held in memory.
  */
 
-int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
+static int parse_srec(const uint8_t *p, const uint8_t *end, 
+	const char *filename, struct hex_sink *sink)
 {
-	int line, records;
-	char *readbuff;
-	uint8_t fill;
+	int line, records, sum, err;
+	uint8_t record[1+255];
+	uint8_t size, *data;
+	uint32_t address;
+	char type;
 
-	line = 0;
+	line = 1;
 	records = 0;
-	fill = buff[0];
-
-	readbuff = (char *)xmalloc(BUFSIZ);
-
-	while(fgets(readbuff, BUFSIZ, file)) {
-		uint8_t *data;
-		char type;
-		uint8_t size, checksum;
-		uint8_t *end, *ptr1, *ptr2;
-		uint32_t address;
-		int i;
 
-		line++;
-
-		/* skip blank lines and tabs */
-		data = (uint8_t *)strtok(readbuff, " \t\r\n");
-		if(data == NULL) {
-			continue;
-		}
-		if(*data == '\0') {
-			continue;
+	for(;;) {
+		p = skip_space(p, end, &line);
+		if(p == end) {
+			break;
 		}
 
 		/* check valid line */
-		if(*data++ != 'S') {
+		if(*p++ != 'S' || p == end) {
 			fprintf(stderr, 
 			    "%s:%d:srec corrupt:invalid start record\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
 
-		/* get type */
-		type = *data++;
-
-		/* remove ascii bias */
-		end = data;
-		while(*end != '\0') {
-			int c;
-			c = *end;
-			if(c >= '0' && c <= '9') {
-				*end++ = c - '0';
-			} else if(c >= 'A' && c <= 'F') {
-				*end++ = c - 'A' + 10;
-			} else if(c >= 'a' && c <= 'f') {
-				*end++ = c - 'a' + 10;
-			} else {
-				fprintf(stderr, 
-				    "%s:%d:srec corrupt:invalid hexvalue\n", 
-				    filename, line);
-				free(readbuff);
-				return -1;
-			}
-		}
-
-		/* should be even number of nibbles */
-		if((end - data) % 2) {
-			fprintf(stderr, "%s:%d:srec corrupt:odd nibbles\n", 
+		/* get type and size */
+		type = *p++;
+		if(end - p < 2 || hex_decode(p, record, 1) < 0) {
+			fprintf(stderr, 
+			    "%s:%d:srec corrupt:invalid hexvalue\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
-			
-		/* pack nibbles into bytes */
-		ptr1 = ptr2 = data;
-		while(ptr2 != end) {
-			*ptr1 = *ptr2++ << 4;
-			*ptr1++ |= *ptr2++;
+		size = record[0];
+		if(end - p < 2 * (1 + size) ||
+		    (end - p > 2 * (1 + size) && 
+		    !isspace(p[2 * (1 + size)]))) {
+			fprintf(stderr, "%s:%d:srec corrupt:invalid size\n", 
+			    filename, line);
+			return -1;
 		}
 
-		/* verify checksum */
-		checksum = 0;
-		ptr2 = data;
-		while(ptr2 < ptr1) {
-			checksum += *ptr2++;
-		}
-		if(checksum != 0xff) {
-			fprintf(stderr, "%s:%d:srec corrupt:bad checksum\n", 
+		/* decode and verify checksum */
+		sum = hex_decode(p, record, 1 + size);
+		if(sum < 0) {
+			fprintf(stderr, 
+			    "%s:%d:srec corrupt:invalid hexvalue\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
-
-		size = *data++;
-
-		if(size != ptr1 - data) {
-			fprintf(stderr, "%s:%d:srec corrupt:invalid size\n", 
+		if(sum != 0xff) {
+			fprintf(stderr, "%s:%d:srec corrupt:bad checksum\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
+		p = skip_line(p + 2 * (1 + size), end);
+
+		data = record + 1;
 
 		switch(type) {
 		case '0':	// header info
-/*
-			if(size < 2+12+1) {
-				fprintf(stderr, 
-				    "%s:%d:srec corrupt:bad size\n", 
-				    filename, line);
-				free(readbuff);
-				return -1;
-			}
-*/
 			continue;
 		case '1':	// 2 byte address + data
 			if(size < 3) {
 				fprintf(stderr, 
 				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			address = data[0] << 8 | data[1];
@@ -325,9 +478,9 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			break;
 		case '2':	// 3 byte address + data
 			if(size < 4) {
-				fprintf(stderr, "%s:%d:srec corrupt:bad size", 
+				fprintf(stderr, 
+				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			address = data[0] << 16 | data[1] << 8 | data[2];
@@ -336,9 +489,9 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			break;
 		case '3':	// 4 byte address + data
 			if(size < 5) {
-				fprintf(stderr, "%s:%d:srec corrupt:bad size", 
+				fprintf(stderr, 
+				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			address = data[0] << 24 | data[1] << 16 
@@ -346,14 +499,24 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			data += 4;
 			size -= 5;
 			break;
-		case '5': {	// num records
+		case '5':	// 2 byte number of records
+		case '6': {	// 3 byte number of records
 			int recs;
+
+			if(type == '5' ? size != 2+1 : size != 3+1) {
+				fprintf(stderr, 
+				    "%s:%d:srec corrupt:bad size\n", 
+				    filename, line);
+				return -1;
+			}
 			recs = data[0] << 8 | data[1];
+			if(type == '6') {
+				recs = recs << 8 | data[2];
+			}
 			if(recs != records) {
 				fprintf(stderr, 
 				    "%s:%d:srec corrupt:wrong num records\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			continue;
@@ -363,7 +526,6 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 				fprintf(stderr, 
 				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			continue;
@@ -372,7 +534,6 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 				fprintf(stderr, 
 				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			continue;
@@ -381,7 +542,6 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 				fprintf(stderr, 
 				    "%s:%d:srec corrupt:bad size\n", 
 				    filename, line);
-				free(readbuff);
 				return -1;
 			}
 			continue;
@@ -389,144 +549,459 @@ int rd_srec(uint8_t *buff, size_t buffsize, FILE *file, const char *filename)
 			fprintf(stderr, 
 			    "%s:%d:srec corrupt:bad type\n", 
 			    filename, line);
-			free(readbuff);
 			return -1;
 		}
-		if(address+size > buffsize) {
-			fprintf(stderr, "%s:%d:size out of range", 
-			    filename, line);
-			free(readbuff);
-			return -1;
+
+		records++;
+		if(!size) {
+			continue;
+		}
+		err = sink->store(sink, address, data, size);
+		if(err) {
+			return sink_error(err, filename, line, address);
 		}
+	}
+
+	return 0;
+}
 
-		/* copy data */
-		for(i=0; i<size; i++) {
-			buff[address+i] = data[i];
+/**************************************************************
+ * This will map a file into memory. Where mmap is not 
+ * available, the file is read into an allocated buffer.
+ */
+
+static uint8_t *map_file(const char *filename, size_t *size)
+{
+	uint8_t *text;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if(fd < 0) {
+		fprintf(stderr, "%s:open:%s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if(fstat(fd, &st)) {
+		fprintf(stderr, "%s:fstat:%s\n", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if(st.st_size == 0) {
+		fprintf(stderr, "%s:file is empty\n", filename);
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+
+#ifdef	HAVE_MMAP
+	text = (uint8_t *)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(text == (uint8_t *)MAP_FAILED) {
+		fprintf(stderr, "%s:mmap:%s\n", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+#else
+	{
+		ssize_t len;
+		size_t total;
+
+		text = (uint8_t *)xmalloc(*size);
+		for(total = 0; total < *size; total += len) {
+			len = read(fd, text + total, *size - total);
+			if(len <= 0) {
+				fprintf(stderr, "%s:read:%s\n", filename, 
+				    len ? strerror(errno) : "short read");
+				free(text);
+				close(fd);
+				return NULL;
+			}
 		}
 	}
+#endif
 
-	free(readbuff);
+	close(fd);
 
-	return 0;
+	return text;
+}
+
+static void unmap_file(uint8_t *text, size_t size)
+{
+#ifdef	HAVE_MMAP
+	munmap(text, size);
+#else
+	free(text);
+#endif
 }
 
 /**************************************************************
- * Automatically select ihex vs srec
+ * This will parse an intel hexfile or S-record file, passing
+ * each data record to the sink.
+ */
+
+static int rd_hexsink(struct hex_sink *sink, const char *filename)
+{
+	const uint8_t *p, *end;
+	uint8_t *text;
+	size_t size;
+	int line, err;
+
+	hex_init();
+
+	text = map_file(filename, &size);
+	if(!text) {
+		return -1;
+	}
+
+	line = 1;
+	end = text + size;
+	p = skip_space(text, end, &line);
+
+	if(p < end && *p == ':') {
+		err = parse_ihex(p, end, filename, sink);
+	} else if(p < end && *p == 'S') {
+		err = parse_srec(p, end, filename, sink);
+	} else {
+		fprintf(stderr, "%s:could not determine file type\n", 
+		    filename);
+		err = -1;
+	}
+
+	unmap_file(text, size);
+
+	return err;
+}
+
+/**************************************************************
+ * Automatically select ihex vs srec, and read the file into 
+ * *buff. Memory not in the file is left unchanged.
  */
 
 int rd_hexfile(uint8_t *buff, size_t buffsize, const char *filename)
 {
-	FILE *file;
-	int fill, i, c, err;
+	struct hex_sink sink;
+	int err;
 
 	assert(buff != NULL);
 	assert(buffsize != 0);
 	assert(filename != NULL);
 
-	fill = *buff;
+	memset(&sink, 0, sizeof(sink));
+	sink.store = store_buff;
+	sink.buff = buff;
+	sink.buffsize = buffsize;
+
+	err = rd_hexsink(&sink, filename);
+	free(sink.extents.extent);
+
+	return err;
+}
+
+/**************************************************************
+ * This will read a file into a new sparse image. Memory not
+ * in the file reads back as fill. It returns NULL on error.
+ */
+
+struct image *rd_hexfile_image(const char *filename, uint8_t fill, 
+	size_t maxsize)
+{
+	struct hex_sink sink;
+	int err;
+
+	assert(filename != NULL);
+	assert(maxsize != 0);
+
+	memset(&sink, 0, sizeof(sink));
+	sink.store = store_image;
+	sink.buffsize = maxsize;
+	sink.image = image_new(fill);
+
+	err = rd_hexsink(&sink, filename);
+	free(sink.extents.extent);
+
+	if(err) {
+		image_free(sink.image);
+		return NULL;
+	}
+
+	return sink.image;
+}
+
+/**************************************************************
+ * Records are encoded into the output buffer, which is written
+ * to the file whenever it fills up.
+ */
+
+#define	HEX_OUTSIZE	0x10000
+#define	HEX_MAXLINE	80	/* longest record, with room to spare */
+#define	HEX_RECSIZE	16	/* data bytes per record */
 
-	for(i=0; i<buffsize; i++) {
-		if(buff[i] != fill) {
-			/* buffer not initialized */
-			abort();
+struct hex_writer {
+	FILE *file;
+	const char *filename;
+	int flags;
+	int err;
+	uint16_t lba;		/* ihex upper address */
+	int addrsize;		/* srec address bytes */
+	unsigned long records;
+	size_t len;
+	uint8_t out[HEX_OUTSIZE];
+};
+
+static void hex_flush(struct hex_writer *w)
+{
+	if(w->len && !w->err) {
+		if(fwrite(w->out, 1, w->len, w->file) != w->len) {
+			fprintf(stderr, "%s:fwrite:%s\n", 
+			    w->filename, strerror(errno));
+			w->err = -1;
 		}
 	}
+	w->len = 0;
 
-	file = fopen(filename, "rb");
-	if(file == NULL) {
-		fprintf(stderr, "%s:fopen:%s\n", 
-		    filename, strerror(errno));
-		return -1;
+	return;
+}
+
+static uint8_t *hex_encode(uint8_t *p, const uint8_t *data, size_t size, 
+	uint8_t *sum)
+{
+	while(size--) {
+		*sum += *data;
+		*p++ = hex_enc[*data][0];
+		*p++ = hex_enc[*data][1];
+		data++;
 	}
 
-	c = fgetc(file);
-	if(c == EOF) {
-		fprintf(stderr, "%s:fgetc:%s\n",
-		    filename, strerror(errno));
-		fclose(file);
-		return -1;
+	return p;
+}
+
+/**************************************************************
+ * These encode a single intel hex record or S-record.
+ */
+
+static void put_ihex(struct hex_writer *w, uint8_t type, uint16_t address,
+	const uint8_t *data, size_t size)
+{
+	uint8_t head[4], sum;
+	uint8_t *p;
+
+	if(w->len + HEX_MAXLINE > HEX_OUTSIZE) {
+		hex_flush(w);
 	}
-	ungetc(c, file);
 
-	switch(c) {
-	case ':':
-		err = rd_ihex(buff, buffsize, file, filename);
-		break;
-	case 'S':
-		err = rd_srec(buff, buffsize, file, filename);
-		break;
-	default:
-		fprintf(stderr, "%s:could not determine file type\n", 
-		    filename);
-		fclose(file);
-		return -1;
+	head[0] = size;
+	head[1] = address >> 8;
+	head[2] = address;
+	head[3] = type;
+
+	sum = 0;
+	p = w->out + w->len;
+	*p++ = ':';
+	p = hex_encode(p, head, 4, &sum);
+	p = hex_encode(p, data, size, &sum);
+	sum = -sum;
+	*p++ = hex_enc[sum][0];
+	*p++ = hex_enc[sum][1];
+	*p++ = '\n';
+	w->len = p - w->out;
+
+	return;
+}
+
+static void put_srec(struct hex_writer *w, char type, int addrsize, 
+	uint32_t address, const uint8_t *data, size_t size)
+{
+	uint8_t head[5], sum;
+	uint8_t *p;
+	int i;
+
+	if(w->len + HEX_MAXLINE > HEX_OUTSIZE) {
+		hex_flush(w);
 	}
 
+	head[0] = addrsize + size + 1;
+	for(i=addrsize; i>0; i--) {
+		head[i] = address;
+		address >>= 8;
+	}
 
-	return err;
+	sum = 0;
+	p = w->out + w->len;
+	*p++ = 'S';
+	*p++ = type;
+	p = hex_encode(p, head, addrsize + 1, &sum);
+	p = hex_encode(p, data, size, &sum);
+	sum = ~sum;
+	*p++ = hex_enc[sum][0];
+	*p++ = hex_enc[sum][1];
+	*p++ = '\n';
+	w->len = p - w->out;
+
+	return;
 }
 
 /**************************************************************
- * This will save the data in *buff a file in intel hexfile 
- * format.
+ * This will write a block of data as data records. Records
+ * are aligned to HEX_RECSIZE, and an intel hexfile extended 
+ * linear address record is emitted whenever the upper address
+ * changes.
  */
 
-int wr_hexfile(uint8_t *buff, size_t buffsize, size_t offset, 
-    const char *filename)
+static void wr_block(struct hex_writer *w, const uint8_t *data, 
+	size_t size, uint32_t address)
 {
-	FILE *file;
-	uint8_t size, dri, type, checksum;
-	uint16_t drlo, lba;
+	uint8_t ela[2];
+	size_t n;
 
-	lba = 0;
+	while(size > 0) {
+		n = HEX_RECSIZE - address % HEX_RECSIZE;
+		if(n > size) {
+			n = size;
+		}
 
-	assert(buff != NULL);
-	assert(filename != NULL);
+		if(w->flags & HEXFILE_SREC) {
+			put_srec(w, '1' + w->addrsize - 2, w->addrsize, 
+			    address, data, n);
+		} else {
+			if((address >> 16) != w->lba) {
+				w->lba = address >> 16;
+				ela[0] = w->lba >> 8;
+				ela[1] = w->lba;
+				put_ihex(w, 0x04, 0x0000, ela, 2);
+			}
+			put_ihex(w, 0x00, address, data, n);
+		}
+		w->records++;
+
+		address += n;
+		data += n;
+		size -= n;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * These start and finish writing a file. The highest address 
+ * is needed to pick the S-record address size.
+ */
+
+static struct hex_writer *wr_begin(const char *filename, int flags, 
+	uint32_t end)
+{
+	struct hex_writer *w;
+	FILE *file;
+
+	hex_init();
 
 	file = fopen(filename, "wb");
 	if(file == NULL) {
 		fprintf(stderr, "%s:fopen:%s\n", filename, strerror(errno));
-		return -1;
+		return NULL;
 	}
 
-	while(buffsize > 0) {
-		if((offset >> 16) != lba) {
-			size = 2;
-			drlo = 0x0000;
-			type = 0x04;
-			lba = offset >> 16;
-			checksum = -(size + (drlo >> 8) + (drlo & 0xff) 
-			    + type + (lba>>8) + (lba & 0xff));
-			fprintf(file, ":%02X%04X%02X%04X%02X\n", 
-			    size, drlo, type, lba, checksum);
-			continue;	
-		}
+	w = (struct hex_writer *)xmalloc(sizeof(struct hex_writer));
+	w->file = file;
+	w->filename = filename;
+	w->flags = flags;
+	w->err = 0;
+	w->lba = 0;
+	w->records = 0;
+	w->len = 0;
+
+	if(end <= 0x10000) {
+		w->addrsize = 2;
+	} else if(end <= 0x1000000) {
+		w->addrsize = 3;
+	} else {
+		w->addrsize = 4;
+	}
+
+	if(flags & HEXFILE_SREC) {
+		put_srec(w, '0', 2, 0x0000, NULL, 0);
+	}
+
+	return w;
+}
 
-		size = offset % 16 ? offset % 16 : 16;
-		size = buffsize < size ? buffsize : size;
-		drlo = offset & 0xffff;
-		type = 0x00;
-		checksum = size + (drlo >> 8) + (drlo & 0xff) + type;
-		fprintf(file, ":%02X%04X%02X", size, drlo, type);
-		for(dri = 0; dri < size; dri++) {
-			fprintf(file, "%02X", buff[dri]);
-			checksum += buff[dri];
+static int wr_end(struct hex_writer *w)
+{
+	int err;
+
+	if(w->flags & HEXFILE_SREC) {
+		if(w->records <= 0xffff) {
+			put_srec(w, '5', 2, w->records, NULL, 0);
 		}
-		checksum = -checksum;
-		fprintf(file, "%02X\n", checksum);
-		offset += size;
-		buff += size;
-		buffsize -= size;
+		put_srec(w, '9' - w->addrsize + 2, w->addrsize, 0x0000, 
+		    NULL, 0);
+	} else {
+		put_ihex(w, 0x01, 0x0000, NULL, 0);
 	}
+	hex_flush(w);
 
-	size = 0;
-	drlo = 0x0000;
-	type = 0x01;
-	checksum = -(size + (drlo >> 8) + (drlo & 0xff) + type);
-	fprintf(file, ":%02X%04X%02X%02X\n", size, drlo, type, checksum);
-	fclose(file);
+	err = w->err;
+	if(fclose(w->file) && !err) {
+		fprintf(stderr, "%s:fclose:%s\n", w->filename, strerror(errno));
+		err = -1;
+	}
+	free(w);
 
-	return 0;
+	return err;
+}
+
+/**************************************************************
+ * This will save the data in *buff to a file. The flags select
+ * S-record output. To leave erased memory out of the file, save
+ * an image with wr_hexfile_image() instead.
+ */
+
+int wr_hexfile_fmt(uint8_t *buff, size_t buffsize, size_t offset, 
+    const char *filename, int flags)
+{
+	struct hex_writer *w;
+
+	assert(buff != NULL);
+	assert(filename != NULL);
+
+	w = wr_begin(filename, flags, offset + buffsize);
+	if(!w) {
+		return -1;
+	}
+
+	wr_block(w, buff, buffsize, offset);
+
+	return wr_end(w);
+}
+
+int wr_hexfile(uint8_t *buff, size_t buffsize, size_t offset, 
+    const char *filename)
+{
+	return wr_hexfile_fmt(buff, buffsize, offset, filename, 0);
+}
+
+/**************************************************************
+ * This will save the populated extents of an image.
+ */
+
+int wr_hexfile_image(const struct image *img, const char *filename, 
+	int flags)
+{
+	struct hex_writer *w;
+	size_t i;
+
+	assert(img != NULL);
+	assert(filename != NULL);
+
+	w = wr_begin(filename, flags, image_end(img));
+	if(!w) {
+		return -1;
+	}
+
+	for(i=0; i<img->count; i++) {
+		wr_block(w, img->extent[i].data, img->extent[i].size,
+		    img->extent[i].address);
+	}
+
+	return wr_end(w);
 }
 
 /**************************************************************/
@@ -6,14 +6,23 @@
 #ifndef	HEXFILE_HEADER
 #define	HEXFILE_HEADER
 
+#include	<stdlib.h>
 #include	<inttypes.h>
 
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
+/* output flags */
+#define	HEXFILE_SREC		0x01	/* write S-records */
+
 int rd_hexfile(uint8_t *, size_t, const char *);
 int wr_hexfile(uint8_t *, size_t, size_t, const char *);
+int wr_hexfile_fmt(uint8_t *, size_t, size_t, const char *, int);
+
+struct image;
+struct image *rd_hexfile_image(const char *, uint8_t, size_t);
+int wr_hexfile_image(const struct image *, const char *, int);
 
 #ifdef	__cplusplus
 }
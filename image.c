@@ -0,0 +1,344 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * A sparse memory image is a sorted list of populated extents.
+ * Everything outside of an extent reads back as the fill byte,
+ * so a small program on a large part only costs as much as the
+ * data it contains.
+ *
+ * Extents never overlap or touch; writing data that overlaps
+ * or is adjacent to existing extents merges them into one.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<string.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"crc.h"
+#include	"image.h"
+
+/* runs of fill at least this long split an extent */
+#define	IMAGE_GAP	16
+
+/**************************************************************
+ * This will create an empty image.
+ */
+
+struct image *image_new(uint8_t fill)
+{
+	struct image *img;
+
+	img = (struct image *)xmalloc(sizeof(struct image));
+	memset(img, 0, sizeof(struct image));
+	img->fill = fill;
+
+	return img;
+}
+
+/**************************************************************
+ * This will remove all data from an image.
+ */
+
+void image_clear(struct image *img)
+{
+	size_t i;
+
+	assert(img != NULL);
+
+	for(i=0; i<img->count; i++) {
+		free(img->extent[i].data);
+	}
+	img->count = 0;
+
+	return;
+}
+
+void image_free(struct image *img)
+{
+	if(!img) {
+		return;
+	}
+
+	image_clear(img);
+	free(img->extent);
+	free(img);
+
+	return;
+}
+
+/**************************************************************
+ * This will make a copy of an image.
+ */
+
+struct image *image_dup(const struct image *img)
+{
+	struct image *copy;
+	size_t i;
+
+	assert(img != NULL);
+
+	copy = image_new(img->fill);
+	for(i=0; i<img->count; i++) {
+		image_write(copy, img->extent[i].address, 
+		    img->extent[i].data, img->extent[i].size);
+	}
+
+	return copy;
+}
+
+/**************************************************************
+ * This will return the index of the first extent that ends
+ * after address. If touch is set, an extent that ends exactly
+ * at address is also included.
+ */
+
+static size_t image_find(const struct image *img, uint32_t address,
+	int touch)
+{
+	const struct image_extent *e;
+	size_t lo, hi, mid;
+	uint32_t end;
+
+	lo = 0;
+	hi = img->count;
+
+	/* common case, past the end */
+	if(hi) {
+		e = &img->extent[hi-1];
+		end = e->address + e->size;
+		if(end < address || (!touch && end == address)) {
+			return hi;
+		}
+	}
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		e = &img->extent[mid];
+		end = e->address + e->size;
+		if(end < address || (!touch && end == address)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**************************************************************
+ * This will write data to an image. Existing data in the
+ * range is replaced.
+ */
+
+void image_write(struct image *img, uint32_t address,
+	const uint8_t *data, size_t size)
+{
+	struct image_extent *e;
+	uint8_t *buff;
+	uint32_t start, end, space;
+	size_t lo, hi, i;
+
+	assert(img != NULL);
+	assert(data != NULL);
+
+	if(!size) {
+		return;
+	}
+	end = address + size;
+
+	/* extents lo..hi-1 overlap or touch the new data */
+	lo = image_find(img, address, 1);
+	for(hi = lo; hi < img->count && img->extent[hi].address <= end;
+	    hi++) ;
+
+	if(lo == hi) {
+		if(img->count == img->alloc) {
+			img->alloc = img->alloc ? img->alloc * 2 : 16;
+			img->extent = (struct image_extent *)xrealloc(
+			    img->extent,
+			    img->alloc * sizeof(struct image_extent));
+		}
+		memmove(img->extent + lo + 1, img->extent + lo,
+		    (img->count - lo) * sizeof(struct image_extent));
+		img->count++;
+
+		e = &img->extent[lo];
+		e->address = address;
+		e->size = size;
+		e->space = size;
+		e->data = (uint8_t *)xmalloc(size);
+		memcpy(e->data, data, size);
+
+		return;
+	}
+
+	e = &img->extent[lo];
+	start = address < e->address ? address : e->address;
+	if(img->extent[hi-1].address + img->extent[hi-1].size > end) {
+		end = img->extent[hi-1].address + img->extent[hi-1].size;
+	}
+
+	if(start < e->address) {
+		buff = (uint8_t *)xmalloc(end - start);
+		memcpy(buff + (e->address - start), e->data, e->size);
+		free(e->data);
+		e->data = buff;
+		e->space = end - start;
+		e->address = start;
+	} else if(end - e->address > e->space) {
+		/* grow geometrically, records are usually appended */
+		space = e->space * 2;
+		if(space < end - e->address) {
+			space = end - e->address;
+		}
+		e->data = (uint8_t *)xrealloc(e->data, space);
+		e->space = space;
+	}
+
+	for(i=lo+1; i<hi; i++) {
+		memcpy(e->data + (img->extent[i].address - e->address),
+		    img->extent[i].data, img->extent[i].size);
+		free(img->extent[i].data);
+	}
+	memmove(img->extent + lo + 1, img->extent + hi,
+	    (img->count - hi) * sizeof(struct image_extent));
+	img->count -= hi - lo - 1;
+
+	e->size = end - e->address;
+	memcpy(e->data + (address - e->address), data, size);
+
+	return;
+}
+
+/**************************************************************
+ * This will read a range of an image into a flat buffer.
+ */
+
+void image_read(const struct image *img, uint32_t address,
+	uint8_t *buff, size_t size)
+{
+	const struct image_extent *e;
+	uint32_t start, end;
+	size_t i;
+
+	assert(img != NULL);
+	assert(buff != NULL);
+
+	memset(buff, img->fill, size);
+
+	for(i = image_find(img, address, 0); i < img->count; i++) {
+		e = &img->extent[i];
+		if(e->address >= address + size) {
+			break;
+		}
+		start = e->address > address ? e->address : address;
+		end = e->address + e->size;
+		if(end > address + size) {
+			end = address + size;
+		}
+		memcpy(buff + (start - address),
+		    e->data + (start - e->address), end - start);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This returns the address following the last populated byte.
+ */
+
+uint32_t image_end(const struct image *img)
+{
+	const struct image_extent *e;
+
+	assert(img != NULL);
+
+	if(!img->count) {
+		return 0;
+	}
+	e = &img->extent[img->count-1];
+
+	return e->address + e->size;
+}
+
+/**************************************************************
+ * This will build an image from a flat buffer. Long runs of
+ * the fill byte are left out.
+ */
+
+struct image *image_from_buffer(const uint8_t *buff, size_t size,
+	uint8_t fill)
+{
+	struct image *img;
+	size_t i, start, end, run;
+
+	assert(buff != NULL);
+
+	img = image_new(fill);
+
+	i = 0;
+	while(i < size) {
+		while(i < size && buff[i] == fill) {
+			i++;
+		}
+		if(i == size) {
+			break;
+		}
+		start = i;
+		end = i;
+		for(run = 0; i < size && run < IMAGE_GAP; i++) {
+			if(buff[i] == fill) {
+				run++;
+			} else {
+				run = 0;
+				end = i + 1;
+			}
+		}
+		image_write(img, start, buff + start, end - start);
+	}
+
+	return img;
+}
+
+/**************************************************************
+ * This will compute the crc of the first size bytes of an
+ * image. Unpopulated ranges are handled in closed form.
+ */
+
+uint16_t image_crc(const struct image *img, uint16_t crc, size_t size)
+{
+	const struct image_extent *e;
+	uint32_t pos, end;
+	size_t i;
+
+	assert(img != NULL);
+
+	pos = 0;
+	for(i=0; i<img->count && pos < size; i++) {
+		e = &img->extent[i];
+		if(e->address >= size) {
+			break;
+		}
+		if(e->address > pos) {
+			crc = crc_ccitt_fill(crc, img->fill, e->address - pos);
+		}
+		end = e->address + e->size;
+		if(end > size) {
+			end = size;
+		}
+		crc = crc_ccitt(crc, e->data, end - e->address);
+		pos = end;
+	}
+	if(pos < size) {
+		crc = crc_ccitt_fill(crc, img->fill, size - pos);
+	}
+
+	return crc;
+}
+
+/**************************************************************/
+
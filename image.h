@@ -0,0 +1,49 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Sparse memory images.
+ */
+
+#ifndef	IMAGE_HEADER
+#define	IMAGE_HEADER
+
+#include	<stdlib.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* populated address range */
+struct image_extent {
+	uint32_t address;
+	uint32_t size;
+	uint32_t space;
+	uint8_t *data;
+};
+
+/* sorted, non-adjacent extents, everything else is fill */
+struct image {
+	uint8_t fill;
+	size_t count;
+	size_t alloc;
+	struct image_extent *extent;
+};
+
+struct image *image_new(uint8_t);
+void image_free(struct image *);
+struct image *image_dup(const struct image *);
+void image_clear(struct image *);
+void image_write(struct image *, uint32_t, const uint8_t *, size_t);
+void image_read(const struct image *, uint32_t, uint8_t *, size_t);
+uint32_t image_end(const struct image *);
+struct image *image_from_buffer(const uint8_t *, size_t, uint8_t);
+uint16_t image_crc(const struct image *, uint16_t, size_t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* IMAGE_HEADER */
+
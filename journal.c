@@ -0,0 +1,297 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * The page journal records the progress of a flash programming
+ * job, one page at a time. Each page state change is appended
+ * to the journal file and flushed, so if the link drops (or the
+ * program is killed) the job can be resumed where it left off.
+ *
+ * Device memory that is kept across the erase is recorded too,
+ * before anything is erased, so a resumed job restores what
+ * was in the device rather than what is left of it.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<errno.h>
+#include	<string.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"journal.h"
+
+#define	JOURNAL_MAGIC	"EZ8JOURNAL"
+
+#define	KEPT(j, addr)	((j)->kept[(addr) / 8] & 1 << (addr) % 8)
+
+/**************************************************************
+ * This will write the kept memory in the given range to the
+ * journal file, one line for each run of up to JOURNAL_KEEPLINE
+ * kept bytes.
+ */
+
+static void journal_put_keep(struct journal *j, uint32_t addr, 
+	uint32_t end)
+{
+	int i;
+
+	while(addr < end) {
+		if(!KEPT(j, addr)) {
+			addr++;
+			continue;
+		}
+		fprintf(j->file, "k %04x ", addr);
+		for(i=0; i<JOURNAL_KEEPLINE && addr < end && 
+		    KEPT(j, addr); i++, addr++) {
+			fprintf(j->file, "%02x", j->keep[addr]);
+		}
+		fprintf(j->file, "\n");
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will read a line of kept memory from the journal file.
+ */
+
+static int journal_get_keep(struct journal *j, const char *line)
+{
+	unsigned int addr, data;
+	int n;
+
+	if(sscanf(line, "k %x %n", &addr, &n) != 1) {
+		return -1;
+	}
+
+	line += n;
+	while(sscanf(line, "%2x", &data) == 1) {
+		if(addr >= JOURNAL_MEMSIZE) {
+			return -1;
+		}
+		j->keep[addr] = data;
+		j->kept[addr / 8] |= 1 << addr % 8;
+		addr++;
+		line += 2;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will (re)write the journal file with the current page
+ * states and kept memory.
+ */
+
+static int journal_write(struct journal *j)
+{
+	int page;
+
+	if(j->file) {
+		fclose(j->file);
+	}
+
+	j->file = fopen(j->filename, "w");
+	if(!j->file) {
+		fprintf(stderr, "%s: %s\n", j->filename, strerror(errno));
+		return -1;
+	}
+
+	fprintf(j->file, "%s %04x %x\n", JOURNAL_MAGIC, j->crc, j->size);
+	for(page=0; page<JOURNAL_PAGES; page++) {
+		if(j->page[page]) {
+			fprintf(j->file, "%02x %x\n", page, j->page[page]);
+		}
+	}
+	journal_put_keep(j, 0, JOURNAL_MEMSIZE);
+	fflush(j->file);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will open a page journal.
+ *
+ * If the journal file exists and was recorded for the same
+ * image crc and memory size, the page states and kept memory
+ * are replayed from it and the journal is marked as resumed.
+ * If it was recorded for anything else, it is left alone and
+ * the journal is marked as a mismatch. Otherwise a new journal
+ * is started.
+ */
+
+struct journal *journal_open(const char *filename, uint16_t crc, int size)
+{
+	struct journal *j;
+	FILE *file;
+	char line[BUFSIZ];
+	unsigned int jcrc, jsize, page, state;
+
+	assert(filename != NULL);
+
+	j = (struct journal *)xmalloc(sizeof(struct journal));
+	memset(j, 0, sizeof(struct journal));
+	j->filename = xstrdup(filename);
+	j->crc = crc;
+	j->size = size;
+
+	file = fopen(filename, "r");
+	if(file) {
+		if(!fgets(line, sizeof(line), file)) {
+			/* empty, start a new journal */
+		} else if(sscanf(line, JOURNAL_MAGIC " %x %x", 
+		    &jcrc, &jsize) == 2 && jcrc == crc && jsize == size) {
+			while(fgets(line, sizeof(line), file)) {
+				/* ignore partially written entry */
+				if(!strchr(line, '\n')) {
+					break;
+				}
+				if(*line == 'k') {
+					if(journal_get_keep(j, line)) {
+						break;
+					}
+				} else if(sscanf(line, "%x %x", 
+				    &page, &state) != 2 ||
+				    page >= JOURNAL_PAGES) {
+					break;
+				} else {
+					j->page[page] = state;
+				}
+				j->resumed = 1;
+			}
+		} else {
+			j->mismatch = 1;
+		}
+		fclose(file);
+	}
+
+	if(j->mismatch) {
+		return j;
+	}
+
+	/* compact journal */
+	if(journal_write(j)) {
+		free(j->filename);
+		free(j);
+		return NULL;
+	}
+
+	return j;
+}
+
+/**************************************************************
+ * This will record a page state change in the journal.
+ */
+
+void journal_mark(struct journal *j, int page, uint8_t state)
+{
+	assert(j != NULL);
+	assert(page >= 0 && page < JOURNAL_PAGES);
+
+	if(j->page[page] == state) {
+		return;
+	}
+
+	j->page[page] = state;
+
+	if(j->file) {
+		fprintf(j->file, "%02x %x\n", page, state);
+		fflush(j->file);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will record memory kept from the device.
+ */
+
+void journal_wr_keep(struct journal *j, uint16_t address, 
+	const uint8_t *data, size_t size)
+{
+	uint32_t addr;
+
+	assert(j != NULL);
+	assert(address + size <= JOURNAL_MEMSIZE);
+
+	for(addr = address; addr < address + size; addr++) {
+		j->keep[addr] = data[addr - address];
+		j->kept[addr / 8] |= 1 << addr % 8;
+	}
+
+	if(j->file) {
+		journal_put_keep(j, address, address + size);
+		fflush(j->file);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will read back memory kept from the device. It returns
+ * -1 if the journal does not record all of it.
+ */
+
+int journal_rd_keep(const struct journal *j, uint16_t address, 
+	uint8_t *data, size_t size)
+{
+	uint32_t addr;
+
+	assert(j != NULL);
+	assert(address + size <= JOURNAL_MEMSIZE);
+
+	for(addr = address; addr < address + size; addr++) {
+		if(!KEPT(j, addr)) {
+			return -1;
+		}
+	}
+	memcpy(data, j->keep + address, size);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will forget all page states. It is used when the
+ * journal can no longer be trusted. The kept memory is still
+ * what the device held before it was first erased.
+ */
+
+void journal_reset(struct journal *j)
+{
+	assert(j != NULL);
+
+	memset(j->page, 0, sizeof(j->page));
+	j->resumed = 0;
+	journal_write(j);
+
+	return;
+}
+
+/**************************************************************
+ * This will close the journal. If the job is done, the journal
+ * file is removed.
+ */
+
+void journal_close(struct journal *j, int done)
+{
+	if(!j) {
+		return;
+	}
+
+	if(j->file) {
+		fclose(j->file);
+	}
+	if(done) {
+		remove(j->filename);
+	}
+
+	free(j->filename);
+	free(j);
+
+	return;
+}
+
+/**************************************************************/
+
@@ -0,0 +1,55 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Flash programming page journal.
+ */
+
+#ifndef	JOURNAL_HEADER
+#define	JOURNAL_HEADER
+
+#include	<stdio.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/* one entry per flash page */
+#define	JOURNAL_PAGESIZE	512
+#define	JOURNAL_PAGES		(0x10000 / JOURNAL_PAGESIZE)
+
+/* page states */
+#define	JOURNAL_ERASED		0x01
+#define	JOURNAL_PROGRAMMED	0x02
+#define	JOURNAL_VERIFIED	0x04
+
+/* memory kept from the device, bytes per journal entry */
+#define	JOURNAL_MEMSIZE		(JOURNAL_PAGES * JOURNAL_PAGESIZE)
+#define	JOURNAL_KEEPLINE	32
+
+struct journal {
+	FILE *file;
+	char *filename;
+	uint16_t crc;
+	int size;
+	int resumed;
+	int mismatch;
+	uint8_t page[JOURNAL_PAGES];
+	uint8_t keep[JOURNAL_MEMSIZE];
+	uint8_t kept[JOURNAL_MEMSIZE / 8];
+};
+
+struct journal *journal_open(const char *, uint16_t, int);
+void journal_mark(struct journal *, int, uint8_t);
+void journal_wr_keep(struct journal *, uint16_t, const uint8_t *, size_t);
+int journal_rd_keep(const struct journal *, uint16_t, uint8_t *, size_t);
+void journal_reset(struct journal *);
+void journal_close(struct journal *, int);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* JOURNAL_HEADER */
+
@@ -8,6 +8,9 @@
 #include	<string.h>
 #include	<stdio.h>
 #include	<assert.h>
+#include	<sys/time.h>
+#include	<sys/types.h>
+#include	<unistd.h>
 #include	<readline/readline.h>
 #include	<readline/history.h>
 #include	"xmalloc.h"
@@ -15,7 +18,9 @@
 #include	"version.h"
 #include	"ez8dbg.h"
 #include	"disassembler.h"
+#include	"image.h"
 #include	"hexfile.h"
+#include	"hexcache.h"
 #include	"dump.h"
 #include	"timer.h"
 
@@ -31,11 +36,12 @@ extern int show_times;
 
 extern rl_command_func_t *tab_function;
 
-uint8_t *filebuff = NULL;
 
 extern bool trce_available(void);
 extern void trce_subsystem(void);
 extern void test_menu(void);
+extern void profile_program(void);
+extern void coverage_program(void);
 
 char *rl_err;
 
@@ -44,6 +50,8 @@ char *rl_err;
  * checks periodically to see if it is stopped.
  */
 
+#define	RUNNING_CHECK	100000
+
 int check_if_running(void)
 {
 	try {
@@ -58,6 +66,76 @@ int check_if_running(void)
 	return 0;
 }
 
+/**************************************************************
+ * This is a readline hook for links that can signal the 
+ * breakpoint acknowledge. It sleeps until a key is pressed,
+ * the acknowledge arrives, or the interval is up, so the part
+ * is not polled, and then calls the real hook.
+ */
+
+static rl_hook_func_t *running_hook;
+static int running_usec;
+
+static int wait_running(void)
+{
+	fd_set rd_fdes;
+	struct timeval t;
+	int fd, tty;
+
+	fd = ez8->poll_fd();
+	if(fd >= 0) {
+		tty = fileno(rl_instream ? rl_instream : stdin);
+		FD_ZERO(&rd_fdes);
+		FD_SET(tty, &rd_fdes);
+		FD_SET(fd, &rd_fdes);
+		t.tv_sec = running_usec / 1000000;
+		t.tv_usec = running_usec % 1000000;
+		select((fd > tty ? fd : tty) + 1, &rd_fdes, NULL, NULL, &t);
+	}
+
+	return running_hook();
+}
+
+/**************************************************************
+ * This will prompt while the part is running, calling hook
+ * about every usec microseconds (and as soon as the part 
+ * stops, if the link can tell) until a line is entered or
+ * the hook sets rl_done. The keyboard timeout is restored
+ * afterwards.
+ */
+
+char *readline_hook(const char *prompt, rl_hook_func_t *hook, int usec)
+{
+	char *buff;
+	int timeout;
+
+	/* wait_running() waits for keys itself */
+	if(ez8->poll_fd() >= 0) {
+		running_hook = hook;
+		running_usec = usec;
+		timeout = rl_set_keyboard_input_timeout(0);
+		rl_event_hook = wait_running;
+	} else {
+		timeout = rl_set_keyboard_input_timeout(usec);
+		rl_event_hook = hook;
+	}
+	buff = readline(prompt);
+	rl_event_hook = NULL;
+	rl_set_keyboard_input_timeout(timeout);
+
+	return buff;
+}
+
+/**************************************************************
+ * This will prompt while the part is running, returning when
+ * a line is entered or the part stops.
+ */
+
+char *readline_running(const char *prompt)
+{
+	return readline_hook(prompt, check_if_running, RUNNING_CHECK);
+}
+
 /**************************************************************
  * display_info()
  *
@@ -152,21 +230,10 @@ void display_info(void)
 int disp_inst(uint16_t addr)
 {
 	int size;
-	uint8_t inst[5];
-	char buff[32];
-
-	if(0x10000 - addr < (int)sizeof(inst)) {
-		size = 0x10000 - addr;
-		memset(buff, 0xff, sizeof(buff));
-	} else {
-		size = sizeof(inst);
-	}
-	
-	ez8->read_mem(addr, inst, size);
+	const uint8_t *inst;
+	const char *buff;
 
-	size = disassemble(buff, sizeof(buff), inst, addr);
-
-	assert(size > 0 && size <= 5);
+	size = ez8->disasm(addr, &inst, &buff);
 
 	if(ez8->breakpoint_set(addr)) {
 		printf("B ");
@@ -174,11 +241,6 @@ int disp_inst(uint16_t addr)
 		printf("  ");
 	}
 
-	if(0x10000 - addr < size) {
-		strncpy(buff, "ill", sizeof(buff)-1);
-		size = 0x10000 - addr;
-	}
-
 	printf("%04X: ", addr);
 
 	switch(size) {
@@ -1217,9 +1279,9 @@ void erase_memory()
 
 void load_file(void)
 {
-	int err;
 	char *filename;
 	char *buff;
+	struct image *image;
 	struct timer t;
 
 	tab_function = rl_complete;	
@@ -1244,14 +1306,8 @@ void load_file(void)
 
 	filename = strtok(buff, " \t\r\n");
 
-	if(!filebuff) {
-		filebuff = (uint8_t *)xmalloc(0x10000);
-	}
-
-	memset(filebuff, 0xff, 0x10000);
-
-	err = rd_hexfile(filebuff, 0x10000, filename);
-	if(err) {
+	image = rd_hexfile_cached(filename, 0xff, 0x10000);
+	if(!image) {
 		free(buff);
 		return;
 	}
@@ -1267,7 +1323,13 @@ void load_file(void)
 		ez8->reset_chip();
 	}
 
-	ez8->wr_mem(0x0000, filebuff, 0x10000);
+	try {
+		ez8->wr_image(image);
+	} catch(char *err) {
+		image_free(image);
+		throw err;
+	}
+	image_free(image);
 	ez8->reset_chip();
 
 	if(show_times) {
@@ -1302,9 +1364,7 @@ void run_program(void)
 
 	ez8->run();
 
-	rl_event_hook = check_if_running;
-	buff = readline("Running... ");
-	rl_event_hook = NULL;
+	buff = readline_running("Running... ");
 	if(buff) {
 		free(buff);
 		buff = NULL;
@@ -1325,8 +1385,10 @@ void run_program(void)
 
 	if(!ez8->state(ez8->state_stopped)) {
 		ez8->stop();
+	} else if(ez8->watchpoint_hit() >= 0) {
+		printf("BREAK - watchpoint %d\n", ez8->watchpoint_hit());
 	} else {
-		cntr = ez8->rd_cntr();
+		cntr = ez8->rd_runcount();
 		if(cntr == 0xffff) {
 			printf("BREAK\n");
 		} else {
@@ -1344,6 +1406,249 @@ void run_program(void)
 	return;
 }
 
+/**************************************************************
+ * time_region()
+ *
+ * This monitor command will measure the clock cycles taken to
+ * run from one address to another. The cpu runs to the start
+ * address, then runs for up to 65535 clocks at a time with the
+ * counter breakpoint until the end address is reached, so 
+ * regions longer than the 16 bit counter are measured by 
+ * adding up the runs.
+ */
+
+#define	REGION_CLKS	0xffff
+#define	REGION_CHECK	1000	/* usec between checks */
+
+static struct {
+	uint16_t start;
+	uint16_t end;
+	int count;
+	int runs;
+	bool timing;
+	bool brk;
+	unsigned long cycles;
+	unsigned long min;
+	unsigned long max;
+	double sum;
+} region;
+
+static void show_cycles(const char *label, double cycles)
+{
+	int sysclk;
+
+	sysclk = ez8->cached_sysclk();
+	printf("%s%.0f cycles", label, cycles);
+	if(sysclk) {
+		printf(" (%.3fus)", cycles * 1e6 / sysclk);
+	}
+
+	return;
+}
+
+/* readline hook, moves on when the cpu stops */
+static int time_region_hook(void)
+{
+	uint16_t pc, cntr;
+
+	try {
+		if(ez8->isrunning()) {
+			return 0;
+		}
+		pc = ez8->rd_pc();
+
+		if(!region.timing) {
+			if(pc != region.start) {
+				region.brk = 1;
+				rl_done = 1;
+				return 0;
+			}
+			region.timing = 1;
+			region.cycles = 0;
+			ez8->run_clks(REGION_CLKS);
+			return 0;
+		}
+
+		cntr = ez8->rd_cntr();
+		region.cycles += REGION_CLKS - cntr;
+		if(pc == region.end) {
+			if(!region.runs || region.cycles < region.min) {
+				region.min = region.cycles;
+			}
+			if(!region.runs || region.cycles > region.max) {
+				region.max = region.cycles;
+			}
+			region.sum += region.cycles;
+			region.runs++;
+			if(region.count > 1) {
+				printf("\n");
+				show_cycles("Run: ", region.cycles);
+			}
+			if(region.runs == region.count) {
+				rl_done = 1;
+				return 0;
+			}
+			region.timing = 0;
+			ez8->run_to(region.start);
+		} else if(cntr == 0) {
+			/* counter ran out, keep going */
+			ez8->run_clks(REGION_CLKS);
+		} else {
+			/* stopped at some other breakpoint */
+			region.brk = 1;
+			rl_done = 1;
+		}
+	} catch(char *err) {
+		rl_done = 1;
+		rl_err = err;
+	}
+
+	return 0;
+}
+
+static int read_region_address(const char *prompt, uint16_t *addr)
+{
+	char *buff, *tail;
+	long value;
+
+	buff = readline(prompt);
+	if(!buff) {
+		printf("Abort\n");
+		return -1;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		free(buff);
+		printf("\nAbort\n");
+		return -1;
+	}
+	value = strtol(buff, &tail, 16);
+	if(!tail || *tail || tail == buff) {
+		printf("Invalid address\n");
+		free(buff);
+		return -1;
+	}
+	free(buff);
+	if(value < 0 || value > 0xffff) {
+		printf("Address out of range\n");
+		return -1;
+	}
+	*addr = value;
+
+	return 0;
+}
+
+void time_region(void)
+{
+	char *buff, *tail;
+	bool end_set;
+
+	memset(&region, 0, sizeof(region));
+
+	if(read_region_address("Start address: ", &region.start)) {
+		return;
+	}
+	if(read_region_address("End address: ", &region.end)) {
+		return;
+	}
+	if(region.start == region.end) {
+		printf("Start and end are the same\n");
+		return;
+	}
+	if(ez8->breakpoint_set(region.start)) {
+		printf("Breakpoint set at start address\n");
+		return;
+	}
+
+	buff = readline("Count [1]: ");
+	if(!buff) {
+		printf("Abort\n");
+		return;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		free(buff);
+		printf("\nAbort\n");
+		return;
+	}
+	region.count = 1;
+	if(*buff) {
+		region.count = strtol(buff, &tail, 0);
+		if(!tail || *tail || tail == buff || region.count <= 0) {
+			printf("Invalid count\n");
+			free(buff);
+			return;
+		}
+	}
+	free(buff);
+
+	/* the end address is a normal breakpoint */
+	end_set = ez8->breakpoint_set(region.end);
+	if(!end_set) {
+		ez8->set_breakpoint(region.end);
+	}
+
+	try {
+		if(ez8->rd_pc() == region.start) {
+			region.timing = 1;
+			ez8->run_clks(REGION_CLKS);
+		} else {
+			ez8->run_to(region.start);
+		}
+
+		buff = readline_hook("Timing... ", time_region_hook, 
+		    REGION_CHECK);
+		if(buff) {
+			free(buff);
+			buff = NULL;
+		} else {
+			printf("\n");
+		}
+		if(esc_key) {
+			esc_key = 0;
+			printf("\n");
+		}
+		if(!ez8->state(ez8->state_stopped)) {
+			ez8->stop();
+		}
+		if(rl_err) {
+			char *err;
+
+			err = rl_err;
+			rl_err = NULL;
+			throw err;
+		}
+	} catch(char *err) {
+		if(!end_set && ez8->state(ez8->state_stopped)) {
+			ez8->remove_breakpoint(region.end);
+		}
+		throw err;
+	}
+	if(!end_set) {
+		ez8->remove_breakpoint(region.end);
+	}
+
+	if(region.brk) {
+		printf("BREAK\n");
+	}
+	if(region.runs == 1) {
+		show_cycles("Elapsed: ", region.min);
+		printf("\n");
+	} else if(region.runs > 1) {
+		printf("%d runs\n", region.runs);
+		show_cycles("Min: ", region.min);
+		printf("\n");
+		show_cycles("Avg: ", region.sum / region.runs);
+		printf("\n");
+		show_cycles("Max: ", region.max);
+		printf("\n");
+	}
+
+	display_registers();
+
+	return;
+}
+
 /**************************************************************
  * step_inst()
  *
@@ -1360,21 +1665,18 @@ void step_inst(void)
 }
 
 /**************************************************************
- * next_inst()
+ * wait_step()
  *
- * This monitor command will step over the next instruction.
+ * This waits for the cpu to stop after stepping over a call,
+ * or out of a function or loop, or until a key is pressed.
  */
 
-void next_inst(void)
+static void wait_step(void)
 {
 	char *buff;
 
-	ez8->next();
-
 	if(!ez8->state(ez8->state_stopped)) {
-		rl_event_hook = check_if_running;
-		buff = readline("");
-		rl_event_hook = NULL;
+		buff = readline_running("");
 		if(buff) {
 			free(buff);
 			buff = NULL;
@@ -1403,109 +1705,219 @@ void next_inst(void)
 	return;
 }
 
+/**************************************************************
+ * next_inst()
+ *
+ * This monitor command will step over the next instruction.
+ */
+
+void next_inst(void)
+{
+	ez8->next();
+	wait_step();
+
+	return;
+}
+
+/**************************************************************
+ * step_out()
+ *
+ * This monitor command will run until the current function
+ * returns.
+ */
+
+void step_out(void)
+{
+	ez8->step_out();
+	wait_step();
+
+	return;
+}
+
+/**************************************************************
+ * step_loop()
+ *
+ * This monitor command will run until the current loop ends.
+ */
+
+void step_loop(void)
+{
+	ez8->step_loop();
+	wait_step();
+
+	return;
+}
+
+/**************************************************************
+ * This will display the condition and hit statistics of
+ * a breakpoint, if it has any.
+ */
+
+void show_bp_condition(uint16_t addr)
+{
+	static const char *ops[] = { "", "==", "!=", "<", "<=", ">", ">=" };
+	struct bp_cond cond;
+	struct bp_stats stats;
+
+	ez8->get_bp_condition(addr, &cond);
+	ez8->get_bp_stats(addr, &stats);
+
+	if(cond.op == bp_always && cond.every <= 1 && !stats.hits) {
+		return;
+	}
+
+	printf("        ");
+	if(cond.op != bp_always) {
+		switch(cond.space) {
+		case bp_wreg:
+			printf("if R%d", cond.address);
+			break;
+		case bp_data:
+			printf("if data %04X", cond.address);
+			break;
+		default:
+			printf("if reg %03X", cond.address);
+			break;
+		}
+		if(cond.mask != 0xff) {
+			printf(" & %02X", cond.mask);
+		}
+		printf(" %s %02X, ", ops[cond.op], cond.value);
+	}
+	if(cond.every > 1) {
+		printf("every %lu, ", cond.every);
+	}
+	printf("%lu hits", stats.hits);
+	if(stats.resumes) {
+		printf(", %lu resumed, %ldus/resume", stats.resumes,
+		    stats.resume_time / (long)stats.resumes);
+	}
+	printf("\n");
+
+	return;
+}
+
 /**************************************************************/
 
 void show_breakpoints(void)
 {
 	int num;
 	int i;
+	uint16_t addr;
 
 	num = ez8->get_num_breakpoints();
 
 	for(i=0; i<num; i++) {
-		disp_inst(ez8->get_breakpoint(i));
+		addr = ez8->get_breakpoint(i);
+		disp_inst(addr);
+		show_bp_condition(addr);
 	}
 
 	return;
 }
 
-/**************************************************************/
+/**************************************************************
+ * This will read a list of breakpoint addresses. It returns 
+ * the number of addresses, or -1 on error.
+ */
 
-void set_breakpoint(void)
+int read_bp_addresses(uint16_t *addrs, int max)
 {
-	int addr;
-	char *buff;
-	char *tail;
-
-	show_breakpoints();
+	int addr, num;
+	char *buff, *tok, *tail;
 
 	buff = readline("Address: ");
 	if(!buff) {
 		printf("Abort\n");
-		return;
+		return -1;
 	}
 	if(esc_key) {
 		esc_key = 0;
 		free(buff);
 		printf("\nAbort\n");
-		return;
+		return -1;
 	}
 
-	addr = strtol(buff, &tail, 16);
-	if(!tail || *tail || tail == buff) {
-		printf("Invalid address\n");
-		free(buff);
-		return;
+	num = 0;
+	for(tok = strtok(buff, " \t,"); tok; tok = strtok(NULL, " \t,")) {
+		addr = strtol(tok, &tail, 16);
+		if(!tail || *tail || tail == tok) {
+			printf("Invalid address\n");
+			free(buff);
+			return -1;
+		}
+		if(addr <= 0x0000 || addr > 0xffff) {
+			printf("Address out of range\n");
+			free(buff);
+			return -1;
+		}
+		if(num == max) {
+			printf("Too many addresses\n");
+			free(buff);
+			return -1;
+		}
+		addrs[num++] = addr;
 	}
 	free(buff);
 
-	if(addr <= 0x0000 || addr > 0xffff) {
-		printf("Address out of range\n");
-		return;
-	}
-
-	if(ez8->breakpoint_set(addr)) {
-		printf("Breakpoint already set\n");
-		return;
+	if(!num) {
+		printf("Invalid address\n");
+		return -1;
 	}
 
-	ez8->set_breakpoint(addr);
-
-	return;
+	return num;
 }
 
 /**************************************************************/
 
-void clear_breakpoint(void)
+#define	MAX_BP_ADDRESSES	64
+
+void set_breakpoint(void)
 {
-	int addr;
-	char *buff;
-	char *tail;
+	uint16_t addrs[MAX_BP_ADDRESSES];
+	int i, num;
 
 	show_breakpoints();
 
-	buff = readline("Address: ");
-	if(!buff) {
-		printf("Abort\n");
+	num = read_bp_addresses(addrs, MAX_BP_ADDRESSES);
+	if(num < 0) {
 		return;
 	}
 
-	if(esc_key) {
-		esc_key = 0;
-		free(buff);
-		printf("\nAbort\n");
-		return;
+	for(i=0; i<num; i++) {
+		if(ez8->breakpoint_set(addrs[i])) {
+			printf("Breakpoint already set\n");
+			return;
+		}
 	}
 
-	addr = strtol(buff, &tail, 16);
-	if(!tail || *tail || tail == buff) {
-		printf("Invalid address\n");
-		free(buff);
-		return;
-	}
-	free(buff);
+	ez8->change_breakpoints(addrs, num, NULL, 0);
 
-	if(addr <= 0x0000 || addr > 0xffff) {
-		printf("Address out of range\n");
+	return;
+}
+
+/**************************************************************/
+
+void clear_breakpoint(void)
+{
+	uint16_t addrs[MAX_BP_ADDRESSES];
+	int i, num;
+
+	show_breakpoints();
+
+	num = read_bp_addresses(addrs, MAX_BP_ADDRESSES);
+	if(num < 0) {
 		return;
 	}
 
-	if(! ez8->breakpoint_set(addr)) {
-		printf("Breakpoint not set\n");
-		return;
+	for(i=0; i<num; i++) {
+		if(! ez8->breakpoint_set(addrs[i])) {
+			printf("Breakpoint not set\n");
+			return;
+		}
 	}
 
-	ez8->remove_breakpoint(addr);
+	ez8->change_breakpoints(NULL, 0, addrs, num);
 
 	return;
 }
@@ -1589,9 +2001,12 @@ void help(void)
 	printf("\tG - run program\n");
 	printf("\tH - display help\n");
 	printf("\tI - info\n");
+	printf("\tK - time region\n");
 	printf("\tL - load program memory from file\n");
 	printf("\tM - modify registers\n");
 	printf("\tN - next (step over calls)\n");
+	printf("\tO - step out of function\n");
+	printf("\tP - profile program\n");
 	printf("\tQ - exit debugger\n");
 	printf("\tR - display working registers\n");
 	printf("\tS - step (step into calls)\n");
@@ -1599,6 +2014,8 @@ void help(void)
 		printf("\tT - trace subsystem\n");
 	}
 	printf("\tU - unassemble instructions\n");
+	printf("\tV - measure code coverage\n");
+	printf("\tW - run to end of loop\n");
 	#ifdef	TEST
 	if(testmenu) {
 		printf("\tX - test menu\n");
@@ -1664,6 +2081,9 @@ int command(int key)
 	case 'I':
 		display_info();
 		break;
+	case 'K':
+		time_region();
+		break;
 	case 'L':
 		load_file();
 		break;
@@ -1673,6 +2093,12 @@ int command(int key)
 	case 'N':
 		next_inst();
 		break;
+	case 'O':
+		step_out();
+		break;
+	case 'P':
+		profile_program();
+		break;
 	case 'Q':
 		key = quit();
 		break;
@@ -1685,6 +2111,12 @@ int command(int key)
 	case 'U':
 		unassemble();
 		break;
+	case 'V':
+		coverage_program();
+		break;
+	case 'W':
+		step_loop();
+		break;
 	case 'Z':
 		reset_part();
 		break;
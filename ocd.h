@@ -38,6 +38,10 @@ public:
 
 	virtual bool available(void) = 0;
 	virtual bool error(void) = 0;
+
+	/* links that can wait for data without polling */
+	virtual bool wait(int) { return available(); };
+	virtual int poll_fd(void) { return -1; };
 };
 
 /**************************************************************/
@@ -319,6 +319,42 @@ bool ocd_serial::available(void)
 	return serialport::available();
 }
 
+/**************************************************************
+ * This will wait up to msec milliseconds (forever if negative)
+ * for data to be available to be read, without polling.
+ */
+
+bool ocd_serial::wait(int msec)
+{
+	if(!open) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "serial port not open\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(!up) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "link needs to be reset first\n", err_len-1);
+		throw err_msg;
+	}
+
+	return serialport::wait(msec);
+}
+
+/**************************************************************
+ * This returns a file descriptor that becomes readable when
+ * data is available, or -1 if there is none.
+ */
+
+int ocd_serial::poll_fd(void)
+{
+	if(!open || !up) {
+		return -1;
+	}
+
+	return serialport::fd();
+}
+
 /**************************************************************
  * This function will check if there is an error pending
  * (such as a break condition). This is used to determine
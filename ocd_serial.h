@@ -39,6 +39,8 @@ public:
 
 	bool available(void);
 	bool error(void);
+	bool wait(int);
+	int poll_fd(void);
 
 	void write(const uint8_t *, size_t);
 	void read(uint8_t *, size_t);
@@ -0,0 +1,666 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This is the simulator ocd connection. It speaks the same
+ * protocol as the on-chip debugger, so everything above the
+ * link works unchanged, but commands are carried out by the
+ * instruction set simulator in ez8sim.c.
+ *
+ * The simulated cpu runs in real time at the system clock.
+ * It only runs when the link is used, catching up on the time
+ * that passed since it was last used, so a running program
+ * does not take any host time while nobody is looking at it.
+ */
+
+#include	<string.h>
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<assert.h>
+#include	<sys/time.h>
+#include	"xmalloc.h"
+
+#include	"ez8.h"
+#include	"ez8sim.h"
+#include	"image.h"
+#include	"hexfile.h"
+#include	"disassembler.h"
+#include	"ocd_sim.h"
+
+#include	"err_msg.h"
+
+/**************************************************************/
+
+/* read memory size, not in ez8.h since it is not a real command */
+#define	DBG_CMD_RD_MEMSIZE	0xf3
+#define	MEMSIZE_REGISTER	0x84
+
+/* longest time the simulator will catch up on, in usec */
+#define	MAX_CATCH_UP		100000
+
+/* poll interval while waiting for a running cpu, in usec */
+#define	WAIT_TICK		1000
+
+/**************************************************************
+ * Constructor for ocd_sim class.
+ */
+
+ocd_sim::ocd_sim(void)
+{
+	sim = NULL;
+	open = 0;
+	up = 0;
+	clock = 0;
+	timeout = 1000;
+
+	command_len = 0;
+	command_alloc = BUFSIZ;
+	command = (uint8_t *)xmalloc(command_alloc);
+
+	reply_len = reply_pos = 0;
+	reply_alloc = BUFSIZ;
+	reply = (uint8_t *)xmalloc(reply_alloc);
+
+	return;
+}
+
+/**************************************************************
+ * Destructor for ocd_sim class.
+ */
+
+ocd_sim::~ocd_sim(void)
+{
+	if(sim) {
+		ez8sim_free(sim);
+		sim = NULL;
+	}
+	if(command) {
+		free(command);
+		command = NULL;
+	}
+	if(reply) {
+		free(reply);
+		reply = NULL;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will create the simulated part. If image is not NULL,
+ * program memory is loaded from that hex file, as if it had
+ * been programmed already.
+ */
+
+void ocd_sim::connect(const char *image, int sysclk)
+{
+	struct image *img;
+
+	if(sim) {
+		strncpy(err_msg, "Cannot connect to simulator\n"
+		    "already connected\n", err_len-1);
+		throw err_msg;
+	}
+	if(sysclk <= 0) {
+		strncpy(err_msg, "Cannot connect to simulator\n"
+		    "system clock not set\n", err_len-1);
+		throw err_msg;
+	}
+
+	sim = ez8sim_new();
+
+	if(image && *image != '\0') {
+		img = rd_hexfile_image(image, 0xff, EZ8MEM_SIZE);
+		if(!img) {
+			ez8sim_free(sim);
+			sim = NULL;
+			snprintf(err_msg, err_len-1,
+			    "Cannot connect to simulator\n"
+			    "could not read \"%s\"\n", image);
+			throw err_msg;
+		}
+		image_read(img, 0x0000, sim->mem, EZ8MEM_SIZE);
+		image_free(img);
+		ez8sim_reset(sim);
+	}
+
+	clock = sysclk;
+	gettimeofday(&last, NULL);
+	open = 1;
+
+	return;
+}
+
+/**************************************************************
+ * This will run the cpu for the time that passed since the
+ * link was last used. If it stops on a breakpoint, and the
+ * debugger asked for it, an acknowledge is sent.
+ */
+
+void ocd_sim::catch_up(void)
+{
+	struct timeval now;
+	long usec;
+	enum ez8sim_stop stop;
+
+	gettimeofday(&now, NULL);
+	usec = (now.tv_sec - last.tv_sec) * 1000000 +
+	    (now.tv_usec - last.tv_usec);
+	last = now;
+
+	if(sim->dbgctl & DBGCTL_DBG_MODE) {
+		return;
+	}
+
+	if(usec <= 0) {
+		return;
+	}
+	if(usec > MAX_CATCH_UP) {
+		usec = MAX_CATCH_UP;
+	}
+
+	stop = ez8sim_run(sim, (unsigned long)((double)usec * clock / 1e6));
+	if(stop != sim_running && (sim->dbgctl & DBGCTL_BRK_ACK)) {
+		queue_byte(0xff);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * These will queue a reply to be read.
+ */
+
+void ocd_sim::queue(const uint8_t *data, size_t size)
+{
+	if(reply_pos == reply_len) {
+		reply_pos = reply_len = 0;
+	}
+	if(reply_len + size > reply_alloc) {
+		while(reply_len + size > reply_alloc) {
+			reply_alloc *= 2;
+		}
+		reply = (uint8_t *)xrealloc(reply, reply_alloc);
+	}
+
+	memcpy(reply + reply_len, data, size);
+	reply_len += size;
+
+	return;
+}
+
+void ocd_sim::queue_byte(uint8_t data)
+{
+	queue(&data, 1);
+
+	return;
+}
+
+void ocd_sim::queue_word(uint16_t data)
+{
+	uint8_t buff[2];
+
+	buff[0] = (data >> 8) & 0xff;
+	buff[1] = data & 0xff;
+	queue(buff, 2);
+
+	return;
+}
+
+/**************************************************************
+ * This will return the size of the command being received,
+ * or 0 if not enough of it has been received to tell.
+ */
+
+size_t ocd_sim::command_size(void)
+{
+	size_t size;
+	int branch;
+
+	if(command_len < 1) {
+		return 0;
+	}
+
+	switch(command[0]) {
+	case DBG_CMD_WR_CNTR:
+	case DBG_CMD_WR_PC:
+		return 3;
+	case DBG_CMD_WR_DBGCTL:
+	case DBG_CMD_STUFF_INST:
+	case DBG_CMD_RD_MEMSIZE:
+		return 2;
+	case DBG_CMD_RD_REG:
+		return 4;
+	case DBG_CMD_WR_REG:
+		if(command_len < 4) {
+			return 0;
+		}
+		return 4 + (command[3] ? command[3] : 0x100);
+	case DBG_CMD_RD_MEM:
+	case DBG_CMD_RD_EDATA:
+		return 5;
+	case DBG_CMD_WR_MEM:
+	case DBG_CMD_WR_EDATA:
+		if(command_len < 5) {
+			return 0;
+		}
+		size = (command[3] << 8) | command[4];
+		return 5 + (size ? size : 0x10000);
+	case DBG_CMD_EXEC_INST:
+		if(command_len < 2) {
+			return 0;
+		}
+		if(command[1] == 0x1f && command_len < 3) {
+			return 0;
+		}
+		return 1 + inst_size(command + 1, &branch);
+	case DBG_CMD_TRCE_CMD:
+		if(command_len < 2) {
+			return 0;
+		}
+		switch(command[1]) {
+		case TRCE_CMD_WR_TRCE_CTL:
+		case TRCE_CMD_RD_TRCE_EVENT:
+			return 3;
+		case TRCE_CMD_WR_TRCE_EVENT:
+			return 16;
+		case TRCE_CMD_RD_TRCE_BUFF:
+			return 6;
+		default:
+			return 2;
+		}
+	default:
+		return 1;
+	}
+}
+
+/**************************************************************
+ * This will carry out a trace command.
+ */
+
+void ocd_sim::do_trce_command(void)
+{
+	struct ez8sim_event event;
+	unsigned long i, size;
+	uint16_t addr;
+
+	switch(command[1]) {
+	case TRCE_CMD_RD_TRCE_STATUS:
+		queue_byte(sim->trce_status);
+		break;
+	case TRCE_CMD_WR_TRCE_CTL:
+		sim->trce_ctl = command[2];
+		break;
+	case TRCE_CMD_RD_TRCE_CTL:
+		queue_byte(sim->trce_ctl);
+		break;
+	case TRCE_CMD_WR_TRCE_EVENT:
+		event.ctl = command[3];
+		memcpy(event.mask, command + 4, 6);
+		memcpy(event.data, command + 10, 6);
+		ez8sim_wr_event(sim, command[2] % TRCE_EVENTS, &event);
+		break;
+	case TRCE_CMD_RD_TRCE_EVENT:
+		i = command[2] % TRCE_EVENTS;
+		queue_byte(sim->events[i].ctl);
+		queue(sim->events[i].mask, 6);
+		queue(sim->events[i].data, 6);
+		break;
+	case TRCE_CMD_RD_TRCE_WR_PTR:
+		queue_word(sim->trce_wr);
+		break;
+	case TRCE_CMD_RD_TRCE_BUFF:
+		addr = (command[2] << 8) | command[3];
+		size = (command[4] << 8) | command[5];
+		if(!size) {
+			size = 0x10000;
+		}
+		for(i=0; i<size; i++) {
+			queue(sim->trce_buff +
+			    (uint16_t)(addr + i) * EZ8SIM_TRCE_FRAME,
+			    EZ8SIM_TRCE_FRAME);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will carry out a complete command. Program memory
+ * reads as FF, and cannot be written, while read protect is
+ * enabled. Instructions cannot be stepped while running.
+ */
+
+void ocd_sim::do_command(void)
+{
+	uint8_t inst[6];
+	unsigned long i, size;
+	uint16_t addr;
+	bool stopped;
+
+	stopped = sim->dbgctl & DBGCTL_DBG_MODE;
+	addr = (command[1] << 8) | command[2];
+
+	switch(command[0]) {
+	case DBG_CMD_RD_REVID:
+		queue_word(EZ8SIM_REVID);
+		break;
+	case DBG_CMD_WR_CNTR:
+		sim->cntr = addr;
+		break;
+	case DBG_CMD_RD_DBGSTAT:
+		queue_byte(ez8sim_rd_dbgstat(sim));
+		break;
+	case DBG_CMD_RD_CNTR:
+		queue_word(sim->cntr);
+		break;
+	case DBG_CMD_WR_DBGCTL:
+		ez8sim_wr_dbgctl(sim, command[1]);
+		break;
+	case DBG_CMD_RD_DBGCTL:
+		queue_byte(sim->dbgctl);
+		break;
+	case DBG_CMD_WR_PC:
+		sim->pc = addr;
+		break;
+	case DBG_CMD_RD_PC:
+		queue_word(sim->pc);
+		break;
+	case DBG_CMD_WR_REG:
+		size = command[3] ? command[3] : 0x100;
+		for(i=0; i<size; i++) {
+			ez8sim_wr_reg(sim, addr + i, command[4 + i]);
+		}
+		break;
+	case DBG_CMD_RD_REG:
+		size = command[3] ? command[3] : 0x100;
+		for(i=0; i<size; i++) {
+			queue_byte(ez8sim_rd_reg(sim, addr + i));
+		}
+		break;
+	case DBG_CMD_WR_MEM:
+		size = (command[3] << 8) | command[4];
+		if(!size) {
+			size = 0x10000;
+		}
+		for(i=0; i<size && !sim->protect; i++) {
+			ez8sim_wr_mem(sim, addr + i, command[5 + i]);
+		}
+		break;
+	case DBG_CMD_RD_MEM:
+		size = (command[3] << 8) | command[4];
+		if(!size) {
+			size = 0x10000;
+		}
+		for(i=0; i<size; i++) {
+			queue_byte(sim->protect ? 0xff :
+			    ez8sim_rd_mem(sim, addr + i));
+		}
+		break;
+	case DBG_CMD_WR_EDATA:
+		size = (command[3] << 8) | command[4];
+		if(!size) {
+			size = 0x10000;
+		}
+		for(i=0; i<size; i++) {
+			sim->data[(uint16_t)(addr + i)] = command[5 + i];
+		}
+		break;
+	case DBG_CMD_RD_EDATA:
+		size = (command[3] << 8) | command[4];
+		if(!size) {
+			size = 0x10000;
+		}
+		for(i=0; i<size; i++) {
+			queue_byte(sim->data[(uint16_t)(addr + i)]);
+		}
+		break;
+	case DBG_CMD_RD_MEMCRC:
+		queue_word(ez8sim_crc(sim));
+		break;
+	case DBG_CMD_STEP_INST:
+		if(stopped) {
+			ez8sim_step(sim, -1);
+		}
+		break;
+	case DBG_CMD_STUFF_INST:
+		if(stopped) {
+			ez8sim_step(sim, command[1]);
+		}
+		break;
+	case DBG_CMD_EXEC_INST:
+		memset(inst, 0, sizeof(inst));
+		memcpy(inst, command + 1, command_len - 1);
+		if(stopped) {
+			ez8sim_exec(sim, inst);
+		}
+		break;
+	case DBG_CMD_RD_RELOAD:
+		queue_word(0x0000);
+		break;
+	case DBG_CMD_RD_MEMSIZE:
+		if(command[1] == MEMSIZE_REGISTER) {
+			queue_byte(EZ8SIM_MEMSIZE);
+		}
+		break;
+	case DBG_CMD_TRCE_CMD:
+		do_trce_command();
+		break;
+	case DBG_CMD_AUTOBAUD:
+	default:
+		break;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will reset the link. Anything half sent or not yet
+ * read is thrown away, as a break on the serial line does.
+ */
+
+void ocd_sim::reset(void)
+{
+	if(!open) {
+		strncpy(err_msg, "Cannot reset on-chip debugger link\n"
+		    "simulator not connected\n", err_len-1);
+		throw err_msg;
+	}
+
+	catch_up();
+	command_len = 0;
+	reply_len = reply_pos = 0;
+	up = 1;
+
+	return;
+}
+
+/**************************************************************/
+
+bool ocd_sim::link_open(void)
+{
+	return open;
+}
+
+bool ocd_sim::link_up(void)
+{
+	return up;
+}
+
+/**************************************************************
+ * The simulator does not have a baudrate, so the system clock
+ * cannot be determined from it.
+ */
+
+int ocd_sim::link_speed(void)
+{
+	return 0;
+}
+
+void ocd_sim::set_baudrate(int baudrate)
+{
+	return;
+}
+
+void ocd_sim::set_timeout(int msec)
+{
+	timeout = msec;
+
+	return;
+}
+
+/**************************************************************/
+
+bool ocd_sim::error(void)
+{
+	return 0;
+}
+
+/**************************************************************
+ * This will determine if data is available to be read.
+ */
+
+bool ocd_sim::available(void)
+{
+	if(!open) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "simulator not connected\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(!up) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "link needs to be reset first\n", err_len-1);
+		throw err_msg;
+	}
+
+	catch_up();
+
+	return reply_pos < reply_len;
+}
+
+/**************************************************************
+ * This will wait up to msec milliseconds (forever if negative)
+ * for data to be available. Data only comes unasked for when
+ * the cpu stops, so it gives up at once if it is stopped.
+ */
+
+bool ocd_sim::wait(int msec)
+{
+	struct timeval start, now;
+	long elapsed;
+
+	gettimeofday(&start, NULL);
+
+	for(;;) {
+		if(available()) {
+			return 1;
+		}
+		if(sim->dbgctl & DBGCTL_DBG_MODE) {
+			return 0;
+		}
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_usec - start.tv_usec) / 1000;
+		if(msec >= 0 && elapsed >= msec) {
+			return 0;
+		}
+
+		usleep(WAIT_TICK);
+	}
+}
+
+/**************************************************************
+ * This will read a reply. Replies are made as soon as the
+ * command is written, so there is only something to wait for
+ * when the cpu is running and has not stopped yet.
+ */
+
+void ocd_sim::read(uint8_t *buff, size_t size)
+{
+	size_t len;
+
+	assert(buff != NULL);
+
+	if(!open) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "simulator not connected\n", err_len-1);
+		throw err_msg;
+	}
+
+	if(!up) {
+		strncpy(err_msg, "Cannot read from on-chip debugger\n"
+		    "link needs to be reset first\n", err_len-1);
+		throw err_msg;
+	}
+
+	while(size > 0) {
+		if(reply_pos == reply_len && !wait(timeout)) {
+			up = 0;
+			strncpy(err_msg, "Read from on-chip debugger failed\n"
+			    "simulator read timeout\n", err_len-1);
+			throw err_msg;
+		}
+
+		len = reply_len - reply_pos;
+		if(len > size) {
+			len = size;
+		}
+		memcpy(buff, reply + reply_pos, len);
+		reply_pos += len;
+		buff += len;
+		size -= len;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will write to the simulator. Each command is carried
+ * out as soon as all of it has been written.
+ */
+
+void ocd_sim::write(const uint8_t *buff, size_t size)
+{
+	size_t len;
+
+	assert(buff != NULL);
+
+	if(!open) {
+		strncpy(err_msg, "Cannot write to on-chip debugger\n"
+		    "simulator not connected\n", err_len-1);
+		throw err_msg;
+	}
+	if(!up) {
+		strncpy(err_msg, "Cannot write to on-chip debugger\n"
+		    "link needs to be reset first\n", err_len-1);
+		throw err_msg;
+	}
+
+	catch_up();
+
+	while(size > 0) {
+		if(command_len == command_alloc) {
+			command_alloc *= 2;
+			command = (uint8_t *)xrealloc(command, command_alloc);
+		}
+		command[command_len++] = *buff++;
+		size--;
+
+		len = command_size();
+		if(len && command_len >= len) {
+			do_command();
+			command_len = 0;
+		}
+	}
+
+	return;
+}
+
+/**************************************************************/
+
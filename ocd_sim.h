@@ -0,0 +1,74 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This is the simulator interface class for the ez8 on-chip
+ * debugger. Commands are carried out by an instruction set
+ * simulator instead of a chip.
+ */
+
+#ifndef	OCD_SIM_HEADER
+#define	OCD_SIM_HEADER
+
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<sys/time.h>
+
+#include	"ez8sim.h"
+#include	"ocd.h"
+
+/**************************************************************/
+
+class ocd_sim : public ocd
+{
+private:
+	struct ez8sim *sim;
+	bool open, up;
+	int clock;
+	int timeout;
+	struct timeval last;
+
+	/* command being received */
+	uint8_t *command;
+	size_t command_len, command_alloc;
+
+	/* reply waiting to be read */
+	uint8_t *reply;
+	size_t reply_len, reply_pos, reply_alloc;
+
+	/* Prohibit use of copy constructor */
+	ocd_sim(ocd_sim &);
+
+	void catch_up(void);
+	size_t command_size(void);
+	void do_command(void);
+	void do_trce_command(void);
+	void queue(const uint8_t *, size_t);
+	void queue_byte(uint8_t);
+	void queue_word(uint16_t);
+
+public:
+	ocd_sim();
+	~ocd_sim();
+
+	void connect(const char *, int);
+	void reset(void);
+
+	bool link_open(void);
+	bool link_up(void);
+	int  link_speed(void);
+	void set_baudrate(int);
+	void set_timeout(int);
+
+	bool available(void);
+	bool error(void);
+	bool wait(int);
+
+	void read(uint8_t *, size_t);
+	void write(const uint8_t *, size_t);
+};
+
+/**************************************************************/
+
+#endif	/* OCD_SIM_HEADER */
+
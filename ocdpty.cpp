@@ -0,0 +1,539 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This program pretends to be an on-chip debugger at the far
+ * end of a serial cable. It opens a pseudo-terminal, and
+ * answers on it the way the OCD answers on its shared tx/rx
+ * line, with the commands carried out by the simulator. The
+ * debugger and flashutil can then be pointed at the slave side
+ * of the pseudo-terminal, to test the whole serial stack
+ * without a board.
+ *
+ * Everything received is echoed, as the tx and rx lines are
+ * tied together. Delays can be added to every byte sent and
+ * before each reply, and bytes sent can be dropped or have a
+ * bit flipped, to exercise the timeout and retry logic. The
+ * errors are drawn from a seeded random number generator, so
+ * a run can be repeated.
+ *
+ * A pseudo-terminal cannot carry a break. The debugger always
+ * flushes the serial port around a break though, so with the
+ * master in packet mode, a flush of the slave side is taken
+ * to be a break, and resets the link.
+ */
+
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<poll.h>
+#include	<termios.h>
+#include	<sys/ioctl.h>
+#include	"xmalloc.h"
+
+#include	"ez8.h"
+#include	"ocd_sim.h"
+#include	"version.h"
+
+/**************************************************************/
+
+#ifndef	DEFAULT_XTAL
+#define	DEFAULT_XTAL 18432000
+#endif
+
+/* how often to look for a break while the cpu runs, in msec */
+#define	POLL_TICK	10
+
+/**************************************************************/
+
+static const char *banner = "Z8 Encore! OCD Emulator";
+static const char *progname;
+
+static char *hexfilename = NULL;
+static char *linkname = NULL;
+static int xtal = DEFAULT_XTAL;
+static int latency = 0;
+static int turnaround = 0;
+static int drop = 0;
+static int corrupt = 0;
+static unsigned int seed = 1;
+static int verbose = 0;
+
+static int master = -1;
+static int slave = -1;
+static ocd_sim *sim = NULL;
+static volatile sig_atomic_t done = 0;
+
+/* link statistics */
+static unsigned long bytes_read = 0;
+static unsigned long bytes_sent = 0;
+static unsigned long breaks = 0;
+static unsigned long dropped = 0;
+static unsigned long corrupted = 0;
+
+/**************************************************************/
+
+void help(void)
+{
+printf("%s - build %s\n", progname, build);
+printf("Usage: %s [OPTION]... [FILE]\n", progname);
+printf("Emulate a Z8 Encore! on-chip debugger on a pseudo-terminal.\n\n");
+printf("  -h               show this help\n");
+printf("  -c FREQUENCY     clock frequency in hertz (default: %d)\n",
+    DEFAULT_XTAL);
+printf("  -L LINK          make LINK a symbolic link to the terminal\n");
+printf("  -b BAUDRATE      delay each byte sent by its time on the wire\n");
+printf("  -l USEC          delay each byte sent by USEC\n");
+printf("  -a USEC          delay each reply by USEC\n");
+printf("  -d N             drop one in N bytes sent\n");
+printf("  -e N             flip a bit in one in N bytes sent\n");
+printf("  -s SEED          seed for dropped and flipped bytes (default: 1)\n");
+printf("  -v               log link traffic\n");
+printf("\n");
+printf("FILE is a hex file to load into program memory. The name of\n");
+printf("the terminal is printed on the first line of output.\n");
+printf("\n");
+
+return;
+}
+
+/**************************************************************/
+
+static int number(const char *arg, const char *what)
+{
+	char *last;
+	long value;
+
+	value = strtol(arg, &last, 0);
+	if(!last || last == arg || *last != '\0' || value < 0) {
+		fprintf(stderr, "Invalid %s \'%s\'\n", what, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return (int)value;
+}
+
+int setup(int argc, char **argv)
+{
+	int c, baudrate;
+	char *last;
+	double clock;
+
+	progname = argv[0];
+
+	while((c = getopt(argc, argv, "hc:L:b:l:a:d:e:s:v")) != EOF) {
+		switch(c) {
+		case '?':
+			printf("Try '%s -h' for more information.\n", argv[0]);
+			exit(EXIT_FAILURE);
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+			break;
+		case 'c':
+			clock = strtod(optarg, &last);
+			if(!last || last == optarg) {
+				fprintf(stderr,
+				    "Invalid clock frequency \'%s\'\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			if(*last == 'k' || *last == 'K') {
+				clock *= 1000;
+				last++;
+			} else if(*last == 'M') {
+				clock *= 1000000;
+				last++;
+			}
+
+			if(*last && strcasecmp(last, "Hz")) {
+				fprintf(stderr, "Invalid clock suffix '%s'\n",
+				    last);
+				exit(EXIT_FAILURE);
+			}
+			if(clock < 20000 || clock > 65000000) {
+				fprintf(stderr,
+				    "Clock frequency out of range\n");
+				exit(EXIT_FAILURE);
+			}
+			xtal = (int)clock;
+			break;
+		case 'L':
+			linkname = optarg;
+			break;
+		case 'b':
+			baudrate = number(optarg, "baudrate");
+			if(!baudrate) {
+				fprintf(stderr,
+				    "Invalid baudrate \'%s\'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			/* start, 8 data and stop bits */
+			latency = 10 * 1000000 / baudrate;
+			break;
+		case 'l':
+			latency = number(optarg, "latency");
+			break;
+		case 'a':
+			turnaround = number(optarg, "turnaround delay");
+			break;
+		case 'd':
+			drop = number(optarg, "drop rate");
+			break;
+		case 'e':
+			corrupt = number(optarg, "error rate");
+			break;
+		case 's':
+			seed = number(optarg, "seed");
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			abort();
+		}
+	}
+
+	if(optind < argc) {
+		hexfilename = argv[optind++];
+	}
+	if(optind < argc) {
+		printf("%s: too many arguments.\n", progname);
+		printf("Try '%s -h' for more information.\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	srand(seed);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will open the pseudo-terminal. The slave side is kept
+ * open, so the master does not hang up between clients, and
+ * set raw, so nothing is echoed before a client sets it up.
+ */
+
+int open_pty(void)
+{
+	struct termios cfg;
+	char *name;
+	int err, pkt;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if(grantpt(master) || unlockpt(master)) {
+		perror("grantpt");
+		return -1;
+	}
+	name = ptsname(master);
+	if(!name) {
+		perror("ptsname");
+		return -1;
+	}
+
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if(slave < 0) {
+		perror(name);
+		return -1;
+	}
+	err = tcgetattr(slave, &cfg);
+	if(!err) {
+		cfmakeraw(&cfg);
+		err = tcsetattr(slave, TCSANOW, &cfg);
+	}
+	if(err) {
+		perror("tcsetattr");
+		return -1;
+	}
+
+	pkt = 1;
+	err = ioctl(master, TIOCPKT, &pkt);
+	if(err) {
+		perror("TIOCPKT");
+		return -1;
+	}
+
+	if(linkname) {
+		unlink(linkname);
+		err = symlink(name, linkname);
+		if(err) {
+			perror(linkname);
+			return -1;
+		}
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will send bytes to the debugger, one at a time, with
+ * the per byte delay and injected errors.
+ */
+
+static int one_in(int n)
+{
+	return n > 0 && rand() % n == 0;
+}
+
+void transmit(const uint8_t *buff, size_t size)
+{
+	uint8_t data;
+	ssize_t len;
+
+	while(size > 0) {
+		data = *buff++;
+		size--;
+
+		if(latency) {
+			usleep(latency);
+		}
+		if(one_in(drop)) {
+			dropped++;
+			if(verbose) {
+				printf("drop  %02X\n", data);
+			}
+			continue;
+		}
+		if(one_in(corrupt)) {
+			corrupted++;
+			data ^= 1 << (rand() % 8);
+			if(verbose) {
+				printf("flip  %02X\n", data);
+			}
+		}
+
+		do {
+			len = write(master, &data, 1);
+		} while(len < 0 && errno == EINTR);
+		if(len < 0) {
+			perror("write");
+			done = 1;
+			return;
+		}
+		bytes_sent++;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will send whatever the simulator has to say, after the
+ * turnaround delay.
+ */
+
+void reply(void)
+{
+	uint8_t buff[BUFSIZ];
+	size_t len;
+	int i;
+
+	if(!sim->available()) {
+		return;
+	}
+	if(turnaround) {
+		usleep(turnaround);
+	}
+
+	do {
+		for(len=0; len<sizeof(buff) && sim->available(); len++) {
+			sim->read(buff + len, 1);
+		}
+		if(verbose) {
+			printf("dbg ->\t");
+			for(i=0; i<(int)len; i++) {
+				if(i % 16 == 0 && i) {
+					printf("\n\t");
+				} else if(i % 8 == 0 && i) {
+					printf(" ");
+				}
+				printf("%02X ", buff[i]);
+			}
+			printf("\n");
+		}
+		transmit(buff, len);
+	} while(len == sizeof(buff));
+
+	return;
+}
+
+/**************************************************************
+ * This will handle bytes from the debugger. Each is echoed,
+ * then given to the simulator, and any reply is sent before
+ * the next byte is looked at.
+ */
+
+void receive(const uint8_t *buff, size_t size)
+{
+	size_t i;
+
+	if(verbose) {
+		printf("dbg <-\t");
+		for(i=0; i<size; i++) {
+			if(i % 16 == 0 && i) {
+				printf("\n\t");
+			} else if(i % 8 == 0 && i) {
+				printf(" ");
+			}
+			printf("%02X ", buff[i]);
+		}
+		printf("\n");
+	}
+
+	for(i=0; i<size && !done; i++) {
+		bytes_read++;
+		transmit(buff + i, 1);
+		sim->write(buff + i, 1);
+		reply();
+	}
+
+	return;
+}
+
+/**************************************************************
+ * A break throws away any command half received and any
+ * reply not yet sent.
+ */
+
+void line_break(void)
+{
+	breaks++;
+	if(verbose) {
+		printf("break\n");
+	}
+
+	sim->reset();
+
+	return;
+}
+
+/**************************************************************/
+
+void quit(int sig)
+{
+	done = 1;
+
+	return;
+}
+
+int run(void)
+{
+	uint8_t buff[BUFSIZ + 1];
+	struct pollfd pfd;
+	ssize_t len;
+	int n;
+
+	while(!done) {
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		n = poll(&pfd, 1, POLL_TICK);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			return -1;
+		}
+
+		try {
+			if(n > 0 && pfd.revents & POLLIN) {
+				len = read(master, buff, sizeof(buff));
+				if(len < 0) {
+					if(errno == EINTR || errno == EAGAIN) {
+						continue;
+					}
+					perror("read");
+					return -1;
+				}
+				if(len == 0) {
+					continue;
+				}
+
+				/* packet mode, first byte says what it is */
+				if(buff[0] != TIOCPKT_DATA) {
+					if(buff[0] & (TIOCPKT_FLUSHREAD |
+					    TIOCPKT_FLUSHWRITE)) {
+						line_break();
+					}
+					continue;
+				}
+				receive(buff + 1, len - 1);
+			}
+
+			/* breakpoint acknowledge */
+			reply();
+
+		} catch(char *err) {
+			fprintf(stderr, "%s", err);
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************/
+
+int main(int argc, char **argv)
+{
+	int err;
+
+	setup(argc, argv);
+
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+	signal(SIGPIPE, SIG_IGN);
+
+	sim = new ocd_sim();
+	try {
+		sim->connect(hexfilename, xtal);
+		sim->reset();
+	} catch(char *err) {
+		fprintf(stderr, "%s", err);
+		delete sim;
+		return EXIT_FAILURE;
+	}
+
+	err = open_pty();
+	if(!err) {
+		if(verbose) {
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			printf("%s - build %s\n", banner, build);
+		}
+		err = run();
+	}
+
+	if(linkname) {
+		unlink(linkname);
+	}
+	if(slave >= 0) {
+		close(slave);
+	}
+	if(master >= 0) {
+		close(master);
+	}
+	delete sim;
+
+	if(verbose) {
+		printf("%lu bytes read, %lu sent, %lu breaks, "
+		    "%lu dropped, %lu flipped\n", bytes_read, bytes_sent,
+		    breaks, dropped, corrupted);
+	}
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**************************************************************/
+
@@ -0,0 +1,640 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This is a sampling profiler for parts without a trace
+ * buffer. While the program runs, it is periodically stopped,
+ * its pc (and optionally the top of the stack) is read, and it
+ * is run again.
+ *
+ * Samples are resolved to functions after the profile is
+ * taken, so as little time as possible is spent with the cpu
+ * stopped. Functions come from a symbol file, or are found by
+ * looking for call instructions in program memory. Callers
+ * are found by looking for return addresses on the stack.
+ */
+
+#include	<string.h>
+#include	<stdio.h>
+#include	<ctype.h>
+#include	<assert.h>
+#include	<sys/time.h>
+#include	<readline/readline.h>
+#include	<readline/history.h>
+#include	"xmalloc.h"
+
+#include	"ez8dbg.h"
+#include	"ez8.h"
+#include	"disassembler.h"
+#include	"timer.h"
+
+/**************************************************************/
+
+extern int esc_key;
+extern char *readline_hook(const char *, rl_hook_func_t *, int);
+extern ez8dbg *ez8;
+extern rl_command_func_t *tab_function;
+extern void display_registers(void);
+
+/* bytes of stack saved with each sample */
+#define	PROF_STACK	32
+
+/* callers to look for on the stack */
+#define	PROF_DEPTH	8
+
+/* default interval between samples (ms) */
+#define	PROF_INTERVAL	10
+
+struct sample {
+	uint16_t pc;
+	uint16_t sp;
+	uint8_t size;
+	uint8_t stack[PROF_STACK];
+};
+
+struct symbol {
+	uint16_t address;
+	char *name;
+	unsigned long count;
+};
+
+static struct sample *samples = NULL;
+static size_t num_samples = 0;
+static size_t max_samples = 0;
+static bool prof_stack = 0;
+static bool prof_brk = 0;
+static long prof_stopped = 0;
+static char *prof_err = NULL;
+
+static struct symbol *symbols = NULL;
+static size_t num_symbols = 0;
+
+/**************************************************************
+ * This is a readline hook. It is called periodically while
+ * profiling, and takes one sample.
+ */
+
+static int take_sample(void)
+{
+	struct sample *s;
+	struct timer t;
+	uint8_t sp[2];
+	int size;
+
+	try {
+		if(!ez8->isrunning()) {
+			prof_brk = 1;
+			rl_done = 1;
+			return 0;
+		}
+
+		timerstart(&t);
+		ez8->stop();
+
+		if(num_samples == max_samples) {
+			max_samples = max_samples ? max_samples * 2 : 1024;
+			samples = (struct sample *)xrealloc(samples,
+			    max_samples * sizeof(struct sample));
+		}
+		s = &samples[num_samples];
+		s->pc = ez8->rd_pc();
+		s->sp = 0;
+		s->size = 0;
+
+		/* stopped at a breakpoint before we stopped it */
+		if(ez8->breakpoint_set(s->pc)) {
+			prof_brk = 1;
+			rl_done = 1;
+			return 0;
+		}
+
+		if(prof_stack) {
+			ez8->rd_regs(EZ8_SPH, sp, 2);
+			s->sp = (sp[0] << 8) | sp[1];
+			size = PROF_STACK;
+			if(s->sp + size > EZ8_PERIPHERIAL_BASE) {
+				size = EZ8_PERIPHERIAL_BASE - s->sp;
+			}
+			if(size > 0) {
+				ez8->rd_regs(s->sp, s->stack, size);
+				s->size = size;
+			}
+		}
+		num_samples++;
+
+		ez8->run();
+		timerstop(&t);
+		prof_stopped += timerusec(&t);
+	} catch(char *err) {
+		prof_err = err;
+		rl_done = 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will add a symbol.
+ */
+
+static void add_symbol(uint16_t address, const char *name)
+{
+	char buff[16];
+
+	if(!(num_symbols & (num_symbols - 1))) {
+		symbols = (struct symbol *)xrealloc(symbols,
+		    (num_symbols ? num_symbols * 2 : 1) *
+		    sizeof(struct symbol));
+	}
+	if(!name) {
+		snprintf(buff, sizeof(buff), "func_%04X", address);
+		name = buff;
+	}
+	symbols[num_symbols].address = address;
+	symbols[num_symbols].name = xstrdup(name);
+	symbols[num_symbols].count = 0;
+	num_symbols++;
+
+	return;
+}
+
+static void free_symbols(void)
+{
+	size_t i;
+
+	for(i=0; i<num_symbols; i++) {
+		free(symbols[i].name);
+	}
+	free(symbols);
+	symbols = NULL;
+	num_symbols = 0;
+
+	return;
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+	return ((const struct symbol *)a)->address -
+	    ((const struct symbol *)b)->address;
+}
+
+/**************************************************************
+ * This will sort the symbols and remove duplicate addresses,
+ * keeping the first name given.
+ */
+
+static void sort_symbols(void)
+{
+	size_t i, j;
+
+	if(!num_symbols) {
+		return;
+	}
+
+	qsort(symbols, num_symbols, sizeof(struct symbol), cmp_symbol);
+	for(i=1, j=0; i<num_symbols; i++) {
+		if(symbols[i].address == symbols[j].address) {
+			free(symbols[i].name);
+		} else {
+			symbols[++j] = symbols[i];
+		}
+	}
+	num_symbols = j + 1;
+
+	return;
+}
+
+/**************************************************************
+ * This will read a symbol file. Each line has a hex address
+ * followed by a name (the last word on the line). Other lines
+ * are ignored. It returns -1 on error.
+ */
+
+static int read_symbols(const char *filename)
+{
+	FILE *file;
+	char line[BUFSIZ];
+	char *tail, *name, *tok;
+	unsigned long addr;
+
+	file = fopen(filename, "r");
+	if(!file) {
+		perror(filename);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), file)) {
+		addr = strtoul(line, &tail, 16);
+		if(tail == line || !isspace(*tail) || addr > 0xffff) {
+			continue;
+		}
+		name = NULL;
+		for(tok = strtok(tail, " \t\r\n"); tok;
+		    tok = strtok(NULL, " \t\r\n")) {
+			name = tok;
+		}
+		if(name) {
+			add_symbol(addr, name);
+		}
+	}
+	fclose(file);
+
+	return 0;
+}
+
+/**************************************************************
+ * This will find functions by disassembling program memory
+ * and looking for the targets of calls.
+ */
+
+static void find_functions(const uint8_t *mem, size_t size)
+{
+	size_t addr;
+	int branch;
+
+	addr = 0;
+	while(addr + 3 <= size) {
+		if(mem[addr] == 0xd6) {
+			add_symbol((mem[addr+1] << 8) | mem[addr+2], NULL);
+		}
+		addr += inst_size(mem + addr, &branch);
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This will find the symbol an address belongs to. It returns
+ * -1 if the address is before the first symbol.
+ */
+
+static int find_symbol(uint16_t address)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = num_symbols;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(symbols[mid].address <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo - 1;
+}
+
+static const char *symbol_name(uint16_t address)
+{
+	static char buff[16];
+	int i;
+
+	i = find_symbol(address);
+	if(i < 0) {
+		snprintf(buff, sizeof(buff), "%04X", address);
+		return buff;
+	}
+
+	return symbols[i].name;
+}
+
+/**************************************************************
+ * This checks if a word on the stack looks like a return
+ * address, by checking if it follows a call instruction.
+ */
+
+static bool is_return(const uint8_t *mem, size_t size, uint16_t address)
+{
+	if(address >= size) {
+		return 0;
+	}
+	if(address >= 3 && mem[address-3] == 0xd6) {
+		return 1;
+	}
+	if(address >= 2 && mem[address-2] == 0xd4) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will find the callers of a sample, innermost first. It
+ * returns the number of addresses stored in frames.
+ */
+
+static int unwind(const struct sample *s, const uint8_t *mem, size_t size,
+	uint16_t *frames)
+{
+	uint16_t addr;
+	int i, num;
+
+	num = 0;
+	frames[num++] = s->pc;
+	for(i=0; i+1 < s->size && num < PROF_DEPTH; i++) {
+		addr = (s->stack[i] << 8) | s->stack[i+1];
+		if(is_return(mem, size, addr)) {
+			frames[num++] = addr;
+			i++;
+		}
+	}
+
+	return num;
+}
+
+/**************************************************************
+ * This will write the samples in the collapsed stack format
+ * used by flamegraph tools: one line for each distinct stack,
+ * outermost caller first, followed by its count.
+ */
+
+static int cmp_string(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int write_collapsed(const char *filename, const uint8_t *mem,
+	size_t size)
+{
+	FILE *file;
+	char **lines;
+	char buff[PROF_DEPTH * 64];
+	uint16_t frames[PROF_DEPTH];
+	size_t i, j, len;
+	int k, num;
+
+	file = fopen(filename, "w");
+	if(!file) {
+		perror(filename);
+		return -1;
+	}
+
+	lines = (char **)xmalloc(num_samples * sizeof(char *));
+	for(i=0; i<num_samples; i++) {
+		num = unwind(&samples[i], mem, size, frames);
+		len = 0;
+		for(k=num-1; k>=0; k--) {
+			len += snprintf(buff + len, sizeof(buff) - len, "%s%s",
+			    symbol_name(frames[k]), k ? ";" : "");
+			if(len >= sizeof(buff)) {
+				len = sizeof(buff) - 1;
+			}
+		}
+		lines[i] = xstrdup(buff);
+	}
+	qsort(lines, num_samples, sizeof(char *), cmp_string);
+
+	for(i=0; i<num_samples; i=j) {
+		for(j=i+1; j<num_samples && !strcmp(lines[i], lines[j]);
+		    j++) ;
+		fprintf(file, "%s %lu\n", lines[i], (unsigned long)(j - i));
+	}
+	for(i=0; i<num_samples; i++) {
+		free(lines[i]);
+	}
+	free(lines);
+
+	if(fclose(file)) {
+		perror(filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will display the flat profile, busiest function first.
+ */
+
+static int cmp_count(const void *a, const void *b)
+{
+	const struct symbol *x = (const struct symbol *)a;
+	const struct symbol *y = (const struct symbol *)b;
+
+	if(x->count != y->count) {
+		return x->count < y->count ? 1 : -1;
+	}
+
+	return x->address - y->address;
+}
+
+static void show_profile(void)
+{
+	unsigned long other;
+	size_t i;
+	int index;
+
+	other = 0;
+	for(i=0; i<num_samples; i++) {
+		index = find_symbol(samples[i].pc);
+		if(index < 0) {
+			other++;
+		} else {
+			symbols[index].count++;
+		}
+	}
+
+	qsort(symbols, num_symbols, sizeof(struct symbol), cmp_count);
+
+	printf(" Samples      %%  Address  Function\n");
+	for(i=0; i<num_symbols && symbols[i].count; i++) {
+		printf("%8lu %5.1f%%  %04X     %s\n", symbols[i].count,
+		    100.0 * symbols[i].count / num_samples,
+		    symbols[i].address, symbols[i].name);
+	}
+	if(other) {
+		printf("%8lu %5.1f%%  0000     (before first function)\n",
+		    other, 100.0 * other / num_samples);
+	}
+
+	/* back in address order for lookups */
+	qsort(symbols, num_symbols, sizeof(struct symbol), cmp_symbol);
+
+	return;
+}
+
+/**************************************************************
+ * This will read a line for a profile prompt. It returns NULL
+ * if aborted.
+ */
+
+static char *prof_readline(const char *prompt, bool complete)
+{
+	char *buff;
+
+	if(complete) {
+		tab_function = rl_complete;
+	}
+	buff = readline(prompt);
+	tab_function = rl_insert;
+	if(!buff) {
+		printf("Abort\n");
+		return NULL;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		free(buff);
+		printf("\nAbort\n");
+		return NULL;
+	}
+
+	return buff;
+}
+
+/**************************************************************
+ * profile_program()
+ *
+ * This monitor command will run the program and take samples
+ * of the pc until a key is pressed or a breakpoint is reached,
+ * then display a flat profile.
+ */
+
+void profile_program(void)
+{
+	char *buff, *tail, *symfile, *stackfile;
+	uint8_t *mem;
+	size_t size;
+	long interval, elapsed;
+	struct timer t;
+
+	symfile = NULL;
+	stackfile = NULL;
+
+	/* get sample interval */
+	buff = prof_readline("Interval (ms) [10]: ", 0);
+	if(!buff) {
+		return;
+	}
+	interval = PROF_INTERVAL;
+	if(*buff) {
+		interval = strtol(buff, &tail, 10);
+		if(!tail || *tail || tail == buff || interval <= 0) {
+			printf("Invalid interval\n");
+			free(buff);
+			return;
+		}
+	}
+	free(buff);
+
+	rl_num_chars_to_read = 1;
+	buff = readline("Record callers [y/n]? ");
+	rl_num_chars_to_read = 0;
+	if(!buff) {
+		printf("\n");
+		return;
+	}
+	prof_stack = toupper(*buff) == 'Y';
+	free(buff);
+
+	buff = prof_readline("Symbol file (none to search code): ", 1);
+	if(!buff) {
+		return;
+	}
+	if(*buff) {
+		add_history(buff);
+		symfile = xstrdup(strtok(buff, " \t\r\n"));
+	}
+	free(buff);
+
+	if(prof_stack) {
+		buff = prof_readline("Collapsed stack file: ", 1);
+		if(!buff) {
+			free(symfile);
+			return;
+		}
+		if(*buff) {
+			add_history(buff);
+			stackfile = xstrdup(strtok(buff, " \t\r\n"));
+		}
+		free(buff);
+	}
+
+	/* take samples until a key is pressed */
+	num_samples = 0;
+	prof_stopped = 0;
+	prof_brk = 0;
+
+	timerstart(&t);
+	ez8->run();
+	buff = readline_hook("Profiling... ", take_sample, interval * 1000);
+	timerstop(&t);
+	if(buff) {
+		free(buff);
+		buff = NULL;
+	} else {
+		printf("\n");
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\n");
+	}
+	if(!ez8->state(ez8->state_stopped)) {
+		ez8->stop();
+	}
+	if(prof_err) {
+		char *err;
+
+		err = prof_err;
+		prof_err = NULL;
+		free(symfile);
+		free(stackfile);
+		throw err;
+	}
+	if(prof_brk) {
+		printf("BREAK\n");
+	}
+
+	elapsed = timerusec(&t);
+	printf("%lu samples in %s", (unsigned long)num_samples,
+	    timerstr(&t));
+	if(elapsed > 0) {
+		printf(", %.1f samples/s", num_samples * 1e6 / elapsed);
+	}
+	printf("\n");
+	if(!num_samples) {
+		free(symfile);
+		free(stackfile);
+		display_registers();
+		return;
+	}
+	printf("Overhead %ldus/sample, cpu stopped %.1f%% of the time\n",
+	    prof_stopped / (long)num_samples,
+	    elapsed > 0 ? 100.0 * prof_stopped / elapsed : 0.0);
+
+	/* resolve samples to functions */
+	size = ez8->memory_size();
+	if(!size) {
+		size = EZ8MEM_SIZE;
+	}
+	mem = (uint8_t *)xmalloc(size);
+	try {
+		ez8->read_mem(0x0000, mem, size);
+		if(!symfile || read_symbols(symfile)) {
+			find_functions(mem, size);
+		}
+		sort_symbols();
+		show_profile();
+		if(stackfile) {
+			write_collapsed(stackfile, mem, size);
+		}
+	} catch(char *err) {
+		free_symbols();
+		free(mem);
+		free(symfile);
+		free(stackfile);
+		throw err;
+	}
+	free_symbols();
+	free(mem);
+	free(symfile);
+	free(stackfile);
+
+	display_registers();
+
+	return;
+}
+
+/**************************************************************/
+
@@ -1100,6 +1100,63 @@ bool serialport::available(void)
 }
 #endif
 
+/**************************************************************
+ * This will wait up to msec milliseconds (forever if negative)
+ * for data to be available. It returns 1 if data is available.
+ */
+
+bool serialport::wait(int msec)
+#ifndef	_WIN32
+{
+	int ready;
+	fd_set rd_fdes;
+	struct timeval t;
+
+	if(fdes < 0) {
+		strncpy(err_msg, "Read serial port failed\n"
+		    "serial port not open\n", err_len-1);
+		throw err_msg;
+	}
+
+	do {
+		FD_ZERO(&rd_fdes);
+		FD_SET(fdes, &rd_fdes);
+		t.tv_sec = msec / 1000;
+		t.tv_usec = msec % 1000 * 1000;
+		ready = select(fdes + 1, &rd_fdes, NULL, NULL, 
+		    msec < 0 ? NULL : &t);
+	} while(ready < 0 && errno == EINTR);
+
+	if(ready < 0) {
+		snprintf(err_msg, err_len-1,
+		    "Read serial port failed\n"
+		    "select:%s\n", strerror(errno));
+		throw err_msg;
+	}
+
+	return ready > 0;
+}
+#else	/* _WIN32 */
+{
+	return available();
+}
+#endif
+
+/**************************************************************
+ * This will return the file descriptor of the serial port, 
+ * so it can be waited on with select() or poll(). It returns
+ * -1 if there is none.
+ */
+
+int serialport::fd(void)
+{
+#ifndef	_WIN32
+	return fdes;
+#else	/* _WIN32 */
+	return -1;
+#endif
+}
+
 /**************************************************************
  * This will read data from the serial port. It returns the
  * number of bytes actually read.
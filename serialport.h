@@ -76,6 +76,8 @@ public:
 	void flush(void);
 
 	bool available(void);
+	bool wait(int);
+	int fd(void);
 	bool error(void);
 };
 
@@ -329,6 +329,8 @@ printf("  -c FREQUENCY               use specified clock frequency for flash\n")
 printf("                               program/erase oprations\n");
 printf("  -s [:PORT]                 run as tcp/ip server\n");
 printf("  -n [SERVER][:PORT]         connect to tcp/ip server\n");
+printf("  -e [HEXFILE]               connect to instruction set simulator\n");
+printf("                               (program memory loaded from HEXFILE)\n");
 printf("  -m TEXT                    calculate and display md5hash of text\n");
 printf("  -d                         dump raw ocd communication\n");
 printf("  -D                         disable memory cache\n");
@@ -353,7 +355,7 @@ void parse_options(int argc, char **argv)
 
 	progname = argv[0];
 
-	while((c = getopt(argc, argv, "hldDTp:b:t:c:snm:vS:")) != EOF) {
+	while((c = getopt(argc, argv, "hldDTp:b:t:c:snem:vS:")) != EOF) {
 		switch(c) {
 		case '?':
 			printf("Try '%s -h' for more information.\n", 
@@ -407,6 +409,13 @@ void parse_options(int argc, char **argv)
 				device = NULL;
 			}
 			break;
+		case 'e':
+			connection = xstrdup("sim");
+			if(device) {
+				free(device);
+				device = NULL;
+			}
+			break;
 		case 'd':
 			log_proto = stdout;
 			break;
@@ -442,7 +451,8 @@ void parse_options(int argc, char **argv)
 		optind++;
 	} 
 
-	if(connection && !strcasecmp(connection, "tcpip")) {
+	if(connection && (!strcasecmp(connection, "tcpip") ||
+	    !strcasecmp(connection, "sim"))) {
 		if(optind + 1 == argc) {
 			if(device) {
 				free(device);
@@ -478,6 +488,10 @@ int connect(void)
 		ez8->log_proto = log_proto;
 	}
 
+	if(show_times) {
+		ez8->log_flash = stdout;
+	}
+
 	if(mtu) {
 		value = strtol(mtu, &tail, 0);
 		if(!tail || *tail || tail == mtu) {
@@ -655,6 +669,29 @@ int connect(void)
 			return -1;
 		}
 
+	} else if(!strcasecmp(connection, "sim")) {
+		if(device && !strcasecmp(device, "auto")) {
+			device = NULL;
+		}
+		try {
+			ez8->connect_sim(device, clk);
+		} catch(char *err) {
+			printf("Simulator connection failed\n");
+			fprintf(stderr, "%s", err);
+			return -1;
+		}
+
+		try {
+			ez8->reset_link();
+		} catch(char *err) {
+			printf("Simulator reset failed\n");
+			fprintf(stderr, "%s", err);
+			ez8->disconnect();
+			return -1;
+		}
+
+		printf("Connected to simulator @ %d Hz\n", clk);
+
 	} else {
 		printf("Invalid connection type \"%s\"\n", 
 		    connection);
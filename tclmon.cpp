@@ -14,7 +14,11 @@
 #include	<tcl/tcl.h>
 #include	"ez8dbg.h"
 #include	"xmalloc.h"
+#include	"image.h"
 #include	"hexfile.h"
+#include	"hexcache.h"
+#include	"disassembler.h"
+#include	"blockmap.h"
 
 #define	MAX_MEMSIZE	0x10000
 
@@ -26,7 +30,46 @@ enum tcl_cmds { dbg_null, dbg_rd_id, dbg_run, dbg_go, dbg_stop,
     dbg_reset_chip, dbg_reset_link, dbg_rd_pc, dbg_wr_pc, 
     dbg_rd_reg, dbg_wr_reg, dbg_rd_regs, dbg_wr_regs, 
     dbg_rd_mem, dbg_wr_mem, dbg_prog_mem, dbg_erase_mem, dbg_rd_crc,
-    dbg_rd_testmode, dbg_wr_testmode };
+    dbg_rd_testmode, dbg_wr_testmode, dbg_set_bp, dbg_clr_bp,
+    dbg_bp_cond, dbg_bp_stats, dbg_step_n, dbg_wait, dbg_watch, 
+    dbg_unwatch, dbg_watch_hit, dbg_next, dbg_step_out, dbg_step_loop,
+    dbg_blocks };
+
+/* get a list of one or two integers, {lo ?hi?} or {value ?mask?},
+ * from 0 to max */
+
+static int get_pair(Tcl_Interp *interp, Tcl_Obj *list, int max,
+	const char *what, int *first, int *second, int dflt)
+{
+	Tcl_Obj **elem;
+	int nelem, status;
+
+	status = Tcl_ListObjGetElements(interp, list, &nelem, &elem);
+	if(status != TCL_OK) {
+		return status;
+	}
+	if(nelem != 1 && nelem != 2) {
+		Tcl_AppendResult(interp, "Invalid ", what, NULL);
+		return TCL_ERROR;
+	}
+	status = Tcl_GetIntFromObj(interp, elem[0], first);
+	if(status != TCL_OK) {
+		return status;
+	}
+	*second = dflt < 0 ? *first : dflt;
+	if(nelem == 2) {
+		status = Tcl_GetIntFromObj(interp, elem[1], second);
+		if(status != TCL_OK) {
+			return status;
+		}
+	}
+	if(*first < 0 || *first > max || *second < 0 || *second > max) {
+		Tcl_AppendResult(interp, "Invalid ", what, NULL);
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
 
 /* execute command */
 
@@ -69,22 +112,31 @@ int dbg_cmd(ClientData clientData,
 		break;
 	}
 	case dbg_run: {
-		int delay;
 		if(objc != 1) {
 			Tcl_WrongNumArgs(interp, 1, objv, NULL);
 			return TCL_ERROR;
 		}
 		ez8->run();
-		delay = 2;
-		#define MAX_DELAY 250000
-		while(ez8->isrunning()) {
-			usleep(delay);
-			delay += delay / 2;
-			if(delay > MAX_DELAY) {
-				delay = MAX_DELAY;
+		ez8->wait_for_stop(-1);
+		break;
+	}
+	case dbg_wait: {
+		int timeout, status;
+		Tcl_Obj *obj;
+
+		if(objc != 1 && objc != 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, "?timeout?");
+			return TCL_ERROR;
+		}
+		timeout = -1;
+		if(objc == 2) {
+			status = Tcl_GetIntFromObj(interp, objv[1], &timeout);
+			if(status != TCL_OK) {
+				return status;
 			}
 		}
-		#undef MAX_DELAY
+		obj = Tcl_NewIntObj(ez8->wait_for_stop(timeout));
+		Tcl_SetObjResult(interp, obj);
 		break;
 	}
 	case dbg_go: {
@@ -104,7 +156,7 @@ int dbg_cmd(ClientData clientData,
 		break;
 	}
 	case dbg_ld_hexfile: {
-		int status;
+		struct image *image;
 		char *filename;
 
 		if(objc != 2) {
@@ -115,27 +167,27 @@ int dbg_cmd(ClientData clientData,
 		/* get filename */
 		filename = Tcl_GetString(objv[1]);
 
-		/* allocate buffer if not done already */
-		buff = (uint8_t *)xmalloc(MAX_MEMSIZE);
-
-		/* clear buffer */
-		memset(buff, 0xff, MAX_MEMSIZE);
-
 		/* read hexfile */
-		status = rd_hexfile(buff, MAX_MEMSIZE, filename);
-		if(status) {
+		image = rd_hexfile_cached(filename, 0xff, MAX_MEMSIZE);
+		if(!image) {
 			Tcl_SetResult(interp, "Error reading hexfile", NULL);
 			return TCL_ERROR;
 		}
 
-		/* erase part */	
-		ez8->flash_mass_erase();
-		if(ez8->state(ez8->state_protected)) {
-			ez8->reset_chip();
-		}
+		try {
+			/* erase part */	
+			ez8->flash_mass_erase();
+			if(ez8->state(ez8->state_protected)) {
+				ez8->reset_chip();
+			}
 
-		/* program memory */
-		ez8->wr_mem(0x0000, buff, MAX_MEMSIZE);
+			/* program populated memory */
+			ez8->wr_image(image);
+		} catch(char *err) {
+			image_free(image);
+			throw err;
+		}
+		image_free(image);
 		ez8->reset_chip(); 
 		break;
 	}
@@ -398,6 +450,386 @@ int dbg_cmd(ClientData clientData,
 		Tcl_SetObjResult(interp, obj);
 		break;
 	}
+	case dbg_set_bp:
+	case dbg_clr_bp: {
+		int i, addr, status;
+		uint16_t *addrs;
+
+		if(objc < 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, "address ?address ...?");
+			return TCL_ERROR;
+		}
+
+		/* get addresses */
+		addrs = (uint16_t *)xmalloc((objc - 1) * sizeof(uint16_t));
+		for(i=1; i<objc; i++) {
+			status = Tcl_GetIntFromObj(interp, objv[i], &addr);
+			if(status != TCL_OK) {
+				free(addrs);
+				return status;
+			}
+			if(addr >= 0x10000 || addr <= 0) {
+				free(addrs);
+				Tcl_SetObjResult(interp, 
+				    Tcl_NewStringObj("Invalid address", -1));
+				return TCL_ERROR;
+			}
+			addrs[i-1] = addr;
+		}
+
+		/* set or clear them all at once */
+		try {
+			if((intptr_t)clientData == dbg_set_bp) {
+				ez8->change_breakpoints(addrs, objc-1, NULL, 0);
+			} else {
+				ez8->change_breakpoints(NULL, 0, addrs, objc-1);
+			}
+		} catch(char *err) {
+			free(addrs);
+			throw err;
+		}
+		free(addrs);
+		break;
+	}
+	case dbg_bp_cond: {
+		static const char *spaces[] = { "reg", "wreg", "data", NULL };
+		static const char *ops[] = { "==", "!=", "<", "<=", ">", ">=", 
+		    NULL };
+		struct bp_cond cond;
+		Tcl_Obj **elem;
+		int addr, nelem, index, value, status;
+
+		if(objc != 3 && objc != 4) {
+			Tcl_WrongNumArgs(interp, 1, objv, 
+			    "address condition ?every?");
+			return TCL_ERROR;
+		}
+		/* get address */
+		status = Tcl_GetIntFromObj(interp, objv[1], &addr);
+		if(status != TCL_OK) {
+			return status;
+		}
+		if(addr >= 0x10000 || addr <= 0) {
+			Tcl_SetObjResult(interp, 
+			    Tcl_NewStringObj("Invalid address", -1));
+			return TCL_ERROR;
+		}
+
+		/* get condition {space location op value ?mask?} */
+		memset(&cond, 0, sizeof(cond));
+		status = Tcl_ListObjGetElements(interp, objv[2], 
+		    &nelem, &elem);
+		if(status != TCL_OK) {
+			return status;
+		}
+		if(nelem) {
+			if(nelem != 4 && nelem != 5) {
+				Tcl_SetObjResult(interp, 
+				    Tcl_NewStringObj("Invalid condition", -1));
+				return TCL_ERROR;
+			}
+			status = Tcl_GetIndexFromObj(interp, elem[0], spaces,
+			    "space", 0, &index);
+			if(status != TCL_OK) {
+				return status;
+			}
+			cond.space = (enum bp_space)index;
+			status = Tcl_GetIntFromObj(interp, elem[1], &value);
+			if(status != TCL_OK) {
+				return status;
+			}
+			if(value >= 0x10000 || value < 0) {
+				Tcl_SetObjResult(interp, 
+				    Tcl_NewStringObj("Invalid location", -1));
+				return TCL_ERROR;
+			}
+			cond.address = value;
+			status = Tcl_GetIndexFromObj(interp, elem[2], ops,
+			    "operator", 0, &index);
+			if(status != TCL_OK) {
+				return status;
+			}
+			cond.op = (enum bp_op)(bp_eq + index);
+			status = Tcl_GetIntFromObj(interp, elem[3], &value);
+			if(status != TCL_OK) {
+				return status;
+			}
+			if(value > 255 || value < 0) {
+				Tcl_SetObjResult(interp, 
+				    Tcl_NewStringObj("Invalid value", -1));
+				return TCL_ERROR;
+			}
+			cond.value = value;
+			value = 0xff;
+			if(nelem == 5) {
+				status = Tcl_GetIntFromObj(interp, elem[4], 
+				    &value);
+				if(status != TCL_OK) {
+					return status;
+				}
+				if(value > 255 || value < 0) {
+					Tcl_SetObjResult(interp, 
+					    Tcl_NewStringObj("Invalid mask", -1));
+					return TCL_ERROR;
+				}
+			}
+			cond.mask = value;
+		}
+
+		/* get count */
+		if(objc == 4) {
+			status = Tcl_GetIntFromObj(interp, objv[3], &value);
+			if(status != TCL_OK) {
+				return status;
+			}
+			if(value < 0) {
+				Tcl_SetObjResult(interp, 
+				    Tcl_NewStringObj("Invalid count", -1));
+				return TCL_ERROR;
+			}
+			cond.every = value;
+		}
+
+		ez8->set_bp_condition(addr, &cond);
+		break;
+	}
+	case dbg_bp_stats: {
+		struct bp_stats stats;
+		Tcl_Obj *obj;
+		int addr, status;
+
+		if(objc != 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, "address");
+			return TCL_ERROR;
+		}
+		/* get address */
+		status = Tcl_GetIntFromObj(interp, objv[1], &addr);
+		if(status != TCL_OK) {
+			return status;
+		}
+		if(addr >= 0x10000 || addr <= 0) {
+			Tcl_SetObjResult(interp, 
+			    Tcl_NewStringObj("Invalid address", -1));
+			return TCL_ERROR;
+		}
+
+		ez8->get_bp_stats(addr, &stats);
+
+		/* return {hits matches resumes resume_time} */
+		obj = Tcl_NewListObj(0, NULL);
+		Tcl_ListObjAppendElement(interp, obj, 
+		    Tcl_NewLongObj(stats.hits));
+		Tcl_ListObjAppendElement(interp, obj, 
+		    Tcl_NewLongObj(stats.matches));
+		Tcl_ListObjAppendElement(interp, obj, 
+		    Tcl_NewLongObj(stats.resumes));
+		Tcl_ListObjAppendElement(interp, obj, 
+		    Tcl_NewLongObj(stats.resume_time));
+		Tcl_SetObjResult(interp, obj);
+		break;
+	}
+	case dbg_step_n: {
+		int i, num, count, status;
+		uint16_t *pc_log;
+		Tcl_Obj *obj;
+
+		if(objc != 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, "count");
+			return TCL_ERROR;
+		}
+		status = Tcl_GetIntFromObj(interp, objv[1], &count);
+		if(status != TCL_OK) {
+			return status;
+		}
+		if(count <= 0) {
+			Tcl_SetObjResult(interp, 
+			    Tcl_NewStringObj("Invalid count", -1));
+			return TCL_ERROR;
+		}
+
+		/* step, logging the pc of each instruction */
+		pc_log = (uint16_t *)xmalloc(count * sizeof(uint16_t));
+		try {
+			num = ez8->step_n(count, pc_log);
+		} catch(char *err) {
+			free(pc_log);
+			throw err;
+		}
+
+		obj = Tcl_NewListObj(0, NULL);
+		for(i=0; i<num; i++) {
+			Tcl_ListObjAppendElement(interp, obj, 
+			    Tcl_NewIntObj(pc_log[i]));
+		}
+		free(pc_log);
+		Tcl_SetObjResult(interp, obj);
+		break;
+	}
+	case dbg_watch: {
+		static const char *options[] = { "-write", "-read", "-access",
+		    "-data", "-pc", "-flags", NULL };
+		enum { opt_write, opt_read, opt_access, opt_data, opt_pc, 
+		    opt_flags };
+		struct watchpoint wp;
+		int i, index, first, second, status;
+
+		if(objc < 3 || !(objc & 1)) {
+			Tcl_WrongNumArgs(interp, 1, objv, 
+			    "option value ?option value ...?");
+			return TCL_ERROR;
+		}
+
+		memset(&wp, 0, sizeof(wp));
+		for(i=1; i<objc; i+=2) {
+			status = Tcl_GetIndexFromObj(interp, objv[i], options,
+			    "option", 0, &index);
+			if(status != TCL_OK) {
+				return status;
+			}
+			switch(index) {
+			case opt_write:
+			case opt_read:
+			case opt_access:
+				status = get_pair(interp, objv[i+1], 0xfff,
+				    "register range", &first, &second, -1);
+				if(status != TCL_OK) {
+					return status;
+				}
+				wp.access = (enum wp_access)(wp_write + 
+				    index - opt_write);
+				wp.reg_lo = first;
+				wp.reg_hi = second;
+				break;
+			case opt_data:
+				status = get_pair(interp, objv[i+1], 0xff,
+				    "data", &first, &second, 0xff);
+				if(status != TCL_OK) {
+					return status;
+				}
+				wp.data = first;
+				wp.data_mask = second;
+				break;
+			case opt_pc:
+				status = get_pair(interp, objv[i+1], 0xffff,
+				    "pc range", &first, &second, -1);
+				if(status != TCL_OK) {
+					return status;
+				}
+				wp.pc = 1;
+				wp.pc_lo = first;
+				wp.pc_hi = second;
+				break;
+			case opt_flags:
+				status = get_pair(interp, objv[i+1], 0xff,
+				    "flags", &first, &second, 0xff);
+				if(status != TCL_OK) {
+					return status;
+				}
+				wp.flags = first;
+				wp.flags_mask = second;
+				break;
+			}
+		}
+
+		index = ez8->set_watchpoint(&wp);
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(index));
+		break;
+	}
+	case dbg_unwatch: {
+		int index, status;
+
+		if(objc != 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, "watchpoint");
+			return TCL_ERROR;
+		}
+		status = Tcl_GetIntFromObj(interp, objv[1], &index);
+		if(status != TCL_OK) {
+			return status;
+		}
+		ez8->clear_watchpoint(index);
+		break;
+	}
+	case dbg_watch_hit: {
+		if(objc != 1) {
+			Tcl_WrongNumArgs(interp, 1, objv, NULL);
+			return TCL_ERROR;
+		}
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(ez8->watchpoint_hit()));
+		break;
+	}
+	case dbg_next:
+	case dbg_step_out:
+	case dbg_step_loop: {
+		if(objc != 1) {
+			Tcl_WrongNumArgs(interp, 1, objv, NULL);
+			return TCL_ERROR;
+		}
+		switch((intptr_t)clientData) {
+		case dbg_step_out:
+			ez8->step_out();
+			break;
+		case dbg_step_loop:
+			ez8->step_loop();
+			break;
+		default:
+			ez8->next();
+			break;
+		}
+		ez8->wait_for_stop(-1);
+		break;
+	}
+	case dbg_blocks: {
+		const struct blockmap *map;
+		const struct block *b;
+		Tcl_Obj *obj, *item, *succ;
+		int start, end, status, j;
+		size_t i;
+
+		if(objc > 3) {
+			Tcl_WrongNumArgs(interp, 1, objv, "?start? ?end?");
+			return TCL_ERROR;
+		}
+		start = 0x0000;
+		end = 0xffff;
+		if(objc > 1) {
+			status = Tcl_GetIntFromObj(interp, objv[1], &start);
+			if(status != TCL_OK) {
+				return status;
+			}
+		}
+		if(objc > 2) {
+			status = Tcl_GetIntFromObj(interp, objv[2], &end);
+			if(status != TCL_OK) {
+				return status;
+			}
+		}
+
+		map = ez8->block_map();
+		obj = Tcl_NewListObj(0, NULL);
+		for(i=0; i<map->count; i++) {
+			b = &map->blocks[i];
+			if(b->start < start || b->start > end) {
+				continue;
+			}
+			succ = Tcl_NewListObj(0, NULL);
+			for(j=0; j<b->nsucc; j++) {
+				Tcl_ListObjAppendElement(interp, succ, 
+				    Tcl_NewIntObj(b->succ[j]));
+			}
+			item = Tcl_NewListObj(0, NULL);
+			Tcl_ListObjAppendElement(interp, item, 
+			    Tcl_NewIntObj(b->start));
+			Tcl_ListObjAppendElement(interp, item, 
+			    Tcl_NewLongObj(b->end));
+			Tcl_ListObjAppendElement(interp, item, succ);
+			Tcl_ListObjAppendElement(interp, item, 
+			    Tcl_NewIntObj((b->flow == flow_call || 
+			    b->flow == flow_trap) && b->call ? b->call : -1));
+			Tcl_ListObjAppendElement(interp, obj, item);
+		}
+		Tcl_SetObjResult(interp, obj);
+		break;
+	}
 	case dbg_rd_testmode: {
 		if(objc != 1) {
 			Tcl_WrongNumArgs(interp, 1, objv, NULL);
@@ -515,6 +947,32 @@ int Tcl_AppInit(Tcl_Interp *interp)
 	    (void *)dbg_prog_mem, NULL);
         Tcl_CreateObjCommand(interp, "dbg_rd_crc", tcl_cmd, 
 	    (void *)dbg_rd_crc, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_set_bp", tcl_cmd, 
+	    (void *)dbg_set_bp, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_clr_bp", tcl_cmd, 
+	    (void *)dbg_clr_bp, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_bp_cond", tcl_cmd, 
+	    (void *)dbg_bp_cond, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_bp_stats", tcl_cmd, 
+	    (void *)dbg_bp_stats, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_step_n", tcl_cmd, 
+	    (void *)dbg_step_n, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_wait", tcl_cmd, 
+	    (void *)dbg_wait, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_watch", tcl_cmd, 
+	    (void *)dbg_watch, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_unwatch", tcl_cmd, 
+	    (void *)dbg_unwatch, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_watch_hit", tcl_cmd, 
+	    (void *)dbg_watch_hit, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_next", tcl_cmd, 
+	    (void *)dbg_next, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_step_out", tcl_cmd, 
+	    (void *)dbg_step_out, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_step_loop", tcl_cmd, 
+	    (void *)dbg_step_loop, NULL);
+        Tcl_CreateObjCommand(interp, "dbg_blocks", tcl_cmd, 
+	    (void *)dbg_blocks, NULL);
         Tcl_CreateObjCommand(interp, "dbg_rd_testmode", tcl_cmd, 
 	    (void *)dbg_rd_testmode, NULL);
         Tcl_CreateObjCommand(interp, "dbg_wr_testmode", tcl_cmd, 
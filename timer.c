@@ -91,3 +91,15 @@ char *timerstr(struct timer *t)
 #endif
 }
 
+long timerusec(struct timer *t)
+{
+#ifndef	_WIN32
+	struct timeval elapsed;
+
+	difftimeval(&t->start, &t->stop, &elapsed);
+	return elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+#else
+	return 0;
+#endif
+}
+
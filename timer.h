@@ -25,6 +25,7 @@ struct timer {
 void timerstart(struct timer *);
 void timerstop(struct timer *);
 char *timerstr(struct timer *);
+long timerusec(struct timer *);
 
 #ifdef	__cplusplus
 };
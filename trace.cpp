@@ -14,6 +14,7 @@
 #include	<unistd.h>
 #include	<sys/types.h>
 #include	<sys/stat.h>
+#include	<sys/time.h>
 #include	<readline/readline.h>
 #include	<readline/history.h>
 #include	"xmalloc.h"
@@ -28,12 +29,18 @@
 #include	"hexfile.h"
 #include	"dump.h"
 #include	"md5.h"
+#include	"err_msg.h"
+#include	"timer.h"
+#include	"trcefile.h"
+#include	"trcedec.h"
 
 /**************************************************************/
 
 extern int esc_key;
+extern char *readline_hook(const char *, rl_hook_func_t *, int);
 extern ez8dbg *ez8;
-extern char *get_inst_str(uint16_t);
+extern const char *get_inst_str(uint16_t);
+extern void trce_call_tree(void);
 
 /**************************************************************/
 
@@ -51,34 +58,15 @@ bool trce_available(void)
 }
 
 /**************************************************************
- * This routine will read and disassembe the instruction at
- * the specified address.
+ * This routine will return the disassembly of the instruction
+ * at the specified address.
  */
 
-char *get_inst_str(uint16_t addr)
+const char *get_inst_str(uint16_t addr)
 {
-	int size;
-	uint8_t inst[5];
-	static char buff[16];
+	const char *buff;
 
-	memset(buff, 0x00, sizeof(buff));
-
-	if(0x10000 - addr < (int)sizeof(inst)) {
-		size = 0x10000 - addr;
-	} else {
-		size = sizeof(inst);
-	}
-	
-	ez8->read_mem(addr, inst, size);
-
-	size = disassemble(buff, sizeof(buff), inst, addr);
-
-	assert(size > 0 && size <= 5);
-
-	if(0x10000 - addr < size) {
-		strncpy(buff, "ill", sizeof(buff)-1);
-		size = 0x10000 - addr;
-	}
+	ez8->disasm(addr, NULL, &buff);
 
 	return buff;
 }
@@ -491,17 +479,73 @@ void write_trce_registers(void)
 	return;
 }
 
+/**************************************************************
+ * This will print decoded trace events.
+ */
+
+void print_trce_events(const struct trcedec *dec)
+{
+	size_t i;
+
+	for(i=0; i<dec->count; i++) {
+		switch(dec->kind[i]) {
+		case trcedec_time:
+			printf("Timestamp: %08lX\n", 
+			    (unsigned long)dec->time[i]);
+			continue;
+		case trcedec_gap:
+			printf("Gap\n");
+			continue;
+		case trcedec_inst:
+			printf("PC:%04X  ", dec->pc[i]);
+			break;
+		case trcedec_intack:
+			printf("IntAck   ");
+			break;
+		case trcedec_dmaack:
+			printf("DmaAck   ");
+			break;
+		default:
+			printf("Idle     ");
+			break;
+		}
+
+		printf("Flags:%02X  ", dec->flags[i]);
+		printf("SP:%04X  ", dec->sp[i]);
+
+		switch(dec->access[i]) {
+		case trcedec_wr:
+			printf("RegWr A:%03X D:%02X  ", dec->reg_addr[i],
+			    dec->reg_data[i]);
+			break;
+		case trcedec_rd:
+			printf("RegRd A:%03X D:%02X  ", dec->reg_addr[i],
+			    dec->reg_data[i]);
+			break;
+		default:
+			printf("                  ");
+		}
+
+		if(dec->kind[i] == trcedec_inst) {
+			printf("%-16s", get_inst_str(dec->pc[i]));
+		}
+		putchar('\n');
+	}
+
+	return;
+}
+
 /**************************************************************/
 
 void read_trce_buffer(void)
 {
-	int i;
 	char *buff;
 	char *tail;
 	unsigned int data;
 	uint16_t start;
 	uint16_t size;
 	struct trce_frame *frames;
+	struct trcedec *dec;
 	
 	buff = readline("Start: ");
 	if(!buff) {
@@ -567,63 +611,17 @@ void read_trce_buffer(void)
 		throw err;
 	}
 
-	for(i=0; i<size; i++) {
-		if((frames[i].data[2] & 0xf0) == 0xf0) {
-			printf("Timestamp: %08X\n", 
-			    (frames[i].data[4] << 24) |
-			    (frames[i].data[5] << 16) |
-			    (frames[i].data[6] <<  8) |
-			    (frames[i].data[7]));
-			continue;
-		}
-
-		switch(frames[i].data[2] & 0xc0) {
-		case 0x40:
-			printf("PC:%04X  ", (frames[i].data[6] << 8) |
-			    frames[i].data[7]);
-			break;
-		case 0x80:
-			printf("IntAck   ");
-			break;
-		case 0xc0:
-			printf("DmaAck   ");
-			break;
-		default:
-			printf("Idle     ");
-			break;
-		}
-
-		printf("Flags:%02X  ", frames[i].data[5]);
-		printf("SP:%04X  ", (frames[i].data[0] << 8)
-		    | frames[i].data[1]);
-
-		switch(frames[i].data[2] & 0x30) {
-		case 0x10:
-			printf("RegWr A:%03X D:%02X  ", frames[i].data[3] |
-			    ((frames[i].data[2] & 0x0f) << 8), 
-			    frames[i].data[4]);
-			break;
-		case 0x20:
-			printf("RegRd A:%03X D:%02X  ", frames[i].data[3] |
-			    ((frames[i].data[2] & 0x0f) << 8), 
-			    frames[i].data[4]);
-			break;
-		case 0x30:
-		default:
-			printf("                  ");
-		}
+	dec = trcedec_new();
+	trcedec_decode(dec, (uint8_t *)frames, size, NULL);
+	free(frames);
 
-		switch(frames[i].data[2] & 0xc0) {
-		case 0x40:
-			printf("%-16s", get_inst_str(
-			    (frames[i].data[6] << 8) | frames[i].data[7]));
-		default:
-			putchar('\n');
-			break;
-		}
+	try {
+		print_trce_events(dec);
+	} catch(char *err) {
+		trcedec_free(dec);
+		throw err;
 	}
-
-	free(frames);
+	trcedec_free(dec);
 
 	return;
 }
@@ -717,6 +715,522 @@ void dump_trce_buffer(void)
 	return;
 }
 
+/**************************************************************
+ * Streaming capture drains the trace buffer while the part
+ * runs. The write pointer is read every few milliseconds, and
+ * the frames written since the last drain are read in chunks
+ * and appended to a capture file.
+ *
+ * The pointer only tells us where the writer is modulo the
+ * buffer depth. If the frames still to be read plus the
+ * frames written since the pointer was last read reach the
+ * depth, the writer has caught up with us, so the unread
+ * frames are dropped and the capture continues from the
+ * pointer, flagging a gap in the file.
+ *
+ * If the writer went all the way round the buffer between two
+ * reads, the pointer looks like it moved only a little. The
+ * trace writes at most one frame per system clock, so if more
+ * clocks than free frames went by between two reads, the 
+ * capture is flagged as overrun too, even if nothing was lost.
+ *
+ * If the buffer fills faster than it is drained, the part is
+ * paced instead: it runs with the counter breakpoint for fewer
+ * clocks than the buffer holds, and is drained before it runs 
+ * again, so the capture has no gaps but the part stops often.
+ *
+ * What still goes undetected: if the system clock is not known
+ * (it is worked out from the baudrate and the reload value),
+ * whole laps of the buffer are not seen. On parts without the
+ * counter breakpoint, the part cannot be paced.
+ */
+
+/* frames read with one command */
+#define	TRCE_CHUNK	0x400
+
+/* msec between drains */
+#define	TRCE_INTERVAL	10
+
+static struct {
+	FILE *file;
+	uint32_t depth;
+	uint32_t rd;
+	uint32_t wr;
+	uint32_t pending;
+	uint32_t flags;
+	unsigned long frames;
+	unsigned long blocks;
+	unsigned long overruns;
+	struct trce_frame *chunk;
+	char *err;
+	bool stopped;
+	int sysclk;
+	uint16_t paced;		/* clocks per run, or 0 */
+	struct timeval polled;	/* just before the pointer was read */
+} stream;
+
+/**************************************************************
+ * This returns 1 if the writer could have gone round the 
+ * buffer between the last pointer read and the one just done,
+ * which started at before, from the clocks that went by.
+ */
+
+static bool stream_lapped(const struct timeval *before)
+{
+	struct timeval now;
+	double clocks;
+
+	gettimeofday(&now, NULL);
+	clocks = (now.tv_sec - stream.polled.tv_sec) * 1e6 + 
+	    (now.tv_usec - stream.polled.tv_usec);
+	clocks = clocks * stream.sysclk / 1e6;
+	stream.polled = *before;
+
+	/* a paced part runs less clocks than the buffer holds */
+	if(stream.paced || !stream.sysclk) {
+		return 0;
+	}
+
+	return clocks >= stream.depth - stream.pending;
+}
+
+/**************************************************************
+ * This reads the write pointer and accounts for the frames
+ * written since it was last read. It returns 0 if unread
+ * frames were overwritten.
+ */
+
+static bool stream_poll(void)
+{
+	struct timeval before;
+	uint32_t wr, delta;
+	bool lapped;
+
+	gettimeofday(&before, NULL);
+	wr = ez8->rd_trce_wr_ptr() & (stream.depth - 1);
+	lapped = stream_lapped(&before);
+	delta = (wr - stream.wr) & (stream.depth - 1);
+	stream.wr = wr;
+
+	if(lapped || stream.pending + delta >= stream.depth) {
+		stream.overruns++;
+		stream.flags |= TRCEFILE_GAP;
+		stream.rd = wr;
+		stream.pending = 0;
+		return 0;
+	}
+	stream.pending += delta;
+
+	return 1;
+}
+
+/**************************************************************
+ * This will drain the frames written since the last drain.
+ * Frames written while draining are left for the next one,
+ * so a fast writer cannot keep us here.
+ */
+
+static void stream_drain(void)
+{
+	uint32_t budget, count;
+
+	if(!stream_poll()) {
+		return;
+	}
+	budget = stream.pending;
+
+	while(budget && stream.pending) {
+		count = stream.pending;
+		if(count > budget) {
+			count = budget;
+		}
+		if(count > TRCE_CHUNK) {
+			count = TRCE_CHUNK;
+		}
+		if(count > stream.depth - stream.rd) {
+			count = stream.depth - stream.rd;
+		}
+
+		ez8->rd_trce_buff(stream.rd, stream.chunk, count);
+
+		/* overwritten while we were reading it */
+		if(!stream_poll()) {
+			return;
+		}
+
+		if(trcefile_write(stream.file, (uint8_t *)stream.chunk, 
+		    count, stream.flags)) {
+			strncpy(err_msg, "Could not write trace file\n",
+			    err_len-1);
+			throw err_msg;
+		}
+		stream.flags = 0;
+		stream.rd = (stream.rd + count) & (stream.depth - 1);
+		stream.pending -= count;
+		stream.frames += count;
+		stream.blocks++;
+		budget -= count;
+	}
+
+	return;
+}
+
+/**************************************************************
+ * This is a readline hook. It drains the trace buffer while
+ * capturing, and finishes when the part stops. A paced part
+ * that ran out of clocks is drained and run again.
+ */
+
+static int stream_hook(void)
+{
+	try {
+		if(!ez8->isrunning()) {
+			if(stream.paced && ez8->rd_cntr() == 0) {
+				stream_drain();
+				ez8->run_clks(stream.paced);
+				return 0;
+			}
+			stream.stopped = 1;
+			stream_drain();
+			rl_done = 1;
+			return 0;
+		}
+		/* a paced part is drained when it stops */
+		if(!stream.paced) {
+			stream_drain();
+		}
+	} catch(char *err) {
+		stream.err = err;
+		rl_done = 1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will capture trace frames to a file until the part
+ * stops or a key is pressed.
+ */
+
+void stream_trce_buffer(void)
+{
+	char *buff;
+	char *tail;
+	char *filename;
+	unsigned long data;
+	struct timer t;
+	long elapsed;
+
+	buff = readline("Buffer depth: ");
+	if(!buff) {
+		printf("\n");
+		return;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(buff);
+		return;
+	}
+
+	data = strtoul(buff, &tail, 16);
+	if(!tail || *tail || tail == buff) {
+		printf("Invalid Number\n");
+		free(buff);
+		return;
+	}
+	free(buff);
+
+	if(data < 2 || data > 0x10000 || (data & (data - 1))) {
+		printf("Depth must be a power of two up to 10000\n");
+		return;
+	}
+
+	filename = readline("Capture file: ");
+	if(!filename) {
+		printf("\n");
+		return;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(filename);
+		return;
+	}
+	if(!*filename) {
+		free(filename);
+		return;
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	stream.depth = data;
+	stream.file = trcefile_create(filename, stream.depth);
+	if(!stream.file) {
+		printf("Could not create %s\n", filename);
+		free(filename);
+		return;
+	}
+	stream.chunk = (struct trce_frame *)
+	    xmalloc(sizeof(struct trce_frame) * TRCE_CHUNK);
+
+	/* pace the part if it can fill the buffer between drains */
+	stream.sysclk = ez8->cached_sysclk();
+	if((double)stream.sysclk * TRCE_INTERVAL / 1000 >= stream.depth) {
+		stream.paced = stream.depth > 0xffff ? 0xffff : stream.depth - 1;
+		printf("Buffer fills in %.2fms, pausing part every %u clocks\n",
+		    stream.depth * 1e3 / stream.sysclk, stream.paced);
+	}
+
+	timerstart(&t);
+	try {
+		if(stream.paced && ez8->isrunning()) {
+			ez8->stop();
+		}
+		gettimeofday(&stream.polled, NULL);
+		stream.wr = ez8->rd_trce_wr_ptr() & (stream.depth - 1);
+		stream.rd = stream.wr;
+		if(stream.paced) {
+			ez8->run_clks(stream.paced);
+		} else if(ez8->isrunning() == 0) {
+			ez8->run();
+		}
+	} catch(char *err) {
+		fclose(stream.file);
+		free(stream.chunk);
+		free(filename);
+		throw err;
+	}
+
+	buff = readline_hook("Capturing... ", stream_hook, 
+	    TRCE_INTERVAL * 1000);
+	timerstop(&t);
+	if(buff) {
+		free(buff);
+	} else {
+		printf("\n");
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\n");
+	}
+
+	/* pick up what was written up to the keypress, and let 
+	 * a paced part run on without the counter */
+	if(!stream.err && !stream.stopped) {
+		try {
+			if(stream.paced && ez8->isrunning()) {
+				ez8->stop();
+			}
+			stream_drain();
+			if(stream.paced) {
+				ez8->run();
+			}
+		} catch(char *err) {
+			stream.err = err;
+		}
+	}
+
+	free(stream.chunk);
+	if(fclose(stream.file) && !stream.err) {
+		strncpy(err_msg, "Could not write trace file\n", err_len-1);
+		stream.err = err_msg;
+	}
+	if(stream.err) {
+		free(filename);
+		throw stream.err;
+	}
+
+	if(stream.stopped) {
+		printf("BREAK\n");
+	}
+	elapsed = timerusec(&t);
+	printf("%lu frames in %s", stream.frames, timerstr(&t));
+	if(elapsed > 0) {
+		printf(", %.0f frames/s", stream.frames * 1e6 / elapsed);
+	}
+	printf("\n");
+	if(stream.overruns) {
+		printf("Buffer overrun %lu times, capture has gaps\n",
+		    stream.overruns);
+	}
+	printf("Wrote %s\n", filename);
+	free(filename);
+
+	return;
+}
+
+/**************************************************************
+ * This will prompt for an optional hex address range. It
+ * returns 1 if a range or nothing was entered, leaving the
+ * range unchanged for nothing, or 0 to abort.
+ */
+
+static bool get_trce_range(const char *prompt, uint16_t *lo, uint16_t *hi,
+	unsigned long max)
+{
+	char *buff;
+	char *tail;
+	unsigned long start, end;
+
+	buff = readline(prompt);
+	if(!buff) {
+		printf("\n");
+		return 0;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(buff);
+		return 0;
+	}
+	if(!*buff) {
+		free(buff);
+		return 1;
+	}
+
+	start = strtoul(buff, &tail, 16);
+	if(!tail || tail == buff || *tail != ' ') {
+		printf("Invalid Number\n");
+		free(buff);
+		return 0;
+	}
+	end = strtoul(tail, &tail, 16);
+	if(!tail || *tail) {
+		printf("Invalid Number\n");
+		free(buff);
+		return 0;
+	}
+	free(buff);
+
+	if(start > end || end > max) {
+		printf("Number out of range\n");
+		return 0;
+	}
+	*lo = start;
+	*hi = end;
+
+	return 1;
+}
+
+/**************************************************************
+ * This will decode a capture file and export the events,
+ * optionally filtered by pc and register address.
+ */
+
+void export_trce_file(void)
+{
+	char *buff;
+	char *infile;
+	char *outfile;
+	char key;
+	struct trcedec_filter filter;
+	struct trcedec *dec;
+	struct timer t;
+	FILE *file;
+	int err;
+
+	infile = readline("Capture file: ");
+	if(!infile) {
+		printf("\n");
+		return;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(infile);
+		return;
+	}
+	if(!*infile) {
+		free(infile);
+		return;
+	}
+
+	trcedec_filter_all(&filter);
+	if(!get_trce_range("PC range (start end): ", 
+	    &filter.pc_lo, &filter.pc_hi, 0xffff)) {
+		free(infile);
+		return;
+	}
+	if(!get_trce_range("Register range (start end): ", 
+	    &filter.reg_lo, &filter.reg_hi, 0xfff)) {
+		free(infile);
+		return;
+	}
+
+	rl_num_chars_to_read = 1;
+	buff = readline("Format [C]sv, [B]inary columns ? ");
+	rl_num_chars_to_read = 0;
+	if(!buff) {
+		printf("Abort\n");
+		free(infile);
+		return;
+	}
+	key = toupper(*buff);
+	free(buff);
+	if(esc_key || (key != 'C' && key != 'B')) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(infile);
+		return;
+	}
+
+	outfile = readline("Output file: ");
+	if(!outfile) {
+		printf("\n");
+		free(infile);
+		return;
+	}
+	if(esc_key) {
+		esc_key = 0;
+		printf("\nAbort\n");
+		free(infile);
+		free(outfile);
+		return;
+	}
+	if(!*outfile) {
+		free(infile);
+		free(outfile);
+		return;
+	}
+
+	timerstart(&t);
+	dec = trcedec_new();
+	if(trcedec_rd_file(dec, infile, &filter)) {
+		printf("Could not read %s\n", infile);
+		trcedec_free(dec);
+		free(infile);
+		free(outfile);
+		return;
+	}
+	free(infile);
+
+	file = fopen(outfile, key == 'C' ? "w" : "wb");
+	if(!file) {
+		printf("Could not create %s\n", outfile);
+		trcedec_free(dec);
+		free(outfile);
+		return;
+	}
+	if(key == 'C') {
+		err = trcedec_wr_csv(dec, file);
+	} else {
+		err = trcedec_wr_columns(dec, file);
+	}
+	err |= fclose(file);
+	timerstop(&t);
+
+	if(err) {
+		printf("Could not write %s\n", outfile);
+	} else {
+		printf("Wrote %lu events to %s in %s\n", 
+		    (unsigned long)dec->count, outfile, timerstr(&t));
+	}
+	trcedec_free(dec);
+	free(outfile);
+
+	return;
+}
+
 /**************************************************************/
 
 void display_trce_help(void)
@@ -729,6 +1243,9 @@ void display_trce_help(void)
 	printf("\tW - write trace registers\n");
 	printf("\tR - read trace buffer\n");
 	printf("\tD - dump raw trace frames\n");
+	printf("\tC - capture trace frames to a file\n");
+	printf("\tX - export a capture file\n");
+	printf("\tF - function timing and call tree\n");
 	printf("\tQ - exit trace subsystem\n");
 
 	return;
@@ -773,9 +1290,15 @@ void trce_subsystem(void)
 		case 'G':
 			trce_go();
 			break;
+		case 'C':
+			stream_trce_buffer();
+			break;
 		case 'D':
 			dump_trce_buffer();
 			break;
+		case 'F':
+			trce_call_tree();
+			break;
 		case 'H':
 			display_trce_help();
 			break;
@@ -796,6 +1319,9 @@ void trce_subsystem(void)
 		case 'W':
 			write_trce_registers();
 			break;
+		case 'X':
+			export_trce_file();
+			break;
 		default:
 			printf("Unknown command\n");
 			break;
@@ -0,0 +1,384 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This decodes emulator trace frames into events. Each frame
+ * records what the cpu did in one cycle: the instruction
+ * fetched or the interrupt or dma acknowledged, the stack
+ * pointer, the flags, and any register read or written.
+ * Frames with the top of the third byte all ones hold a
+ * timestamp instead.
+ *
+ * Events are kept as one array per field, so a pass over one
+ * field of a large capture only touches that field. Frames
+ * are decoded in bulk, and a filter drops events that are not
+ * wanted before they are stored.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<string.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"trcefile.h"
+#include	"trcedec.h"
+
+static const char *kind_names[] = {
+	"idle", "inst", "intack", "dmaack", "time", "gap"
+};
+
+static const char *access_names[] = {
+	"", "wr", "rd"
+};
+
+/**************************************************************
+ * This will create an empty set of events.
+ */
+
+struct trcedec *trcedec_new(void)
+{
+	struct trcedec *dec;
+
+	dec = (struct trcedec *)xmalloc(sizeof(struct trcedec));
+	memset(dec, 0, sizeof(struct trcedec));
+
+	return dec;
+}
+
+/**************************************************************
+ * This will remove all events.
+ */
+
+void trcedec_clear(struct trcedec *dec)
+{
+	assert(dec != NULL);
+
+	dec->count = 0;
+	dec->stamp = 0;
+
+	return;
+}
+
+void trcedec_free(struct trcedec *dec)
+{
+	if(!dec) {
+		return;
+	}
+
+	free(dec->kind);
+	free(dec->access);
+	free(dec->flags);
+	free(dec->reg_data);
+	free(dec->pc);
+	free(dec->sp);
+	free(dec->reg_addr);
+	free(dec->time);
+	free(dec);
+
+	return;
+}
+
+/**************************************************************
+ * This will make room for size more events.
+ */
+
+static void reserve(struct trcedec *dec, size_t size)
+{
+	size_t alloc;
+
+	if(dec->count + size <= dec->alloc) {
+		return;
+	}
+	alloc = dec->alloc ? dec->alloc * 2 : 4096;
+	while(alloc < dec->count + size) {
+		alloc *= 2;
+	}
+
+	dec->kind = (uint8_t *)xrealloc(dec->kind, alloc);
+	dec->access = (uint8_t *)xrealloc(dec->access, alloc);
+	dec->flags = (uint8_t *)xrealloc(dec->flags, alloc);
+	dec->reg_data = (uint8_t *)xrealloc(dec->reg_data, alloc);
+	dec->pc = (uint16_t *)xrealloc(dec->pc, alloc * sizeof(uint16_t));
+	dec->sp = (uint16_t *)xrealloc(dec->sp, alloc * sizeof(uint16_t));
+	dec->reg_addr = (uint16_t *)xrealloc(dec->reg_addr, 
+	    alloc * sizeof(uint16_t));
+	dec->time = (uint32_t *)xrealloc(dec->time, 
+	    alloc * sizeof(uint32_t));
+	dec->alloc = alloc;
+
+	return;
+}
+
+/**************************************************************
+ * This will set a filter that keeps every event.
+ */
+
+void trcedec_filter_all(struct trcedec_filter *filter)
+{
+	assert(filter != NULL);
+
+	filter->kinds = (1 << trcedec_kinds) - 1;
+	filter->access = (1 << trcedec_accesses) - 1;
+	filter->pc_lo = 0x0000;
+	filter->pc_hi = 0xffff;
+	filter->reg_lo = 0x000;
+	filter->reg_hi = 0xfff;
+
+	return;
+}
+
+/**************************************************************
+ * This will decode count frames, and append the events the
+ * filter keeps. A NULL filter keeps everything. It returns
+ * the number of events appended.
+ */
+
+size_t trcedec_decode(struct trcedec *dec, const uint8_t *frames,
+	size_t count, const struct trcedec_filter *filter)
+{
+	static const uint8_t kinds[4] = {
+		trcedec_idle, trcedec_inst, trcedec_intack, trcedec_dmaack
+	};
+	static const uint8_t accesses[4] = {
+		trcedec_none, trcedec_wr, trcedec_rd, trcedec_none
+	};
+	const uint8_t *f;
+	size_t i, n;
+	uint8_t kind, access;
+	uint16_t pc, reg_addr;
+
+	assert(dec != NULL);
+	assert(frames != NULL || !count);
+
+	reserve(dec, count);
+	n = dec->count;
+
+	for(i=0, f=frames; i<count; i++, f+=TRCEFILE_FRAME) {
+		if((f[2] & 0xf0) == 0xf0) {
+			dec->stamp = (f[4] << 24) | (f[5] << 16) | 
+			    (f[6] << 8) | f[7];
+			kind = trcedec_time;
+			access = trcedec_none;
+			pc = 0;
+			reg_addr = 0;
+		} else {
+			kind = kinds[f[2] >> 6];
+			access = accesses[(f[2] >> 4) & 0x03];
+			pc = kind == trcedec_inst ? (f[6] << 8) | f[7] : 0;
+			reg_addr = access ? ((f[2] & 0x0f) << 8) | f[3] : 0;
+		}
+
+		if(filter) {
+			if(!(filter->kinds & (1 << kind)) ||
+			    !(filter->access & (1 << access))) {
+				continue;
+			}
+			if(kind == trcedec_inst && 
+			    (pc < filter->pc_lo || pc > filter->pc_hi)) {
+				continue;
+			}
+			if(access && (reg_addr < filter->reg_lo || 
+			    reg_addr > filter->reg_hi)) {
+				continue;
+			}
+		}
+
+		dec->kind[n] = kind;
+		dec->access[n] = access;
+		dec->time[n] = dec->stamp;
+		if(kind == trcedec_time) {
+			dec->flags[n] = 0;
+			dec->sp[n] = 0;
+			dec->reg_data[n] = 0;
+		} else {
+			dec->flags[n] = f[5];
+			dec->sp[n] = (f[0] << 8) | f[1];
+			dec->reg_data[n] = access ? f[4] : 0;
+		}
+		dec->pc[n] = pc;
+		dec->reg_addr[n] = reg_addr;
+		n++;
+	}
+
+	count = n - dec->count;
+	dec->count = n;
+
+	return count;
+}
+
+/**************************************************************
+ * This will append a gap event, unless gaps are filtered.
+ */
+
+static void add_gap(struct trcedec *dec, const struct trcedec_filter *filter)
+{
+	size_t n;
+
+	if(filter && !(filter->kinds & (1 << trcedec_gap))) {
+		return;
+	}
+
+	reserve(dec, 1);
+	n = dec->count++;
+	dec->kind[n] = trcedec_gap;
+	dec->access[n] = trcedec_none;
+	dec->flags[n] = 0;
+	dec->reg_data[n] = 0;
+	dec->pc[n] = 0;
+	dec->sp[n] = 0;
+	dec->reg_addr[n] = 0;
+	dec->time[n] = dec->stamp;
+
+	return;
+}
+
+/**************************************************************
+ * This will decode a capture file. It returns 0, or -1 if the
+ * file could not be read.
+ */
+
+int trcedec_rd_file(struct trcedec *dec, const char *filename,
+	const struct trcedec_filter *filter)
+{
+	struct trcefile_block block;
+	uint8_t *buff;
+	size_t alloc;
+	FILE *file;
+	int status;
+
+	assert(dec != NULL);
+	assert(filename != NULL);
+
+	file = trcefile_open(filename, NULL);
+	if(!file) {
+		return -1;
+	}
+
+	buff = NULL;
+	alloc = 0;
+	while((status = trcefile_read(file, &block, &buff, &alloc)) > 0) {
+		if(block.flags & TRCEFILE_GAP) {
+			add_gap(dec, filter);
+		}
+		trcedec_decode(dec, buff, block.count, filter);
+	}
+	free(buff);
+	fclose(file);
+
+	return status;
+}
+
+/**************************************************************
+ * This will write events as comma separated values.
+ */
+
+int trcedec_wr_csv(const struct trcedec *dec, FILE *file)
+{
+	size_t i;
+
+	assert(dec != NULL);
+	assert(file != NULL);
+
+	fprintf(file, "kind,pc,sp,flags,access,reg_addr,reg_data,time\n");
+	for(i=0; i<dec->count; i++) {
+		fprintf(file, "%s,%04X,%04X,%02X,%s,%03X,%02X,%08lX\n",
+		    kind_names[dec->kind[i]], dec->pc[i], dec->sp[i],
+		    dec->flags[i], access_names[dec->access[i]],
+		    dec->reg_addr[i], dec->reg_data[i], 
+		    (unsigned long)dec->time[i]);
+	}
+
+	return ferror(file) ? -1 : 0;
+}
+
+/**************************************************************
+ * This will write an array of 16 or 32 bit fields big endian,
+ * a buffer at a time.
+ */
+
+#define	COLUMN_BUFSIZ	4096
+
+static int wr_column16(const uint16_t *data, size_t count, FILE *file)
+{
+	uint8_t buff[COLUMN_BUFSIZ];
+	size_t i, n;
+
+	while(count) {
+		n = count < COLUMN_BUFSIZ / 2 ? count : COLUMN_BUFSIZ / 2;
+		for(i=0; i<n; i++) {
+			buff[i*2] = data[i] >> 8;
+			buff[i*2+1] = data[i];
+		}
+		if(fwrite(buff, 2, n, file) != n) {
+			return -1;
+		}
+		data += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static int wr_column32(const uint32_t *data, size_t count, FILE *file)
+{
+	uint8_t buff[COLUMN_BUFSIZ];
+	size_t i, n;
+
+	while(count) {
+		n = count < COLUMN_BUFSIZ / 4 ? count : COLUMN_BUFSIZ / 4;
+		for(i=0; i<n; i++) {
+			buff[i*4] = data[i] >> 24;
+			buff[i*4+1] = data[i] >> 16;
+			buff[i*4+2] = data[i] >> 8;
+			buff[i*4+3] = data[i];
+		}
+		if(fwrite(buff, 4, n, file) != n) {
+			return -1;
+		}
+		data += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will write events in a binary columnar format: the
+ * magic, a 64 bit event count, then each field as an array,
+ * in the order kind, access, flags, reg_data, pc, sp,
+ * reg_addr, time. Fields are big endian, like capture files.
+ */
+
+int trcedec_wr_columns(const struct trcedec *dec, FILE *file)
+{
+	uint8_t head[16];
+	uint64_t count;
+	int i, err;
+
+	assert(dec != NULL);
+	assert(file != NULL);
+
+	count = dec->count;
+	memcpy(head, TRCEDEC_MAGIC, 8);
+	for(i=0; i<8; i++) {
+		head[8+i] = count >> (56 - i * 8);
+	}
+	err = fwrite(head, sizeof(head), 1, file) != 1;
+	if(count) {
+		err |= fwrite(dec->kind, 1, count, file) != count;
+		err |= fwrite(dec->access, 1, count, file) != count;
+		err |= fwrite(dec->flags, 1, count, file) != count;
+		err |= fwrite(dec->reg_data, 1, count, file) != count;
+		err |= wr_column16(dec->pc, count, file);
+		err |= wr_column16(dec->sp, count, file);
+		err |= wr_column16(dec->reg_addr, count, file);
+		err |= wr_column32(dec->time, count, file);
+	}
+
+	return err ? -1 : 0;
+}
+
+/**************************************************************/
+
@@ -0,0 +1,81 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Trace frame decoder.
+ */
+
+#ifndef	TRCEDEC_HEADER
+#define	TRCEDEC_HEADER
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	TRCEDEC_MAGIC	"EZ8TRCD2"
+
+/* event kinds */
+enum trcedec_kind {
+	trcedec_idle,
+	trcedec_inst,
+	trcedec_intack,
+	trcedec_dmaack,
+	trcedec_time,
+	trcedec_gap,
+	trcedec_kinds
+};
+
+/* register access */
+enum trcedec_access {
+	trcedec_none,
+	trcedec_wr,
+	trcedec_rd,
+	trcedec_accesses
+};
+
+/* decoded events, one array per field */
+struct trcedec {
+	size_t count;
+	size_t alloc;
+	uint8_t *kind;
+	uint8_t *access;
+	uint8_t *flags;
+	uint8_t *reg_data;
+	uint16_t *pc;
+	uint16_t *sp;
+	uint16_t *reg_addr;
+	uint32_t *time;		/* last timestamp */
+	uint32_t stamp;
+};
+
+/* events kept by a decode */
+struct trcedec_filter {
+	unsigned int kinds;	/* bit per kind */
+	unsigned int access;	/* bit per access */
+	uint16_t pc_lo;		/* instruction pc range */
+	uint16_t pc_hi;
+	uint16_t reg_lo;	/* register range */
+	uint16_t reg_hi;
+};
+
+struct trcedec *trcedec_new(void);
+void trcedec_free(struct trcedec *);
+void trcedec_clear(struct trcedec *);
+void trcedec_filter_all(struct trcedec_filter *);
+size_t trcedec_decode(struct trcedec *, const uint8_t *, size_t, 
+	const struct trcedec_filter *);
+int trcedec_rd_file(struct trcedec *, const char *, 
+	const struct trcedec_filter *);
+int trcedec_wr_csv(const struct trcedec *, FILE *);
+int trcedec_wr_columns(const struct trcedec *, FILE *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* TRCEDEC_HEADER */
+
@@ -0,0 +1,175 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * This reads and writes trace capture files. A capture file
+ * holds the raw frames drained from the emulator trace buffer,
+ * in the order they were written.
+ *
+ * Frames are written in blocks, one for each read of the trace
+ * buffer. If frames were overwritten before they could be
+ * read, the next block is flagged as following a gap.
+ *
+ * The header and block fields are packed big endian by hand,
+ * rather than written as structs, so files can be moved
+ * between hosts.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<inttypes.h>
+#include	<string.h>
+#include	<assert.h>
+#include	"xmalloc.h"
+
+#include	"trcefile.h"
+
+/* packed sizes */
+#define	HEADER_SIZE	16
+#define	BLOCK_SIZE	8
+
+/**************************************************************
+ * These store and load big endian 32 bit fields.
+ */
+
+static void put32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+
+	return;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**************************************************************
+ * This will create a capture file for a trace buffer of depth
+ * frames. It returns NULL if the file could not be created.
+ */
+
+FILE *trcefile_create(const char *filename, uint32_t depth)
+{
+	uint8_t head[HEADER_SIZE];
+	FILE *file;
+
+	assert(filename != NULL);
+
+	file = fopen(filename, "wb");
+	if(!file) {
+		return NULL;
+	}
+
+	memcpy(head, TRCEFILE_MAGIC, 8);
+	put32(head + 8, depth);
+	put32(head + 12, 0);
+
+	if(fwrite(head, sizeof(head), 1, file) != 1) {
+		fclose(file);
+		remove(filename);
+		return NULL;
+	}
+
+	return file;
+}
+
+/**************************************************************
+ * This will append a block of frames to a capture file.
+ */
+
+int trcefile_write(FILE *file, const uint8_t *frames, uint32_t count,
+	uint32_t flags)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	assert(file != NULL);
+	assert(frames != NULL || !count);
+
+	put32(block, count);
+	put32(block + 4, flags);
+
+	if(fwrite(block, sizeof(block), 1, file) != 1) {
+		return -1;
+	}
+	if(count && fwrite(frames, TRCEFILE_FRAME, count, file) != count) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************
+ * This will open a capture file for reading, and return the
+ * depth of the trace buffer it was captured from. It returns
+ * NULL if the file could not be opened or is not a capture.
+ */
+
+FILE *trcefile_open(const char *filename, uint32_t *depth)
+{
+	uint8_t head[HEADER_SIZE];
+	FILE *file;
+
+	assert(filename != NULL);
+
+	file = fopen(filename, "rb");
+	if(!file) {
+		return NULL;
+	}
+
+	if(fread(head, sizeof(head), 1, file) != 1 ||
+	    memcmp(head, TRCEFILE_MAGIC, 8)) {
+		fclose(file);
+		return NULL;
+	}
+	if(depth) {
+		*depth = get32(head + 8);
+	}
+
+	return file;
+}
+
+/**************************************************************
+ * This will read the next block of a capture file. The frames
+ * are read into *buff, which is grown as needed; *alloc is
+ * its size in frames. It returns 1 if a block was read, 0 at
+ * the end of the file, or -1 if the file is truncated.
+ */
+
+int trcefile_read(FILE *file, struct trcefile_block *block,
+	uint8_t **buff, size_t *alloc)
+{
+	uint8_t packed[BLOCK_SIZE];
+
+	assert(file != NULL);
+	assert(block != NULL);
+	assert(buff != NULL);
+	assert(alloc != NULL);
+
+	if(fread(packed, sizeof(packed), 1, file) != 1) {
+		return feof(file) && !ferror(file) ? 0 : -1;
+	}
+	block->count = get32(packed);
+	block->flags = get32(packed + 4);
+	if(block->count > 0x10000) {
+		return -1;
+	}
+
+	if(block->count > *alloc) {
+		*alloc = block->count;
+		*buff = (uint8_t *)xrealloc(*buff, *alloc * TRCEFILE_FRAME);
+	}
+	if(block->count && fread(*buff, TRCEFILE_FRAME, block->count, 
+	    file) != block->count) {
+		return -1;
+	}
+
+	return 1;
+}
+
+/**************************************************************/
+
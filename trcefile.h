@@ -0,0 +1,50 @@
+/* Copyright (C) 2002, 2003, 2004 Zilog, Inc.
+ *
+ * $Id$
+ *
+ * Trace capture files.
+ */
+
+#ifndef	TRCEFILE_HEADER
+#define	TRCEFILE_HEADER
+
+#include	<stdio.h>
+#include	<inttypes.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	TRCEFILE_MAGIC	"EZ8TRCE2"
+
+/* bytes in a trace frame */
+#define	TRCEFILE_FRAME	8
+
+/* block flags */
+#define	TRCEFILE_GAP	0x0001		/* frames lost before block */
+
+/*
+ * A file is a 16 byte header followed by blocks of raw frames.
+ * The header is the magic, then the 32 bit buffer depth and
+ * flags. Each block starts with a 32 bit frame count and
+ * flags. These fields are stored big endian, like the frames,
+ * so a capture reads the same on any host.
+ */
+
+/* block header, in host byte order */
+struct trcefile_block {
+	uint32_t count;
+	uint32_t flags;
+};
+
+FILE *trcefile_create(const char *, uint32_t);
+int trcefile_write(FILE *, const uint8_t *, uint32_t, uint32_t);
+FILE *trcefile_open(const char *, uint32_t *);
+int trcefile_read(FILE *, struct trcefile_block *, uint8_t **, size_t *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* TRCEFILE_HEADER */
+